@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 
 #include "amp.h"
@@ -20,6 +21,39 @@
 #include "dispatch.h"
 
 
+/* Passed to the callbacks of calls that are cancelled, time out or are
+ * abandoned. These carry no data, so one of each is shared by every call
+ * and amp_free_result() leaves them alone. */
+static AMP_Result_T cancel_result = {AMP_CANCEL, NULL, NULL};
+static AMP_Result_T timeout_result = {AMP_TIMEOUT, NULL, NULL};
+static AMP_Result_T connection_lost_result = {AMP_CONNECTION_LOST, NULL, NULL};
+
+
+struct cancel_all_state
+{
+    AMP_Proto_T *proto;
+    AMP_Result_T *result;
+};
+
+static void cancel_one(void *arg, struct _AMP_Callback *cb)
+{
+    struct cancel_all_state *state = arg;
+    if (cb->func != NULL)
+        (cb->func)(state->proto, state->result, cb->arg);
+}
+
+/* Invoke the callback of every call in `calls' with `result' */
+static void cancel_calls(AMP_Proto_T *proto, _AMP_Callback_Map_p calls,
+                         AMP_Result_T *result)
+{
+    struct cancel_all_state state;
+
+    state.proto = proto;
+    state.result = result;
+    _amp_pop_each_callback(calls, cancel_one, &state);
+}
+
+
 amp_error_t _amp_send_unhandled_command_error(AMP_Proto_T *proto, AMP_Request_T *req)
 {
     /* Fire off an _error box */
@@ -27,8 +61,6 @@ amp_error_t _amp_send_unhandled_command_error(AMP_Proto_T *proto, AMP_Request_T
     AMP_Box_T *box;
     unsigned char *buf    = NULL;
     unsigned char *idx;
-    unsigned char *packet = NULL;
-    int packetSize;
     amp_error_t ret = 0;
 
     static char prefix[] = "Unhandled Command: '";
@@ -73,11 +105,7 @@ amp_error_t _amp_send_unhandled_command_error(AMP_Proto_T *proto, AMP_Request_T
 
     /* buf has been copied in to the box now */
 
-    if ((ret = amp_serialize_box(box, &packet, &packetSize)) != 0)
-        goto error;
-
-    /* write handler has taken possession of buffer - don't free */
-    ret = proto->write(proto, packet, packetSize, proto->write_arg);
+    ret = _amp_write_box(proto, box, NULL, NULL, NULL);
 
 error:
     amp_free_box(box);
@@ -85,51 +113,40 @@ error:
     return ret;
 }
 
-int _amp_new_request_from_box(AMP_Box_T *box, AMP_Request_T **request)
+/* Point `chunk' at the value stored under `key', which must be present */
+static int view_value(AMP_Box_T *box, const char *key, AMP_Chunk_T *chunk)
 {
-    int ret, buf_size;
-    unsigned char *buf;
-
-    AMP_Request_T *r = NULL;
-    AMP_Chunk_T *cmd_name = NULL;
-    AMP_Chunk_T *ask_key = NULL; /* default if no _ask key given */
-
-    if ( (r = MALLOC(sizeof(*r))) == NULL)
-        return ENOMEM;
+    return amp_get_bytes(box, key, &chunk->value, &chunk->size);
+}
 
-    if ( (ret = amp_get_bytes(box, COMMAND, &buf, &buf_size)) != 0)
-        goto error;
+int _amp_new_request_from_box(AMP_Box_T *box, AMP_Request_T **request)
+{
+    int ret;
+    struct amp_box_views *views = &box->views;
+    AMP_Request_T *r = &views->as.request;
 
-    if ( (cmd_name = amp_chunk_copy_buffer(buf, buf_size)) == NULL)
-    {
-        ret = ENOMEM;
+    if ( (ret = view_value(box, COMMAND, &views->chunks[0])) != 0)
         goto error;
-    }
+    r->command = &views->chunks[0];
 
+    r->ask_key = NULL; /* default if no _ask key given */
     if (amp_has_key(box, ASK))
     {
-        if ( (ret = amp_get_bytes(box, ASK, &buf, &buf_size)) != 0)
-            goto error;
-
-        if ( (ask_key = amp_chunk_copy_buffer(buf, buf_size)) == NULL)
-        {
-            ret = ENOMEM;
+        if ( (ret = view_value(box, ASK, &views->chunks[1])) != 0)
             goto error;
-        }
+        r->ask_key = &views->chunks[1];
     }
 
-    r->command = cmd_name;
-    r->ask_key = ask_key;
-    r->args    = box;
+    r->args = box;
+    r->deadline = 0;
+    r->has_deadline = 0;
+    r->admitted_by = NULL;
 
     *request = r;
     return 0;
 
 error:
     *request = NULL;
-    free(r);
-    amp_free_chunk(cmd_name);
-    amp_free_chunk(ask_key);
     return ret;
 }
 
@@ -137,36 +154,25 @@ int _amp_new_response_from_box(AMP_Box_T *box, AMP_Response_T **response)
 {
     int ret;
     unsigned int key;
-    AMP_Response_T *r;
+    AMP_Response_T *r = &box->views.as.response;
 
-    if ( (r = MALLOC(sizeof(*r))) == NULL)
+    if ( (ret = amp_get_uint(box, ANSWER, &key)) != 0)
     {
-        ret = ENOMEM;
-        goto error;
+        *response = NULL;
+        return ret;
     }
 
-    if ( (ret = amp_get_uint(box, ANSWER, &key)) != 0)
-        goto error;
-
     r->answer_key = key;
     r->args = box;
 
     *response = r;
 
     return 0;
-
-error:
-    *response = NULL;
-    free(r);
-    return ret;
 }
 
 int _amp_new_result_with_response(AMP_Response_T *response, AMP_Result_T **result)
 {
-    AMP_Result_T *r;
-
-    if ( (r = MALLOC(sizeof(*r))) == NULL)
-        return ENOMEM;
+    AMP_Result_T *r = &AMP_BOX_OF(response, as.response)->views.result;
 
     r->reason = AMP_SUCCESS;
     r->response = response;
@@ -180,66 +186,39 @@ int _amp_new_result_with_response(AMP_Response_T *response, AMP_Result_T **resul
 
 int _amp_new_error_from_box(AMP_Box_T *box, AMP_Error_T **error)
 {
-    int ret, key, buf_size;
-    unsigned char *buf;
-
-    AMP_Chunk_T *error_code  = NULL;
-    AMP_Chunk_T *error_descr = NULL;
-    AMP_Error_T *e;
-
-    if ( (e = MALLOC(sizeof(*e))) == NULL)
-        return ENOMEM;
+    int ret, key;
+    struct amp_box_views *views = &box->views;
+    AMP_Error_T *e = &views->as.error;
 
     if ( (ret = amp_get_int(box, _ERROR, &key)) != 0)
-        goto error; /* error decoding _answer key */
+        return ret; /* error decoding _error key */
 
+    e->error_code = NULL;
     if (amp_has_key(box, ERROR_CODE))
     {
-        if ( (ret = amp_get_bytes(box, ERROR_CODE, &buf, &buf_size)) != 0)
-            goto error;
-
-        if ( (error_code = amp_chunk_copy_buffer(buf, buf_size)) == NULL)
-        {
-            ret = ENOMEM;
-            goto error;
-        }
+        if ( (ret = view_value(box, ERROR_CODE, &views->chunks[0])) != 0)
+            return ret;
+        e->error_code = &views->chunks[0];
     }
 
+    e->error_descr = NULL;
     if (amp_has_key(box, ERROR_DESCR))
     {
-        if ( (ret = amp_get_bytes(box, ERROR_DESCR, &buf, &buf_size)) != 0)
-            goto error;
-
-        if ( (error_descr = amp_chunk_copy_buffer(buf, buf_size)) == NULL)
-        {
-            ret = ENOMEM;
-            goto error;
-        }
+        if ( (ret = view_value(box, ERROR_DESCR, &views->chunks[1])) != 0)
+            return ret;
+        e->error_descr = &views->chunks[1];
     }
 
-    /* Free the box, we have what we need */
-    amp_free_box(box);
-
+    /* the error now owns the box, and free's it in amp_free_error() */
     e->answer_key  = key;
-    e->error_code  = error_code;
-    e->error_descr = error_descr;
 
     *error = e;
     return 0;
-
-error:
-    free(e);
-    amp_free_chunk(error_code);
-    amp_free_chunk(error_descr);
-    return ret;
 }
 
 int _amp_new_result_with_error(AMP_Error_T *error, AMP_Result_T **result)
 {
-    AMP_Result_T *r;
-
-    if ( (r = MALLOC(sizeof(*r))) == NULL)
-        return ENOMEM;
+    AMP_Result_T *r = &AMP_BOX_OF(error, as.error)->views.result;
 
     r->reason = AMP_ERROR;
     r->response = NULL;
@@ -251,6 +230,220 @@ int _amp_new_result_with_error(AMP_Error_T *error, AMP_Result_T **result)
 }
 
 
+/* Forget the outstanding call using `ask_key', and stop its timer if it
+ * has one. Arguments and return value are as for _amp_pop_callback(). */
+static int pop_call(AMP_Proto_T *proto, unsigned int ask_key,
+                    struct _AMP_Callback *callback)
+{
+    struct _AMP_Callback cb;
+
+    if (!_amp_pop_callback(proto->outstanding_requests, ask_key, &cb))
+        return 0;
+
+    if (cb.timer != NULL)
+        _amp_remove_timer(proto->timers, cb.timer);
+
+    if (callback != NULL)
+        *callback = cb;
+    return 1;
+}
+
+
+_AMP_Responder_p _amp_find_responder(AMP_Proto_T *proto, AMP_Chunk_T *command)
+{
+    _AMP_Responder_p responder = NULL;
+
+    if (proto->responder_index != NULL)
+        responder = _amp_index_get_responder(proto->responder_index,
+                                             command->value, command->size);
+    else if (proto->responders != NULL)
+        responder = _amp_get_responder(proto->responders, command->value);
+
+    if (responder == NULL && proto->registry != NULL)
+        responder = _amp_index_get_responder(proto->registry->index,
+                                             command->value, command->size);
+
+    return responder;
+}
+
+
+static int write_cached_answer(AMP_Proto_T *proto, AMP_Chunk_T *ask_key,
+                               const unsigned char *answer, int answer_size);
+
+/* Answer `request' from the response cache, if it's cacheable and an
+ * answer is cached for it. Returns 1 if it was answered - in which case
+ * `*ret' is the result of writing the answer - or 0 if not. */
+static int answer_from_cache(AMP_Proto_T *proto, AMP_Request_T *request,
+                             AMP_Box_T *box, int *ret)
+{
+    struct _AMP_Cache_Policy *policy;
+    const unsigned char *answer;
+    int answer_size;
+
+    if (request->ask_key == NULL ||
+        (policy = _amp_get_cache_policy(proto->response_cache,
+                                        request->command)) == NULL)
+        return 0;
+
+    if (!_amp_cache_lookup(proto->response_cache, policy,
+                           _amp_box_digest(box), box, proto->clock,
+                           &answer, &answer_size))
+        return 0;
+
+    *ret = write_cached_answer(proto, request->ask_key, answer, answer_size);
+    return 1;
+}
+
+/* Record the deadline a caller gave `request' - a number of milliseconds
+ * from now - on the proto's clock */
+static void read_deadline(AMP_Proto_T *proto, AMP_Request_T *request)
+{
+    unsigned int budget;
+
+    if (amp_get_uint(request->args, DEADLINE, &budget) != 0)
+    {
+        amp_log("Ignoring a bad _deadline key");
+        return;
+    }
+    request->deadline = proto->clock + budget;
+    request->has_deadline = 1;
+}
+
+/* The views of the box an admitted request lives in */
+#define ADMITTED_BOX(req) AMP_BOX_OF(req, as.request)
+
+/* Count `request' towards `proto's limit on requests in progress, until
+ * it is answered or free'd */
+static void admit_request(AMP_Proto_T *proto, AMP_Request_T *request)
+{
+    struct amp_box_views *views = &ADMITTED_BOX(request)->views;
+
+    request->admitted_by = proto;
+    views->admitted_prev = NULL;
+    views->admitted_next = proto->admitted;
+    if (proto->admitted != NULL)
+        ADMITTED_BOX(proto->admitted)->views.admitted_prev = request;
+    proto->admitted = request;
+    proto->in_progress++;
+}
+
+/* Take `request' off `proto's list of admitted requests - though it is
+ * still counted */
+static void unlink_admitted(AMP_Proto_T *proto, AMP_Request_T *request)
+{
+    struct amp_box_views *views = &ADMITTED_BOX(request)->views;
+
+    if (views->admitted_prev == NULL && proto->admitted != request)
+        return; /* already off it */
+
+    if (views->admitted_prev != NULL)
+        ADMITTED_BOX(views->admitted_prev)->views.admitted_next =
+            views->admitted_next;
+    else
+        proto->admitted = views->admitted_next;
+    if (views->admitted_next != NULL)
+        ADMITTED_BOX(views->admitted_next)->views.admitted_prev =
+            views->admitted_prev;
+    views->admitted_prev = views->admitted_next = NULL;
+}
+
+/* Milliseconds until `deadline' on `proto's clock - at least 1, so that
+ * an expired deadline isn't taken for no deadline at all */
+static unsigned int time_left(AMP_Proto_T *proto,
+                              unsigned long long deadline)
+{
+    if (deadline <= proto->clock)
+        return 1;
+    if (deadline - proto->clock > UINT_MAX)
+        return UINT_MAX;
+    return deadline - proto->clock;
+}
+
+unsigned int amp_request_time_left(AMP_Proto_T *proto, AMP_Request_T *request)
+{
+    if (!request->has_deadline)
+        return 0;
+    return time_left(proto, request->deadline);
+}
+
+/* The deadline of the request whose responder is running on this thread,
+ * if any, and the proto whose clock it is kept by - inherited by the
+ * calls the responder makes */
+static __thread AMP_Proto_T *responding_proto;
+static __thread int responding_has_deadline;
+static __thread unsigned long long responding_deadline;
+
+/* The timeout for a call made now with a timeout of `timeout' */
+static unsigned int inherit_timeout(unsigned int timeout)
+{
+    unsigned int left;
+
+    if (!responding_has_deadline)
+        return timeout;
+
+    left = time_left(responding_proto, responding_deadline);
+    return timeout == 0 || left < timeout ? left : timeout;
+}
+
+static void run_responder(AMP_Proto_T *proto, _AMP_Responder_p responder,
+                          AMP_Request_T *request)
+{
+    AMP_Proto_T *outer_proto = responding_proto;
+    int outer_has_deadline = responding_has_deadline;
+    unsigned long long outer_deadline = responding_deadline;
+
+    responding_proto = proto;
+    responding_has_deadline = request->has_deadline;
+    responding_deadline = request->deadline;
+
+    (responder->func)(proto, request, responder->arg);
+
+    responding_proto = outer_proto;
+    responding_has_deadline = outer_has_deadline;
+    responding_deadline = outer_deadline;
+}
+
+/* Hand `request' to its responder, or answer it with an error if
+ * there's no responder for its command */
+static int dispatch_request(AMP_Proto_T *proto, AMP_Request_T *request)
+{
+    int ret = 0;
+    _AMP_Responder_p responder;
+
+    /* the caller has stopped waiting for an answer */
+    if (request->has_deadline && request->deadline <= proto->clock)
+    {
+        debug_print("Dropping expired request at %p\n", request);
+        amp_free_request(request);
+        return 0;
+    }
+
+    if ( (responder = _amp_find_responder(proto, request->command)) != NULL)
+    {
+        /* Fire off user-supplied responder, here or on a worker */
+        if (responder->pool != NULL)
+        {
+            /* a worker releases the request through `completions' */
+            if (request->admitted_by != NULL)
+                unlink_admitted(proto, request);
+            _amp_submit_request(responder->pool, proto, responder, request);
+        }
+        else
+            run_responder(proto, responder, request);
+        return 0;
+    }
+
+    amp_log("No handler for command: %s", request->command->value);
+
+    /* send error to remote peer if _ask key present. */
+    if (request->ask_key != NULL)
+        ret = _amp_send_unhandled_command_error(proto, request);
+
+    /* This free's the box too */
+    amp_free_request(request);
+    return ret;
+}
+
 int _amp_process_full_packet(AMP_Proto_T *proto, AMP_Box_T *box)
 {
     /* Dispatch the box that has been accumulated by the given AMP_Proto .
@@ -272,31 +465,36 @@ int _amp_process_full_packet(AMP_Proto_T *proto, AMP_Box_T *box)
         if ( (ret = _amp_new_request_from_box(box, &request)) != 0)
             return ret;
 
-        proto->box = NULL; /* forget the box that is now held by the
-                              request object */
+        if (proto->clock_started && amp_has_key(box, DEADLINE))
+            read_deadline(proto, request);
 
-        _AMP_Responder_p responder;
-        if ( (responder = _amp_get_responder(proto->responders,
-                                             request->command->value)) != NULL)
+        if (proto->response_cache != NULL &&
+            answer_from_cache(proto, request, box, &ret))
         {
-            /* Fire off user-supplied responder */
-            (responder->func)(proto, request, responder->arg);
+            /* leave the box with the proto, to parse the next box in
+             * to */
+            _amp_clear_box(box);
+            return ret;
         }
-        else
-        {
-            amp_log("No handler for command: %s", request->command->value);
 
-            /* send error to remote peer if _ask key present.
-             * (ret == 0 before this point) */
-            if (request->ask_key != NULL)
-            {
-                ret = _amp_send_unhandled_command_error(proto, request);
-            }
+        proto->box = NULL; /* forget the box that is now held by the
+                              request object */
 
-            /* This free's the box too */
-            amp_free_request(request);
-            return ret;
+        /* counted until it is answered or free'd, if there is a limit
+         * - staged requests included, since they hold on to their box
+         * all the same */
+        if (request->ask_key != NULL && proto->max_in_progress != 0)
+            admit_request(proto, request);
+
+        /* in staged mode, requests wait their turn in their priority
+         * class */
+        if (proto->staged)
+        {
+            _amp_stage_request(proto->staging, request);
+            return 0;
         }
+
+        return dispatch_request(proto, request);
     }
     else if (amp_has_key(box, ANSWER))
     {
@@ -309,19 +507,16 @@ int _amp_process_full_packet(AMP_Proto_T *proto, AMP_Box_T *box)
         proto->box = NULL; /* forget the box that is now held by the newly
                               created response object */
 
-        _AMP_Callback_p cb;
-        if ((cb = _amp_pop_callback(proto->outstanding_requests,
-                                    response->answer_key)) != NULL) {
+        struct _AMP_Callback cb;
+        if (pop_call(proto, response->answer_key, &cb)) {
             AMP_Result_T *result;
             if ( (ret = _amp_new_result_with_response(response, &result)) != 0)
             {
                 amp_free_response(response);
-                _amp_free_callback(cb);
                 return ret;
             }
 
-            (cb->func)(proto, result, cb->arg);
-            _amp_free_callback(cb);
+            (cb.func)(proto, result, cb.arg);
 
         }
         else
@@ -340,24 +535,20 @@ int _amp_process_full_packet(AMP_Proto_T *proto, AMP_Box_T *box)
         if ( (ret = _amp_new_error_from_box(box, &error)) != 0)
             return ret;
 
-        /* _amp_new_error_from_box was successful which means the box has
-         * been free'd - so forget it to avoid a potential double-free() */
-        proto->box = NULL;
+        proto->box = NULL; /* forget the box that is now held by the newly
+                              created error object */
 
-        _AMP_Callback_p cb;
-        if ((cb = _amp_pop_callback(proto->outstanding_requests,
-                                    error->answer_key)) != NULL) {
+        struct _AMP_Callback cb;
+        if (pop_call(proto, error->answer_key, &cb)) {
 
             AMP_Result_T *result;
             if ( (ret = _amp_new_result_with_error(error, &result)) != 0)
             {
                 amp_free_error(error);
-                _amp_free_callback(cb);
                 return ret;
             }
 
-            (cb->func)(proto, result, cb->arg);
-            _amp_free_callback(cb);
+            (cb.func)(proto, result, cb.arg);
 
         }
         else
@@ -383,7 +574,6 @@ AMP_Proto_T *amp_new_proto(void)
     AMP_Proto_T *proto;
     AMP_Box_T *box = NULL;
     _AMP_Callback_Map_p outstanding_requests = NULL;
-    _AMP_Responder_Map_p responders = NULL;
 
     if ( (proto = MALLOC(sizeof(struct AMP_Proto))) == NULL)
         return NULL;
@@ -403,15 +593,51 @@ AMP_Proto_T *amp_new_proto(void)
 
     proto->dispatch_box = _amp_process_full_packet;
 
+    proto->write = NULL;
+    proto->writev = NULL;
+    proto->write_arg = NULL;
+
+    proto->corked = 0;
+    proto->out_buf = NULL;
+    proto->out_size = 0;
+    proto->out_capacity = 0;
+
+    proto->out_pending = 0;
+    proto->low_water = 0;
+    proto->high_water = 0;
+    proto->write_paused = 0;
+    proto->on_pause = NULL;
+    proto->on_resume = NULL;
+    proto->flow_arg = NULL;
+
+    proto->in_progress = 0;
+    proto->max_in_progress = 0;
+    proto->admission_paused = 0;
+    proto->on_admit = NULL;
+    proto->admit_arg = NULL;
+    proto->admitted = NULL;
+
     if ((outstanding_requests = _amp_new_callback_map()) == NULL)
         goto error;
 
-    if((responders = _amp_new_responder_map()) == NULL)
-        goto error;
+    proto->timers = NULL;
+    proto->clock = 0;
+    proto->clock_started = 0;
 
     proto->box = box;
     proto->outstanding_requests = outstanding_requests;
-    proto->responders = responders;
+
+    /* allocated by amp_add_responder(), since a proto that gets all of
+     * its responders from a shared registry doesn't need its own */
+    proto->responders = NULL;
+    proto->responder_index = NULL;
+    proto->registry = NULL;
+    proto->response_cache = NULL;
+    proto->coalesced_calls = NULL;
+    proto->staged = 0;
+    proto->staging = NULL;
+    proto->propagate_deadlines = 0;
+    proto->completions = NULL;
 
     debug_print("New AMP_Proto at 0x%p\n", proto);
     return proto;
@@ -422,13 +648,10 @@ error:
     if (box)
         amp_free_box(box);
 
+    /* NOTE - uncomment this if new structures are allocated below
+     * the line above where `outstanding_requests' is allocated
     if (outstanding_requests)
         _amp_free_callback_map(outstanding_requests);
-
-    /* NOTE - uncomment this if new structures are allocated below
-     * the line above where `responders' is allocated
-    if (responders)
-        _amp_free_responder_map(responders);
      */
 
     return NULL;
@@ -456,6 +679,24 @@ void amp_reset_proto(AMP_Proto_T *proto)
 
 void amp_free_proto(AMP_Proto_T *proto)
 {
+    AMP_Request_T *request;
+
+    /* requests the application still holds outlive the proto */
+    while ( (request = proto->admitted) != NULL)
+    {
+        unlink_admitted(proto, request);
+        request->admitted_by = NULL;
+    }
+
+    /* let the callbacks of any outstanding calls clean up after
+     * themselves - including those still queued by other threads */
+    if (proto->completions != NULL)
+    {
+        _amp_close_completions(proto);
+        proto->completions = NULL;
+    }
+    cancel_calls(proto, proto->outstanding_requests, &cancel_result);
+
     /* XXX TODO Hmmm... what about freeing proto->box ?
      * I guess lets do it for now... might need to support
      * a method for the user to acquire ownership of
@@ -464,7 +705,20 @@ void amp_free_proto(AMP_Proto_T *proto)
     amp_free_box(proto->box);
 
     _amp_free_callback_map(proto->outstanding_requests);
-    _amp_free_responder_map(proto->responders);
+    if (proto->timers != NULL)
+        _amp_free_timer_wheel(proto->timers);
+    free(proto->out_buf); /* anything still corked is discarded */
+    if (proto->responders != NULL)
+        _amp_free_responder_map(proto->responders);
+    if (proto->responder_index != NULL)
+        _amp_free_responder_index(proto->responder_index);
+    if (proto->response_cache != NULL)
+        _amp_free_response_cache(proto->response_cache);
+    if (proto->coalesced_calls != NULL)
+        _amp_free_coalesced_calls(proto->coalesced_calls);
+    proto->on_admit = NULL; /* no more to admit */
+    if (proto->staging != NULL)
+        _amp_free_staging(proto->staging); /* drops unanswered requests */
     free(proto);
     debug_print("Free AMP_Proto at 0x%p\n", proto);
 }
@@ -473,6 +727,15 @@ void amp_set_write_handler(AMP_Proto_T *proto, write_amp_data_func func,
                            void *write_arg)
 {
     proto->write = func;
+    proto->writev = NULL;
+    proto->write_arg = write_arg;
+}
+
+void amp_set_writev_handler(AMP_Proto_T *proto, writev_amp_data_func func,
+                            void *write_arg)
+{
+    proto->write = NULL;
+    proto->writev = func;
     proto->write_arg = write_arg;
 }
 
@@ -663,7 +926,56 @@ int amp_parse_box(AMP_Proto_T *proto, AMP_Box_T *box, int *bytesConsumed,
                  it just means we never found the end of an AMP box */
 }
 
-int amp_consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int len)
+/* Requests counted towards `proto's limit */
+static int in_progress(AMP_Proto_T *proto)
+{
+    if (proto->completions != NULL)
+        proto->in_progress -= _amp_take_released(proto->completions);
+    return proto->in_progress;
+}
+
+/* Whether `proto' has as many requests in progress as it may have */
+static int admission_full(AMP_Proto_T *proto)
+{
+    return proto->max_in_progress != 0 &&
+           in_progress(proto) >= proto->max_in_progress;
+}
+
+void _amp_update_admission(AMP_Proto_T *proto)
+{
+    if (!proto->admission_paused || admission_full(proto))
+        return;
+
+    proto->admission_paused = 0;
+    if (proto->on_admit != NULL)
+        (proto->on_admit)(proto, proto->admit_arg);
+}
+
+/* Take `request' off the count of requests in progress, if it is on it */
+static void release_admission(AMP_Request_T *request)
+{
+    AMP_Proto_T *proto = request->admitted_by;
+    _AMP_Completions_p completions;
+
+    if (proto == NULL)
+        return;
+    request->admitted_by = NULL;
+
+    /* on a worker thread the proto is left alone - its own thread takes
+     * the release into account later */
+    if ( (completions = _amp_worker_completions(proto)) != NULL)
+    {
+        _amp_release_async(completions);
+        return;
+    }
+
+    unlink_admitted(proto, request);
+    proto->in_progress--;
+    _amp_update_admission(proto);
+}
+
+static int consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int len,
+                         int *consumed, int admit)
 {
     /* Guaranteed to have at least 1 byte in `buf' */
 
@@ -671,6 +983,7 @@ int amp_consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int len)
     int bytesConsumed = 0;
     int parseStatus;
 
+    *consumed = 0;
     if (proto->error)
     {
         /* refuse to do any more work if the protocol
@@ -680,6 +993,16 @@ int amp_consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int len)
 
     while (idx < len) {
 
+        /* stop between boxes once the limit is reached - the rest of
+         * `buf' is left for the caller to hand back later */
+        if (admit && proto->state == KEY_LEN_READ && proto->key_len == -1 &&
+            amp_num_keys(proto->box) == 0 && admission_full(proto))
+        {
+            *consumed = idx;
+            proto->admission_paused = 1;
+            return AMP_PAUSED;
+        }
+
         parseStatus = amp_parse_box(proto, proto->box, &bytesConsumed,
                                     buf+idx, len-idx);
         idx += bytesConsumed;
@@ -694,8 +1017,10 @@ int amp_consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int len)
 
             /* Start parsing a new AMP box.
              * The handler function has taken ownership of the box we
-             * just dispatched - so don't free it. */
-            proto->box = amp_new_box();
+             * just dispatched - so don't free it - unless it left the
+             * box with the proto to be re-used. */
+            if (proto->box == NULL)
+                proto->box = amp_new_box();
         }
         else
         {
@@ -708,9 +1033,23 @@ int amp_consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int len)
              * we should fall out of the while-loop now */
         }
     }
+    *consumed = idx;
     return 0;
 }
 
+int amp_consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int len)
+{
+    int consumed;
+
+    return consume_bytes(proto, buf, len, &consumed, 0);
+}
+
+int amp_consume_bytes_partial(AMP_Proto_T *proto, unsigned char* buf, int len,
+                              int *consumed)
+{
+    return consume_bytes(proto, buf, len, consumed, 1);
+}
+
 AMP_Chunk_T *amp_new_chunk(int size)
 {
     AMP_Chunk_T *c;
@@ -761,220 +1100,912 @@ int amp_chunks_equal(AMP_Chunk_T *c1, AMP_Chunk_T *c2)
     return 0;
 }
 
-/* XXX TODO TESTS */
 void amp_free_request(AMP_Request_T *request)
 {
-    amp_free_chunk(request->command);
-
-    /* May be NULL if no _ask key was given in the _command
-     * box as allowed by the protocol */
-    if (request->ask_key != NULL)
-        amp_free_chunk(request->ask_key);
+    release_admission(request);
 
-    /* May be manually free()ed and set to NULL
-     * by user code */
+    /* The request lives in the box it was parsed from, so freeing the
+     * box frees the request too. May be set to NULL by user code that
+     * takes ownership of the box. */
     if (request->args != NULL)
         amp_free_box(request->args);
-
-    free(request);
-}
-
-int _amp_new_result_with_cancel(AMP_Result_T **result)
-{
-    AMP_Result_T *r;
-
-    if ( (r = MALLOC(sizeof(*r))) == NULL)
-        return ENOMEM;
-
-    r->reason = AMP_CANCEL;
-    r->response = NULL;
-    r->error = NULL;
-
-    *result = r;
-
-    return 0;
 }
 
 void amp_free_response(AMP_Response_T *response)
 {
+    /* the response lives in its box */
     amp_free_box(response->args);
-    free(response);
 }
 
-/* XXX TODO TESTS */
 void amp_free_error(AMP_Error_T *error)
 {
-    if (error->error_code != NULL)
-        amp_free_chunk(error->error_code);
-
-    if (error->error_descr != NULL)
-        amp_free_chunk(error->error_descr);
-    free(error);
+    /* the error, and the chunks it points to, live in its box */
+    amp_free_box(AMP_BOX_OF(error, as.error));
 }
 
 void amp_free_result(AMP_Result_T *result)
 {
+    /* Results for responses and errors live in the same box as the
+     * response or error. Any other result is one of the shared ones
+     * above. */
     if (result->response != NULL)
         amp_free_response(result->response);
-
-    if (result->error != NULL)
+    else if (result->error != NULL)
         amp_free_error(result->error);
-
-    free(result);
 }
 
 int amp_next_ask_key(AMP_Proto_T *proto)
 {
     /* In the case that proto->last_ask_key == UINT_MAX it will wrap around
-     * on incrementation. Assume that UINT_MAX is large enough to prevent key
-     * collisions with outstanding requests. */
+     * on incrementation. _amp_call() skips any key that is still held by an
+     * outstanding request, so wrapping can't cause a collision. */
     proto->last_ask_key++;
     return proto->last_ask_key;
 }
 
-int _amp_do_write(AMP_Proto_T *proto, unsigned char *buf, int buf_size)
+/* Pause or resume the proto at its watermarks */
+static void check_watermarks(AMP_Proto_T *proto)
 {
-    if (proto->write == NULL)
+    if (!proto->write_paused)
     {
-        amp_log("AMP_Proto.write == NULL, missing call to amp_set_write_handler()?");
-        free(buf);
-        return 1;
-    }        
-    return proto->write(proto, buf, buf_size, proto->write_arg);
+        if (proto->high_water == 0 || proto->out_pending < proto->high_water)
+            return;
+
+        proto->write_paused = 1;
+        if (proto->on_pause != NULL)
+            (proto->on_pause)(proto, proto->flow_arg);
+    }
+    else if (proto->high_water == 0 || proto->out_pending <= proto->low_water)
+    {
+        proto->write_paused = 0;
+        if (proto->on_resume != NULL)
+            (proto->on_resume)(proto, proto->flow_arg);
+    }
 }
 
-static int _amp_call(AMP_Proto_T *proto, const char *command, AMP_Box_T *args,
-                     amp_callback_func callback, void *callback_arg, unsigned int *ask_key_ret,
-                     int requiresAnswer)
+/* Count `size' bytes accepted by the write handler, whose result was
+ * `ret' */
+static int count_written(AMP_Proto_T *proto, int ret, size_t size)
 {
-    /* TODO mutates the passed in box by adding special _command and
-     * _ask (optional) keys. But user code might re-use the AMP_Box
-     * they passed us here to make future calls, possibly with different
-     * key/values.... so will the presence of the special keys
-     * in their box cause problems ever? */
-
-    int ret, ask_key = -1;
-    unsigned char *buf;
-    int buf_size;
-    _AMP_Callback_p cb = NULL;
-
-    if ( (ret = amp_put_cstring(args, COMMAND, command)) != 0)
-        goto error;
-
-    if (requiresAnswer)
+    if (ret == 0)
     {
-        if ((cb = _amp_new_callback(callback, callback_arg)) == NULL)
-        {
-            ret = ENOMEM;
-            goto error;
-        }
+        proto->out_pending += size;
+        check_watermarks(proto);
+    }
+    return ret;
+}
 
-        ask_key = amp_next_ask_key(proto);
+/* Whether new calls are to be refused for now */
+static int would_block(AMP_Proto_T *proto)
+{
+    return proto->high_water != 0 &&
+           (proto->write_paused ||
+            proto->out_pending + proto->out_size >= proto->high_water);
+}
 
-        if (ask_key_ret != NULL)
-            *ask_key_ret = ask_key;
+void amp_set_write_watermarks(AMP_Proto_T *proto, size_t low, size_t high)
+{
+    proto->low_water = low < high ? low : high;
+    proto->high_water = high;
+    check_watermarks(proto);
+}
 
-        if ((ret = _amp_put_callback(proto->outstanding_requests,
-                                     ask_key, cb)) != 0)
-            goto error;
+void amp_set_flow_handlers(AMP_Proto_T *proto, amp_flow_func on_pause,
+                           amp_flow_func on_resume, void *flow_arg)
+{
+    proto->on_pause = on_pause;
+    proto->on_resume = on_resume;
+    proto->flow_arg = flow_arg;
+}
 
-        if ( (ret = amp_put_uint(args, ASK, proto->last_ask_key)) != 0)
-            goto error;
+void amp_bytes_drained(AMP_Proto_T *proto, size_t bytes)
+{
+    proto->out_pending -= bytes < proto->out_pending ? bytes
+                                                     : proto->out_pending;
+    check_watermarks(proto);
+}
+
+size_t amp_bytes_pending(AMP_Proto_T *proto)
+{
+    return proto->out_pending;
+}
+
+void amp_set_max_in_progress(AMP_Proto_T *proto, int max,
+                             amp_flow_func on_admit, void *admit_arg)
+{
+    proto->max_in_progress = max > 0 ? max : 0;
+    proto->on_admit = on_admit;
+    proto->admit_arg = admit_arg;
+    _amp_update_admission(proto);
+}
+
+int amp_in_progress(AMP_Proto_T *proto)
+{
+    return in_progress(proto);
+}
+
+/* Hand `buf' straight to the write handler */
+static int write_now(AMP_Proto_T *proto, unsigned char *buf, int buf_size)
+{
+    struct amp_gather *gather;
+
+    if (proto->writev != NULL)
+    {
+        /* a single segment, released by free()ing the buffer */
+        if ( (gather = MALLOC(sizeof(*gather) + sizeof(AMP_IOVec_T))) == NULL)
+        {
+            free(buf);
+            return ENOMEM;
+        }
+        gather->iov = (AMP_IOVec_T *)(gather + 1);
+        gather->iov[0].base = buf;
+        gather->iov[0].len = buf_size;
+        gather->iovcnt = 1;
+        gather->box = NULL;
+        gather->buf = buf;
+
+        return count_written(proto,
+                             proto->writev(proto, gather->iov,
+                                           gather->iovcnt,
+                                           _amp_release_gather, gather,
+                                           proto->write_arg),
+                             buf_size);
     }
-    else
+
+    if (proto->write == NULL)
     {
-        /* ensure it doesn't have an old _ask key */
-        amp_del_key(args, ASK);
+        amp_log("AMP_Proto.write == NULL, missing call to amp_set_write_handler()?");
+        free(buf);
+        return 1;
+    }        
+    return count_written(proto,
+                         proto->write(proto, buf, buf_size,
+                                      proto->write_arg),
+                         buf_size);
+}
+
+/* Make room for `size' more bytes in the proto's output buffer.
+ * Returns 0 on success, or ENOMEM. */
+static int reserve_out_buf(AMP_Proto_T *proto, int size)
+{
+    unsigned char *grown;
+    int capacity;
+
+    if (proto->out_buf != NULL &&
+        proto->out_size + size <= proto->out_capacity)
+        return 0;
+
+    capacity = proto->out_capacity > 0 ? proto->out_capacity * 2 : 256;
+    while (capacity < proto->out_size + size)
+        capacity *= 2;
+
+    if ( (grown = MALLOC(capacity)) == NULL)
+        return ENOMEM;
+    if (proto->out_buf != NULL)
+        memcpy(grown, proto->out_buf, proto->out_size);
+    free(proto->out_buf);
+
+    proto->out_buf = grown;
+    proto->out_capacity = capacity;
+    return 0;
+}
+
+/* Append `buf' to the proto's output buffer, taking ownership of it */
+static int cork_append(AMP_Proto_T *proto, unsigned char *buf, int buf_size)
+{
+    if (proto->out_buf == NULL)
+    {
+        /* the first box written while corked becomes the output
+         * buffer, without copying */
+        proto->out_buf = buf;
+        proto->out_size = buf_size;
+        proto->out_capacity = buf_size;
+        return 0;
     }
 
-    if ( (ret = amp_serialize_box(args, &buf, &buf_size)) != 0)
-        goto error;
+    if (reserve_out_buf(proto, buf_size) != 0)
+    {
+        free(buf);
+        return ENOMEM;
+    }
+
+    memcpy(proto->out_buf + proto->out_size, buf, buf_size);
+    proto->out_size += buf_size;
+    free(buf);
+    return 0;
+}
+
+/* Write the `n' key/value pairs in `keys' and `values', followed by
+ * `body_size' bytes of already-serialized key/values ending the box */
+static int write_prefixed(AMP_Proto_T *proto, int n, const char **keys,
+                          AMP_Chunk_T *values, const unsigned char *body,
+                          int body_size)
+{
+    unsigned char *buf, *p;
+    int i, keySize, size = body_size;
+
+    for (i = 0; i < n; i++)
+        size += 4 + strlen(keys[i]) + values[i].size;
+
+    /* when corked, straight in to the output buffer */
+    if (proto->corked)
+    {
+        if (reserve_out_buf(proto, size) != 0)
+            return ENOMEM;
+        buf = proto->out_buf + proto->out_size;
+        proto->out_size += size;
+    }
+    else if ( (buf = MALLOC(size)) == NULL)
+        return ENOMEM;
+
+    p = buf;
+    for (i = 0; i < n; i++)
+    {
+        keySize = strlen(keys[i]);
+        *p++ = 0;
+        *p++ = (unsigned char)keySize;
+        memcpy(p, keys[i], keySize);
+        p += keySize;
+        *p++ = (unsigned char)(values[i].size >> 8);
+        *p++ = (unsigned char)(values[i].size & 0xff);
+        memcpy(p, values[i].value, values[i].size);
+        p += values[i].size;
+    }
+    memcpy(p, body, body_size);
+
+    if (proto->corked)
+        return 0;
+    return write_now(proto, buf, size);
+}
+
+/* Write an answer from the response cache: an _answer key for
+ * `ask_key', followed by the cached key/values of the answer. */
+static int write_cached_answer(AMP_Proto_T *proto, AMP_Chunk_T *ask_key,
+                               const unsigned char *answer, int answer_size)
+{
+    const char *keys[1] = {ANSWER};
+
+    return write_prefixed(proto, 1, keys, ask_key, answer, answer_size);
+}
+
+int _amp_do_write(AMP_Proto_T *proto, unsigned char *buf, int buf_size)
+{
+    if (proto->corked)
+        return cork_append(proto, buf, buf_size);
+
+    return write_now(proto, buf, buf_size);
+}
+
+int _amp_write_box(AMP_Proto_T *proto, AMP_Box_T *box, const char *command,
+                   const char *ask_key, const char *deadline)
+{
+    int ret;
+    unsigned char *buf;
+    int buf_size;
+    struct amp_gather *gather;
+    size_t gather_size = 0;
+    int i;
+
+    /* a scatter/gather write refers to the larger values in the box
+     * rather than copying them - unless we're corked, in which case
+     * everything is copied in to the output buffer anyway */
+    if (proto->writev != NULL && !proto->corked)
+    {
+        if ( (ret = _amp_gather_call(box, command, ask_key, deadline,
+                                     &gather)) != 0)
+            return ret;
+
+        /* the handler may release the gather straight away */
+        for (i = 0; i < gather->iovcnt; i++)
+            gather_size += gather->iov[i].len;
+
+        return count_written(proto,
+                             proto->writev(proto, gather->iov,
+                                           gather->iovcnt,
+                                           _amp_release_gather, gather,
+                                           proto->write_arg),
+                             gather_size);
+    }
+
+    if (command != NULL)
+        ret = _amp_serialize_call(box, command, ask_key, deadline,
+                                  &buf, &buf_size);
+    else
+        ret = amp_serialize_box(box, &buf, &buf_size);
+    if (ret != 0)
+        return ret;
 
     /* The write handler should return 0 on success, or non-zero on error
      * so just pass on the value */
     return _amp_do_write(proto, buf, buf_size);
+}
 
-error:
-    if (cb)
+void amp_cork(AMP_Proto_T *proto)
+{
+    proto->corked = 1;
+}
+
+int amp_uncork(AMP_Proto_T *proto)
+{
+    proto->corked = 0;
+    return amp_flush(proto);
+}
+
+int amp_flush(AMP_Proto_T *proto)
+{
+    unsigned char *buf = proto->out_buf;
+    int buf_size = proto->out_size;
+
+    if (buf == NULL)
+        return 0;
+
+    /* the write handler takes ownership of the buffer */
+    proto->out_buf = NULL;
+    proto->out_size = 0;
+    proto->out_capacity = 0;
+
+    return write_now(proto, buf, buf_size);
+}
+
+/* Take the next free ask key, and register `callback' for it.
+ * Returns 0 on success, or ENOMEM. */
+static int register_call(AMP_Proto_T *proto, amp_callback_func callback,
+                         void *callback_arg, unsigned int *ask_key)
+{
+    int ret;
+
+    /* Skip over any ask key whose slot is still held by a call that
+     * has been outstanding for a very long time. */
+    do
     {
-        /* Try to remove this callback from outstanding_requests - does
-         * nothing if it doesn't exist in the hash table */
-        _amp_pop_callback(proto->outstanding_requests, ask_key);
-        _amp_free_callback(cb);
+        *ask_key = amp_next_ask_key(proto);
+    } while ( (ret = _amp_put_callback(proto->outstanding_requests,
+                                       *ask_key, callback,
+                                       callback_arg)) == -1);
+    return ret;
+}
+
+static int _amp_call(AMP_Proto_T *proto, const char *command, AMP_Box_T *args,
+                     amp_callback_func callback, void *callback_arg, unsigned int *ask_key_ret,
+                     int requiresAnswer, unsigned int timeout)
+{
+    /* The _command and _ask keys are serialized ahead of the contents of
+     * `args', rather than being stored in it, so the same box may be
+     * passed to any number of calls. */
+
+    int ret;
+    unsigned int ask_key = 0;
+    char ask_key_str[sizeof("4294967295")];
+    char deadline_str[sizeof("4294967295")];
+    const char *deadline = NULL;
+    int registered = 0;
+    struct _AMP_Timer *timer;
+
+    if (would_block(proto))
+        return AMP_WOULD_BLOCK;
+
+    if (requiresAnswer)
+    {
+        timeout = inherit_timeout(timeout);
+
+        if ( (ret = register_call(proto, callback, callback_arg,
+                                  &ask_key)) != 0)
+            goto error;
+        registered = 1;
+
+        if (timeout > 0)
+        {
+            if (proto->timers == NULL &&
+                (proto->timers = _amp_new_timer_wheel(proto->clock)) == NULL)
+            {
+                ret = ENOMEM;
+                goto error;
+            }
+
+            if ( (timer = _amp_add_timer(proto->timers,
+                                         proto->clock + timeout,
+                                         ask_key)) == NULL)
+            {
+                ret = ENOMEM;
+                goto error;
+            }
+            _amp_get_callback(proto->outstanding_requests, ask_key)->timer =
+                timer;
+        }
+
+        if (ask_key_ret != NULL)
+            *ask_key_ret = ask_key;
+
+        snprintf(ask_key_str, sizeof(ask_key_str), "%u", ask_key);
+
+        if (timeout > 0 && proto->propagate_deadlines)
+        {
+            snprintf(deadline_str, sizeof(deadline_str), "%u", timeout);
+            deadline = deadline_str;
+        }
     }
+
+    /* if the call couldn't be written, its callback is never made */
+    if ( (ret = _amp_write_box(proto, args, command,
+                               requiresAnswer ? ask_key_str : NULL,
+                               deadline)) != 0)
+        goto error;
+
+    return 0;
+
+error:
+    if (registered)
+        pop_call(proto, ask_key, NULL);
     return ret;
 }
 
 int amp_call(AMP_Proto_T *proto, const char *command, AMP_Box_T *args,
              amp_callback_func callback, void *callback_arg, unsigned int *ask_key)
 {
-    return _amp_call(proto, command, args, callback, callback_arg, ask_key, 1);
+    return _amp_call(proto, command, args, callback, callback_arg, ask_key, 1,
+                     0);
+}
+
+int amp_call_with_timeout(AMP_Proto_T *proto, const char *command,
+                          AMP_Box_T *args, amp_callback_func callback,
+                          void *callback_arg, unsigned int timeout,
+                          unsigned int *ask_key)
+{
+    return _amp_call(proto, command, args, callback, callback_arg, ask_key, 1,
+                     timeout);
+}
+
+void amp_set_deadline_propagation(AMP_Proto_T *proto, int enabled)
+{
+    proto->propagate_deadlines = enabled != 0;
 }
 
 int amp_call_no_answer(AMP_Proto_T *proto, const char *command, AMP_Box_T *args)
 {
-    /* TODO mutates the passed in box by adding special _answer key.
-     * But user code might re-use the AMP_Box they passed us here,
-     * possibly with different key/values.... so will the presence of the
-     * special keys in their box cause problems ever? */
-    return _amp_call(proto, command, args, NULL, NULL, NULL, 0);
+    return _amp_call(proto, command, args, NULL, NULL, NULL, 0, 0);
 }
 
-int amp_cancel(AMP_Proto_T *proto, int ask_key)
+int _amp_make_prepared_call(AMP_Proto_T *proto, const char *command,
+                            const unsigned char *args, int args_size,
+                            amp_callback_func callback, void *callback_arg)
 {
+    const char *keys[2] = {COMMAND, ASK};
+    AMP_Chunk_T values[2];
+    char ask_key_str[sizeof("4294967295")];
+    unsigned int ask_key;
     int ret;
-    _AMP_Callback_p cb;
-    if ((cb = _amp_pop_callback(proto->outstanding_requests,
-                                ask_key)) != NULL) {
-        AMP_Result_T *result;
-        if ( (ret = _amp_new_result_with_cancel(&result)) != 0)
-        {
-            /* This would be quit awkward if _amp_new_result_with_cancel
-             * fails here due to a malloc() failure.... we would have
-             * forgotten about the callback, so any incoming _answer or
-             * _error boxes for this ask_key will be ignored. BUT the
-             * user-defined callback function will never have been called
-             * with a result indicating cancellation as was requested */
-            _amp_free_callback(cb);
-            return ret;
-        }
 
-        (cb->func)(proto, result, cb->arg);
-        _amp_free_callback(cb);
+    if ( (ret = register_call(proto, callback, callback_arg, &ask_key)) != 0)
+        goto error;
+
+    values[0].value = (unsigned char *)command;
+    values[0].size = strlen(command);
+    values[1].value = (unsigned char *)ask_key_str;
+    values[1].size = snprintf(ask_key_str, sizeof(ask_key_str), "%u",
+                              ask_key);
 
+    if ( (ret = write_prefixed(proto, 2, keys, values, args,
+                               args_size)) != 0)
+    {
+        pop_call(proto, ask_key, NULL);
+        goto error;
+    }
+    return 0;
+
+error:
+    /* the caller has long since returned, so has to be told */
+    (callback)(proto, &cancel_result, callback_arg);
+    return ret;
+}
+
+int amp_cancel(AMP_Proto_T *proto, int ask_key)
+{
+    struct _AMP_Callback cb;
+    if (pop_call(proto, ask_key, &cb)) {
+        (cb.func)(proto, &cancel_result, cb.arg);
         return 0;
     }
     return AMP_NO_SUCH_ASK_KEY;
 }
 
+int amp_cancel_all(AMP_Proto_T *proto, enum amp_result_reason reason)
+{
+    _AMP_Callback_Map_p cancelled;
+    AMP_Result_T *result;
+
+    if (_amp_callback_map_length(proto->outstanding_requests) == 0)
+        return 0;
+
+    if (reason == AMP_TIMEOUT)
+        result = &timeout_result;
+    else if (reason == AMP_CONNECTION_LOST)
+        result = &connection_lost_result;
+    else
+        result = &cancel_result;
+
+    /* Swap in an empty map before invoking any callbacks, so that calls
+     * they make are left alone, and a callback that cancels another call
+     * which is being cancelled here finds nothing to do. */
+    cancelled = proto->outstanding_requests;
+    if ( (proto->outstanding_requests = _amp_new_callback_map()) == NULL)
+    {
+        proto->outstanding_requests = cancelled;
+        return ENOMEM;
+    }
+
+    /* Every pending timer belongs to one of the calls being cancelled */
+    if (proto->timers != NULL)
+        _amp_clear_timers(proto->timers);
+
+    cancel_calls(proto, cancelled, result);
+    _amp_free_callback_map(cancelled);
+    return 0;
+}
+
+/* Called by the timer wheel for each call that times out */
+static void expire_call(void *arg, unsigned int ask_key)
+{
+    AMP_Proto_T *proto = arg;
+    struct _AMP_Callback cb;
+
+    /* the wheel has already dropped the call's timer */
+    if (_amp_pop_callback(proto->outstanding_requests, ask_key, &cb))
+        (cb.func)(proto, &timeout_result, cb.arg);
+}
+
+int amp_tick(AMP_Proto_T *proto, unsigned long long now)
+{
+    if (!proto->clock_started)
+    {
+        /* Starting the clock. Timeouts set before now are counted from
+         * this point. */
+        if (proto->timers != NULL)
+            _amp_rebase_timers(proto->timers, now);
+        proto->clock = now;
+        proto->clock_started = 1;
+        return 0;
+    }
+
+    if (now <= proto->clock)
+        return 0;
+    proto->clock = now;
+
+    if (proto->timers == NULL)
+        return 0;
+
+    return _amp_expire_timers(proto->timers, now, expire_call, proto);
+}
+
+int amp_set_response_cache(AMP_Proto_T *proto, const char *command,
+                           unsigned int ttl, size_t budget)
+{
+    if (proto->response_cache == NULL)
+    {
+        if (ttl == 0)
+            return 0;
+        if ( (proto->response_cache = _amp_new_response_cache()) == NULL)
+            return ENOMEM;
+    }
+
+    return _amp_set_cache_policy(proto->response_cache, command, ttl, budget);
+}
+
+/* Allocate the proto's staging queues, if it hasn't any yet */
+static int need_staging(AMP_Proto_T *proto)
+{
+    if (proto->staging == NULL &&
+        (proto->staging = _amp_new_staging()) == NULL)
+        return ENOMEM;
+    return 0;
+}
+
+/* Whether `priority' names one of the priority classes - the enum may
+ * hold any int */
+static int valid_priority(enum amp_priority priority)
+{
+    return (int)priority >= 0 && (int)priority < AMP_PRIORITY_CLASSES;
+}
+
+int amp_set_command_priority(AMP_Proto_T *proto, const char *command,
+                             enum amp_priority priority)
+{
+    if (!valid_priority(priority))
+        return AMP_BAD_PRIORITY;
+
+    if (need_staging(proto) != 0)
+        return ENOMEM;
+
+    return _amp_set_priority(proto->staging, command, priority);
+}
+
+int amp_set_priority_weight(AMP_Proto_T *proto, enum amp_priority priority,
+                            int weight)
+{
+    if (!valid_priority(priority))
+        return AMP_BAD_PRIORITY;
+
+    if (need_staging(proto) != 0)
+        return ENOMEM;
+
+    _amp_set_priority_weight(proto->staging, priority, weight);
+    return 0;
+}
+
+int amp_set_staged_dispatch(AMP_Proto_T *proto, int enabled)
+{
+    if (enabled && need_staging(proto) != 0)
+        return ENOMEM;
+
+    proto->staged = enabled != 0;
+    return 0;
+}
+
+int amp_dispatch_staged(AMP_Proto_T *proto, int max)
+{
+    AMP_Request_T *request;
+    int ret, n = 0;
+
+    if (proto->staging == NULL)
+        return 0;
+
+    while ((max <= 0 || n < max) &&
+           (request = _amp_next_staged(proto->staging)) != NULL)
+    {
+        n++;
+        if ( (ret = dispatch_request(proto, request)) != 0)
+            amp_log("Couldn't dispatch a staged request: %s",
+                    amp_strerror(ret));
+    }
+    return n;
+}
+
+int amp_staged_requests(AMP_Proto_T *proto)
+{
+    if (proto->staging == NULL)
+        return 0;
+    return _amp_staged_length(proto->staging);
+}
+
+/* Forget the compiled responder index, if any, since the responders
+ * it was built from are about to change */
+static void thaw_responders(AMP_Proto_T *proto)
+{
+    if (proto->responder_index != NULL)
+    {
+        _amp_free_responder_index(proto->responder_index);
+        proto->responder_index = NULL;
+    }
+}
+
 void amp_add_responder(AMP_Proto_T *proto, const char *command, void *responder,
                        void *responder_arg)
 {
-    _AMP_Responder_p resp = _amp_new_responder(responder, responder_arg);
-    _amp_put_responder(proto->responders, command, resp);
+    if (proto->responders == NULL &&
+        (proto->responders = _amp_new_responder_map()) == NULL)
+    {
+        amp_log("Couldn't add responder for %s: %s", command,
+                amp_strerror(ENOMEM));
+        return;
+    }
+
+    _AMP_Responder_p resp, old;
+
+    if ( (resp = _amp_new_responder(responder, responder_arg)) == NULL)
+    {
+        amp_log("Couldn't add responder for %s: %s", command,
+                amp_strerror(ENOMEM));
+        return;
+    }
+
+    thaw_responders(proto);
+    /* the responder being replaced, if any, is only free'd once the new
+     * one is in its place */
+    old = _amp_get_responder(proto->responders,
+                             (const unsigned char *)command);
+    if (_amp_put_responder(proto->responders, command, resp) != 0)
+    {
+        _amp_free_responder(resp);
+        amp_log("Couldn't add responder for %s: %s", command,
+                amp_strerror(ENOMEM));
+        return;
+    }
+    if (old != NULL)
+        _amp_free_responder(old);
+}
+
+int amp_add_responder_async(AMP_Proto_T *proto, AMP_Worker_Pool_T *pool,
+                            const char *command, amp_responder_func responder,
+                            void *responder_arg)
+{
+    _AMP_Responder_p resp, old;
+
+    if (proto->completions == NULL &&
+        (proto->completions = _amp_new_completions()) == NULL)
+        return ENOMEM;
+
+    if (proto->responders == NULL &&
+        (proto->responders = _amp_new_responder_map()) == NULL)
+        return ENOMEM;
+
+    if ( (resp = _amp_new_responder(responder, responder_arg)) == NULL)
+        return ENOMEM;
+    resp->pool = pool;
+
+    thaw_responders(proto);
+    old = _amp_get_responder(proto->responders,
+                             (const unsigned char *)command);
+    if (_amp_put_responder(proto->responders, command, resp) != 0)
+    {
+        _amp_free_responder(resp);
+        return ENOMEM;
+    }
+    if (old != NULL)
+        _amp_free_responder(old);
+    return 0;
 }
 
 void amp_remove_responder(AMP_Proto_T *proto, const char *command)
 {
+    if (proto->responders == NULL)
+        return;
+
+    thaw_responders(proto);
     _amp_remove_responder(proto->responders, command);
 }
 
+int amp_freeze_responders(AMP_Proto_T *proto)
+{
+    _AMP_Responder_Index_p index;
+
+    /* nothing to compile - any lookups go straight to the registry */
+    if (proto->responders == NULL)
+        return 0;
+
+    if ( (index = _amp_new_responder_index(proto->responders)) == NULL)
+        return ENOMEM;
+
+    thaw_responders(proto);
+    proto->responder_index = index;
+    return 0;
+}
+
+AMP_Registry_T *amp_new_registry(void)
+{
+    AMP_Registry_T *registry;
+
+    if ( (registry = MALLOC(sizeof(*registry))) == NULL)
+        return NULL;
+
+    if ( (registry->responders = _amp_new_responder_map()) == NULL)
+    {
+        free(registry);
+        return NULL;
+    }
+    registry->index = NULL;
+
+    debug_print("New AMP_Registry at %p\n", registry);
+    return registry;
+}
+
+int amp_registry_add_responder(AMP_Registry_T *registry, const char *command,
+                               amp_responder_func responder,
+                               void *responder_arg)
+{
+    _AMP_Responder_p resp, old;
+
+    if (registry->index != NULL)
+        return AMP_REGISTRY_FROZEN;
+
+    if ( (resp = _amp_new_responder(responder, responder_arg)) == NULL)
+        return ENOMEM;
+
+    /* the responder being replaced, if any, is only free'd once the new
+     * one is in its place */
+    old = _amp_get_responder(registry->responders,
+                             (const unsigned char *)command);
+    if (_amp_put_responder(registry->responders, command, resp) != 0)
+    {
+        _amp_free_responder(resp);
+        return ENOMEM;
+    }
+    if (old != NULL)
+        _amp_free_responder(old);
+    return 0;
+}
+
+int amp_freeze_registry(AMP_Registry_T *registry)
+{
+    if (registry->index != NULL)
+        return 0; /* already frozen */
+
+    if ( (registry->index = _amp_new_responder_index(registry->responders))
+         == NULL)
+        return ENOMEM;
+
+    return 0;
+}
+
+int amp_set_registry(AMP_Proto_T *proto, AMP_Registry_T *registry)
+{
+    int ret;
+
+    if (registry != NULL && (ret = amp_freeze_registry(registry)) != 0)
+        return ret;
+
+    proto->registry = registry;
+    return 0;
+}
+
+void amp_free_registry(AMP_Registry_T *registry)
+{
+    if (registry == NULL)
+        return;
+
+    debug_print("Free AMP_Registry at %p\n", registry);
+
+    if (registry->index != NULL)
+        _amp_free_responder_index(registry->index);
+
+    _amp_free_responder_map(registry->responders);
+    free(registry);
+}
+
+/* Keep the answer `args' to a request for a cacheable command. This is
+ * best-effort: the answer is still sent if it can't be cached. */
+static void cache_answer(AMP_Proto_T *proto, struct _AMP_Cache_Policy *policy,
+                         AMP_Request_T *request, AMP_Box_T *args)
+{
+    /* the request's own box, even if the application took ownership of
+     * its arguments */
+    AMP_Box_T *box = AMP_BOX_OF(request, as.request);
+    unsigned char *key = NULL, *answer = NULL;
+    int key_size, answer_size;
+
+    if (_amp_box_canonical(box, &key, &key_size) != 0 ||
+        amp_serialize_box(args, &answer, &answer_size) != 0)
+        goto done;
+
+    _amp_cache_store(proto->response_cache, policy, _amp_box_digest(box),
+                     key, key_size, answer, answer_size, proto->clock);
+
+done:
+    free(key);
+    free(answer);
+}
+
 int amp_respond(AMP_Proto_T *proto, AMP_Request_T*request, AMP_Box_T *args)
 {
     int ret;
-    unsigned char *buf;
-    int buf_size;
+    struct _AMP_Cache_Policy *policy;
+    _AMP_Completions_p completions;
+
+    /* answering from a worker thread - leave the proto alone. The
+     * release is counted before the answer is queued, so that the
+     * drain which writes the answer also takes the release into
+     * account, after writing it. */
+    if ( (completions = _amp_worker_completions(proto)) != NULL)
+    {
+        release_admission(request);
+        return _amp_respond_async(completions, request, args);
+    }
+
+    if (proto->response_cache != NULL &&
+        (policy = _amp_get_cache_policy(proto->response_cache,
+                                        request->command)) != NULL)
+        cache_answer(proto, policy, request, args);
 
     if ( (ret = amp_put_bytes(args, ANSWER, request->ask_key->value,
                               request->ask_key->size)) != 0)
         return ret;
 
-    if ( (ret = amp_serialize_box(args, &buf, &buf_size)) != 0)
-        return ret;
-
     /* proto->write() should return 0 on success, or non-zero on error
      * so just pass on the value */
-    return _amp_do_write(proto, buf, buf_size);
+    ret = _amp_write_box(proto, args, NULL, NULL, NULL);
+
+    /* answered, as far as the limit on requests in progress goes - only
+     * now may the `on_admit' handler read more requests */
+    release_admission(request);
+    return ret;
 }
 
 /* Error codes as defined in amp.h */
@@ -993,6 +2024,13 @@ struct {
     {AMP_OUT_OF_RANGE,    "The decoded value falls outside the representable range of the requested type"},
     {AMP_INTERNAL_ERROR,  "Libamp encountered an internal error. Please file a bug report."},
     {AMP_NO_SUCH_ASK_KEY, "amp_cancel() could not find the ask_key you requested."},
+    {AMP_REGISTRY_FROZEN, "The AMP_Registry is frozen and can no longer be changed"},
+    {AMP_NO_WAKEUP_HANDLER, "amp_call_threadsafe() needs a wakeup handler set with amp_set_wakeup_handler()"},
+    {AMP_GATHER_FULL,     "The AMP_Gather has finished, or has no free slots"},
+    {AMP_NOT_IN_COROUTINE, "amp_co_call() may only be used from a coroutine started by amp_co_spawn()"},
+    {AMP_WOULD_BLOCK,     "The AMP_Proto's pending output is above its high watermark"},
+    {AMP_PAUSED,          "The AMP_Proto has as many requests in progress as it may have"},
+    {AMP_BAD_PRIORITY,    "The priority is not one of enum amp_priority"},
     {ENOMEM,              "malloc() failed. Out Of Memory."}
 };
 
@@ -1007,4 +2045,3 @@ const char *amp_strerror(int amp_error_num)
 
     return "Unknown libamp error code";
 }
-
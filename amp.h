@@ -15,6 +15,8 @@
 #ifndef _AMP_H
 #define _AMP_H
 
+#include <stddef.h> /* size_t */
+
 /* Prevent symbols from being named-mangled by evil C++ compilers */
 #ifdef __cplusplus
 extern "C" {
@@ -52,6 +54,32 @@ extern "C" {
 /* amp_cancel() could not find the ask_key you requested */
 #define AMP_NO_SUCH_ASK_KEY 111
 
+/* The AMP_Registry has been frozen and can no longer be changed */
+#define AMP_REGISTRY_FROZEN 112
+
+/* amp_call_threadsafe() was used on an AMP_Proto that has no wakeup
+ * handler */
+#define AMP_NO_WAKEUP_HANDLER 113
+
+/* amp_gather_call() was used on an AMP_Gather that has already finished,
+ * or has made as many calls as it has slots */
+#define AMP_GATHER_FULL     114
+
+/* amp_co_call() was used outside of a coroutine */
+#define AMP_NOT_IN_COROUTINE 115
+
+/* amp_call() was refused because the AMP_Proto's pending output has
+ * reached its high watermark */
+#define AMP_WOULD_BLOCK     116
+
+/* amp_consume_bytes_partial() stopped because the AMP_Proto has as many
+ * requests in progress as amp_set_max_in_progress() allows */
+#define AMP_PAUSED          117
+
+/* amp_set_command_priority() or amp_set_priority_weight() was given a
+ * value that isn't one of enum amp_priority */
+#define AMP_BAD_PRIORITY    118
+
 
 /* One of the codes above, or ENOMEM
  * TODO - go through and use this type instead of int where appropriate */
@@ -148,17 +176,40 @@ typedef struct AMP_Chunk AMP_Chunk_T;
 
 /* Represents an AMP call from a remote peer.
  * Passed to responders registered via the
- * amp_add_responder() API */
+ * amp_add_responder() API
+ *
+ * The request is stored inside its `args' box, and `command'
+ * and `ask_key' point at the values of the _command and _ask
+ * keys in that box - so they remain valid only as long as the
+ * box does, and those keys aren't changed. */
 struct AMP_Request
 {
     AMP_Chunk_T *command;
     AMP_Chunk_T *ask_key;
     AMP_Box_T *args;
+
+    /* The time, on the clock of the AMP_Proto the request was read by,
+     * after which the caller no longer wants an answer - if
+     * `has_deadline' is set. It isn't if the caller gave no deadline.
+     * See amp_set_deadline_propagation(). */
+    unsigned long long deadline;
+    int has_deadline;
+
+    /* Private: the proto whose count of requests in progress includes
+     * this request, until it is answered or free'd. See
+     * amp_set_max_in_progress(). */
+    struct AMP_Proto *admitted_by;
 };
 typedef struct AMP_Request AMP_Request_T;
 
 
-/* Free an AMP_Request_T * */
+/* Free an AMP_Request_T * along with its `args' box.
+ *
+ * The request must be one handed to a responder by libamp: it lives in
+ * the box it was parsed from, and freeing the box is what frees it.
+ * To keep the box, set request->args to NULL first - the
+ * request is then free'd along with the box, whenever
+ * that is. */
 void AMP_DLL amp_free_request(AMP_Request_T *request);
 
 
@@ -191,7 +242,9 @@ enum amp_result_reason
 {
     AMP_SUCCESS,
     AMP_ERROR,
-    AMP_CANCEL
+    AMP_CANCEL,
+    AMP_TIMEOUT,
+    AMP_CONNECTION_LOST
 };
 
 
@@ -211,6 +264,32 @@ typedef struct {
 } AMP_DateTime_T;
 
 
+/* Used to represent AMP Decimal values.
+ *
+ * A finite value is (-1)^negative * coefficient * 10^exponent, where the
+ * coefficient is the unsigned 128-bit integer formed from coeff_high and
+ * coeff_low. Values of up to 19 significant digits have coeff_high == 0.
+ *
+ * The coefficient is not normalized, so trailing zeros are kept: "1.50"
+ * is {coefficient 150, exponent -2}, and re-encodes as "1.50". */
+enum amp_decimal_kind
+{
+    AMP_DECIMAL_FINITE,
+    AMP_DECIMAL_INFINITY,
+    AMP_DECIMAL_NAN
+};
+
+typedef struct {
+    enum amp_decimal_kind kind;
+
+    int                negative;    /* Non-zero for "-0", "-1.5", "-Infinity" */
+    unsigned long long coeff_high;  /* High 64 bits of the coefficient */
+    unsigned long long coeff_low;   /* Low 64 bits of the coefficient */
+    int                exponent;    /* Power of ten applied to the coefficient */
+
+} AMP_Decimal_T;
+
+
 /* Represents the result of an AMP call.
  *
  * `reason' indicates the type of event that generated this Result:
@@ -221,12 +300,23 @@ typedef struct {
  * AMP_ERROR - received an AMP error for this call, access it
  *             through r->error.
  *
- * AMP_CANCEL - call was cancelled via amp_cancel() API. No other
- *              data is available.
+ * AMP_TIMEOUT - no response arrived before the timeout given to
+ *               amp_call_with_timeout() expired. No other data is
+ *               available.
+ *
+ * AMP_CANCEL - call was cancelled via amp_cancel() or amp_cancel_all(),
+ *              or the AMP_Proto was freed. No other data is available.
+ *
+ * AMP_CONNECTION_LOST - call was cancelled via amp_cancel_all() because
+ *                       the connection was lost. No other data is
+ *                       available.
  *
  * Only one outcome is possible, and only the associated
  * pointer for that outcome is assured to be valid; the
- * rest should be assumed to be NULL, and not dereferenced. */
+ * rest should be assumed to be NULL, and not dereferenced.
+ *
+ * The result, and the response or error it holds, are
+ * stored inside the AMP box they were parsed from. */
 struct AMP_Result
 {
     enum amp_result_reason reason;
@@ -243,6 +333,44 @@ void AMP_DLL amp_free_result(AMP_Result_T *result);
 typedef struct AMP_Proto AMP_Proto_T;
 
 
+/* A set of responders that may be shared by any number of AMP_Protos,
+ * so that a server need not build the same responder table for every
+ * connection.
+ *
+ * This is an opaque structure - you many only interact with it
+ * by using the provided access functions. */
+typedef struct AMP_Registry AMP_Registry_T;
+
+
+/* A pool of threads which run the responders added with
+ * amp_add_responder_async(), for any number of AMP_Protos.
+ *
+ * This is an opaque structure - you many only interact with it
+ * by using the provided access functions. */
+typedef struct AMP_Worker_Pool AMP_Worker_Pool_T;
+
+
+/* Priority classes for staged dispatch, most urgent first. Commands are
+ * AMP_PRIORITY_NORMAL unless set otherwise with
+ * amp_set_command_priority(). */
+enum amp_priority
+{
+    AMP_PRIORITY_CONTROL, /* e.g. health checks and cancellations */
+    AMP_PRIORITY_HIGH,
+    AMP_PRIORITY_NORMAL,
+    AMP_PRIORITY_BULK
+};
+
+#define AMP_PRIORITY_CLASSES 4
+
+
+/* Prototype for a function which wakes the thread that owns an AMP_Proto
+ * - e.g. by writing to an eventfd or pipe that its event loop watches -
+ * so that it calls amp_drain_completions(). It is called from other
+ * threads, and must be safe to call from them. */
+typedef void (*amp_wakeup_func)(void *wakeup_arg);
+
+
 /* Prototype for function to handle a new AMP box read off the wire */
 typedef int (*amp_dispatch_box_handler)(AMP_Proto_T *proto, AMP_Box_T *box);
 
@@ -292,6 +420,21 @@ typedef void (*amp_callback_func)(AMP_Proto_T *proto, AMP_Result_T *result,
 int AMP_DLL amp_cancel(AMP_Proto_T *proto, int ask_key);
 
 
+/* Cancel every outstanding AMP request at once - typically because the
+ * connection has been lost. The callback of each one is invoked with a
+ * result whose reason is `reason', which should be AMP_CANCEL,
+ * AMP_TIMEOUT or AMP_CONNECTION_LOST.
+ *
+ * The result passed to the callbacks is shared between them, and doesn't
+ * need to be free'd (though it is harmless to pass it to
+ * amp_free_result()). Calls made by the callbacks are not cancelled.
+ *
+ * Returns 0 on success or ENOMEM, in which case no request has been
+ * cancelled. */
+int AMP_DLL amp_cancel_all(AMP_Proto_T *proto,
+                           enum amp_result_reason reason);
+
+
 /* Prototype for function to handle writing data
  * to the remote AMP peer. We don't want libamp to
  * be tied to sockets, unnecessarily. So we may
@@ -326,7 +469,12 @@ void AMP_DLL amp_reset_proto(AMP_Proto_T *proto);
 
 
 /* Free an AMP_Proto - call this after you've lost the connection to the
- * remote AMP peer. */
+ * remote AMP peer.
+ *
+ * The callback of each outstanding AMP request is invoked first, with a
+ * result whose reason is AMP_CANCEL, so that callback arguments may be
+ * released. Use amp_cancel_all() beforehand to give a different reason.
+ * The callbacks must not make further calls with this AMP_Proto. */
 void AMP_DLL amp_free_proto(AMP_Proto_T *proto);
 
 
@@ -365,32 +513,477 @@ void AMP_DLL amp_free_proto(AMP_Proto_T *proto);
 int AMP_DLL amp_consume_bytes(AMP_Proto_T *proto, unsigned char* buf, int nbytes);
 
 
+/* Like amp_consume_bytes(), but stops short of the next box once the
+ * proto has as many requests in progress as amp_set_max_in_progress()
+ * allows - returning AMP_PAUSED. The number of bytes consumed is stored
+ * in `consumed' either way, and the rest of `buf' should be handed to
+ * this function again once the proto's `on_admit' handler is called.
+ * amp_consume_bytes() itself ignores the limit. */
+int AMP_DLL amp_consume_bytes_partial(AMP_Proto_T *proto, unsigned char* buf,
+                                      int nbytes, int *consumed);
+
+
 /* Set handler function for writing data to the remote AMP peer */
 void AMP_DLL amp_set_write_handler(AMP_Proto_T *proto, write_amp_data_func func,
                                    void *write_arg);
 
 
+/* Cork an AMP_Proto: until amp_uncork() is called, the boxes produced by
+ * amp_call(), amp_respond() and so on are collected in a single buffer,
+ * instead of each being passed to the write handler as it is made.
+ *
+ * Corking around a batch of work - e.g. consuming everything that one
+ * read returned, or issuing many pipelined calls - turns one write per
+ * box in to one write per batch. */
+void AMP_DLL amp_cork(AMP_Proto_T *proto);
+
+
+/* Uncork an AMP_Proto, and pass anything written while it was corked
+ * to the write handler in a single call.
+ *
+ * Returns 0, or the value returned by the write handler. */
+int AMP_DLL amp_uncork(AMP_Proto_T *proto);
+
+
+/* Pass anything written while corked to the write handler in a single
+ * call, leaving the proto corked. Does nothing if there is nothing to
+ * write.
+ *
+ * Returns 0, or the value returned by the write handler. */
+int AMP_DLL amp_flush(AMP_Proto_T *proto);
+
+
+/* A segment of a scatter/gather write. Laid out like the POSIX
+ * `struct iovec', so an array of these may be passed to writev() or
+ * sendmsg() directly. */
+typedef struct AMP_IOVec
+{
+    void *base;
+    size_t len;
+} AMP_IOVec_T;
+
+
+/* Releases the memory referenced by a scatter/gather write */
+typedef void (*amp_write_release_func)(void *release_arg);
+
+
+/* Prototype for a function which writes data to the remote AMP peer
+ * from a list of buffers, rather than one contiguous buffer.
+ *
+ * `iov' is an array of `iovcnt' segments which, written in order, form
+ * one or more serialized AMP boxes. The segments refer to memory owned
+ * by libamp - including the values stored in the boxes passed to
+ * amp_call() or amp_respond(), which are not copied. They remain valid
+ * until the handler calls `release(release_arg)', which it must do
+ * exactly once, once it has finished with them - whether or not the
+ * write succeeded.
+ *
+ * A box passed to amp_call() or amp_respond() may be free'd straight
+ * away, as usual, but must not be modified until the write has been
+ * released.
+ *
+ * Must return 0 on success, or non-zero on error. */
+typedef int(*writev_amp_data_func)(AMP_Proto_T *proto, const AMP_IOVec_T *iov,
+                                   int iovcnt, amp_write_release_func release,
+                                   void *release_arg, void *write_arg);
+
+
+/* Set a scatter/gather handler function for writing data to the remote
+ * AMP peer. Replaces any handler set with amp_set_write_handler(). */
+void AMP_DLL amp_set_writev_handler(AMP_Proto_T *proto,
+                                    writev_amp_data_func func,
+                                    void *write_arg);
+
+
+/* Prototype for the functions called when an AMP_Proto's pending output
+ * crosses one of its watermarks */
+typedef void (*amp_flow_func)(AMP_Proto_T *proto, void *flow_arg);
+
+
+/* Set watermarks on the output that the proto has handed to its write
+ * handler, and that the application hasn't yet reported drained with
+ * amp_bytes_drained().
+ *
+ * When the pending output reaches `high' bytes, the proto is paused:
+ * amp_call(), amp_call_with_timeout() and amp_call_no_answer() - and the
+ * functions built on them - fail with AMP_WOULD_BLOCK until it has
+ * fallen to `low' bytes or fewer. Output still corked counts towards
+ * `high' too. Answers to requests are never refused, but count towards
+ * the pending output like anything else.
+ *
+ * A `high' of 0, the default, turns the watermarks off. The watermarks
+ * are only useful if the application calls amp_bytes_drained(). */
+void AMP_DLL amp_set_write_watermarks(AMP_Proto_T *proto, size_t low,
+                                      size_t high);
+
+
+/* Set functions called when the proto is paused at its high watermark,
+ * and resumed at its low watermark - e.g. to stop and restart a
+ * producer. Either may be NULL. They are called from within whichever
+ * function wrote, or drained, the bytes that crossed the watermark, and
+ * must not free the proto. */
+void AMP_DLL amp_set_flow_handlers(AMP_Proto_T *proto, amp_flow_func on_pause,
+                                   amp_flow_func on_resume, void *flow_arg);
+
+
+/* Report that `bytes' of the output handed to the write handler have
+ * been written out - e.g. from the write callback of a buffered socket,
+ * by how much its output buffer has shrunk. */
+void AMP_DLL amp_bytes_drained(AMP_Proto_T *proto, size_t bytes);
+
+
+/* Returns the number of bytes handed to the write handler and not yet
+ * reported drained. */
+size_t AMP_DLL amp_bytes_pending(AMP_Proto_T *proto);
+
+
+/* Limit the number of requests that are in progress at once - those read
+ * that expect an answer, and that haven't been answered or free'd yet.
+ * Only requests read while a limit is set count. Requests answered from
+ * the response cache don't, but requests waiting in staged dispatch do.
+ * A request may be free'd after the proto it was read by.
+ *
+ * Once `max' are in progress amp_consume_bytes_partial() stops reading,
+ * so that a peer that sends requests faster than they are answered is
+ * held back by the transport - e.g. by no longer reading from its
+ * socket. `on_admit' is called once a request is answered or free'd
+ * after that, and may be NULL; it is called from within amp_respond(),
+ * amp_free_request() or amp_drain_completions(), and must not free the
+ * proto. A `max' of 0, the default, turns the limit off. */
+void AMP_DLL amp_set_max_in_progress(AMP_Proto_T *proto, int max,
+                                     amp_flow_func on_admit, void *admit_arg);
+
+
+/* Returns the number of requests in progress, see
+ * amp_set_max_in_progress() */
+int AMP_DLL amp_in_progress(AMP_Proto_T *proto);
+
+
 /* Call a remote AMP Command
  *
  * The passed in AMP_Box should contain key/values for the arguments that the
  * remote Command expects to receive. It should not contain any of the special
- * AMP protocol keys, such as _command, or _ask.
+ * AMP protocol keys, such as _command, or _ask - any that it does contain
+ * are left out of the call. `args' may be NULL if the Command takes no
+ * arguments.
+ *
+ * The _command and _ask keys are written to the wire ahead of the
+ * arguments, and `args' is not modified - so the same box may be passed
+ * to any number of calls, on any number of AMP_Protos.
  *
  * The function supplied in `callback' will be invoked when a response is
  * received for this call. `callback_arg' is an argument to be passed to
  * the callback.
  *
- * Returns 0 on success, otherwise an an AMP_* error code. */
+ * Returns 0 on success, otherwise an an AMP_* error code - such as
+ * AMP_WOULD_BLOCK, see amp_set_write_watermarks() - or the non-zero value
+ * returned by the write handler - in which case the callback will never
+ * be invoked. */
 int AMP_DLL amp_call(AMP_Proto_T *proto, const char *command, AMP_Box_T *args,
              amp_callback_func callback, void *callback_arg, unsigned int *ask_key);
 
 
+/* Same as amp_call(), except that if no response has arrived `timeout'
+ * milliseconds from now, the callback is invoked with a result whose
+ * reason is AMP_TIMEOUT and the call is forgotten - so any late response
+ * is ignored. A `timeout' of 0 means no timeout.
+ *
+ * Time is measured by the clock that the application drives with
+ * amp_tick(). */
+int AMP_DLL amp_call_with_timeout(AMP_Proto_T *proto, const char *command,
+                                  AMP_Box_T *args, amp_callback_func callback,
+                                  void *callback_arg, unsigned int timeout,
+                                  unsigned int *ask_key);
+
+
+/* Advance the AMP_Proto's clock to `now' - a time in milliseconds from
+ * any fixed point, such as a monotonic clock reading - and time out any
+ * calls whose timeout has expired. Call this regularly, e.g. from a
+ * periodic timer of the application's event loop. A `now' earlier than
+ * the last one given is ignored.
+ *
+ * The first call only starts the clock: timeouts set before then are
+ * counted from that point.
+ *
+ * Expiring a call costs O(1), however many calls are outstanding.
+ *
+ * Returns the number of calls that timed out. */
+int AMP_DLL amp_tick(AMP_Proto_T *proto, unsigned long long now);
+
+
+/* Turn propagation of deadlines on or off for calls made with `proto'.
+ *
+ * While it is on, each call made with a timeout - given to
+ * amp_call_with_timeout(), or inherited as below - tells the peer how
+ * long it has to answer, in a _deadline key. libamp on the peer records
+ * the deadline in the request's `deadline' member, and drops the request
+ * unanswered if it expires before a responder is found for it - e.g.
+ * while it waits for staged dispatch.
+ *
+ * Deadlines are received whether or not propagation is turned on, so
+ * long as the proto's clock has been started with amp_tick().
+ *
+ * While a responder for a request with a deadline runs, the calls it
+ * makes - on any AMP_Proto - inherit the time left before the deadline
+ * as their timeout, or keep their own timeout if that is shorter. A
+ * responder which answers later can do the same with
+ * amp_request_time_left(). */
+void AMP_DLL amp_set_deadline_propagation(AMP_Proto_T *proto, int enabled);
+
+
+/* Returns the time left, in milliseconds, before the deadline of a
+ * request read by `proto' - suitable as the timeout of a call made on the
+ * request's behalf. Returns 0 if the request has no deadline, or 1 if it
+ * has already expired. */
+unsigned int AMP_DLL amp_request_time_left(AMP_Proto_T *proto,
+                                           AMP_Request_T *request);
+
+
 /* Same as amp_call() except does not request an answer from the remote peer.
  *
  * You will never receive a callback as a result of this call. */
 int AMP_DLL amp_call_no_answer(AMP_Proto_T *proto, const char *command, AMP_Box_T *args);
 
 
+/* Call a remote AMP Command, unless an identical call - the same command,
+ * with the same arguments - made by this function is already awaiting a
+ * result on `proto'. In that case no box is written: the callback waits
+ * for the result of the earlier call instead. The arguments are as for
+ * amp_call().
+ *
+ * Arguments are compared by content, so boxes holding the same keys and
+ * values are identical however they were built.
+ *
+ * When the result arrives, every waiting callback is invoked with a
+ * result of its own, which it must free with amp_free_result() as usual.
+ * Those results all refer to the same response or error, so the box
+ * holding the response must not be modified.
+ *
+ * Every waiting callback is given the same `ask_key'. Cancelling it with
+ * amp_cancel() cancels the call for all of them.
+ *
+ * Returns 0 on success, ENOMEM, or any error returned by amp_call() - in
+ * which case the callback will never be invoked. */
+int AMP_DLL amp_call_coalesced(AMP_Proto_T *proto, const char *command,
+                               AMP_Box_T *args, amp_callback_func callback,
+                               void *callback_arg, unsigned int *ask_key);
+
+
+/* An AMP_Pipeline makes calls on an AMP_Proto on behalf of the
+ * application, keeping at most `window' of them in flight at once. Calls
+ * made while the window is full are queued, and made in order as earlier
+ * calls complete. */
+typedef struct AMP_Pipeline AMP_Pipeline_T;
+
+/* Counters kept by an AMP_Pipeline */
+typedef struct AMP_Pipeline_Stats
+{
+    int in_flight;                /* calls awaiting a result */
+    int queued;                   /* calls waiting for room in the window */
+
+    /* since the pipeline was created, or the counters were last reset */
+    unsigned long long sent;      /* calls made */
+    unsigned long long completed; /* calls answered with AMP_SUCCESS */
+    unsigned long long failed;    /* calls with any other result */
+} AMP_Pipeline_Stats_T;
+
+
+/* Allocate and return a new AMP_Pipeline which makes calls on `proto',
+ * keeping at most `window' in flight. Returns NULL on allocation failure.
+ *
+ * The pipeline must be free'd before `proto' is. */
+AMP_DLL AMP_Pipeline_T *amp_new_pipeline(AMP_Proto_T *proto, int window);
+
+
+/* Call a remote AMP Command through the pipeline. The arguments are as
+ * for amp_call(), except that the ask key isn't made available.
+ *
+ * If the window is full the call is queued. `command' must then remain
+ * valid until the call is made, and `args' must not be modified - though
+ * it may be free'd straight away, as the pipeline keeps a reference.
+ *
+ * The callback is invoked with the result of the call as usual. When it
+ * returns, queued calls are made to refill the window - unless the
+ * result's reason is AMP_CONNECTION_LOST. The callback must not free the
+ * pipeline.
+ *
+ * Returns 0 on success, ENOMEM, or any error returned by amp_call() if
+ * the call was made straight away - in which case the callback will
+ * never be invoked. */
+int AMP_DLL amp_pipeline_call(AMP_Pipeline_T *pipeline, const char *command,
+                              AMP_Box_T *args, amp_callback_func callback,
+                              void *callback_arg);
+
+
+/* Make queued calls until the window is full or the queue is empty.
+ *
+ * This happens automatically whenever a call completes. It need only be
+ * called directly to retry after a queued call could not be made - for
+ * instance because the write handler failed, or the proto was paused at
+ * its high watermark (when the proto's `on_resume' handler is a good
+ * place to call it) - since that call is kept at the front of the
+ * queue.
+ *
+ * Returns 0 on success, or the error returned by amp_call(). */
+int AMP_DLL amp_pipeline_fill(AMP_Pipeline_T *pipeline);
+
+
+/* Change the number of calls the pipeline keeps in flight. If the window
+ * grows, queued calls are made straight away.
+ *
+ * Returns as amp_pipeline_fill(). */
+int AMP_DLL amp_pipeline_set_window(AMP_Pipeline_T *pipeline, int window);
+
+
+/* Copy the pipeline's counters in to `stats'. If `reset' is non-zero,
+ * the `sent', `completed' and `failed' counters are then zeroed - so
+ * that calling this once per interval gives the throughput of each
+ * interval. */
+void AMP_DLL amp_pipeline_stats(AMP_Pipeline_T *pipeline,
+                                AMP_Pipeline_Stats_T *stats, int reset);
+
+
+/* Free an AMP_Pipeline. The calls it has in flight are cancelled with
+ * amp_cancel(), and the callbacks of any calls still queued are invoked
+ * with a result whose reason is AMP_CANCEL. */
+void AMP_DLL amp_free_pipeline(AMP_Pipeline_T *pipeline);
+
+
+/* An AMP_Gather makes a fixed number of calls, on any number of
+ * AMP_Protos, and stores their results in its slots - one per call, in
+ * the order the calls were made. The application is told once, by a
+ * single callback, when the gather finishes. */
+typedef struct AMP_Gather AMP_Gather_T;
+
+/* Prototype for the function called when an AMP_Gather finishes.
+ * `successes' is the number of calls whose result's reason is
+ * AMP_SUCCESS. */
+typedef void (*amp_gather_func)(AMP_Gather_T *gather, int successes,
+                                void *done_arg);
+
+
+/* Allocate and return a new AMP_Gather with room for `size' calls.
+ * Returns NULL on allocation failure.
+ *
+ * The gather finishes when the first of these happens:
+ *
+ * - every one of its `size' calls has a result.
+ * - `quorum' calls have succeeded. A `quorum' of 0 or less, or more than
+ *   `size', means all of them.
+ * - so many calls have failed that `quorum' can no longer be reached.
+ * - the application calls amp_gather_finish().
+ *
+ * If `timeout' isn't 0, each call times out that many milliseconds after
+ * it is made, as for amp_call_with_timeout() - which puts a deadline on
+ * the whole gather when its calls are made together.
+ *
+ * When it finishes, calls still in flight are cancelled - their slots
+ * hold results whose reason is AMP_CANCEL - and then `done' is called.
+ * From then on every slot that was used holds a result. */
+AMP_DLL AMP_Gather_T *amp_new_gather(int size, int quorum,
+                                     unsigned int timeout,
+                                     amp_gather_func done, void *done_arg);
+
+
+/* Call a remote AMP Command, storing its result in the next slot of the
+ * gather. The arguments are as for amp_call().
+ *
+ * If the call can't be made, its slot is given a result whose reason is
+ * AMP_CANCEL - so the gather still finishes, and may do so before this
+ * returns.
+ *
+ * Returns 0 on success, AMP_GATHER_FULL, or any error returned by
+ * amp_call(). */
+int AMP_DLL amp_gather_call(AMP_Gather_T *gather, AMP_Proto_T *proto,
+                            const char *command, AMP_Box_T *args);
+
+
+/* Finish the gather now, e.g. when a deadline of the application's own
+ * has passed. Does nothing if the gather has already finished. */
+void AMP_DLL amp_gather_finish(AMP_Gather_T *gather);
+
+
+/* Returns non-zero if the gather has finished. */
+int AMP_DLL amp_gather_finished(AMP_Gather_T *gather);
+
+
+/* Returns the result of the call made in slot `index', or NULL if it has
+ * no result yet. The result belongs to the gather, and is free'd with
+ * it. */
+AMP_DLL AMP_Result_T *amp_gather_result(AMP_Gather_T *gather, int index);
+
+
+/* Free an AMP_Gather, and the results it holds. Any calls still in flight
+ * are cancelled, without calling the gather's `done' function. May be
+ * called from `done'.
+ *
+ * The gather must be free'd before the AMP_Protos its calls are in flight
+ * on. */
+void AMP_DLL amp_free_gather(AMP_Gather_T *gather);
+
+
+/* A pool of coroutines, which let a sequence of calls be written as
+ * straight-line code: amp_co_call() suspends the coroutine until the
+ * result of its call arrives, while the application's event loop carries
+ * on. The stacks of coroutines that have returned are kept for re-use,
+ * so that a server running many short sessions needn't allocate a stack
+ * for each one.
+ *
+ * Coroutines are not threads: each one runs on the thread that spawned
+ * or resumed it, and only until it makes its next call or returns.
+ *
+ * This is an opaque structure - you many only interact with it
+ * by using the provided access functions. */
+typedef struct AMP_Co_Pool AMP_Co_Pool_T;
+
+/* Prototype for the function a coroutine runs */
+typedef void (*amp_co_func)(void *arg);
+
+
+/* Allocate and return a new AMP_Co_Pool, whose coroutines are given
+ * stacks of `stack_size' bytes - 64KiB if it is 0 - and which keeps up
+ * to `max_idle' coroutines for re-use once they have returned.
+ *
+ * A coroutine's stack must hold everything it calls, including libamp
+ * and the responders and callbacks run while it is resumed; there is no
+ * guard against overflowing it.
+ *
+ * Returns NULL on allocation failure. */
+AMP_DLL AMP_Co_Pool_T *amp_new_co_pool(size_t stack_size, int max_idle);
+
+
+/* Free an AMP_Co_Pool. Every coroutine spawned from it must have
+ * returned. */
+void AMP_DLL amp_free_co_pool(AMP_Co_Pool_T *pool);
+
+
+/* Start a coroutine which runs func(arg). It runs straight away, until
+ * its first amp_co_call() or until it returns - whichever comes first -
+ * and then this returns.
+ *
+ * Returns 0 on success, or ENOMEM. */
+int AMP_DLL amp_co_spawn(AMP_Co_Pool_T *pool, amp_co_func func, void *arg);
+
+
+/* Call a remote AMP Command from a coroutine, suspending the coroutine
+ * until the result arrives. The coroutine is resumed from within whatever
+ * delivers the result - usually amp_consume_bytes(), or amp_free_proto()
+ * cancelling the call - and `*result' is then set to the result, which
+ * the coroutine must free with amp_free_result() as usual.
+ *
+ * Returns 0 on success, AMP_NOT_IN_COROUTINE, or any error returned by
+ * amp_call() - in which case the coroutine isn't suspended. */
+int AMP_DLL amp_co_call(AMP_Proto_T *proto, const char *command,
+                        AMP_Box_T *args, AMP_Result_T **result);
+
+
+/* Same as amp_co_call(), but with a timeout as for
+ * amp_call_with_timeout(). */
+int AMP_DLL amp_co_call_with_timeout(AMP_Proto_T *proto, const char *command,
+                                     AMP_Box_T *args, unsigned int timeout,
+                                     AMP_Result_T **result);
+
+
 /* Register a responder function to handle an AMP command from the
  * remote peer.
  *
@@ -408,6 +1001,220 @@ void AMP_DLL amp_add_responder(AMP_Proto_T *proto, const char *command, void *re
 void AMP_DLL amp_remove_responder(AMP_Proto_T *proto, const char *command);
 
 
+/* Compile the responders registered so far in to a hash table, so that
+ * finding the responder for each incoming command usually costs a
+ * single hash and string comparison. Call this once all responders
+ * have been added.
+ *
+ * Adding or removing a responder afterwards discards the compiled
+ * table, reverting to the ordinary lookup until
+ * amp_freeze_responders() is called again.
+ *
+ * Returns 0 on success, or ENOMEM - in which case the responders
+ * continue to work as before. */
+int AMP_DLL amp_freeze_responders(AMP_Proto_T *proto);
+
+
+/* Cache the answers to an idempotent command, so that a request with the
+ * same arguments as an earlier one is answered straight from the cache -
+ * without calling the responder, or building an answer box.
+ *
+ * Requests are matched on all of their keys and values except _ask, in
+ * any order. Answers are kept for `ttl' milliseconds, measured by the
+ * clock that the application drives with amp_tick(), and the answers to
+ * `command' are limited to `budget' bytes between them - the least
+ * recently used being evicted to make room. Errors sent with
+ * amp_respond_error() are never cached.
+ *
+ * This applies to the responder that handles `command' for this proto,
+ * whether it was added to the proto or comes from its registry. The
+ * responder must not modify the request's arguments.
+ *
+ * A `ttl' of 0 stops caching the answers to `command', and drops those
+ * that are cached.
+ *
+ * Returns 0 on success, or ENOMEM. */
+int AMP_DLL amp_set_response_cache(AMP_Proto_T *proto, const char *command,
+                                   unsigned int ttl, size_t budget);
+
+
+/* Allocate and return a new AMP_Worker_Pool of `num_threads' threads.
+ *
+ * Returns NULL if the pool couldn't be allocated, or its threads
+ * couldn't be started. */
+AMP_DLL AMP_Worker_Pool_T *amp_new_worker_pool(int num_threads);
+
+
+/* Free an AMP_Worker_Pool, once its threads have run every request
+ * queued on it. Any AMP_Proto with a responder on the pool must not
+ * dispatch further requests. */
+void AMP_DLL amp_free_worker_pool(AMP_Worker_Pool_T *pool);
+
+
+/* Register a responder which runs on a thread of `pool', rather than
+ * inside amp_consume_bytes(), so that a slow responder doesn't hold up
+ * the other boxes read from the connection. Arguments are otherwise as
+ * for amp_add_responder().
+ *
+ * The responder answers with amp_respond(), as usual, and must free the
+ * request before it returns. It must not use `proto' for anything
+ * else. The answer is serialized on the worker thread and queued, and
+ * written by the next amp_drain_completions() on the proto's own thread
+ * - which should be prompted to call it by a handler set with
+ * amp_set_wakeup_handler(). Answers from asynchronous responders are not
+ * added to the response cache.
+ *
+ * The AMP_Proto may be free'd while it has requests with the pool; their
+ * answers are discarded.
+ *
+ * Returns 0 on success, or ENOMEM. */
+int AMP_DLL amp_add_responder_async(AMP_Proto_T *proto, AMP_Worker_Pool_T *pool,
+                                    const char *command,
+                                    amp_responder_func responder,
+                                    void *responder_arg);
+
+
+/* Set the handler called, from another thread, when an answer or a call
+ * is queued for this proto by an asynchronous responder or
+ * amp_call_threadsafe(). It is called once for any number of them queued
+ * between calls to amp_drain_completions(). `func' may be NULL, if the
+ * proto's thread polls amp_drain_completions() instead.
+ *
+ * Set it on the proto's own thread, before any requests are dispatched
+ * to a worker pool, or any other thread makes calls with the proto.
+ *
+ * Returns 0 on success, or ENOMEM. */
+int AMP_DLL amp_set_wakeup_handler(AMP_Proto_T *proto, amp_wakeup_func func,
+                                   void *wakeup_arg);
+
+
+/* Call a remote AMP Command from any thread. Arguments are as for
+ * amp_call(), except that the call's ask key isn't known until it is
+ * made - so it can't be cancelled with amp_cancel().
+ *
+ * `args' is serialized on the calling thread, and may be free'd or
+ * re-used straight away. The call is then queued for the proto's own
+ * thread, which gives it an ask key and writes it the next time it calls
+ * amp_drain_completions() - writing every queued call in one go. The
+ * callback is invoked on the proto's own thread.
+ *
+ * If the call can't be made once it has been queued - or the proto is
+ * free'd first - the callback is invoked with a result whose reason is
+ * AMP_CANCEL.
+ *
+ * Returns 0 on success, ENOMEM, or AMP_NO_WAKEUP_HANDLER if
+ * amp_set_wakeup_handler() hasn't been called for the proto - in which
+ * case the callback will never be invoked. */
+int AMP_DLL amp_call_threadsafe(AMP_Proto_T *proto, const char *command,
+                                AMP_Box_T *args, amp_callback_func callback,
+                                void *callback_arg);
+
+
+/* Write the answers queued by asynchronous responders, and make the calls
+ * queued by amp_call_threadsafe(). Call this from the proto's own thread
+ * - the same thread that calls amp_consume_bytes(). Everything is written
+ * together, as if the proto were corked.
+ *
+ * Returns 0 on success, or the first error returned by the write
+ * handler. */
+int AMP_DLL amp_drain_completions(AMP_Proto_T *proto);
+
+
+/* Put requests for `command' in priority class `priority' for staged
+ * dispatch. Has no effect unless staged dispatch is enabled.
+ *
+ * Returns 0 on success, AMP_BAD_PRIORITY, or ENOMEM. */
+int AMP_DLL amp_set_command_priority(AMP_Proto_T *proto, const char *command,
+                                     enum amp_priority priority);
+
+
+/* Set how many requests of class `priority' are dispatched in each turn
+ * of staged dispatch, while other classes have requests waiting. A busy
+ * class is thus never starved by a more urgent one - over a full round
+ * each class gets a share in proportion to its weight. The defaults are
+ * 8, 4, 2 and 1, from AMP_PRIORITY_CONTROL to AMP_PRIORITY_BULK. A
+ * `weight' below 1 is taken as 1.
+ *
+ * Returns 0 on success, AMP_BAD_PRIORITY, or ENOMEM. */
+int AMP_DLL amp_set_priority_weight(AMP_Proto_T *proto,
+                                    enum amp_priority priority, int weight);
+
+
+/* Turn staged dispatch on or off. While it is on, amp_consume_bytes()
+ * doesn't run responders: each request it parses is queued by the
+ * priority class of its command, to be dispatched by
+ * amp_dispatch_staged(). This lets a server that has read more than it
+ * can handle at once - e.g. everything available on the socket - serve
+ * the urgent requests first. Answers and errors are still handled as
+ * they are read, as are requests answered from the response cache.
+ *
+ * Turning staged dispatch off leaves any queued requests for
+ * amp_dispatch_staged(). Requests still queued when the proto is free'd
+ * are dropped unanswered.
+ *
+ * Returns 0 on success, or ENOMEM. */
+int AMP_DLL amp_set_staged_dispatch(AMP_Proto_T *proto, int enabled);
+
+
+/* Dispatch up to `max' of the requests queued by staged dispatch - or all
+ * of them, if `max' is 0 or less - by weighted round-robin over the
+ * priority classes. Each is handed to its responder, or answered with an
+ * error if there is none, just as if it had been dispatched by
+ * amp_consume_bytes().
+ *
+ * Returns the number of requests dispatched. */
+int AMP_DLL amp_dispatch_staged(AMP_Proto_T *proto, int max);
+
+
+/* Returns the number of requests queued by staged dispatch. */
+int AMP_DLL amp_staged_requests(AMP_Proto_T *proto);
+
+
+/* Allocate and return a new, empty AMP_Registry.
+ *
+ * Returns NULL on allocation failure. */
+AMP_DLL AMP_Registry_T *amp_new_registry(void);
+
+
+/* Add an AMP responder to a registry. Replaces any responder already
+ * registered for `command'. Arguments are as for amp_add_responder().
+ *
+ * Returns 0 on success, ENOMEM, or AMP_REGISTRY_FROZEN if the registry
+ * has already been frozen. */
+int AMP_DLL amp_registry_add_responder(AMP_Registry_T *registry,
+                                       const char *command,
+                                       amp_responder_func responder,
+                                       void *responder_arg);
+
+
+/* Compile the registry's responders in to a perfect hash table and make
+ * the registry immutable. Once frozen, a registry is only ever read, so
+ * it may be shared by AMP_Protos running in different threads.
+ *
+ * Freezing an already frozen registry does nothing.
+ *
+ * Returns 0 on success, or ENOMEM - in which case the registry is left
+ * unfrozen and may be frozen again later. */
+int AMP_DLL amp_freeze_registry(AMP_Registry_T *registry);
+
+
+/* Attach a registry to an AMP_Proto, freezing it if necessary. Incoming
+ * requests are dispatched to the registry's responders, unless a
+ * responder for the same command was added to the proto itself with
+ * amp_add_responder() - which allows per-connection overrides.
+ *
+ * The registry must not be freed while any AMP_Proto is attached to it.
+ * Pass a NULL `registry' to detach the current one.
+ *
+ * Returns 0 on success, or ENOMEM if the registry could not be frozen -
+ * in which case the proto is left unchanged. */
+int AMP_DLL amp_set_registry(AMP_Proto_T *proto, AMP_Registry_T *registry);
+
+
+/* Free an AMP_Registry and the responders registered with it. */
+void AMP_DLL amp_free_registry(AMP_Registry_T *registry);
+
+
 /* Respond to an AMP request. This function is usually called from within
  * an `amp_responder_func', after the result has been formed for an AMP
  * request. It may however be called at a later stage if application code
@@ -566,6 +1373,28 @@ int AMP_DLL amp_put_bytes(AMP_Box_T *box, const char *key, const unsigned char *
 int AMP_DLL amp_put_cstring(AMP_Box_T *box, const char *key, const char *value);
 
 
+/* AMP Type: Unicode (UTF-8 encoded text) */
+
+/* Store a pointer to the UTF-8 encoded text in to `buf' and store its
+ * length in bytes in to `size'. Ownership rules are the same as for
+ * amp_get_bytes().
+ *
+ * Unlike amp_get_bytes(), the value is validated first: AMP_DECODE_ERROR
+ * is returned if it is not well-formed UTF-8. Overlong encodings and
+ * embedded NUL bytes are treated as malformed, so a value returned by
+ * this function may safely be treated either as a buffer or as a C-string
+ * (see the SECURITY NOTE on AMP_Chunk above) - though note that the
+ * buffer itself is not NULL-terminated. */
+int AMP_DLL amp_get_unicode(AMP_Box_T *box, const char *key, unsigned char **buf, int *size);
+
+
+/* Store a buffer of UTF-8 encoded text in to the AMP_Box.
+ *
+ * Returns AMP_ENCODE_ERROR, without modifying the box, if the buffer is
+ * not well-formed UTF-8 (by the same rules as amp_get_unicode()). */
+int AMP_DLL amp_put_unicode(AMP_Box_T *box, const char *key, const unsigned char *buf, int size);
+
+
 /* AMP Type: Integer (C type `long long') */
 
 /* get a `long long' from a value in an AMP box and store it in
@@ -632,6 +1461,48 @@ int amp_put_datetime(AMP_Box_T *box, const char *key, AMP_DateTime_T *value);
 int amp_get_datetime(AMP_Box_T *box, const char *key, AMP_DateTime_T *value);
 
 
+/* AMP Type: Decimal (C type `AMP_Decimal_T *') */
+
+/* Encode and store an `AMP_Decimal' in to an AMP_Box, using the same
+ * textual form as Python's str(decimal.Decimal), e.g. "123.45", "1E+2",
+ * "-0", "Infinity", "-Infinity" or "NaN".
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int AMP_DLL amp_put_decimal(AMP_Box_T *box, const char *key, AMP_Decimal_T *value);
+
+
+/* Retrieve and decode an `AMP_Decimal' from an AMP_Box.
+ * Stores the decoded data in to the `AMP_Decimal' pointed to by `value'.
+ *
+ * Returns AMP_OUT_OF_RANGE if the coefficient does not fit in 128 bits
+ * (more than 38 significant digits) or the exponent does not fit in an
+ * `int'. Returns 0 on success, or an AMP_* error code on failure. */
+int AMP_DLL amp_get_decimal(AMP_Box_T *box, const char *key, AMP_Decimal_T *value);
+
+
+/* Arrays of `int' or `double', stored one element per key.
+ *
+ * The amp_put_*_array() functions store element `i' of `values' under
+ * the key "<prefix><i>", e.g. "v0", "v1", ... "v9" for a prefix of "v"
+ * and n = 10. The amp_get_*_array() functions decode the value stored
+ * under each of the `n' keys in `keys' in to the matching element of
+ * `values'.
+ *
+ * All return 0 on success, or an AMP_* error code for the first element
+ * that failed - in which case the elements before it will have already
+ * been stored or decoded. */
+int AMP_DLL amp_put_int_array(AMP_Box_T *box, const char *prefix,
+                              const int *values, int n);
+
+int AMP_DLL amp_get_int_array(AMP_Box_T *box, const char **keys, int n,
+                              int *values);
+
+int AMP_DLL amp_put_double_array(AMP_Box_T *box, const char *prefix,
+                                 const double *values, int n);
+
+int AMP_DLL amp_get_double_array(AMP_Box_T *box, const char **keys, int n,
+                                 double *values);
+
+
 /* TODO - More function prototypes for other standard AMP data types */
 
 #ifdef __cplusplus
@@ -2,6 +2,7 @@
 #define _AMP_INTERNAL_H
 
 #include <stdio.h>
+#include <stddef.h>
 
 #include "mem.h"
 #include "table.h"
@@ -24,6 +25,7 @@ static const char ANSWER[]      = "_answer";
 static const char _ERROR[]       = "_error";
 static const char ERROR_CODE[]  = "_error_code";
 static const char ERROR_DESCR[] = "_error_description";
+static const char DEADLINE[]    = "_deadline";
 
 #define MAX_KEY_LENGTH 0xff
 #define MAX_VALUE_LENGTH 0xffff
@@ -38,6 +40,15 @@ enum amp_protocol_state
 };
 
 
+/* Type of the decoded value, if any, held in amp_key_value.decoded */
+enum amp_decoded_type
+{
+    DECODED_NONE,
+    DECODED_LONG_LONG,
+    DECODED_DOUBLE
+};
+
+
 struct amp_key_value
 {
     char *key; /* NUL-terminated key string */
@@ -45,6 +56,18 @@ struct amp_key_value
     void *value;
     int valueSize;
 
+    /* The result of the first successful typed amp_get_* call on this
+     * value, so that repeated reads skip re-parsing the raw bytes.
+     *
+     * A put allocates a fresh amp_key_value and a delete frees this one,
+     * so a decoded value can never outlive the bytes it came from. */
+    enum amp_decoded_type decodedType;
+    union
+    {
+        long long ll;
+        double d;
+    } decoded;
+
     /* When we allocate these structures, we allocate
      * additional room to store the key and value data,
      * which will begin at the address of this variable. */
@@ -58,6 +81,51 @@ typedef int key_cmp_func(const void *x, const void *y);
 typedef unsigned int key_hash_func(const void *key);
 
 
+/* Storage for the objects that describe an inbound box, so that
+ * dispatching a box costs no allocations beyond the box itself.
+ *
+ * A box is dispatched as exactly one of a request, a response or an
+ * error, so those share storage. `chunks' are views of the _command
+ * and _ask values of a request, or the _error_code and
+ * _error_description values of an error. */
+struct amp_box_views
+{
+    AMP_Chunk_T chunks[2];
+    AMP_Result_T result;
+    union
+    {
+        AMP_Request_T request;
+        AMP_Response_T response;
+        AMP_Error_T error;
+    } as;
+
+    /* links a request waiting in its priority class for staged
+     * dispatch */
+    AMP_Request_T *staged_next;
+
+    /* link a request in to its proto's list of admitted requests, see
+     * amp_set_max_in_progress() */
+    AMP_Request_T *admitted_prev;
+    AMP_Request_T *admitted_next;
+
+    /* queues a request on the worker pool of an asynchronous responder */
+    struct amp_job
+    {
+        struct amp_job *next;
+        AMP_Proto_T *proto;
+        struct _AMP_Completions *completions;
+        amp_responder_func func;
+        void *arg;
+    } job;
+};
+
+
+/* The box which holds the amp_box_views object `ptr', which is its
+ * `member' - e.g. AMP_BOX_OF(request, as.request) */
+#define AMP_BOX_OF(ptr, member) \
+        ((AMP_Box_T *)((char *)(ptr) - offsetof(AMP_Box_T, views.member)))
+
+
 /* Collection of key/value pairs representing an AMP
  * packet. May represent either a request or a response.
  *
@@ -77,6 +145,17 @@ struct AMP_Box
     int get_fail_code;
     const char *get_fail_key;
 #endif
+    struct amp_box_views views;
+
+    /* amp_free_box() only frees the box once this drops to zero - a
+     * scatter/gather write holds a reference until it is released */
+    int refs;
+
+    /* the results handed to all but the first caller waiting on a
+     * coalesced call, each a copy of views.result - free'd along with
+     * the box */
+    AMP_Result_T *extra_results;
+
     struct binding
     {
         struct binding *link;
@@ -85,12 +164,41 @@ struct AMP_Box
 };
 
 
-typedef Table_T *_AMP_Callback_Map_p;
+typedef struct _AMP_Callback_Map *_AMP_Callback_Map_p;
+
+
+typedef struct _AMP_Timer_Wheel *_AMP_Timer_Wheel_p;
 
 
 typedef Table_T *_AMP_Responder_Map_p;
 
 
+typedef struct _AMP_Responder_Index *_AMP_Responder_Index_p;
+
+
+typedef struct _AMP_Response_Cache *_AMP_Response_Cache_p;
+
+
+typedef struct _AMP_Coalesced_Calls *_AMP_Coalesced_Calls_p;
+
+
+typedef struct _AMP_Completions *_AMP_Completions_p;
+
+
+typedef struct _AMP_Staging *_AMP_Staging_p;
+
+
+/* An immutable-once-frozen set of responders, shared between protos */
+struct AMP_Registry
+{
+    _AMP_Responder_Map_p responders;
+
+    /* built by amp_freeze_registry() - NULL until the registry is
+     * frozen, after which nothing may be added */
+    _AMP_Responder_Index_p index;
+};
+
+
 /* Represents our side of an AMP connection.
  *
  * Encapsulates the protocol parsing state, and holds pointers to callback
@@ -128,22 +236,104 @@ struct AMP_Proto
      * a TCP socket) */
     write_amp_data_func write;
 
+    /* Alternative to `write', set by amp_set_writev_handler() */
+    writev_amp_data_func writev;
+
     /* Pointer to application-defined argument passed
      * to write handler */
     void *write_arg;
 
+    /* Set by amp_cork(). While corked, serialized boxes are appended
+     * to `out_buf' instead of being passed to the write handler, and
+     * are handed over all at once by amp_flush() or amp_uncork(). */
+    int corked;
+    unsigned char *out_buf;
+    int out_size;     /* bytes waiting in out_buf */
+    int out_capacity; /* bytes allocated for out_buf */
+
+    /* Bytes handed to the write handler and not yet reported drained by
+     * amp_bytes_drained(). Once they reach `high_water' (unless that is
+     * 0) the proto is paused: amp_call() refuses new calls until they
+     * fall back to `low_water'. */
+    size_t out_pending;
+    size_t low_water;
+    size_t high_water;
+    int write_paused;
+    amp_flow_func on_pause;
+    amp_flow_func on_resume;
+    void *flow_arg;
+
     /* Pointer to function which will handle all
      * AMP boxes read off the wire */
     amp_dispatch_box_handler dispatch_box;
 
-    /* hash table used to keep track of responses we are
-     * waiting for */
+    /* ring, indexed by ask key, used to keep track of responses we
+     * are waiting for */
     _AMP_Callback_Map_p outstanding_requests;
 
+    /* timers for the outstanding requests made with a timeout -
+     * allocated by the first amp_call_with_timeout() */
+    _AMP_Timer_Wheel_p timers;
+
+    /* the time, in milliseconds, last passed to amp_tick() */
+    unsigned long long clock;
+    int clock_started;
+
     /* hash table used to find command-handler functions for
      * incoming requests */
     _AMP_Responder_Map_p responders;
 
+    /* perfect-hashed snapshot of `responders', built by
+     * amp_freeze_responders() and discarded if they change */
+    _AMP_Responder_Index_p responder_index;
+
+    /* shared responders, consulted for commands that have no
+     * responder in `responders' - may be NULL */
+    AMP_Registry_T *registry;
+
+    /* answers to cacheable commands - allocated by the first
+     * amp_set_response_cache() */
+    _AMP_Response_Cache_p response_cache;
+
+    /* calls made by amp_call_coalesced() that are awaiting a result -
+     * allocated by the first amp_call_coalesced() */
+    _AMP_Coalesced_Calls_p coalesced_calls;
+
+    /* answers made by asynchronous responders, waiting to be written by
+     * amp_drain_completions() - allocated by the first
+     * amp_add_responder_async() or amp_set_wakeup_handler() */
+    _AMP_Completions_p completions;
+
+    /* set by amp_set_staged_dispatch() - requests are then queued in
+     * `staging' by priority class, rather than dispatched as they are
+     * parsed */
+    int staged;
+
+    /* command priorities, and the queue for staged dispatch - allocated
+     * by the first amp_set_command_priority(), amp_set_priority_weight()
+     * or amp_set_staged_dispatch() */
+    _AMP_Staging_p staging;
+
+    /* set by amp_set_deadline_propagation() - calls with a timeout then
+     * carry it to the peer in a _deadline key */
+    int propagate_deadlines;
+
+    /* Requests read that expect an answer, and haven't yet been answered
+     * or free'd - counting those released by workers until the proto's
+     * own thread takes them off. amp_consume_bytes_partial() pauses at
+     * `max_in_progress' of them (unless that is 0), and `on_admit' is
+     * called once it may be called again. */
+    int in_progress;
+    int max_in_progress;
+    int admission_paused;
+    amp_flow_func on_admit;
+    void *admit_arg;
+
+    /* The counted requests held on this thread, whose `admitted_by' is
+     * cleared when the proto is free'd. Those handed to a worker are
+     * taken off, since they are released through `completions'. */
+    AMP_Request_T *admitted;
+
     /* The "current" AMP box being parsed. */
     AMP_Box_T *box;
 };
@@ -153,10 +343,34 @@ int _amp_get_buf(AMP_Box_T *box, const char *key,
                  unsigned char **buf, int *size);
 
 
+/* Find the amp_key_value stored under `key'. Used by the typed
+ * amp_get_* functions to reach the decoded-value cache.
+ * Returns 0 on success, or AMP_KEY_NOT_FOUND. */
+int _amp_get_keyval(AMP_Box_T *box, const char *key,
+                    struct amp_key_value **keyval);
+
+
 int _amp_put_buf(AMP_Box_T *box, const char *key,
                  const unsigned char *buf, int buf_size);
 
 
+/* Allocate an amp_key_value for `key' with room for a value of up to
+ * `buf_size' bytes, plus a spare byte for a NUL-terminator. Encoders
+ * write their output directly in to keyval->value, lower
+ * keyval->valueSize to the number of bytes actually written, and then
+ * hand the keyval to _amp_store_keyval() - avoiding a temporary buffer
+ * and a copy.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int _amp_new_keyval(const char *key, int buf_size,
+                    struct amp_key_value **keyval);
+
+
+/* Store `keyval' in the box, replacing any existing value for its key.
+ * The box takes ownership of `keyval'; it is free'd on failure.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int _amp_store_keyval(AMP_Box_T *box, struct amp_key_value *keyval);
+
+
 /* Allocate a new AMP_Chunk with room to hold `size' bytes of data
  * and a terminating NULL byte. */
 AMP_Chunk_T *amp_new_chunk(int size);
@@ -189,10 +403,144 @@ void amp_free_response(AMP_Response_T *response);
 void amp_free_error(AMP_Error_T *error);
 
 
+/* Values of up to this many bytes are copied in to the buffer of a
+ * scatter/gather write, along with the keys and length prefixes.
+ * Larger values are referenced where they lie in the box. */
+#define AMP_GATHER_COPY_MAX 64
+
+
+/* A box laid out for a scatter/gather write. Allocated in one piece
+ * along with the iovec array and the copied bytes it refers to. */
+struct amp_gather
+{
+    AMP_IOVec_T *iov;
+    int iovcnt;
+
+    /* box holding the referenced values, or NULL if none are */
+    AMP_Box_T *box;
+
+    /* separately allocated buffer to free() along with the
+     * amp_gather, or NULL */
+    unsigned char *buf;
+};
+
+
+/* Lay out an AMP call as for _amp_serialize_call(), but as a list of
+ * iovecs which refer to the larger values where they lie in `args'
+ * (taking a reference to the box) instead of copying them. If
+ * `command' is NULL the box is laid out as-is.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int _amp_gather_call(AMP_Box_T *args, const char *command,
+                     const char *ask_key, const char *deadline,
+                     struct amp_gather **gather);
+
+
+/* Free an amp_gather, and drop its reference to its box. Passed to
+ * scatter/gather write handlers as their release function. */
+void _amp_release_gather(void *gather);
+
+
+/* Write `box' to the proto's peer - as an AMP call, prefixed by the
+ * _command, _ask and _deadline keys, unless `command' is NULL - through
+ * whichever kind of write handler the proto has. */
+int _amp_write_box(AMP_Proto_T *proto, AMP_Box_T *box, const char *command,
+                   const char *ask_key, const char *deadline);
+
+
+/* Pass a serialized box to the proto's write handler, or collect it
+ * in the proto's output buffer if the proto is corked. Takes ownership
+ * of `buf'. */
+int _amp_do_write(AMP_Proto_T *proto, unsigned char *buf, int buf_size);
+
+
 /* Serialize an AMP box into a newly-allocated buffer */
 int amp_serialize_box(AMP_Box_T *box, unsigned char **buf, int *size);
 
 
+/* Serialize an AMP call in to a newly-allocated buffer: the _command
+ * key (and the _ask key, unless `ask_key' is NULL, and then the
+ * _deadline key, unless `deadline' is NULL) are written first, followed
+ * by the key/values of `args' - which may be NULL, and is not modified.
+ * Any _command, _ask or _deadline keys in `args' are left out. */
+int _amp_serialize_call(AMP_Box_T *args, const char *command,
+                        const char *ask_key, const char *deadline,
+                        unsigned char **buf, int *size);
+
+
+/* Digest of the canonical form of `box' - its key/value pairs, other
+ * than _ask and _deadline, in an order that doesn't depend on how the box was built */
+unsigned long long _amp_box_digest(AMP_Box_T *box);
+
+
+/* Lay out the canonical form of `box' in a newly-allocated buffer.
+ * Returns 0 on success, or ENOMEM. */
+int _amp_box_canonical(AMP_Box_T *box, unsigned char **buf, int *size);
+
+
+/* Returns 1 if the canonical form of `box' is the `size' bytes at
+ * `buf', or 0 if not. */
+int _amp_box_canonical_equal(AMP_Box_T *box, const unsigned char *buf,
+                             int size);
+
+
+/* Remove every key/value pair from `box', so that it may be re-used */
+void _amp_clear_box(AMP_Box_T *box);
+
+
+/* Table of the calls made by amp_call_coalesced() */
+_AMP_Coalesced_Calls_p _amp_new_coalesced_calls(void);
+
+/* Number of coalesced calls awaiting a result */
+int _amp_coalesced_calls_length(_AMP_Coalesced_Calls_p calls);
+
+void _amp_free_coalesced_calls(_AMP_Coalesced_Calls_p calls);
+
+
+/* Number of coroutines kept by `pool' for re-use */
+int _amp_co_pool_idle(AMP_Co_Pool_T *pool);
+
+
+/* Queue of the answers made by asynchronous responders */
+_AMP_Completions_p _amp_new_completions(void);
+
+/* Drop the proto's reference to its queue, cancelling any calls that are
+ * still queued, and discarding any answers */
+void _amp_close_completions(AMP_Proto_T *proto);
+
+/* The completion queue to answer through, if called from a worker thread
+ * running a responder for `proto' - otherwise NULL */
+_AMP_Completions_p _amp_worker_completions(AMP_Proto_T *proto);
+
+/* amp_respond() from a worker thread: queue the answer to `request'
+ * for the proto's own thread to write.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int _amp_respond_async(_AMP_Completions_p completions, AMP_Request_T *request,
+                       AMP_Box_T *args);
+
+/* From a worker thread: note that a request counted towards the proto's
+ * requests in progress is finished with */
+void _amp_release_async(_AMP_Completions_p completions);
+
+/* Returns the number of requests released by workers since the last
+ * call, on the proto's own thread */
+int _amp_take_released(_AMP_Completions_p completions);
+
+/* Take the requests released by workers off the proto's count of
+ * requests in progress, and call its `on_admit' handler if it was
+ * paused and there is now room for more */
+void _amp_update_admission(AMP_Proto_T *proto);
+
+/* Make a call queued by amp_call_threadsafe(), whose arguments are the
+ * `args_size' bytes of serialized key/values at `args'. If the call
+ * can't be made, its callback is invoked straight away with a result
+ * whose reason is AMP_CANCEL.
+ * Returns 0 on success, ENOMEM, or the error returned by the write
+ * handler. */
+int _amp_make_prepared_call(AMP_Proto_T *proto, const char *command,
+                            const unsigned char *args, int args_size,
+                            amp_callback_func callback, void *callback_arg);
+
+
 /* Log handler singleton used by all of libamp.
  * Defined in log.c */
 extern amp_log_handler amp_log_handler_func;
@@ -99,6 +99,8 @@ AMP_Box_T *amp_new_box(void)
                 box->buckets[i] = NULL;
     box->length = 0;
     box->timestamp = 0;
+    box->refs = 1;
+    box->extra_results = NULL;
 
 #ifdef AMP_TEST_SUPPORT
     box->get_fail_code = 0;
@@ -118,6 +120,10 @@ void amp_free_box(AMP_Box_T *box)
     if (box == NULL)
         return;
 
+    /* still referenced by a scatter/gather write */
+    if (--box->refs > 0)
+        return;
+
     struct binding *p, *next;
     int i;
     debug_print("Free AMP_Box at %p.\n", box);
@@ -133,6 +139,7 @@ void amp_free_box(AMP_Box_T *box)
             p = next;
         }
     }
+    free(box->extra_results);
     free(box);
 }
 
@@ -235,14 +242,13 @@ int amp_boxes_equal(AMP_Box_T *box, AMP_Box_T *box2)
 }
 
 
-/* Store a key and an already-encoded value (buffer) in to the
- * box (hash table) */
-int _amp_put_buf(AMP_Box_T *box, const char *key,
-                 const unsigned char *buf, int buf_size)
+/* Allocate an amp_key_value for `key' with room for `buf_size' bytes
+ * of value, plus one spare byte so encoders may NUL-terminate in place.
+ * The value is left uninitialized. */
+int _amp_new_keyval(const char *key, int buf_size,
+                    struct amp_key_value **new_keyval)
 {
-    int i;
     struct amp_key_value *keyval;
-    struct binding *p;
     int keySize;
     int bytesNeeded;
 
@@ -257,10 +263,10 @@ int _amp_put_buf(AMP_Box_T *box, const char *key,
     bytesNeeded += sizeof(struct amp_key_value);
     bytesNeeded += keySize;
     bytesNeeded += buf_size;
-    /* TODO - I think this gives us an extra byte, since
-     * amp_key_value already contains a variable of type
-     * char this is just a placeholder and will be
-     * overwritten */
+    /* This gives us an extra byte, since amp_key_value already
+     * contains the placeholder `_bufferSpaceStartsHere' char which
+     * is overwritten by the key. That extra byte is the spare byte
+     * after the value that encoders may NUL-terminate in to. */
 
     if ( (keyval = MALLOC(bytesNeeded)) == NULL)
         return ENOMEM;
@@ -272,17 +278,29 @@ int _amp_put_buf(AMP_Box_T *box, const char *key,
 
     /* value falls directly after the key */
     keyval->value = keyval->key + keySize + 1;
-    memcpy(keyval->value, buf, buf_size);
     keyval->valueSize = buf_size;
 
+    keyval->decodedType = DECODED_NONE;
+
     /* END Initialize amp_key_value */
 
+    *new_keyval = keyval;
+    return 0;
+}
 
-    /* Now do a hash-table STORE */
-    i = box->hash(key) % box->size;
+
+/* Store an amp_key_value in to the box (hash table), replacing any
+ * value already stored under the same key. The box takes ownership
+ * of `keyval' - even on failure, in which case it is free'd. */
+int _amp_store_keyval(AMP_Box_T *box, struct amp_key_value *keyval)
+{
+    int i;
+    struct binding *p;
+
+    i = box->hash(keyval->key) % box->size;
 
     for (p = box->buckets[i]; p; p = p->link)
-        if (box->cmp(key, p->keyval->key) == 0)
+        if (box->cmp(keyval->key, p->keyval->key) == 0)
             break;
     if (p == NULL)
     {
@@ -309,6 +327,11 @@ int _amp_put_buf(AMP_Box_T *box, const char *key,
     /* just replace keyval pointer on the existing `binding' */
     p->keyval = keyval;
 
+    /* NUL-terminate the value in the spare byte left by
+     * _amp_new_keyval(), so that AMP_Chunk_T views of it may be
+     * treated as C-strings */
+    ((unsigned char *)keyval->value)[keyval->valueSize] = '\0';
+
     /* not sure if we need this timestamp at all really... it *seems* to
      * only be used, in the original hash-table code, for sanity checking
      * when "mapping" a user-supplied function over the hash-table - it's
@@ -323,8 +346,25 @@ int _amp_put_buf(AMP_Box_T *box, const char *key,
 }
 
 
-int _amp_get_buf(AMP_Box_T *box, const char *key,
-                 unsigned char **buf, int *size)
+/* Store a key and an already-encoded value (buffer) in to the
+ * box (hash table) */
+int _amp_put_buf(AMP_Box_T *box, const char *key,
+                 const unsigned char *buf, int buf_size)
+{
+    int ret;
+    struct amp_key_value *keyval;
+
+    if ( (ret = _amp_new_keyval(key, buf_size, &keyval)) != 0)
+        return ret;
+
+    memcpy(keyval->value, buf, buf_size);
+
+    return _amp_store_keyval(box, keyval);
+}
+
+
+int _amp_get_keyval(AMP_Box_T *box, const char *key,
+                    struct amp_key_value **keyval)
 {
     int i;
     struct binding *p;
@@ -342,36 +382,124 @@ int _amp_get_buf(AMP_Box_T *box, const char *key,
     {
         if ((*box->cmp)(key, p->keyval->key) == 0)
         {
-            *buf = p->keyval->value;
-            *size = p->keyval->valueSize;
+            *keyval = p->keyval;
             return 0;
         }
     }
     return AMP_KEY_NOT_FOUND;
 }
 
-/* some places we use `size' for buffer size pointer, other places
- * `buf_size', we should choose one and a use it everywhere */
-int amp_serialize_box(AMP_Box_T *box, unsigned char **buf_p, int *size_p)
+
+int _amp_get_buf(AMP_Box_T *box, const char *key,
+                 unsigned char **buf, int *size)
+{
+    int err;
+    struct amp_key_value *keyval;
+
+    if ( (err = _amp_get_keyval(box, key, &keyval)) != 0)
+        return err;
+
+    *buf = keyval->value;
+    *size = keyval->valueSize;
+    return 0;
+}
+
+/* Write a key, and the length prefix of its value, in wire format at
+ * `buf', returning the address at which the value belongs */
+static unsigned char *write_key(unsigned char *buf,
+                                const char *key, int key_len, int val_len)
+{
+    *buf++ = 0;
+    *buf++ = (char)key_len;
+
+    memcpy(buf, key, key_len);
+    buf += key_len;
+
+    /* We know val_len fits in a 16-bit integer.
+     * Thus, right-shifting by 8 will leave us with the
+     * most-significant 8 bits, which are placed on the wire
+     * first, because we are encoding big-endian values */
+    *buf++ = (char)(val_len >> 8);
+
+    /* mask out (zero) all bits except the first 8 bits. */
+    *buf++ = (char)(val_len & 0xff);
+
+    return buf;
+}
+
+/* Write one key/value pair in wire format at `buf', returning the
+ * address just past it */
+static unsigned char *write_key_value(unsigned char *buf,
+                                      const char *key, int key_len,
+                                      const void *value, int val_len)
+{
+    buf = write_key(buf, key, key_len, val_len);
+    memcpy(buf, value, val_len);
+    return buf + val_len;
+}
+
+/* Is `keyval' one of the keys that _amp_serialize_call() writes
+ * itself? */
+static int is_call_key(struct amp_key_value *keyval)
+{
+    return ((keyval->keySize == sizeof(COMMAND)-1 &&
+             memcmp(keyval->key, COMMAND, sizeof(COMMAND)-1) == 0) ||
+            (keyval->keySize == sizeof(ASK)-1 &&
+             memcmp(keyval->key, ASK, sizeof(ASK)-1) == 0) ||
+            (keyval->keySize == sizeof(DEADLINE)-1 &&
+             memcmp(keyval->key, DEADLINE, sizeof(DEADLINE)-1) == 0));
+}
+
+/* Number of the keys written ahead of a call's arguments */
+static int call_prefix_length(const char *command, const char *ask_key,
+                              const char *deadline)
+{
+    if (command == NULL)
+        return 0;
+    if (ask_key == NULL)
+        return 1;
+    return deadline == NULL ? 2 : 3;
+}
+
+/* Serialize `box' in to a newly-allocated buffer, preceded by the
+ * key/value pairs in `prefix_keys' and `prefix_values' (`num_prefix' of
+ * them). When `skip_call_keys' is set, any _command or _ask keys in the
+ * box itself are left out. */
+static int serialize(AMP_Box_T *box, int num_prefix,
+                     const char **prefix_keys, const char **prefix_values,
+                     int skip_call_keys,
+                     unsigned char **buf_p, int *size_p)
 {
     int i;
-    int val_len, key_len;
     struct binding *p;
     unsigned char *buf;
+    int prefix_len[3];
 
     /* at least 2 bytes for terminating NULL-NULL */
     int size = 2;
 
+    for (i = 0; i < num_prefix; i++)
+    {
+        if ( (prefix_len[i] = strlen(prefix_values[i])) > MAX_VALUE_LENGTH)
+            return AMP_BAD_VAL_SIZE;
+
+        /* extra 4 bytes for key/value length prefixes */
+        size += (4 + strlen(prefix_keys[i]) + prefix_len[i]);
+    }
+
     /* repeat double-for-loop.. is there a better way? does it matter?
      * we could at least keep a record of populated buckets to speed
      * up the second loop.. but the time saving would presumably be
      * miniscule given that box->size is rarely going to be > 127 */
 
     /* calculate memory required for buf */
-    for (i = 0; i < box->size; i++)
+    for (i = 0; box != NULL && i < box->size; i++)
     {
         for (p = box->buckets[i]; p; p = p->link)
         {
+            if (skip_call_keys && is_call_key(p->keyval))
+                continue;
+
             /* extra 4 bytes for key/value length prefixes */
             size += (4 + p->keyval->keySize + p->keyval->valueSize);
         }
@@ -387,37 +515,334 @@ int amp_serialize_box(AMP_Box_T *box, unsigned char **buf_p, int *size_p)
     *buf_p = buf;
     *size_p = size;
 
+    for (i = 0; i < num_prefix; i++)
+        buf = write_key_value(buf, prefix_keys[i], strlen(prefix_keys[i]),
+                              prefix_values[i], prefix_len[i]);
+
     /* iterate key-value pairs and populate buffer */
-    for (i = 0; i < box->size; i++)
+    for (i = 0; box != NULL && i < box->size; i++)
     {
         for (p = box->buckets[i]; p; p = p->link)
         {
-            key_len = p->keyval->keySize;
-            val_len = p->keyval->valueSize;
+            if (skip_call_keys && is_call_key(p->keyval))
+                continue;
+
+            buf = write_key_value(buf, p->keyval->key, p->keyval->keySize,
+                                  p->keyval->value, p->keyval->valueSize);
+        }
+    }
 
-            *buf++ = 0;
-            *buf++ = (char)key_len;
+    /* NULL-NULL terminator */
+    *buf++ = 0;
+    *buf   = 0;
+
+    return 0;
+}
+
+/* some places we use `size' for buffer size pointer, other places
+ * `buf_size', we should choose one and a use it everywhere */
+int amp_serialize_box(AMP_Box_T *box, unsigned char **buf_p, int *size_p)
+{
+    return serialize(box, 0, NULL, NULL, 0, buf_p, size_p);
+}
+
+/* Add the iovec for the bytes copied since `*start', if any */
+static void end_segment(struct amp_gather *gather, unsigned char **start,
+                        unsigned char *end)
+{
+    if (end > *start)
+    {
+        gather->iov[gather->iovcnt].base = *start;
+        gather->iov[gather->iovcnt].len = end - *start;
+        gather->iovcnt++;
+    }
+    *start = end;
+}
 
-            memcpy(buf, p->keyval->key, key_len);
-            buf += key_len;
+int _amp_gather_call(AMP_Box_T *args, const char *command,
+                     const char *ask_key, const char *deadline,
+                     struct amp_gather **gather_p)
+{
+    const char *keys[3] = {COMMAND, ASK, DEADLINE};
+    const char *values[3] = {command, ask_key, deadline};
+    int prefix_len[3];
+    int num_prefix = call_prefix_length(command, ask_key, deadline);
+    struct amp_gather *gather;
+    struct binding *p;
+    unsigned char *buf, *start;
+    int i, val_len;
+    int num_referenced = 0;
 
-            /* We know val_len fits in a 16-bit integer.
-             * Thus, right-shifting by 8 will leave us with the
-             * most-significant 8 bits, which are placed on the wire
-             * first, because we are encoding big-endian values */
-            *buf++ = (char)(val_len >> 8);
+    /* at least 2 bytes for terminating NULL-NULL */
+    int copy_size = 2;
+    int wire_size = 2;
 
-            /* mask out (zero) all bits except the first 8 bits. */
-            *buf++ = (char)(val_len & 0xff);
+    for (i = 0; i < num_prefix; i++)
+    {
+        if ( (prefix_len[i] = strlen(values[i])) > MAX_VALUE_LENGTH)
+            return AMP_BAD_VAL_SIZE;
+
+        copy_size += (4 + strlen(keys[i]) + prefix_len[i]);
+    }
+
+    for (i = 0; args != NULL && i < args->size; i++)
+    {
+        for (p = args->buckets[i]; p; p = p->link)
+        {
+            if (command != NULL && is_call_key(p->keyval))
+                continue;
 
-            memcpy(buf, p->keyval->value, val_len);
-            buf += val_len;
+            copy_size += (4 + p->keyval->keySize);
+            if (p->keyval->valueSize > AMP_GATHER_COPY_MAX)
+                num_referenced++;
+            else
+                copy_size += p->keyval->valueSize;
+            wire_size += (4 + p->keyval->keySize + p->keyval->valueSize);
+        }
+    }
+
+    if (wire_size == 2 && num_prefix == 0)
+        return AMP_BOX_EMPTY;
+
+    /* Each referenced value splits the copied bytes in two, so there
+     * are at most 2 iovecs per referenced value, plus one. The iovecs
+     * and the copied bytes share the allocation. */
+    if ( (gather = MALLOC(sizeof(*gather) +
+                          (2 * num_referenced + 1) * sizeof(AMP_IOVec_T) +
+                          copy_size)) == NULL)
+        return ENOMEM;
+
+    gather->iov = (AMP_IOVec_T *)(gather + 1);
+    gather->iovcnt = 0;
+    gather->box = NULL;
+    gather->buf = NULL;
+
+    buf = start = (unsigned char *)(gather->iov + 2 * num_referenced + 1);
+
+    for (i = 0; i < num_prefix; i++)
+        buf = write_key_value(buf, keys[i], strlen(keys[i]),
+                              values[i], prefix_len[i]);
+
+    for (i = 0; args != NULL && i < args->size; i++)
+    {
+        for (p = args->buckets[i]; p; p = p->link)
+        {
+            if (command != NULL && is_call_key(p->keyval))
+                continue;
+
+            val_len = p->keyval->valueSize;
+            if (val_len <= AMP_GATHER_COPY_MAX)
+            {
+                buf = write_key_value(buf, p->keyval->key,
+                                      p->keyval->keySize,
+                                      p->keyval->value, val_len);
+                continue;
+            }
+
+            /* copy the key and length prefixes, then refer to the
+             * value where it lies in the box */
+            buf = write_key(buf, p->keyval->key, p->keyval->keySize,
+                            val_len);
+            end_segment(gather, &start, buf);
+
+            gather->iov[gather->iovcnt].base = p->keyval->value;
+            gather->iov[gather->iovcnt].len = val_len;
+            gather->iovcnt++;
         }
     }
 
     /* NULL-NULL terminator */
     *buf++ = 0;
-    *buf   = 0;
+    *buf++ = 0;
+    end_segment(gather, &start, buf);
+
+    /* the referenced values must outlive the write */
+    if (num_referenced > 0)
+    {
+        args->refs++;
+        gather->box = args;
+    }
 
+    *gather_p = gather;
     return 0;
 }
+
+void _amp_release_gather(void *gather_p)
+{
+    struct amp_gather *gather = gather_p;
+
+    amp_free_box(gather->box);
+    free(gather->buf);
+    free(gather);
+}
+
+int _amp_serialize_call(AMP_Box_T *args, const char *command,
+                        const char *ask_key, const char *deadline,
+                        unsigned char **buf_p, int *size_p)
+{
+    const char *keys[3] = {COMMAND, ASK, DEADLINE};
+    const char *values[3] = {command, ask_key, deadline};
+
+    return serialize(args, call_prefix_length(command, ask_key, deadline),
+                     keys, values, 1, buf_p, size_p);
+}
+
+/* Canonical form of a request, which keys the response cache: each
+ * key/value pair other than _ask and _deadline, laid out as on the wire,
+ * bucket by bucket and in key order within a bucket - so that two boxes
+ * with the same contents have the same canonical form however they were
+ * built. */
+
+typedef void canonical_func(void *arg, const unsigned char *bytes, int size);
+
+static void walk_canonical(AMP_Box_T *box, canonical_func *emit, void *arg)
+{
+    struct binding *p, *next;
+    const char *last;
+    unsigned char lengths[2];
+    int i;
+
+    for (i = 0; i < box->size; i++)
+    {
+        /* chains are short - find each binding in turn by key */
+        last = NULL;
+        while (1)
+        {
+            next = NULL;
+            for (p = box->buckets[i]; p; p = p->link)
+                if ((last == NULL || strcmp(p->keyval->key, last) > 0) &&
+                    (next == NULL ||
+                     strcmp(p->keyval->key, next->keyval->key) < 0))
+                    next = p;
+
+            if (next == NULL)
+                break;
+            last = next->keyval->key;
+
+            if ((next->keyval->keySize == sizeof(ASK)-1 &&
+                 memcmp(next->keyval->key, ASK, sizeof(ASK)-1) == 0) ||
+                (next->keyval->keySize == sizeof(DEADLINE)-1 &&
+                 memcmp(next->keyval->key, DEADLINE,
+                        sizeof(DEADLINE)-1) == 0))
+                continue;
+
+            lengths[0] = 0;
+            lengths[1] = (unsigned char)next->keyval->keySize;
+            emit(arg, lengths, 2);
+            emit(arg, (unsigned char *)next->keyval->key,
+                 next->keyval->keySize);
+
+            lengths[0] = (unsigned char)(next->keyval->valueSize >> 8);
+            lengths[1] = (unsigned char)(next->keyval->valueSize & 0xff);
+            emit(arg, lengths, 2);
+            emit(arg, next->keyval->value, next->keyval->valueSize);
+        }
+    }
+}
+
+/* 64-bit FNV-1a */
+static void digest_bytes(void *arg, const unsigned char *bytes, int size)
+{
+    unsigned long long *digest = arg;
+    int i;
+
+    for (i = 0; i < size; i++)
+    {
+        *digest ^= bytes[i];
+        *digest *= 0x100000001b3ULL;
+    }
+}
+
+unsigned long long _amp_box_digest(AMP_Box_T *box)
+{
+    unsigned long long digest = 0xcbf29ce484222325ULL;
+
+    walk_canonical(box, digest_bytes, &digest);
+    return digest;
+}
+
+struct canonical_buffer
+{
+    unsigned char *buf;
+    int size;
+    int mismatch;
+};
+
+static void count_bytes(void *arg, const unsigned char *bytes, int size)
+{
+    (void)bytes;
+    ((struct canonical_buffer *)arg)->size += size;
+}
+
+static void copy_bytes(void *arg, const unsigned char *bytes, int size)
+{
+    struct canonical_buffer *cb = arg;
+
+    memcpy(cb->buf + cb->size, bytes, size);
+    cb->size += size;
+}
+
+int _amp_box_canonical(AMP_Box_T *box, unsigned char **buf_p, int *size_p)
+{
+    struct canonical_buffer cb;
+
+    cb.size = 0;
+    walk_canonical(box, count_bytes, &cb);
+
+    /* at least one byte, so that an empty form is still allocated */
+    if ( (cb.buf = MALLOC(cb.size > 0 ? cb.size : 1)) == NULL)
+        return ENOMEM;
+
+    cb.size = 0;
+    walk_canonical(box, copy_bytes, &cb);
+
+    *buf_p = cb.buf;
+    *size_p = cb.size;
+    return 0;
+}
+
+static void compare_bytes(void *arg, const unsigned char *bytes, int size)
+{
+    struct canonical_buffer *cb = arg;
+
+    if (cb->mismatch || size > cb->size ||
+        memcmp(cb->buf, bytes, size) != 0)
+    {
+        cb->mismatch = 1;
+        return;
+    }
+    cb->buf += size;
+    cb->size -= size;
+}
+
+int _amp_box_canonical_equal(AMP_Box_T *box, const unsigned char *buf,
+                             int size)
+{
+    struct canonical_buffer cb;
+
+    cb.buf = (unsigned char *)buf;
+    cb.size = size;
+    cb.mismatch = 0;
+    walk_canonical(box, compare_bytes, &cb);
+
+    return !cb.mismatch && cb.size == 0;
+}
+
+void _amp_clear_box(AMP_Box_T *box)
+{
+    struct binding *p, *next;
+    int i;
+
+    for (i = 0; i < box->size; i++)
+    {
+        for (p = box->buckets[i]; p; p = next)
+        {
+            next = p->link;
+            free(p->keyval);
+            free(p);
+        }
+        box->buckets[i] = NULL;
+    }
+    box->length = 0;
+    box->timestamp++;
+}
@@ -0,0 +1,315 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/*
+ * Coalesced calls.
+ *
+ * amp_call_coalesced() makes at most one call for each distinct command
+ * and set of arguments at a time. A struct coalesced_call records each
+ * call in flight, in a chained hash table keyed on a digest of the
+ * command and the canonical form of the arguments. Later identical calls
+ * join it as waiters, and its single result is handed to every waiter
+ * when it arrives.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "amp.h"
+#include "amp_internal.h"
+
+
+/* Initial number of hash buckets - must be a power of two */
+#define COALESCED_CALLS_INITIAL_SIZE 16
+
+struct coalesced_waiter
+{
+    struct coalesced_waiter *next;
+    amp_callback_func callback;
+    void *callback_arg;
+};
+
+struct coalesced_call
+{
+    struct coalesced_call *hash_next;
+    _AMP_Coalesced_Calls_p calls; /* the table holding this call */
+
+    unsigned long long digest;
+    unsigned int ask_key;
+
+    /* the canonical form of the arguments */
+    unsigned char *key;
+    int key_size;
+
+    /* the caller which made the call, then those which joined it */
+    struct coalesced_waiter first;
+    struct coalesced_waiter *last;
+    int waiters;
+
+    char *command; /* allocated along with the call */
+};
+
+struct _AMP_Coalesced_Calls
+{
+    unsigned int mask; /* number of buckets - 1 */
+    int length;        /* number of calls in flight */
+    struct coalesced_call **buckets;
+};
+
+
+_AMP_Coalesced_Calls_p _amp_new_coalesced_calls(void)
+{
+    _AMP_Coalesced_Calls_p calls;
+
+    if ( (calls = MALLOC(sizeof(*calls))) == NULL)
+        return NULL;
+
+    if ( (calls->buckets = MALLOC(COALESCED_CALLS_INITIAL_SIZE *
+                                  sizeof(*calls->buckets))) == NULL)
+    {
+        free(calls);
+        return NULL;
+    }
+    memset(calls->buckets, 0, COALESCED_CALLS_INITIAL_SIZE *
+                              sizeof(*calls->buckets));
+
+    calls->mask = COALESCED_CALLS_INITIAL_SIZE - 1;
+    calls->length = 0;
+
+    debug_print("New _AMP_Coalesced_Calls at %p\n", calls);
+    return calls;
+}
+
+int _amp_coalesced_calls_length(_AMP_Coalesced_Calls_p calls)
+{
+    return calls->length;
+}
+
+static void free_call(struct coalesced_call *call)
+{
+    struct coalesced_waiter *waiter, *next;
+
+    for (waiter = call->first.next; waiter != NULL; waiter = next)
+    {
+        next = waiter->next;
+        free(waiter);
+    }
+    free(call->key);
+    free(call);
+}
+
+void _amp_free_coalesced_calls(_AMP_Coalesced_Calls_p calls)
+{
+    struct coalesced_call *call, *next;
+    unsigned int i;
+
+    debug_print("Free _AMP_Coalesced_Calls at %p\n", calls);
+
+    /* normally empty, since freeing the proto cancels every call */
+    for (i = 0; i <= calls->mask; i++)
+        for (call = calls->buckets[i]; call != NULL; call = next)
+        {
+            next = call->hash_next;
+            free_call(call);
+        }
+    free(calls->buckets);
+    free(calls);
+}
+
+/* Double the number of buckets. The table carries on with the buckets
+ * it has if that fails. */
+static void grow_calls(_AMP_Coalesced_Calls_p calls)
+{
+    struct coalesced_call **buckets, *call, *next;
+    unsigned int i, size = calls->mask + 1;
+    unsigned int newMask = size * 2 - 1;
+
+    if ( (buckets = MALLOC(size * 2 * sizeof(*buckets))) == NULL)
+        return;
+    memset(buckets, 0, size * 2 * sizeof(*buckets));
+
+    for (i = 0; i < size; i++)
+        for (call = calls->buckets[i]; call != NULL; call = next)
+        {
+            next = call->hash_next;
+            call->hash_next = buckets[call->digest & newMask];
+            buckets[call->digest & newMask] = call;
+        }
+
+    free(calls->buckets);
+    calls->buckets = buckets;
+    calls->mask = newMask;
+}
+
+static void remove_call(_AMP_Coalesced_Calls_p calls,
+                        struct coalesced_call *call)
+{
+    struct coalesced_call **link;
+
+    for (link = &calls->buckets[call->digest & calls->mask];
+         *link != call; link = &(*link)->hash_next)
+        ;
+    *link = call->hash_next;
+    calls->length--;
+}
+
+/* Digest of `command' and the canonical form of `args' */
+static unsigned long long call_digest(const char *command, AMP_Box_T *args)
+{
+    unsigned long long digest = 0xcbf29ce484222325ULL;
+
+    if (args != NULL)
+        digest = _amp_box_digest(args);
+
+    /* fold in the command, FNV-1a style */
+    for (; *command != '\0'; command++)
+    {
+        digest ^= (unsigned char)*command;
+        digest *= 0x100000001b3ULL;
+    }
+    return digest;
+}
+
+static struct coalesced_call *find_call(_AMP_Coalesced_Calls_p calls,
+                                        unsigned long long digest,
+                                        const char *command, AMP_Box_T *args)
+{
+    struct coalesced_call *call;
+
+    for (call = calls->buckets[digest & calls->mask]; call != NULL;
+         call = call->hash_next)
+    {
+        if (call->digest != digest || strcmp(call->command, command) != 0)
+            continue;
+
+        if (args == NULL ? call->key_size == 0 :
+            _amp_box_canonical_equal(args, call->key, call->key_size))
+            return call;
+    }
+    return NULL;
+}
+
+/* Hand the result of a coalesced call to each of its waiters */
+static void call_done(AMP_Proto_T *proto, AMP_Result_T *result,
+                      void *callback_arg)
+{
+    struct coalesced_call *call = callback_arg;
+    struct coalesced_waiter *waiter;
+    AMP_Result_T *results = NULL;
+    AMP_Box_T *box = NULL;
+    int i;
+
+    /* identical calls made by the callbacks start a new call */
+    remove_call(call->calls, call);
+
+    if (result->response != NULL)
+        box = AMP_BOX_OF(result->response, as.response);
+    else if (result->error != NULL)
+        box = AMP_BOX_OF(result->error, as.error);
+
+    /* each waiter holds a reference to the box, and gets a result of its
+     * own - unless there's no memory for them, in which case they share
+     * this one */
+    if (box != NULL && call->waiters > 1)
+    {
+        box->refs += call->waiters - 1;
+
+        if ( (results = MALLOC((call->waiters - 1) *
+                               sizeof(*results))) != NULL)
+        {
+            for (i = 0; i < call->waiters - 1; i++)
+                results[i] = *result;
+            box->extra_results = results;
+        }
+    }
+
+    for (i = 0, waiter = &call->first; waiter != NULL;
+         i++, waiter = waiter->next)
+        (waiter->callback)(proto, i > 0 && results != NULL ?
+                                  &results[i - 1] : result,
+                           waiter->callback_arg);
+
+    free_call(call);
+}
+
+int amp_call_coalesced(AMP_Proto_T *proto, const char *command,
+                       AMP_Box_T *args, amp_callback_func callback,
+                       void *callback_arg, unsigned int *ask_key)
+{
+    _AMP_Coalesced_Calls_p calls;
+    struct coalesced_call *call;
+    struct coalesced_waiter *waiter;
+    unsigned long long digest;
+    int ret, size;
+
+    if (proto->coalesced_calls == NULL &&
+        (proto->coalesced_calls = _amp_new_coalesced_calls()) == NULL)
+        return ENOMEM;
+    calls = proto->coalesced_calls;
+
+    digest = call_digest(command, args);
+
+    if ( (call = find_call(calls, digest, command, args)) != NULL)
+    {
+        /* join the call in flight */
+        if ( (waiter = MALLOC(sizeof(*waiter))) == NULL)
+            return ENOMEM;
+
+        waiter->next = NULL;
+        waiter->callback = callback;
+        waiter->callback_arg = callback_arg;
+        call->last->next = waiter;
+        call->last = waiter;
+        call->waiters++;
+
+        if (ask_key != NULL)
+            *ask_key = call->ask_key;
+        return 0;
+    }
+
+    size = strlen(command);
+    if ( (call = MALLOC(sizeof(*call) + size + 1)) == NULL)
+        return ENOMEM;
+
+    call->command = (char *)(call + 1);
+    memcpy(call->command, command, size + 1);
+
+    call->key = NULL;
+    call->key_size = 0;
+    if (args != NULL &&
+        (ret = _amp_box_canonical(args, &call->key, &call->key_size)) != 0)
+        goto error;
+
+    call->calls = calls;
+    call->digest = digest;
+    call->first.next = NULL;
+    call->first.callback = callback;
+    call->first.callback_arg = callback_arg;
+    call->last = &call->first;
+    call->waiters = 1;
+
+    if ( (ret = amp_call(proto, command, args, call_done, call,
+                         &call->ask_key)) != 0)
+        goto error;
+
+    if ((unsigned int)calls->length > calls->mask)
+        grow_calls(calls);
+
+    call->hash_next = calls->buckets[digest & calls->mask];
+    calls->buckets[digest & calls->mask] = call;
+    calls->length++;
+
+    if (ask_key != NULL)
+        *ask_key = call->ask_key;
+    return 0;
+
+error:
+    free(call->key);
+    free(call);
+    return ret;
+}
@@ -0,0 +1,230 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/*
+ * Coroutines, so that a sequence of calls can be written as straight-line
+ * code rather than a chain of callbacks.
+ *
+ * Each coroutine runs on a stack of its own, switched to and from with
+ * swapcontext(). amp_co_call() makes a call whose callback argument is
+ * the coroutine, then switches back to whoever resumed the coroutine -
+ * ultimately the event loop, inside amp_consume_bytes(). The callback
+ * switches back in to the coroutine, which picks up where it left off
+ * with the result in hand.
+ *
+ * A coroutine's stack is allocated along with it. When the coroutine
+ * returns it is kept on its AMP_Co_Pool's free list for the next
+ * amp_co_spawn(), up to the pool's limit of idle coroutines.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <ucontext.h>
+
+#include "amp.h"
+#include "amp_internal.h"
+
+
+/* Used when amp_new_co_pool() is given a `stack_size' of 0 */
+#define CO_DEFAULT_STACK_SIZE (64 * 1024)
+
+/* Smallest stack a coroutine may be given */
+#define CO_MIN_STACK_SIZE (16 * 1024)
+
+/* Offset of a coroutine's stack from the start of its allocation */
+#define CO_STACK_OFFSET ((sizeof(struct co) + 15) & ~(size_t)15)
+
+struct co
+{
+    struct co *next; /* link in the free list */
+    AMP_Co_Pool_T *pool;
+
+    ucontext_t context;   /* where the coroutine is suspended */
+    ucontext_t resumer;   /* where it returns to when it suspends */
+
+    amp_co_func func;
+    void *arg;
+    int finished;
+
+    AMP_Result_T *result; /* handed over by the callback of amp_co_call() */
+};
+
+struct AMP_Co_Pool
+{
+    size_t stack_size;
+    int max_idle;
+
+    int idle;             /* coroutines on the free list */
+    struct co *free_list;
+};
+
+/* The coroutine running on this thread, if any */
+static __thread struct co *current_co;
+
+
+static void release_co(struct co *co)
+{
+    AMP_Co_Pool_T *pool = co->pool;
+
+    if (pool->idle < pool->max_idle)
+    {
+        co->next = pool->free_list;
+        pool->free_list = co;
+        pool->idle++;
+    }
+    else
+        free(co);
+}
+
+/* Switch to `co' until it next suspends, or returns */
+static void resume(struct co *co)
+{
+    struct co *resumer = current_co;
+
+    current_co = co;
+    swapcontext(&co->resumer, &co->context);
+    current_co = resumer;
+
+    if (co->finished)
+        release_co(co);
+}
+
+static void suspend(struct co *co)
+{
+    swapcontext(&co->context, &co->resumer);
+}
+
+static void co_main(void)
+{
+    struct co *co = current_co;
+
+    (co->func)(co->arg);
+    co->finished = 1;
+
+    /* never to be resumed - resume() takes care of the stack */
+    setcontext(&co->resumer);
+}
+
+static void co_callback(AMP_Proto_T *proto, AMP_Result_T *result,
+                        void *callback_arg)
+{
+    struct co *co = callback_arg;
+
+    (void)proto;
+    co->result = result;
+
+    /* an answer delivered from within the call itself - e.g. by a write
+     * handler that loops back - finds the coroutine still running, and
+     * amp_co_call_with_timeout() picks it up without suspending */
+    if (co != current_co)
+        resume(co);
+}
+
+/* Point `co' at the start of co_main(), on its own stack. Kept apart
+ * from amp_co_spawn() so that no variable of the caller's is live
+ * across getcontext(). */
+static __attribute__((noinline)) void init_co(struct co *co,
+                                              size_t stack_size)
+{
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = (char *)co + CO_STACK_OFFSET;
+    co->context.uc_stack.ss_size = stack_size;
+    co->context.uc_link = NULL;
+    makecontext(&co->context, co_main, 0);
+}
+
+
+AMP_Co_Pool_T *amp_new_co_pool(size_t stack_size, int max_idle)
+{
+    AMP_Co_Pool_T *pool;
+
+    if ( (pool = MALLOC(sizeof(*pool))) == NULL)
+        return NULL;
+
+    if (stack_size == 0)
+        stack_size = CO_DEFAULT_STACK_SIZE;
+    else if (stack_size < CO_MIN_STACK_SIZE)
+        stack_size = CO_MIN_STACK_SIZE;
+
+    pool->stack_size = stack_size;
+    pool->max_idle = max_idle > 0 ? max_idle : 0;
+    pool->idle = 0;
+    pool->free_list = NULL;
+
+    debug_print("New AMP_Co_Pool at %p\n", pool);
+    return pool;
+}
+
+int _amp_co_pool_idle(AMP_Co_Pool_T *pool)
+{
+    return pool->idle;
+}
+
+void amp_free_co_pool(AMP_Co_Pool_T *pool)
+{
+    struct co *co;
+
+    while ( (co = pool->free_list) != NULL)
+    {
+        pool->free_list = co->next;
+        free(co);
+    }
+
+    debug_print("Free AMP_Co_Pool at %p\n", pool);
+    free(pool);
+}
+
+int amp_co_spawn(AMP_Co_Pool_T *pool, amp_co_func func, void *arg)
+{
+    struct co *co;
+
+    if ( (co = pool->free_list) != NULL)
+    {
+        pool->free_list = co->next;
+        pool->idle--;
+    }
+    else if ( (co = MALLOC(CO_STACK_OFFSET + pool->stack_size)) == NULL)
+        return ENOMEM;
+
+    co->pool = pool;
+    co->func = func;
+    co->arg = arg;
+    co->finished = 0;
+    co->result = NULL;
+
+    init_co(co, pool->stack_size);
+    resume(co);
+    return 0;
+}
+
+int amp_co_call(AMP_Proto_T *proto, const char *command, AMP_Box_T *args,
+                AMP_Result_T **result)
+{
+    return amp_co_call_with_timeout(proto, command, args, 0, result);
+}
+
+int amp_co_call_with_timeout(AMP_Proto_T *proto, const char *command,
+                             AMP_Box_T *args, unsigned int timeout,
+                             AMP_Result_T **result)
+{
+    struct co *co = current_co;
+    int ret;
+
+    if (co == NULL)
+        return AMP_NOT_IN_COROUTINE;
+
+    if ( (ret = amp_call_with_timeout(proto, command, args, co_callback, co,
+                                      timeout, NULL)) != 0)
+        return ret;
+
+    if (co->result == NULL)
+        suspend(co);
+
+    *result = co->result;
+    co->result = NULL;
+    return 0;
+}
@@ -6,8 +6,10 @@
 
 /* Internal AMP request/response dispatch data structures */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "table.h"
 
@@ -15,63 +17,454 @@
 #include "amp_internal.h"
 #include "dispatch.h"
 
-/* Callback map */
+/* Callback map
+ *
+ * Outstanding calls are kept in a ring of slots indexed by
+ * `ask_key & mask'. Since amp_next_ask_key() hands out consecutive keys,
+ * calls that are in flight at the same time land in distinct slots, and
+ * registering or completing a call is O(1) with no allocation.
+ *
+ * A call that stays outstanding while `size' newer calls are made will
+ * still occupy the slot that a new key maps to. _amp_put_callback()
+ * detects that collision, and _amp_call() simply moves on to the next
+ * ask key. The ring doubles in size when it fills up. Because every key
+ * in the ring is distinct modulo the old size, it is also distinct
+ * modulo the new size, so re-indexing the entries can never collide. */
+
+/* Initial number of slots - must be a power of two */
+#define CALLBACK_MAP_INITIAL_SIZE 16
 
-static int cmp_callback_key(const void *x, const void *y) {
-    return *(unsigned int *)x != *(unsigned int *)y;
+struct _AMP_Callback_Map
+{
+    unsigned int mask;   /* number of slots - 1 */
+    int length;          /* number of slots in use */
+    struct _AMP_Callback *slots;
+};
+
+_AMP_Callback_Map_p _amp_new_callback_map(void)
+{
+    _AMP_Callback_Map_p cb_map;
+
+    if ( (cb_map = MALLOC(sizeof(*cb_map))) == NULL)
+        return NULL;
+
+    if ( (cb_map->slots = MALLOC(CALLBACK_MAP_INITIAL_SIZE *
+                                 sizeof(*cb_map->slots))) == NULL)
+    {
+        free(cb_map);
+        return NULL;
+    }
+    memset(cb_map->slots, 0, CALLBACK_MAP_INITIAL_SIZE *
+                             sizeof(*cb_map->slots));
+
+    cb_map->mask = CALLBACK_MAP_INITIAL_SIZE - 1;
+    cb_map->length = 0;
+
+    debug_print("New _AMP_Callback_Map at %p\n", cb_map);
+    return cb_map;
 }
 
-static unsigned hash_callback_key(const void *key) {
-    /* Identity function should fill our buckets evenly since the key
-     * is produced by a counter (i.e. keys are distributed evenly), and
-     * counter maximum is significantly greater than no. of buckets */
-    return *(unsigned int *)key;
+/* Double the number of slots, re-indexing the outstanding calls.
+ * Returns 0 on success, or ENOMEM. */
+static int grow_callback_map(_AMP_Callback_Map_p cb_map)
+{
+    struct _AMP_Callback *slots;
+    unsigned int i, size = cb_map->mask + 1;
+    unsigned int newMask = size * 2 - 1;
+
+    if ( (slots = MALLOC(size * 2 * sizeof(*slots))) == NULL)
+        return ENOMEM;
+    memset(slots, 0, size * 2 * sizeof(*slots));
+
+    for (i = 0; i < size; i++)
+        if (cb_map->slots[i].in_use)
+            slots[cb_map->slots[i].ask_key & newMask] = cb_map->slots[i];
+
+    free(cb_map->slots);
+    cb_map->slots = slots;
+    cb_map->mask = newMask;
+    return 0;
 }
 
-_AMP_Callback_p _amp_new_callback(amp_callback_func func, void *arg)
+int _amp_put_callback(_AMP_Callback_Map_p cb_map, unsigned int ask_key,
+                      amp_callback_func func, void *arg)
 {
-    _AMP_Callback_p cb;
-    if ( (cb = MALLOC(sizeof(struct _AMP_Callback))) == NULL)
-        return NULL;
+    int ret;
+    struct _AMP_Callback *slot;
 
-    cb->func = func;
-    cb->arg = arg;
+    if ((unsigned int)cb_map->length > cb_map->mask)
+    {
+        /* full */
+        if ( (ret = grow_callback_map(cb_map)) != 0)
+            return ret;
+    }
+
+    slot = &cb_map->slots[ask_key & cb_map->mask];
+    if (slot->in_use)
+        return -1; /* collides with a long-outstanding call */
 
-    return cb;
+    slot->in_use = 1;
+    slot->ask_key = ask_key;
+    slot->func = func;
+    slot->arg = arg;
+    slot->timer = NULL;
+    cb_map->length++;
+    return 0;
 }
 
-_AMP_Callback_Map_p _amp_new_callback_map(void)
+struct _AMP_Callback *_amp_get_callback(_AMP_Callback_Map_p cb_map,
+                                        unsigned int ask_key)
 {
-    _AMP_Callback_Map_p cb_map = Table_new(0, cmp_callback_key,
-                                           hash_callback_key);
-    if (cb_map == NULL)
+    struct _AMP_Callback *slot = &cb_map->slots[ask_key & cb_map->mask];
+
+    if (!slot->in_use || slot->ask_key != ask_key)
         return NULL;
-    debug_print("New _AMP_Callback_Map at %p\n", cb_map);
-    return cb_map;
+    return slot;
+}
+
+int _amp_pop_callback(_AMP_Callback_Map_p cb_map, unsigned int ask_key,
+                      struct _AMP_Callback *callback)
+{
+    struct _AMP_Callback *slot = &cb_map->slots[ask_key & cb_map->mask];
+
+    /* the slot may be empty, or hold a different call whose key
+     * shares the same low bits */
+    if (!slot->in_use || slot->ask_key != ask_key)
+        return 0;
+
+    if (callback != NULL)
+        *callback = *slot;
+
+    slot->in_use = 0;
+    cb_map->length--;
+    return 1;
 }
 
-int _amp_put_callback(_AMP_Callback_Map_p cb_map, int ask_key,
-                      _AMP_Callback_p callback)
+void _amp_pop_each_callback(_AMP_Callback_Map_p cb_map,
+                            void (*func)(void *arg,
+                                         struct _AMP_Callback *callback),
+                            void *arg)
 {
-    callback->ask_key = ask_key;
-    return Table_put(cb_map, &(callback->ask_key), callback);
+    struct _AMP_Callback cb;
+    unsigned int i;
+
+    /* a single pass over the ring. Each slot is emptied before `func'
+     * sees it, so a call can't be popped twice. */
+    for (i = 0; i <= cb_map->mask && cb_map->length > 0; i++)
+    {
+        if (!cb_map->slots[i].in_use)
+            continue;
+
+        cb = cb_map->slots[i];
+        cb_map->slots[i].in_use = 0;
+        cb_map->length--;
+        func(arg, &cb);
+    }
 }
 
-_AMP_Callback_p _amp_pop_callback(_AMP_Callback_Map_p cb_map, int ask_key)
+int _amp_callback_map_length(_AMP_Callback_Map_p cb_map)
 {
-    return (_AMP_Callback_p)Table_remove(cb_map, &ask_key);
+    return cb_map->length;
 }
 
 void _amp_free_callback_map(_AMP_Callback_Map_p cb_map)
 {
     debug_print("Free _AMP_Callback_Map at %p\n", cb_map);
-    Table_free(&cb_map);
+    free(cb_map->slots);
+    free(cb_map);
+}
+
+/* Timer wheel
+ *
+ * A hierarchical timing wheel, as described by Varghese and Lauck, with
+ * a resolution of one millisecond. Level 0 has a slot for each of the
+ * next 64 milliseconds; each slot of level 1 covers 64 milliseconds,
+ * each slot of level 2 covers 64 of those, and so on.
+ *
+ * Advancing the wheel fires the level 0 slot for each millisecond in
+ * turn. Every 64 milliseconds the next slot of level 1 is "cascaded":
+ * its timers are re-inserted, landing in level 0 (or back in level 1),
+ * and likewise for the levels above. A timer is therefore touched at
+ * most once per level, so adding, removing and expiring a timer are
+ * all O(1) amortised. Timers further away than the wheel spans wait in
+ * level 3 and are cascaded around again. */
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SIZE   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+/* a timer for the call using `ask_key' */
+struct _AMP_Timer
+{
+    struct _AMP_Timer *next;
+    struct _AMP_Timer *prev;
+    unsigned long long expires;
+    unsigned int ask_key;
+};
+
+struct _AMP_Timer_Wheel
+{
+    /* the next millisecond to be processed - every timer that expires
+     * before this one has fired */
+    unsigned long long current;
+
+    int length; /* number of pending timers */
+
+    /* list heads - each slot is a circular, doubly-linked list */
+    struct _AMP_Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+
+    /* timers that have been removed, kept for re-use */
+    struct _AMP_Timer *free_list;
+};
+
+static void timer_list_init(struct _AMP_Timer *head)
+{
+    head->next = head->prev = head;
+}
+
+static void timer_list_append(struct _AMP_Timer *head,
+                              struct _AMP_Timer *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void timer_list_unlink(struct _AMP_Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+}
+
+/* Move all of the timers in `from' to the empty list `to' */
+static void timer_list_splice(struct _AMP_Timer *from, struct _AMP_Timer *to)
+{
+    if (from->next == from)
+    {
+        timer_list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    timer_list_init(from);
+}
+
+/* Place `timer' in the slot that covers its expiry time */
+static void insert_timer(_AMP_Timer_Wheel_p wheel, struct _AMP_Timer *timer)
+{
+    unsigned long long expires = timer->expires;
+    unsigned long long delta;
+    int level;
+
+    if (expires < wheel->current)
+        expires = wheel->current; /* overdue - fire on the next advance */
+
+    delta = expires - wheel->current;
+
+    /* too far away for the wheel - park it in the last slot that level 3
+     * reaches, from where it will be cascaded around again */
+    if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+    {
+        delta = (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        expires = wheel->current + delta;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+        if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+            break;
+
+    timer_list_append(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS *
+                                                        level))
+                                           & TIMER_WHEEL_MASK],
+                      timer);
+}
+
+/* Re-insert the timers in slot `index' of `level', returning `index' */
+static int cascade(_AMP_Timer_Wheel_p wheel, int level, int index)
+{
+    struct _AMP_Timer list, *timer;
+
+    timer_list_splice(&wheel->slots[level][index], &list);
+    while ( (timer = list.next) != &list)
+    {
+        timer_list_unlink(timer);
+        insert_timer(wheel, timer);
+    }
+    return index;
+}
+
+_AMP_Timer_Wheel_p _amp_new_timer_wheel(unsigned long long now)
+{
+    _AMP_Timer_Wheel_p wheel;
+    int level, i;
+
+    if ( (wheel = MALLOC(sizeof(*wheel))) == NULL)
+        return NULL;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+            timer_list_init(&wheel->slots[level][i]);
+
+    wheel->current = now;
+    wheel->length = 0;
+    wheel->free_list = NULL;
+
+    debug_print("New _AMP_Timer_Wheel at %p\n", wheel);
+    return wheel;
 }
 
-void _amp_free_callback(_AMP_Callback_p callback)
+struct _AMP_Timer *_amp_add_timer(_AMP_Timer_Wheel_p wheel,
+                                  unsigned long long expires,
+                                  unsigned int ask_key)
 {
-    /* leave application code responsible for freeing cb->arg */
-    free(callback);
+    struct _AMP_Timer *timer;
+
+    if ( (timer = wheel->free_list) != NULL)
+        wheel->free_list = timer->next;
+    else if ( (timer = MALLOC(sizeof(*timer))) == NULL)
+        return NULL;
+
+    timer->expires = expires;
+    timer->ask_key = ask_key;
+    insert_timer(wheel, timer);
+    wheel->length++;
+    return timer;
+}
+
+void _amp_remove_timer(_AMP_Timer_Wheel_p wheel, struct _AMP_Timer *timer)
+{
+    timer_list_unlink(timer);
+    wheel->length--;
+
+    timer->next = wheel->free_list;
+    wheel->free_list = timer;
+}
+
+int _amp_expire_timers(_AMP_Timer_Wheel_p wheel, unsigned long long now,
+                       void (*expire)(void *arg, unsigned int ask_key),
+                       void *arg)
+{
+    struct _AMP_Timer list, *timer;
+    int index, level, expired = 0;
+    unsigned int ask_key;
+
+    while (wheel->current <= now)
+    {
+        if (wheel->length == 0)
+        {
+            /* nothing to fire or cascade - skip straight ahead */
+            wheel->current = now + 1;
+            break;
+        }
+
+        /* each time a level wraps around, cascade the next slot of the
+         * level above it */
+        index = wheel->current & TIMER_WHEEL_MASK;
+        for (level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++)
+            index = cascade(wheel, level,
+                            (wheel->current >> (TIMER_WHEEL_BITS * level))
+                            & TIMER_WHEEL_MASK);
+
+        /* `expire' may add or remove timers, so take this slot's timers
+         * out of the wheel before firing them */
+        timer_list_splice(&wheel->slots[0][wheel->current & TIMER_WHEEL_MASK],
+                          &list);
+        wheel->current++;
+
+        while ( (timer = list.next) != &list)
+        {
+            ask_key = timer->ask_key;
+            _amp_remove_timer(wheel, timer);
+            expire(arg, ask_key);
+            expired++;
+        }
+    }
+    return expired;
+}
+
+void _amp_rebase_timers(_AMP_Timer_Wheel_p wheel, unsigned long long now)
+{
+    struct _AMP_Timer list, *timer, *next;
+    unsigned long long shift = now - wheel->current;
+    int level, i;
+
+    /* gather every timer in to one list... */
+    timer_list_init(&list);
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+            for (timer = wheel->slots[level][i].next;
+                 timer != &wheel->slots[level][i]; timer = next)
+            {
+                next = timer->next;
+                timer_list_append(&list, timer);
+            }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+            timer_list_init(&wheel->slots[level][i]);
+
+    /* ...and put them back, shifted along */
+    wheel->current = now;
+    while ( (timer = list.next) != &list)
+    {
+        timer_list_unlink(timer);
+        timer->expires += shift;
+        insert_timer(wheel, timer);
+    }
+}
+
+void _amp_clear_timers(_AMP_Timer_Wheel_p wheel)
+{
+    struct _AMP_Timer *timer, *next;
+    int level, i;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+        {
+            for (timer = wheel->slots[level][i].next;
+                 timer != &wheel->slots[level][i]; timer = next)
+            {
+                next = timer->next;
+                timer->next = wheel->free_list;
+                wheel->free_list = timer;
+            }
+            timer_list_init(&wheel->slots[level][i]);
+        }
+
+    wheel->length = 0;
+}
+
+int _amp_timer_wheel_length(_AMP_Timer_Wheel_p wheel)
+{
+    return wheel->length;
+}
+
+void _amp_free_timer_wheel(_AMP_Timer_Wheel_p wheel)
+{
+    struct _AMP_Timer *timer, *next;
+    int level, i;
+
+    debug_print("Free _AMP_Timer_Wheel at %p\n", wheel);
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+            for (timer = wheel->slots[level][i].next;
+                 timer != &wheel->slots[level][i]; timer = next)
+            {
+                next = timer->next;
+                free(timer);
+            }
+
+    while ( (timer = wheel->free_list) != NULL)
+    {
+        wheel->free_list = timer->next;
+        free(timer);
+    }
+    free(wheel);
 }
 
 /* Responder map */
@@ -104,6 +497,7 @@ _AMP_Responder_p _amp_new_responder(amp_responder_func func, void *arg)
 
     resp->func = func;
     resp->arg = arg;
+    resp->pool = NULL;
 
     return resp;
 }
@@ -118,11 +512,11 @@ _AMP_Responder_Map_p _amp_new_responder_map(void)
     return resp_map;
 }
 
-void _amp_put_responder(_AMP_Responder_Map_p resp_map, const char *command,
-                        _AMP_Responder_p responder)
+int _amp_put_responder(_AMP_Responder_Map_p resp_map, const char *command,
+                       _AMP_Responder_p responder)
 {
     responder->command = command;
-    Table_put(resp_map, responder->command, responder);
+    return Table_put(resp_map, responder->command, responder);
 }
 
 _AMP_Responder_p _amp_get_responder(_AMP_Responder_Map_p resp_map,
@@ -150,3 +544,667 @@ void _amp_free_responder(_AMP_Responder_p responder)
     /* leave application code responsible for freeing responder->arg */
     free(responder);
 }
+
+
+/* Responder index
+ *
+ * A read-only snapshot of a responder map, compiled in to a perfect hash
+ * table: a power-of-two array of slots, and a hash seed chosen so that
+ * every registered command lands in its own slot. A lookup is then a
+ * single hash of the command name, and at most one length check and
+ * memcmp() - no bucket chains.
+ *
+ * If no such seed turns up even after growing the table, the index falls
+ * back to linear probing at the largest size, which always fits: a
+ * lookup then walks forward from its slot until it finds the command or
+ * an empty slot. */
+
+/* Give up looking for a collision-free seed at a given table size after
+ * this many attempts, and try again with twice as many slots */
+#define RESPONDER_INDEX_SEED_ATTEMPTS 64
+
+/* Double the table at most this many times beyond its starting size
+ * before settling for linear probing */
+#define RESPONDER_INDEX_MAX_GROWTH 4
+
+struct _AMP_Responder_Slot
+{
+    const char *command; /* NULL if the slot is empty */
+    int size;
+    _AMP_Responder_p responder;
+};
+
+struct _AMP_Responder_Index
+{
+    unsigned int seed;
+    unsigned int mask;
+    int probing; /* 1 if colliding commands were moved to later slots */
+    struct _AMP_Responder_Slot *slots;
+};
+
+/* FNV-1a, with the offset basis perturbed by `seed' */
+static unsigned int hash_command(const unsigned char *command, int size,
+                                 unsigned int seed)
+{
+    unsigned int hash = 2166136261U ^ (seed * 0x9E3779B9U);
+    int i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash ^= command[i];
+        hash *= 16777619U;
+    }
+    return hash ^ (hash >> 16);
+}
+
+/* Try to place every responder in `responders' in its own slot using
+ * the index's current seed and mask.
+ * Returns 1 on success, or 0 on a collision - which can only happen when
+ * the index isn't probing. */
+static int fill_responder_index(_AMP_Responder_Index_p index,
+                                void **responders)
+{
+    struct _AMP_Responder_Slot *slot;
+    _AMP_Responder_p resp;
+    unsigned int h;
+    int i, size;
+
+    memset(index->slots, 0, (index->mask + 1) * sizeof(*index->slots));
+
+    /* Table_toArray() gives alternating keys and values */
+    for (i = 0; responders[i] != NULL; i += 2)
+    {
+        resp = responders[i+1];
+        size = strlen(resp->command);
+        h = hash_command((const unsigned char *)resp->command, size,
+                         index->seed);
+        h &= index->mask;
+        while (index->slots[h].command != NULL)
+        {
+            if (!index->probing)
+                return 0;
+            h = (h + 1) & index->mask;
+        }
+
+        slot = &index->slots[h];
+        slot->command = resp->command;
+        slot->size = size;
+        slot->responder = resp;
+    }
+    return 1;
+}
+
+_AMP_Responder_Index_p _amp_new_responder_index(_AMP_Responder_Map_p resp_map)
+{
+    _AMP_Responder_Index_p index;
+    void **responders;
+    unsigned int size = 1, length = Table_length(resp_map);
+    int attempts, growth;
+
+    /* keep the largest table's size within an unsigned int */
+    if (length > (UINT_MAX >> (RESPONDER_INDEX_MAX_GROWTH + 2)))
+        return NULL;
+
+    if ( (index = MALLOC(sizeof(*index))) == NULL)
+        return NULL;
+    index->slots = NULL;
+
+    if ( (responders = Table_toArray(resp_map, NULL)) == NULL)
+        goto error;
+
+    /* start with a load factor of at most 1/2 */
+    while (size < 2 * length)
+        size *= 2;
+
+    for (growth = 0; ; growth++)
+    {
+        if ( (index->slots = MALLOC(size * sizeof(*index->slots))) == NULL)
+            goto error;
+        index->mask = size - 1;
+        index->probing = growth == RESPONDER_INDEX_MAX_GROWTH;
+
+        for (attempts = 0; attempts < RESPONDER_INDEX_SEED_ATTEMPTS; attempts++)
+        {
+            index->seed = attempts;
+            if (fill_responder_index(index, responders))
+            {
+                free(responders);
+                debug_print("New _AMP_Responder_Index at %p, %u slots%s\n",
+                            index, size,
+                            index->probing ? ", probing" : "");
+                return index;
+            }
+        }
+
+        free(index->slots);
+        index->slots = NULL;
+        size *= 2;
+    }
+
+error:
+    free(responders);
+    free(index->slots);
+    free(index);
+    return NULL;
+}
+
+_AMP_Responder_p _amp_index_get_responder(_AMP_Responder_Index_p index,
+                                          const unsigned char *command,
+                                          int size)
+{
+    struct _AMP_Responder_Slot *slot;
+    unsigned int h;
+
+    h = hash_command(command, size, index->seed) & index->mask;
+
+    for (slot = &index->slots[h]; slot->command != NULL;
+         slot = &index->slots[h])
+    {
+        if (slot->size == size && memcmp(slot->command, command, size) == 0)
+            return slot->responder;
+        if (!index->probing)
+            break;
+        h = (h + 1) & index->mask;
+    }
+
+    return NULL;
+}
+
+void _amp_free_responder_index(_AMP_Responder_Index_p index)
+{
+    debug_print("Free _AMP_Responder_Index at %p\n", index);
+    free(index->slots);
+    free(index);
+}
+
+/* Response cache
+ *
+ * Serialized answers to cacheable commands, keyed by the canonical form
+ * of the request that produced them. Entries are found through a
+ * chained hash table on the digest of that canonical form, and each
+ * cacheable command keeps its entries on an LRU list so that the oldest
+ * can be evicted when the command's memory budget is exceeded. Expired
+ * entries are dropped when they are next looked up, or evicted. */
+
+/* Initial number of hash buckets - must be a power of two */
+#define RESPONSE_CACHE_INITIAL_SIZE 64
+
+struct _AMP_Cache_Entry
+{
+    struct _AMP_Cache_Entry *hash_next;
+
+    /* the LRU list of its policy, most recently used first */
+    struct _AMP_Cache_Entry *prev;
+    struct _AMP_Cache_Entry *next;
+
+    struct _AMP_Cache_Policy *policy;
+    unsigned long long digest;
+    unsigned long long expires;
+
+    /* the canonical request, followed by the serialized answer - both
+     * allocated along with the entry */
+    unsigned char *key;
+    int key_size;
+    unsigned char *answer;
+    int answer_size;
+};
+
+struct _AMP_Cache_Policy
+{
+    struct _AMP_Cache_Policy *next;
+
+    unsigned int ttl;
+    size_t budget;
+    size_t used; /* bytes held by this command's entries */
+
+    struct _AMP_Cache_Entry lru; /* list head */
+
+    int command_size;
+    char *command; /* allocated along with the policy */
+};
+
+struct _AMP_Response_Cache
+{
+    struct _AMP_Cache_Policy *policies;
+
+    unsigned int mask; /* number of buckets - 1 */
+    int length;        /* number of entries */
+    struct _AMP_Cache_Entry **buckets;
+};
+
+/* Memory charged to a command's budget for `entry' */
+#define CACHE_ENTRY_COST(entry) \
+        (sizeof(struct _AMP_Cache_Entry) + (entry)->key_size + \
+         (entry)->answer_size)
+
+_AMP_Response_Cache_p _amp_new_response_cache(void)
+{
+    _AMP_Response_Cache_p cache;
+
+    if ( (cache = MALLOC(sizeof(*cache))) == NULL)
+        return NULL;
+
+    if ( (cache->buckets = MALLOC(RESPONSE_CACHE_INITIAL_SIZE *
+                                  sizeof(*cache->buckets))) == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    memset(cache->buckets, 0, RESPONSE_CACHE_INITIAL_SIZE *
+                              sizeof(*cache->buckets));
+
+    cache->policies = NULL;
+    cache->mask = RESPONSE_CACHE_INITIAL_SIZE - 1;
+    cache->length = 0;
+
+    debug_print("New _AMP_Response_Cache at %p\n", cache);
+    return cache;
+}
+
+static void remove_entry(_AMP_Response_Cache_p cache,
+                         struct _AMP_Cache_Entry *entry)
+{
+    struct _AMP_Cache_Entry **link;
+
+    for (link = &cache->buckets[entry->digest & cache->mask];
+         *link != entry; link = &(*link)->hash_next)
+        ;
+    *link = entry->hash_next;
+
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+
+    entry->policy->used -= CACHE_ENTRY_COST(entry);
+    cache->length--;
+    free(entry);
+}
+
+/* Double the number of buckets. The cache carries on with the buckets
+ * it has if that fails. */
+static void grow_response_cache(_AMP_Response_Cache_p cache)
+{
+    struct _AMP_Cache_Entry **buckets, *entry, *next;
+    unsigned int i, size = cache->mask + 1;
+    unsigned int newMask = size * 2 - 1;
+
+    if ( (buckets = MALLOC(size * 2 * sizeof(*buckets))) == NULL)
+        return;
+    memset(buckets, 0, size * 2 * sizeof(*buckets));
+
+    for (i = 0; i < size; i++)
+        for (entry = cache->buckets[i]; entry != NULL; entry = next)
+        {
+            next = entry->hash_next;
+            entry->hash_next = buckets[entry->digest & newMask];
+            buckets[entry->digest & newMask] = entry;
+        }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->mask = newMask;
+}
+
+static struct _AMP_Cache_Policy **find_policy(_AMP_Response_Cache_p cache,
+                                              const char *command, int size)
+{
+    struct _AMP_Cache_Policy **link;
+
+    for (link = &cache->policies; *link != NULL; link = &(*link)->next)
+        if ((*link)->command_size == size &&
+            memcmp((*link)->command, command, size) == 0)
+            break;
+    return link;
+}
+
+int _amp_set_cache_policy(_AMP_Response_Cache_p cache, const char *command,
+                          unsigned int ttl, size_t budget)
+{
+    struct _AMP_Cache_Policy **link, *policy;
+    int size = strlen(command);
+
+    link = find_policy(cache, command, size);
+
+    if ( (policy = *link) == NULL)
+    {
+        if (ttl == 0)
+            return 0;
+
+        if ( (policy = MALLOC(sizeof(*policy) + size + 1)) == NULL)
+            return ENOMEM;
+
+        policy->command = (char *)(policy + 1);
+        memcpy(policy->command, command, size + 1);
+        policy->command_size = size;
+        policy->used = 0;
+        policy->lru.next = policy->lru.prev = &policy->lru;
+
+        policy->next = NULL;
+        *link = policy;
+    }
+
+    policy->ttl = ttl;
+    policy->budget = budget;
+
+    /* drop entries to fit the new budget, or all of them if caching is
+     * being turned off */
+    while (policy->lru.prev != &policy->lru &&
+           (ttl == 0 || policy->used > budget))
+        remove_entry(cache, policy->lru.prev);
+
+    if (ttl == 0)
+    {
+        *link = policy->next;
+        free(policy);
+    }
+    return 0;
+}
+
+struct _AMP_Cache_Policy *_amp_get_cache_policy(_AMP_Response_Cache_p cache,
+                                                AMP_Chunk_T *command)
+{
+    return *find_policy(cache, (const char *)command->value, command->size);
+}
+
+int _amp_cache_lookup(_AMP_Response_Cache_p cache,
+                      struct _AMP_Cache_Policy *policy,
+                      unsigned long long digest, AMP_Box_T *request,
+                      unsigned long long now,
+                      const unsigned char **answer, int *answer_size)
+{
+    struct _AMP_Cache_Entry *entry;
+
+    for (entry = cache->buckets[digest & cache->mask]; entry != NULL;
+         entry = entry->hash_next)
+        if (entry->digest == digest && entry->policy == policy &&
+            _amp_box_canonical_equal(request, entry->key, entry->key_size))
+            break;
+
+    if (entry == NULL)
+        return 0;
+
+    if (entry->expires <= now)
+    {
+        remove_entry(cache, entry);
+        return 0;
+    }
+
+    /* most recently used */
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = policy->lru.next;
+    entry->prev = &policy->lru;
+    entry->next->prev = entry;
+    policy->lru.next = entry;
+
+    *answer = entry->answer;
+    *answer_size = entry->answer_size;
+    return 1;
+}
+
+int _amp_cache_store(_AMP_Response_Cache_p cache,
+                     struct _AMP_Cache_Policy *policy,
+                     unsigned long long digest,
+                     const unsigned char *key, int key_size,
+                     const unsigned char *answer, int answer_size,
+                     unsigned long long now)
+{
+    struct _AMP_Cache_Entry *entry, *old;
+    size_t cost = sizeof(*entry) + key_size + answer_size;
+
+    if (cost > policy->budget)
+        return 0; /* would never fit */
+
+    /* replace any entry for the same request */
+    for (old = cache->buckets[digest & cache->mask]; old != NULL;
+         old = old->hash_next)
+        if (old->digest == digest && old->policy == policy &&
+            old->key_size == key_size &&
+            memcmp(old->key, key, key_size) == 0)
+        {
+            remove_entry(cache, old);
+            break;
+        }
+
+    while (policy->used + cost > policy->budget)
+        remove_entry(cache, policy->lru.prev);
+
+    if ( (entry = MALLOC(cost)) == NULL)
+        return ENOMEM;
+
+    entry->key = (unsigned char *)(entry + 1);
+    entry->key_size = key_size;
+    memcpy(entry->key, key, key_size);
+    entry->answer = entry->key + key_size;
+    entry->answer_size = answer_size;
+    memcpy(entry->answer, answer, answer_size);
+
+    entry->policy = policy;
+    entry->digest = digest;
+    entry->expires = now + policy->ttl;
+
+    if ((unsigned int)cache->length > cache->mask)
+        grow_response_cache(cache);
+
+    entry->hash_next = cache->buckets[digest & cache->mask];
+    cache->buckets[digest & cache->mask] = entry;
+
+    entry->next = policy->lru.next;
+    entry->prev = &policy->lru;
+    entry->next->prev = entry;
+    policy->lru.next = entry;
+
+    policy->used += cost;
+    cache->length++;
+    return 0;
+}
+
+int _amp_response_cache_length(_AMP_Response_Cache_p cache)
+{
+    return cache->length;
+}
+
+void _amp_free_response_cache(_AMP_Response_Cache_p cache)
+{
+    struct _AMP_Cache_Policy *policy;
+
+    debug_print("Free _AMP_Response_Cache at %p\n", cache);
+
+    while ( (policy = cache->policies) != NULL)
+    {
+        while (policy->lru.next != &policy->lru)
+            remove_entry(cache, policy->lru.next);
+
+        cache->policies = policy->next;
+        free(policy);
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+
+/* Staged dispatch
+ *
+ * Each command belongs to a priority class - AMP_PRIORITY_NORMAL unless
+ * it has been given another - and in staged mode parsed requests wait in
+ * a FIFO queue per class. They are taken out by deficit round-robin: on
+ * its turn, each class that has requests waiting may dispatch up to its
+ * weight of them before the turn passes to the next class, in priority
+ * order. A turn interrupted by the caller's limit is resumed next time. */
+
+static const int default_weights[AMP_PRIORITY_CLASSES] = {8, 4, 2, 1};
+
+struct _AMP_Priority
+{
+    struct _AMP_Priority *next;
+    enum amp_priority priority;
+    int command_size;
+    char *command; /* allocated along with the struct */
+};
+
+struct _AMP_Staged_Class
+{
+    AMP_Request_T *head;
+    AMP_Request_T *tail;
+    int weight;
+    int credit; /* requests left to dispatch in this turn */
+};
+
+struct _AMP_Staging
+{
+    struct _AMP_Priority *priorities;
+    struct _AMP_Staged_Class classes[AMP_PRIORITY_CLASSES];
+    int current; /* the class whose turn it is */
+    int length;
+};
+
+/* The box of a request in a staging queue */
+#define STAGED_BOX(req) AMP_BOX_OF(req, as.request)
+
+_AMP_Staging_p _amp_new_staging(void)
+{
+    _AMP_Staging_p staging;
+    int i;
+
+    if ( (staging = MALLOC(sizeof(*staging))) == NULL)
+        return NULL;
+
+    staging->priorities = NULL;
+    for (i = 0; i < AMP_PRIORITY_CLASSES; i++)
+    {
+        staging->classes[i].head = NULL;
+        staging->classes[i].tail = NULL;
+        staging->classes[i].weight = default_weights[i];
+        staging->classes[i].credit = 0;
+    }
+    staging->current = 0;
+    staging->classes[0].credit = staging->classes[0].weight;
+    staging->length = 0;
+
+    debug_print("New _AMP_Staging at %p\n", staging);
+    return staging;
+}
+
+static struct _AMP_Priority **find_priority(_AMP_Staging_p staging,
+                                            const char *command, int size)
+{
+    struct _AMP_Priority **link;
+
+    for (link = &staging->priorities; *link != NULL; link = &(*link)->next)
+        if ((*link)->command_size == size &&
+            memcmp((*link)->command, command, size) == 0)
+            break;
+    return link;
+}
+
+int _amp_set_priority(_AMP_Staging_p staging, const char *command,
+                      enum amp_priority priority)
+{
+    struct _AMP_Priority **link, *p;
+    int size = strlen(command);
+
+    link = find_priority(staging, command, size);
+
+    if ( (p = *link) == NULL)
+    {
+        if (priority == AMP_PRIORITY_NORMAL)
+            return 0;
+
+        if ( (p = MALLOC(sizeof(*p) + size + 1)) == NULL)
+            return ENOMEM;
+
+        p->command = (char *)(p + 1);
+        memcpy(p->command, command, size + 1);
+        p->command_size = size;
+
+        p->next = NULL;
+        *link = p;
+    }
+
+    /* the default needs no entry */
+    if (priority == AMP_PRIORITY_NORMAL)
+    {
+        *link = p->next;
+        free(p);
+        return 0;
+    }
+
+    p->priority = priority;
+    return 0;
+}
+
+void _amp_set_priority_weight(_AMP_Staging_p staging,
+                              enum amp_priority priority, int weight)
+{
+    staging->classes[priority].weight = weight > 0 ? weight : 1;
+}
+
+void _amp_stage_request(_AMP_Staging_p staging, AMP_Request_T *request)
+{
+    struct _AMP_Priority *p;
+    struct _AMP_Staged_Class *cls;
+
+    p = *find_priority(staging, (const char *)request->command->value,
+                       request->command->size);
+    cls = &staging->classes[p != NULL ? p->priority : AMP_PRIORITY_NORMAL];
+
+    STAGED_BOX(request)->views.staged_next = NULL;
+    if (cls->tail != NULL)
+        STAGED_BOX(cls->tail)->views.staged_next = request;
+    else
+        cls->head = request;
+    cls->tail = request;
+
+    staging->length++;
+}
+
+AMP_Request_T *_amp_next_staged(_AMP_Staging_p staging)
+{
+    struct _AMP_Staged_Class *cls;
+    AMP_Request_T *request;
+
+    if (staging->length == 0)
+        return NULL;
+
+    /* pass the turn on until it reaches a class with requests waiting and
+     * credit to dispatch them */
+    while ( (cls = &staging->classes[staging->current])->head == NULL ||
+            cls->credit == 0)
+    {
+        cls->credit = 0; /* an idle class doesn't save up credit */
+
+        staging->current = (staging->current + 1) % AMP_PRIORITY_CLASSES;
+        cls = &staging->classes[staging->current];
+        cls->credit = cls->weight;
+    }
+
+    request = cls->head;
+    if ( (cls->head = STAGED_BOX(request)->views.staged_next) == NULL)
+        cls->tail = NULL;
+    cls->credit--;
+
+    staging->length--;
+    return request;
+}
+
+int _amp_staged_length(_AMP_Staging_p staging)
+{
+    return staging->length;
+}
+
+void _amp_free_staging(_AMP_Staging_p staging)
+{
+    struct _AMP_Priority *p;
+    AMP_Request_T *request;
+
+    debug_print("Free _AMP_Staging at %p\n", staging);
+
+    while ( (request = _amp_next_staged(staging)) != NULL)
+        amp_free_request(request);
+
+    while ( (p = staging->priorities) != NULL)
+    {
+        staging->priorities = p->next;
+        free(p);
+    }
+    free(staging);
+}
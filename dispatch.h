@@ -7,24 +7,82 @@
 #include "table.h"
 #include "amp.h"
 
+/* An outstanding call, stored by value in a slot of the callback map */
 struct _AMP_Callback
 {
-    int ask_key;
+    int in_use;
+    unsigned int ask_key;
     amp_callback_func func;
     void *arg;
+    struct _AMP_Timer *timer; /* NULL unless the call has a timeout */
 };
 
-typedef struct _AMP_Callback *_AMP_Callback_p;
 
+_AMP_Callback_Map_p _amp_new_callback_map(void);
 
-_AMP_Callback_p _amp_new_callback(amp_callback_func func, void *arg);
+/* Register the callback for the call using `ask_key'.
+ * Returns 0 on success, ENOMEM, or -1 if the slot for `ask_key' is held
+ * by another outstanding call - in which case the caller should try the
+ * next ask key. */
+int _amp_put_callback(_AMP_Callback_Map_p cb_map, unsigned int ask_key,
+                      amp_callback_func func, void *arg);
+
+/* Forget the callback for `ask_key', copying it in to `*callback' if
+ * `callback' is not NULL.
+ * Returns 1 if the callback was found, or 0 if not. */
+int _amp_pop_callback(_AMP_Callback_Map_p cb_map, unsigned int ask_key,
+                      struct _AMP_Callback *callback);
+
+/* The callback for `ask_key', or NULL if there isn't one. The pointer
+ * is only valid until the next _amp_put_callback(). */
+struct _AMP_Callback *_amp_get_callback(_AMP_Callback_Map_p cb_map,
+                                        unsigned int ask_key);
+
+/* Pop every outstanding call, passing each to `func'. `func' must not
+ * make new calls in to this map. */
+void _amp_pop_each_callback(_AMP_Callback_Map_p cb_map,
+                            void (*func)(void *arg,
+                                         struct _AMP_Callback *callback),
+                            void *arg);
+
+/* Number of outstanding calls */
+int _amp_callback_map_length(_AMP_Callback_Map_p cb_map);
 
-_AMP_Callback_Map_p _amp_new_callback_map(void);
-int _amp_put_callback(_AMP_Callback_Map_p cb_map, int ask_key,
-                           _AMP_Callback_p callback);
-_AMP_Callback_p _amp_pop_callback(_AMP_Callback_Map_p cb_map, int ask_key);
 void _amp_free_callback_map(_AMP_Callback_Map_p cb_map);
-void _amp_free_callback(_AMP_Callback_p callback);
+
+
+/* Timer wheel, used to expire calls made with a timeout. Times are in
+ * milliseconds. */
+_AMP_Timer_Wheel_p _amp_new_timer_wheel(unsigned long long now);
+
+/* Start a timer for the call using `ask_key', to expire at `expires'.
+ * Returns NULL on allocation failure. */
+struct _AMP_Timer *_amp_add_timer(_AMP_Timer_Wheel_p wheel,
+                                  unsigned long long expires,
+                                  unsigned int ask_key);
+
+/* Stop a timer that hasn't expired */
+void _amp_remove_timer(_AMP_Timer_Wheel_p wheel, struct _AMP_Timer *timer);
+
+/* Advance the wheel to `now', calling `expire' with the ask key of each
+ * timer that expires at or before then. Each timer is removed before
+ * `expire' is called for it.
+ * Returns the number of timers that expired. */
+int _amp_expire_timers(_AMP_Timer_Wheel_p wheel, unsigned long long now,
+                       void (*expire)(void *arg, unsigned int ask_key),
+                       void *arg);
+
+/* Move the wheel's clock to `now' without expiring anything, shifting
+ * every timer along with it */
+void _amp_rebase_timers(_AMP_Timer_Wheel_p wheel, unsigned long long now);
+
+/* Stop every pending timer */
+void _amp_clear_timers(_AMP_Timer_Wheel_p wheel);
+
+/* Number of pending timers */
+int _amp_timer_wheel_length(_AMP_Timer_Wheel_p wheel);
+
+void _amp_free_timer_wheel(_AMP_Timer_Wheel_p wheel);
 
 
 struct _AMP_Responder
@@ -32,18 +90,107 @@ struct _AMP_Responder
     const char *command;
     amp_responder_func func;
     void *arg;
+    AMP_Worker_Pool_T *pool; /* NULL unless the responder is asynchronous */
 };
 
 typedef struct _AMP_Responder *_AMP_Responder_p;
 
+/* Queue `request' to be run by `responder' on a worker of `pool'. The
+ * proto must have a completion queue. */
+void _amp_submit_request(AMP_Worker_Pool_T *pool, AMP_Proto_T *proto,
+                         _AMP_Responder_p responder, AMP_Request_T *request);
+
 _AMP_Responder_p _amp_new_responder(amp_responder_func func, void *arg);
 
 _AMP_Responder_Map_p _amp_new_responder_map(void);
-void _amp_put_responder(_AMP_Responder_Map_p resp_map, const char *command,
-                        _AMP_Responder_p responder);
+/* Returns 0 on success, or ENOMEM */
+int _amp_put_responder(_AMP_Responder_Map_p resp_map, const char *command,
+                       _AMP_Responder_p responder);
 _AMP_Responder_p _amp_get_responder(_AMP_Responder_Map_p resp_map,
                                     const unsigned char *command);
 void _amp_remove_responder(_AMP_Responder_Map_p resp_map,
                            const char *command);
 void _amp_free_responder_map(_AMP_Responder_Map_p resp_map);
 void _amp_free_responder(_AMP_Responder_p responder);
+
+
+/* A read-only, perfect-hashed snapshot of a responder map. It refers to
+ * the _AMP_Responder structs owned by the map, so must be free'd (or
+ * rebuilt) whenever the map changes. */
+_AMP_Responder_Index_p _amp_new_responder_index(_AMP_Responder_Map_p resp_map);
+_AMP_Responder_p _amp_index_get_responder(_AMP_Responder_Index_p index,
+                                          const unsigned char *command,
+                                          int size);
+void _amp_free_responder_index(_AMP_Responder_Index_p index);
+
+
+/* Response cache, holding the serialized answers of cacheable commands.
+ * Times are in milliseconds. */
+_AMP_Response_Cache_p _amp_new_response_cache(void);
+
+/* Cache the answers to `command' for `ttl' milliseconds, within a budget
+ * of `budget' bytes. A `ttl' of 0 stops caching them, and drops any
+ * that are cached.
+ * Returns 0 on success, or ENOMEM. */
+int _amp_set_cache_policy(_AMP_Response_Cache_p cache, const char *command,
+                          unsigned int ttl, size_t budget);
+
+/* The policy for `command', or NULL if its answers aren't cached */
+struct _AMP_Cache_Policy *_amp_get_cache_policy(_AMP_Response_Cache_p cache,
+                                                AMP_Chunk_T *command);
+
+/* Find the answer cached for `request', whose digest is `digest'.
+ * Returns 1, pointing `*answer' at the serialized answer (less its
+ * _answer key), or 0 if there is no unexpired answer. */
+int _amp_cache_lookup(_AMP_Response_Cache_p cache,
+                      struct _AMP_Cache_Policy *policy,
+                      unsigned long long digest, AMP_Box_T *request,
+                      unsigned long long now,
+                      const unsigned char **answer, int *answer_size);
+
+/* Cache `answer' for the request whose canonical form is `key',
+ * evicting the least recently used answers to the same command as
+ * necessary to keep within its budget.
+ * Returns 0 on success, or ENOMEM. */
+int _amp_cache_store(_AMP_Response_Cache_p cache,
+                     struct _AMP_Cache_Policy *policy,
+                     unsigned long long digest,
+                     const unsigned char *key, int key_size,
+                     const unsigned char *answer, int answer_size,
+                     unsigned long long now);
+
+/* Number of cached answers */
+int _amp_response_cache_length(_AMP_Response_Cache_p cache);
+
+void _amp_free_response_cache(_AMP_Response_Cache_p cache);
+
+
+/* Priority classes, and the per-class queues of staged dispatch */
+_AMP_Staging_p _amp_new_staging(void);
+
+/* Put `command' in priority class `priority'.
+ * Returns 0 on success, or ENOMEM. */
+int _amp_set_priority(_AMP_Staging_p staging, const char *command,
+                      enum amp_priority priority);
+
+void _amp_set_priority_weight(_AMP_Staging_p staging,
+                              enum amp_priority priority, int weight);
+
+/* Queue `request' at the back of its command's priority class */
+void _amp_stage_request(_AMP_Staging_p staging, AMP_Request_T *request);
+
+/* Take the next request to dispatch, by weighted round-robin between the
+ * priority classes. Returns NULL if none are queued. */
+AMP_Request_T *_amp_next_staged(_AMP_Staging_p staging);
+
+/* Number of requests queued */
+int _amp_staged_length(_AMP_Staging_p staging);
+
+/* Free the staging queues, along with any requests still in them */
+void _amp_free_staging(_AMP_Staging_p staging);
+
+
+/* Find the responder for an incoming `command': one added to the proto
+ * itself takes precedence over one from the proto's registry.
+ * Returns NULL if there's no responder for the command. */
+_AMP_Responder_p _amp_find_responder(AMP_Proto_T *proto, AMP_Chunk_T *command);
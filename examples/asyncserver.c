@@ -38,6 +38,9 @@
 /* strtonum() from OpenBSD */
 #include "strtonum.h"
 
+/* Responders shared by every connection - built once, in main() */
+AMP_Registry_T *registry;
+
 void usage()
 {
     fprintf(stderr, "asyncserver <port>\n\n"
@@ -126,13 +129,23 @@ void conn_readcb(struct bufferevent *bev, void *state)
 
     AMP_Proto_T *proto = state;
 
-    bytesRead = bufferevent_read(bev, buf, 256);
+    /* answer every request in this read with a single write */
+    amp_cork(proto);
 
-    if ( (ret = amp_consume_bytes(proto, buf, bytesRead)) != 0)
+    /* drain the input buffer - this callback isn't invoked again for data
+     * that has already arrived, which a pipelining client may well have
+     * sent more than `buf' can hold of */
+    while ( (bytesRead = bufferevent_read(bev, buf, sizeof(buf))) > 0)
     {
-        fprintf(stderr, "ERROR in amp_consume_bytes(): %s\n", amp_strerror(ret));
-        return;
+        if ( (ret = amp_consume_bytes(proto, buf, bytesRead)) != 0)
+        {
+            fprintf(stderr, "ERROR in amp_consume_bytes(): %s\n",
+                    amp_strerror(ret));
+            break;
+        }
     }
+
+    amp_uncork(proto);
 }
 
 
@@ -187,7 +200,8 @@ void listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
         exit(1);
     }
 
-    amp_add_responder(proto, "Sum", sum_responder, bev);
+    /* the registry was frozen in main(), so this can't fail */
+    amp_set_registry(proto, registry);
     amp_set_write_handler(proto, do_write, bev);
 
     /* Start read/write monitoring of the new connection */
@@ -232,6 +246,23 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    /* Build the responder registry shared by all connections */
+    if ( (registry = amp_new_registry()) == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate AMP_Registry.\n");
+        exit(1);
+    }
+
+    int ret;
+    if ( (ret = amp_registry_add_responder(registry, "Sum", sum_responder,
+                                           NULL)) != 0 ||
+         (ret = amp_freeze_registry(registry)) != 0)
+    {
+        fprintf(stderr, "Couldn't build AMP_Registry: %s\n",
+                amp_strerror(ret));
+        exit(1);
+    }
+
     struct evconnlistener *listener;
 
     /* Listen... */
@@ -258,6 +289,7 @@ int main(int argc, char *argv[])
 
     evconnlistener_free(listener);
     event_base_free(ev_base);
+    amp_free_registry(registry);
     return 0;
 }
 
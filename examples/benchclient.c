@@ -6,7 +6,10 @@
 
 /* Benchmark client - Client for "Sum" command which performs as many synchronous calls
  * as possible
- * using blocking I/O */
+ * using blocking I/O
+ *
+ * With -w, calls are made through an AMP_Pipeline which keeps up to
+ * <window> of them in flight at once. */
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -36,22 +39,28 @@
 
 void usage()
 {
-    fprintf(stderr, "benchclient <host:port> <number-of-calls>\n\n"
+    fprintf(stderr, "benchclient [-w <window>] <host:port> <number-of-calls>\n\n"
                     "Ex: benchclient localhost:1234 10000\n"
                     "Will use the Sum server on localhost port 1234 to perform "
                     "10,000 additions to test the AMP/s throughput of "
-                    "the server.\n");
+                    "the server.\n\n"
+                    "With -w, up to <window> calls are kept in flight at "
+                    "once, rather than waiting for each answer before "
+                    "making the next call.\n");
     exit(1);
 }
 
 typedef struct {
     int count;
     int max_count;
+    int issued; /* calls made so far */
     double start_time;
+    AMP_Box_T *args; /* the same arguments are sent with every call */
+    AMP_Pipeline_T *pipeline; /* NULL unless -w was given */
 } *Bench_State_T;
 
 /* forward declaration */
-void do_sum_call(AMP_Proto_T *proto, Bench_State_T *state);
+void do_sum_call(AMP_Proto_T *proto, Bench_State_T state);
 
 void resp_cb(AMP_Proto_T *proto, AMP_Result_T *result, void *callback_arg)
 {
@@ -79,7 +88,7 @@ void resp_cb(AMP_Proto_T *proto, AMP_Result_T *result, void *callback_arg)
                    state->count, diff, state->count / diff);
             exit(0);
         }
-        else
+        else if (state->issued < state->max_count)
         {
             do_sum_call(proto, state);
         }
@@ -99,19 +108,21 @@ void resp_cb(AMP_Proto_T *proto, AMP_Result_T *result, void *callback_arg)
     amp_free_result(result);
 }
 
-void do_sum_call(AMP_Proto_T *proto, Bench_State_T *state)
+void do_sum_call(AMP_Proto_T *proto, Bench_State_T state)
 {
     int ret;
-    AMP_Box_T *box = amp_new_box();
-    amp_put_long_long(box, "a", 5);
-    amp_put_long_long(box, "b", 7);
 
-    ret = amp_call(proto, "Sum", box, resp_cb, state, NULL);
+    if (state->pipeline != NULL)
+        ret = amp_pipeline_call(state->pipeline, "Sum", state->args, resp_cb,
+                                state);
+    else
+        ret = amp_call(proto, "Sum", state->args, resp_cb, state, NULL);
     if (ret)
     {
         fprintf(stderr, "amp_call() failed: %s\n", amp_strerror(ret));
         exit(1);
     }
+    state->issued++;
 }
 
 int do_write(AMP_Proto_T *proto, unsigned char *buf, int bufSize, void *write_arg)
@@ -123,6 +134,18 @@ int do_write(AMP_Proto_T *proto, unsigned char *buf, int bufSize, void *write_ar
 
 int main(int argc, char *argv[])
 {
+    int window = 0;
+    const char *errstr;
+
+    if (argc == 5 && strcmp(argv[1], "-w") == 0)
+    {
+        window = strtonum(argv[2], 1, INT_MAX, &errstr);
+        if (errstr != NULL)
+            usage();
+        argv += 2;
+        argc -= 2;
+    }
+
     if (argc != 3)
         usage();
 
@@ -145,8 +168,19 @@ int main(int argc, char *argv[])
     }
 
     state->count = 0;
+    state->issued = 0;
+    state->pipeline = NULL;
+
+    /* amp_call() doesn't modify the arguments box, so one will do for
+     * every call */
+    if ( (state->args = amp_new_box()) == NULL ||
+         amp_put_long_long(state->args, "a", 5) != 0 ||
+         amp_put_long_long(state->args, "b", 7) != 0)
+    {
+        fprintf(stderr, "Unable to allocate call arguments.\n");
+        exit(1);
+    }
 
-    const char *errstr;
     state->max_count = strtonum(argv[2], 0, LLONG_MAX, &errstr);
     if (errstr != NULL)
         usage();
@@ -187,21 +221,51 @@ int main(int argc, char *argv[])
     amp_set_log_handler(amp_stderr_logger);
 
 
+    if (window > 0 &&
+        (state->pipeline = amp_new_pipeline(proto, window)) == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate AMP_Pipeline.\n");
+        return 1;
+    }
+
     /* Make first call... */
 
     state->start_time = time_double();
     do_sum_call(proto, state);
 
+    /* ...and, when pipelining, enough to fill the window with as many
+     * again queued behind it. Each answer then queues another call. */
+    while (state->pipeline != NULL && state->issued < 2 * window &&
+           state->issued < state->max_count)
+        do_sum_call(proto, state);
+
     /* Start reading loop */
 
     int bytesRead;
+    double lastReport = state->start_time;
+    AMP_Pipeline_Stats_T stats;
     while ( (bytesRead = recv(client_sock, buf, sizeof(buf), 0)) >= 0)
     {
+        /* report the throughput of each second */
+        if (state->pipeline != NULL && time_double() - lastReport >= 1.0)
+        {
+            amp_pipeline_stats(state->pipeline, &stats, 1);
+            printf("%.1f AMP/s, %d in flight, %d queued\n",
+                   stats.completed / (time_double() - lastReport),
+                   stats.in_flight, stats.queued);
+            lastReport = time_double();
+        }
+
+        /* send any calls made while handling this read in one write */
+        amp_cork(proto);
+
         if ( (ret = amp_consume_bytes(proto, buf, bytesRead)) != 0)
         {
             fprintf(stderr, "ERROR detected by amp_consume_bytes(): %s\n", amp_strerror(ret));
             return 1;
         };
+
+        amp_uncork(proto);
     }
 
     return 0;
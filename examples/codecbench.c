@@ -0,0 +1,177 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/* Codec benchmark - measures the throughput of the numeric type encoders
+ * and decoders, one key at a time and with the batch array functions.
+ * No network I/O is involved. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+/* libamp */
+#include <amp.h>
+
+#include "common.h"
+#include "time_utils.h"
+/* strtonum() from OpenBSD */
+#include "strtonum.h"
+
+/* Room for the key of any value: "v" and an int */
+#define KEY_SLOT sizeof("v-2147483648")
+
+
+void usage()
+{
+    fprintf(stderr, "codecbench <values-per-box> <iterations>\n\n"
+                    "Ex: codecbench 1000 1000\n"
+                    "Will encode and then decode 1,000 boxes of 1,000 doubles "
+                    "each, and report the throughput in MB/s of encoded "
+                    "value bytes.\n");
+    exit(1);
+}
+
+
+/* Sum the sizes of the encoded values, so that throughput can be
+ * reported in bytes of text processed. */
+long long value_bytes(AMP_Box_T *box, const char **keys, int n)
+{
+    unsigned char *buf;
+    int i, bufSize;
+    long long total = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        amp_get_bytes(box, keys[i], &buf, &bufSize);
+        total += bufSize;
+    }
+    return total;
+}
+
+
+void report(const char *what, long long bytes, double seconds)
+{
+    printf("%-28s %8.3f s  %8.1f MB/s\n", what, seconds,
+           bytes / seconds / (1024 * 1024));
+}
+
+
+int main(int argc, char *argv[])
+{
+    int n, iterations;
+    int i, j, ret;
+    const char *errstr;
+    double *values, *decoded;
+    const char **keys;
+    char *keyStorage;
+    long long bytes = 0;
+    double start;
+    double encodeTime = 0, decodeTime = 0, batchTime = 0;
+    AMP_Box_T *box;
+
+    if (argc != 3)
+        usage();
+
+    n = strtonum(argv[1], 1, 100000, &errstr);
+    if (errstr != NULL)
+        usage();
+
+    iterations = strtonum(argv[2], 1, INT_MAX, &errstr);
+    if (errstr != NULL)
+        usage();
+
+    values = malloc(n * sizeof(*values));
+    decoded = malloc(n * sizeof(*decoded));
+    keys = malloc(n * sizeof(*keys));
+    keyStorage = malloc(n * KEY_SLOT);
+    if (!values || !decoded || !keys || !keyStorage)
+    {
+        fprintf(stderr, "Unable to allocate benchmark data.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        /* a spread of magnitudes, with full-precision fractions */
+        values[i] = (double)rand() / RAND_MAX * (i % 7 ? 1000.0 : 1e9);
+        if (i % 2)
+            values[i] = -values[i];
+
+        keys[i] = keyStorage + i * KEY_SLOT;
+        snprintf(keyStorage + i * KEY_SLOT, KEY_SLOT, "v%d", i);
+    }
+
+    /* The decoders cache decoded values, so every decode below works on a
+     * freshly-encoded box in order to time the parsing itself. */
+    for (j = 0; j < iterations; j++)
+    {
+        /* encode */
+        if ( (box = amp_new_box()) == NULL)
+        {
+            fprintf(stderr, "Couldn't allocate box.\n");
+            exit(1);
+        }
+
+        start = time_double();
+        if ( (ret = amp_put_double_array(box, "v", values, n)) != 0)
+        {
+            fprintf(stderr, "amp_put_double_array() failed: %s\n",
+                    amp_strerror(ret));
+            exit(1);
+        }
+        encodeTime += time_double() - start;
+
+        if (j == 0)
+            bytes = value_bytes(box, keys, n);
+
+        /* decode, one key at a time */
+        start = time_double();
+        for (i = 0; i < n; i++)
+        {
+            if ( (ret = amp_get_double(box, keys[i], &decoded[i])) != 0)
+            {
+                fprintf(stderr, "amp_get_double() failed: %s\n",
+                        amp_strerror(ret));
+                exit(1);
+            }
+        }
+        decodeTime += time_double() - start;
+
+        amp_free_box(box);
+
+        /* decode, batch */
+        if ( (box = amp_new_box()) == NULL ||
+             amp_put_double_array(box, "v", values, n) != 0)
+        {
+            fprintf(stderr, "Couldn't build box.\n");
+            exit(1);
+        }
+
+        start = time_double();
+        if ( (ret = amp_get_double_array(box, keys, n, decoded)) != 0)
+        {
+            fprintf(stderr, "amp_get_double_array() failed: %s\n",
+                    amp_strerror(ret));
+            exit(1);
+        }
+        batchTime += time_double() - start;
+
+        amp_free_box(box);
+    }
+
+    bytes *= iterations;
+    printf("%d iterations of %d doubles (%lld bytes encoded)\n",
+           iterations, n, bytes);
+    report("amp_put_double_array()", bytes, encodeTime);
+    report("amp_get_double() per key", bytes, decodeTime);
+    report("amp_get_double_array()", bytes, batchTime);
+
+    free(values);
+    free(decoded);
+    free(keys);
+    free(keyStorage);
+    return 0;
+}
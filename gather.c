@@ -0,0 +1,195 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/*
+ * Gathered calls.
+ *
+ * An AMP_Gather collects the results of a fixed number of calls, made on
+ * any number of AMP_Protos, and tells the application once - when every
+ * result is in, or enough have succeeded to make a quorum. Its slots are
+ * allocated along with it, and each slot is the callback argument of its
+ * own call, so making a call costs the gather no further allocation.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "amp.h"
+#include "amp_internal.h"
+
+
+/* Stored in the slots of calls that couldn't be made, or that were no
+ * longer awaited. amp_free_result() leaves it alone. */
+static AMP_Result_T cancel_result = {AMP_CANCEL, NULL, NULL};
+
+struct gather_slot
+{
+    AMP_Gather_T *gather;
+    AMP_Proto_T *proto;
+    unsigned int ask_key;
+    AMP_Result_T *result;       /* NULL while the call is in flight */
+};
+
+struct AMP_Gather
+{
+    int size;
+    int quorum;                 /* successes needed to finish early */
+    unsigned int timeout;
+
+    int calls;                  /* slots used so far */
+    int results;                /* slots holding a result */
+    int successes;
+
+    int finished;
+    amp_gather_func done;
+    void *done_arg;
+
+    struct gather_slot *slots;  /* allocated along with the gather */
+};
+
+
+/* Forget the calls still in flight, cancelling each one - which stores
+ * a result in its slot */
+static void cancel_slots(AMP_Gather_T *gather)
+{
+    struct gather_slot *slot;
+    int i;
+
+    for (i = 0; i < gather->calls; i++)
+    {
+        slot = &gather->slots[i];
+        if (slot->result == NULL &&
+            amp_cancel(slot->proto, slot->ask_key) != 0)
+        {
+            /* already forgotten by the AMP_Proto */
+            slot->result = &cancel_result;
+            gather->results++;
+        }
+    }
+}
+
+static void finish(AMP_Gather_T *gather)
+{
+    gather->finished = 1;
+    cancel_slots(gather);
+
+    /* the gather is the application's from here on - it may be free'd */
+    (gather->done)(gather, gather->successes, gather->done_arg);
+}
+
+/* Whether `gather' has all the results it is going to get */
+static int complete(AMP_Gather_T *gather)
+{
+    int failures = gather->results - gather->successes;
+
+    return gather->results == gather->size ||
+           gather->successes >= gather->quorum ||
+           failures > gather->size - gather->quorum;
+}
+
+static void store_result(struct gather_slot *slot, AMP_Result_T *result)
+{
+    AMP_Gather_T *gather = slot->gather;
+
+    slot->result = result;
+    gather->results++;
+    if (result->reason == AMP_SUCCESS)
+        gather->successes++;
+
+    if (!gather->finished && complete(gather))
+        finish(gather);
+}
+
+static void call_done(AMP_Proto_T *proto, AMP_Result_T *result,
+                      void *callback_arg)
+{
+    (void)proto;
+    store_result(callback_arg, result);
+}
+
+
+AMP_Gather_T *amp_new_gather(int size, int quorum, unsigned int timeout,
+                             amp_gather_func done, void *done_arg)
+{
+    AMP_Gather_T *gather;
+
+    if (size < 1)
+        size = 1;
+
+    if ( (gather = MALLOC(sizeof(*gather) +
+                          size * sizeof(*gather->slots))) == NULL)
+        return NULL;
+
+    gather->slots = (struct gather_slot *)(gather + 1);
+    gather->size = size;
+    gather->quorum = quorum > 0 && quorum < size ? quorum : size;
+    gather->timeout = timeout;
+    gather->calls = 0;
+    gather->results = 0;
+    gather->successes = 0;
+    gather->finished = 0;
+    gather->done = done;
+    gather->done_arg = done_arg;
+
+    debug_print("New AMP_Gather at %p\n", gather);
+    return gather;
+}
+
+int amp_gather_call(AMP_Gather_T *gather, AMP_Proto_T *proto,
+                    const char *command, AMP_Box_T *args)
+{
+    struct gather_slot *slot;
+    int ret;
+
+    if (gather->finished || gather->calls == gather->size)
+        return AMP_GATHER_FULL;
+
+    slot = &gather->slots[gather->calls++];
+    slot->gather = gather;
+    slot->proto = proto;
+    slot->result = NULL;
+
+    if ( (ret = amp_call_with_timeout(proto, command, args, call_done, slot,
+                                      gather->timeout, &slot->ask_key)) != 0)
+        /* the slot is spent all the same, so that the gather still
+         * finishes */
+        store_result(slot, &cancel_result);
+
+    return ret;
+}
+
+void amp_gather_finish(AMP_Gather_T *gather)
+{
+    if (!gather->finished)
+        finish(gather);
+}
+
+int amp_gather_finished(AMP_Gather_T *gather)
+{
+    return gather->finished;
+}
+
+AMP_Result_T *amp_gather_result(AMP_Gather_T *gather, int index)
+{
+    if (index < 0 || index >= gather->calls)
+        return NULL;
+    return gather->slots[index].result;
+}
+
+void amp_free_gather(AMP_Gather_T *gather)
+{
+    int i;
+
+    /* the application is no longer waiting */
+    gather->finished = 1;
+    cancel_slots(gather);
+
+    for (i = 0; i < gather->calls; i++)
+        amp_free_result(gather->slots[i].result);
+
+    debug_print("Free AMP_Gather at %p\n", gather);
+    free(gather);
+}
@@ -0,0 +1,308 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/*
+ * Pipelined calls.
+ *
+ * An AMP_Pipeline keeps up to `window' calls in flight on one AMP_Proto
+ * and queues the rest, sending the next queued call each time one
+ * completes. Every call is tracked by a struct pipeline_call, which is
+ * recycled through a free list - so once a pipeline has seen a full
+ * window of calls it makes no further allocations of its own.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "amp.h"
+#include "amp_internal.h"
+
+
+/* Passed to the callbacks of queued calls that are dropped when the
+ * pipeline is free'd. amp_free_result() leaves it alone. */
+static AMP_Result_T cancel_result = {AMP_CANCEL, NULL, NULL};
+
+struct pipeline_call
+{
+    /* links in the queue, the in-flight list or the free list */
+    struct pipeline_call *next;
+    struct pipeline_call *prev;
+
+    AMP_Pipeline_T *pipeline;
+    const char *command;
+    AMP_Box_T *args;            /* a reference held while queued */
+    amp_callback_func callback;
+    void *callback_arg;
+    unsigned int ask_key;       /* valid while in flight */
+};
+
+struct AMP_Pipeline
+{
+    AMP_Proto_T *proto;
+    int window;
+    int closing;                /* set by amp_free_pipeline() */
+
+    /* calls waiting to be made, oldest first */
+    struct pipeline_call *queue_head;
+    struct pipeline_call *queue_tail;
+
+    /* head of a circular, doubly-linked list of calls in flight */
+    struct pipeline_call in_flight;
+
+    struct pipeline_call *free_list;
+
+    AMP_Pipeline_Stats_T stats;
+};
+
+
+static struct pipeline_call *new_call(AMP_Pipeline_T *pipeline)
+{
+    struct pipeline_call *call;
+
+    if ( (call = pipeline->free_list) != NULL)
+        pipeline->free_list = call->next;
+    else if ( (call = MALLOC(sizeof(*call))) == NULL)
+        return NULL;
+
+    call->pipeline = pipeline;
+    call->args = NULL;
+    return call;
+}
+
+static void recycle_call(AMP_Pipeline_T *pipeline, struct pipeline_call *call)
+{
+    call->next = pipeline->free_list;
+    pipeline->free_list = call;
+}
+
+/* Take the oldest call off the queue */
+static struct pipeline_call *dequeue(AMP_Pipeline_T *pipeline)
+{
+    struct pipeline_call *call = pipeline->queue_head;
+
+    if ( (pipeline->queue_head = call->next) == NULL)
+        pipeline->queue_tail = NULL;
+    pipeline->stats.queued--;
+    return call;
+}
+
+static void enqueue(AMP_Pipeline_T *pipeline, struct pipeline_call *call)
+{
+    call->next = NULL;
+    if (pipeline->queue_tail != NULL)
+        pipeline->queue_tail->next = call;
+    else
+        pipeline->queue_head = call;
+    pipeline->queue_tail = call;
+    pipeline->stats.queued++;
+}
+
+/* Put a call that couldn't be made back at the front of the queue */
+static void requeue(AMP_Pipeline_T *pipeline, struct pipeline_call *call)
+{
+    if ( (call->next = pipeline->queue_head) == NULL)
+        pipeline->queue_tail = call;
+    pipeline->queue_head = call;
+    pipeline->stats.queued++;
+}
+
+static void call_done(AMP_Proto_T *proto, AMP_Result_T *result,
+                      void *callback_arg);
+
+static int send_call(AMP_Pipeline_T *pipeline, struct pipeline_call *call)
+{
+    int ret;
+
+    if ( (ret = amp_call(pipeline->proto, call->command, call->args,
+                         call_done, call, &call->ask_key)) != 0)
+        return ret;
+
+    call->prev = &pipeline->in_flight;
+    call->next = pipeline->in_flight.next;
+    call->next->prev = call;
+    pipeline->in_flight.next = call;
+
+    pipeline->stats.in_flight++;
+    pipeline->stats.sent++;
+    return 0;
+}
+
+static void call_done(AMP_Proto_T *proto, AMP_Result_T *result,
+                      void *callback_arg)
+{
+    struct pipeline_call *call = callback_arg;
+    AMP_Pipeline_T *pipeline = call->pipeline;
+    amp_callback_func callback = call->callback;
+    void *arg = call->callback_arg;
+    enum amp_result_reason reason = result->reason;
+    int ret;
+
+    call->prev->next = call->next;
+    call->next->prev = call->prev;
+    recycle_call(pipeline, call);
+
+    pipeline->stats.in_flight--;
+    if (reason == AMP_SUCCESS)
+        pipeline->stats.completed++;
+    else
+        pipeline->stats.failed++;
+
+    (callback)(proto, result, arg);
+
+    /* there's no point making more calls over a lost connection */
+    if (pipeline->closing || reason == AMP_CONNECTION_LOST)
+        return;
+
+    /* a paused proto is expected to be refilled once it resumes */
+    if ( (ret = amp_pipeline_fill(pipeline)) != 0 && ret != AMP_WOULD_BLOCK)
+        amp_log("Couldn't make a pipelined call: %s", amp_strerror(ret));
+}
+
+
+AMP_Pipeline_T *amp_new_pipeline(AMP_Proto_T *proto, int window)
+{
+    AMP_Pipeline_T *pipeline;
+
+    if ( (pipeline = MALLOC(sizeof(*pipeline))) == NULL)
+        return NULL;
+
+    pipeline->proto = proto;
+    pipeline->window = window > 0 ? window : 1;
+    pipeline->closing = 0;
+    pipeline->queue_head = NULL;
+    pipeline->queue_tail = NULL;
+    pipeline->in_flight.next = &pipeline->in_flight;
+    pipeline->in_flight.prev = &pipeline->in_flight;
+    pipeline->free_list = NULL;
+
+    pipeline->stats.in_flight = 0;
+    pipeline->stats.queued = 0;
+    pipeline->stats.sent = 0;
+    pipeline->stats.completed = 0;
+    pipeline->stats.failed = 0;
+
+    debug_print("New AMP_Pipeline at %p\n", pipeline);
+    return pipeline;
+}
+
+int amp_pipeline_call(AMP_Pipeline_T *pipeline, const char *command,
+                      AMP_Box_T *args, amp_callback_func callback,
+                      void *callback_arg)
+{
+    struct pipeline_call *call;
+    int ret;
+
+    if ( (call = new_call(pipeline)) == NULL)
+        return ENOMEM;
+
+    call->command = command;
+    call->callback = callback;
+    call->callback_arg = callback_arg;
+
+    /* make the call straight away if there's room in the window, and
+     * nothing queued ahead of it */
+    if (pipeline->queue_head == NULL &&
+        pipeline->stats.in_flight < pipeline->window)
+    {
+        call->args = args;
+        if ( (ret = send_call(pipeline, call)) != 0)
+        {
+            recycle_call(pipeline, call);
+            return ret;
+        }
+        call->args = NULL;
+        return 0;
+    }
+
+    if (args != NULL)
+    {
+        args->refs++;
+        call->args = args;
+    }
+    enqueue(pipeline, call);
+    return 0;
+}
+
+int amp_pipeline_fill(AMP_Pipeline_T *pipeline)
+{
+    struct pipeline_call *call;
+    int ret;
+
+    while (pipeline->queue_head != NULL &&
+           pipeline->stats.in_flight < pipeline->window)
+    {
+        call = dequeue(pipeline);
+        if ( (ret = send_call(pipeline, call)) != 0)
+        {
+            requeue(pipeline, call);
+            return ret;
+        }
+
+        if (call->args != NULL)
+        {
+            amp_free_box(call->args); /* drop our reference */
+            call->args = NULL;
+        }
+    }
+    return 0;
+}
+
+int amp_pipeline_set_window(AMP_Pipeline_T *pipeline, int window)
+{
+    pipeline->window = window > 0 ? window : 1;
+    return amp_pipeline_fill(pipeline);
+}
+
+void amp_pipeline_stats(AMP_Pipeline_T *pipeline, AMP_Pipeline_Stats_T *stats,
+                        int reset)
+{
+    *stats = pipeline->stats;
+
+    if (reset)
+    {
+        pipeline->stats.sent = 0;
+        pipeline->stats.completed = 0;
+        pipeline->stats.failed = 0;
+    }
+}
+
+void amp_free_pipeline(AMP_Pipeline_T *pipeline)
+{
+    struct pipeline_call *call;
+
+    pipeline->closing = 1;
+
+    /* cancelling a call takes it off the in-flight list */
+    while ( (call = pipeline->in_flight.next) != &pipeline->in_flight)
+    {
+        if (amp_cancel(pipeline->proto, call->ask_key) != 0)
+        {
+            /* already forgotten by the AMP_Proto */
+            call->prev->next = call->next;
+            call->next->prev = call->prev;
+            recycle_call(pipeline, call);
+        }
+    }
+
+    while (pipeline->queue_head != NULL)
+    {
+        call = dequeue(pipeline);
+        if (call->args != NULL)
+            amp_free_box(call->args);
+        (call->callback)(pipeline->proto, &cancel_result, call->callback_arg);
+        free(call);
+    }
+
+    while ( (call = pipeline->free_list) != NULL)
+    {
+        pipeline->free_list = call->next;
+        free(call);
+    }
+
+    debug_print("Free AMP_Pipeline at %p\n", pipeline);
+    free(pipeline);
+}
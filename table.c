@@ -180,6 +180,25 @@ int Table_num_buckets(Table_T *table)
     return table->size;
 }
 
+void **Table_toArray(Table_T *table, void *end)
+{
+    int i, j = 0;
+    void **array;
+    struct binding *p;
+    assert(table);
+    array = MALLOC((2*table->length + 1)*sizeof (*array));
+    if (array == NULL)
+        return NULL;
+    for (i = 0; i < table->size; i++)
+        for (p = table->buckets[i]; p; p = p->link)
+        {
+            array[j++] = (void *)p->key;
+            array[j++] = p->value;
+        }
+    array[j] = end;
+    return array;
+}
+
 /* CURRENTLY UNUSED FUNCTIONS - UNCOMMENT IF YOU NEED TO MAKE USE OF THEM
 
 void Table_map(Table_T *table,
@@ -200,22 +219,4 @@ void Table_map(Table_T *table,
         }
 }
 
-void **Table_toArray(Table_T *table, void *end)
-{
-    int i, j = 0;
-    void **array;
-    struct binding *p;
-    assert(table);
-    array = MALLOC((2*table->length + 1)*sizeof (*array));
-    for (i = 0; i < table->size; i++)
-        for (p = table->buckets[i]; p; p = p->link)
-        {
-            array[j++] = (void *)p->key;
-            array[j++] = p->value;
-        }
-    array[j] = end;
-    return array;
-}
-
-
 */
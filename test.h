@@ -11,4 +11,5 @@ Suite *make_list_suite(void);
 Suite *make_table_suite(void);
 Suite *make_mem_suite(void);
 Suite *make_buftoll_suite(void);
+Suite *make_utf8_suite(void);
 Suite *make_ampc_suite(void);
@@ -24,6 +24,9 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 /* Check - C unit testing framework */
 #include <check.h>
@@ -78,6 +81,7 @@ static int save_box(AMP_Proto_T *proto, AMP_Box_T *box)
 {
     int err;
     saved_boxes = List_push(saved_boxes, box, &err);
+    proto->box = NULL; /* the box is ours now */
     return 0;
 }
 
@@ -121,6 +125,13 @@ int discarding_write_handler(AMP_Proto_T *proto, unsigned char *buf,
     return 0;
 }
 
+int failing_write_handler(AMP_Proto_T *proto, unsigned char *buf,
+                          int bufSize, void *write_arg)
+{
+    free(buf);
+    return -1;
+}
+
 List_T *saved_writes = NULL;
 struct saved_write
 {
@@ -525,6 +536,240 @@ START_TEST(dispatch_handled_requests)
 }
 END_TEST
 
+START_TEST(dispatch_frozen_requests)
+{
+    /* Verify that responders are found through the compiled index built
+     * by amp_freeze_responders(), and that changing the responders
+     * discards it */
+    AMP_Box_T *test_box;
+    AMP_Request_T *request;
+
+    amp_add_responder(test_proto, "Sum", sum_responder, NULL);
+    amp_add_responder(test_proto, "Multiply", multiply_responder, NULL);
+    amp_set_write_handler(test_proto, discarding_write_handler, NULL);
+
+    fail_if( amp_freeze_responders(test_proto) );
+    fail_unless( test_proto->responder_index != NULL );
+
+    test_box = test_proto->box;
+    amp_put_int(test_box, ASK, 1);
+    amp_put_cstring(test_box, COMMAND, "Multiply");
+    fail_if( test_proto->dispatch_box(test_proto, test_box));
+
+    fail_unless(List_length(saved_requests) == 1);
+    saved_requests = List_pop(saved_requests, (void**)&request);
+    fail_unless(request->args == test_box);
+    amp_free_request(request);
+
+    /* prefixes and extensions of a registered command don't match */
+    test_box = amp_new_box();
+    test_proto->box = test_box;
+    amp_put_int(test_box, ASK, 2);
+    amp_put_cstring(test_box, COMMAND, "Sums");
+    fail_if( test_proto->dispatch_box(test_proto, test_box));
+
+    test_box = amp_new_box();
+    test_proto->box = test_box;
+    amp_put_int(test_box, ASK, 3);
+    amp_put_cstring(test_box, COMMAND, "Su");
+    fail_if( test_proto->dispatch_box(test_proto, test_box));
+
+    fail_unless(List_length(saved_requests) == 0);
+
+    /* removing a responder discards the index */
+    amp_remove_responder(test_proto, "Multiply");
+    fail_unless( test_proto->responder_index == NULL );
+
+    test_box = amp_new_box();
+    test_proto->box = test_box;
+    amp_put_int(test_box, ASK, 4);
+    amp_put_cstring(test_box, COMMAND, "Multiply");
+    fail_if( test_proto->dispatch_box(test_proto, test_box));
+
+    fail_unless(List_length(saved_requests) == 0);
+}
+END_TEST
+
+
+START_TEST(dispatch_registry_requests)
+{
+    /* Verify that requests are dispatched to the responders of a shared
+     * registry, that responders added to the proto override them, and
+     * that a frozen registry can't be changed */
+    AMP_Registry_T *registry;
+    AMP_Proto_T *other_proto;
+    AMP_Box_T *test_box;
+    AMP_Request_T *request;
+
+    fail_unless( (registry = amp_new_registry()) != NULL );
+    fail_if( amp_registry_add_responder(registry, "Sum", sum_responder,
+                                        (void *)1) );
+    fail_if( amp_registry_add_responder(registry, "Multiply",
+                                        multiply_responder, (void *)1) );
+    /* replacing a registered responder */
+    fail_if( amp_registry_add_responder(registry, "Sum", sum_responder,
+                                        (void *)2) );
+
+    /* a proto that only uses the registry allocates no responder table */
+    fail_unless( test_proto->responders == NULL );
+
+    /* amp_set_registry() freezes the registry */
+    fail_if( amp_set_registry(test_proto, registry) );
+    fail_unless( amp_registry_add_responder(registry, "Divide", sum_responder,
+                                            NULL) == AMP_REGISTRY_FROZEN );
+    fail_if( amp_freeze_registry(registry) );
+
+    /* the registry may be shared */
+    fail_unless( (other_proto = amp_new_proto()) != NULL );
+    fail_if( amp_set_registry(other_proto, registry) );
+
+    test_box = amp_new_box();
+    amp_free_box(other_proto->box);
+    other_proto->box = test_box;
+    amp_put_int(test_box, ASK, 1);
+    amp_put_cstring(test_box, COMMAND, "Sum");
+    fail_if( other_proto->dispatch_box(other_proto, test_box));
+
+    fail_unless(List_length(saved_requests) == 1);
+    saved_requests = List_pop(saved_requests, (void**)&request);
+    fail_unless(request->args == test_box);
+    amp_free_request(request);
+
+    /* an override on one proto doesn't affect the other */
+    amp_add_responder(test_proto, "Multiply", sum_responder, NULL);
+    fail_unless( _amp_find_responder(test_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Multiply", 8})->func == sum_responder );
+    fail_unless( _amp_find_responder(other_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Multiply", 8})->func
+                 == multiply_responder );
+    fail_unless( (long)_amp_find_responder(test_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Sum", 3})->arg == 2 );
+
+    /* ...including when the proto's responders are frozen */
+    fail_if( amp_freeze_responders(test_proto) );
+    fail_unless( _amp_find_responder(test_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Multiply", 8})->func == sum_responder );
+    fail_unless( _amp_find_responder(test_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Sum", 3}) != NULL );
+
+    /* removing the override falls back to the registry */
+    amp_remove_responder(test_proto, "Multiply");
+    fail_unless( _amp_find_responder(test_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Multiply", 8})->func
+                 == multiply_responder );
+
+    fail_unless( _amp_find_responder(test_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Divide", 6}) == NULL );
+
+    /* detaching the registry */
+    fail_if( amp_set_registry(test_proto, NULL) );
+    fail_unless( _amp_find_responder(test_proto, &(AMP_Chunk_T){
+                     (unsigned char *)"Sum", 3}) == NULL );
+
+    amp_free_proto(other_proto);
+    amp_free_registry(registry);
+}
+END_TEST
+
+
+START_TEST(test__responder_index__many_commands)
+{
+    static char commands[500][16];
+    _AMP_Responder_Map_p map = _amp_new_responder_map();
+    _AMP_Responder_Index_p index;
+    _AMP_Responder_p resp;
+    int i;
+
+    for (i = 0; i < 500; i++)
+    {
+        snprintf(commands[i], sizeof(commands[i]), "Command%d", i);
+        _amp_put_responder(map, commands[i],
+                           _amp_new_responder(sum_responder,
+                                              (void *)(long)i));
+    }
+
+    fail_unless( (index = _amp_new_responder_index(map)) != NULL );
+
+    for (i = 0; i < 500; i++)
+    {
+        resp = _amp_index_get_responder(index,
+                                        (unsigned char *)commands[i],
+                                        strlen(commands[i]));
+        fail_unless( resp != NULL );
+        fail_unless( resp->arg == (void *)(long)i );
+    }
+
+    fail_unless( _amp_index_get_responder(index, (unsigned char *)"Command",
+                                          7) == NULL );
+    fail_unless( _amp_index_get_responder(index, (unsigned char *)"", 0)
+                 == NULL );
+
+    _amp_free_responder_index(index);
+    for (i = 0; i < 500; i++)
+        _amp_remove_responder(map, commands[i]);
+    _amp_free_responder_map(map);
+}
+END_TEST
+
+
+/* Too many commands for any seed to spread out, even in the largest
+ * table - the index has to fall back to probing */
+START_TEST(test__responder_index__probing)
+{
+    static char commands[5000][16];
+    _AMP_Responder_Map_p map = _amp_new_responder_map();
+    _AMP_Responder_Index_p index;
+    _AMP_Responder_p resp;
+    int i;
+
+    for (i = 0; i < 5000; i++)
+    {
+        snprintf(commands[i], sizeof(commands[i]), "Command%d", i);
+        _amp_put_responder(map, commands[i],
+                           _amp_new_responder(sum_responder,
+                                              (void *)(long)i));
+    }
+
+    fail_unless( (index = _amp_new_responder_index(map)) != NULL );
+
+    for (i = 0; i < 5000; i++)
+    {
+        resp = _amp_index_get_responder(index,
+                                        (unsigned char *)commands[i],
+                                        strlen(commands[i]));
+        fail_unless( resp != NULL );
+        fail_unless( resp->arg == (void *)(long)i );
+    }
+
+    fail_unless( _amp_index_get_responder(index, (unsigned char *)"Command",
+                                          7) == NULL );
+    fail_unless( _amp_index_get_responder(index,
+                                          (unsigned char *)"Command5000",
+                                          11) == NULL );
+
+    _amp_free_responder_index(index);
+    for (i = 0; i < 5000; i++)
+        _amp_remove_responder(map, commands[i]);
+    _amp_free_responder_map(map);
+}
+END_TEST
+
+
+START_TEST(test__responder_index__empty)
+{
+    _AMP_Responder_Map_p map = _amp_new_responder_map();
+    _AMP_Responder_Index_p index = _amp_new_responder_index(map);
+
+    fail_unless( index != NULL );
+    fail_unless( _amp_index_get_responder(index, (unsigned char *)"Sum",
+                                          3) == NULL );
+
+    _amp_free_responder_index(index);
+    _amp_free_responder_map(map);
+}
+END_TEST
+
+
 START_TEST(unhandled_request_sends_error)
 {
     /* Verify that an incoming request (_command) box, with no
@@ -822,14 +1067,13 @@ START_TEST(test_process_with_malloc_failure)
     /* ANSWER box */
     int ask_key = 1;
     AMP_Proto_T *proto;
-    _AMP_Callback_p cb;
 
     fail_after = 0;
     while (1)
     {
         proto = amp_new_proto();
-        cb = _amp_new_callback(junk_callback, NULL);
-        _amp_put_callback(proto->outstanding_requests, ask_key, cb);
+        _amp_put_callback(proto->outstanding_requests, ask_key,
+                          junk_callback, NULL);
 
         amp_put_int(proto->box, ANSWER, ask_key);
 
@@ -876,8 +1120,8 @@ START_TEST(test_process_with_malloc_failure)
     while (1)
     {
         proto = amp_new_proto();
-        cb = _amp_new_callback(junk_callback, NULL);
-        _amp_put_callback(proto->outstanding_requests, ask_key, cb);
+        _amp_put_callback(proto->outstanding_requests, ask_key,
+                          junk_callback, NULL);
 
         amp_put_int(proto->box, _ERROR, 1);
 
@@ -1040,7 +1284,7 @@ START_TEST(test_amp_call_with_malloc_failures)
             fail_unless(result == ENOMEM);
 
             /* And ensure that no state was left in the proto */
-            fail_unless(Table_length(test_proto->outstanding_requests) == 0);
+            fail_unless(_amp_callback_map_length(test_proto->outstanding_requests) == 0);
         }
         else
         {
@@ -1063,10 +1307,11 @@ START_TEST(test_amp_cancel_with_malloc_failures)
     {
         args = amp_new_box();
         proto = amp_new_proto();
+        amp_set_write_handler(proto, discarding_write_handler, NULL);
 
         /* Register some callbacks */
-        amp_call(proto, "someCommand", args,
-                 ignore_result_cb, NULL, &askKey);
+        fail_if( amp_call(proto, "someCommand", args,
+                          ignore_result_cb, NULL, &askKey) );
         amp_free_box(args);
 
         enable_malloc_failures(fail_after++);
@@ -1148,6 +1393,39 @@ START_TEST(test_amp_chunks_with_malloc_failures)
 }
 END_TEST
 
+/* A responder and callback which only stash their argument - unlike
+ * sum_responder() and save_result_cb() they don't allocate */
+static AMP_Request_T *stashed_request;
+static AMP_Result_T *stashed_result;
+
+static void stash_request(AMP_Proto_T *proto, AMP_Request_T *request,
+                          void *responder_arg)
+{
+    stashed_request = request;
+}
+
+static void stash_result(AMP_Proto_T *proto, AMP_Result_T *result,
+                         void *callback_arg)
+{
+    stashed_result = result;
+}
+
+/* Feed `proto' a request for "Cmd" with `ask_key', and return it as it
+ * was handed to stash_request() - the responder `proto' must have for
+ * "Cmd" */
+static AMP_Request_T *read_request(AMP_Proto_T *proto, const char *ask_key)
+{
+    unsigned char *buf;
+    int size;
+
+    stashed_request = NULL;
+    fail_if( _amp_serialize_call(NULL, "Cmd", ask_key, NULL, &buf, &size) );
+    fail_if( amp_consume_bytes(proto, buf, size) );
+    free(buf);
+    fail_unless( stashed_request != NULL );
+    return stashed_request;
+}
+
 START_TEST(test_amp_respond_with_malloc_failures)
 {
     char *ask_key = "ask123";
@@ -1161,12 +1439,8 @@ START_TEST(test_amp_respond_with_malloc_failures)
 
     amp_set_write_handler(proto, discarding_write_handler, NULL);
 
-    NEW(req);
-    memset(req, 0, sizeof(*req));
-
-    /* The other fields of a `struct AMP_Request' are not accessed
-     * when responding */
-    req->ask_key = amp_chunk_copy_buffer(ask_key, strlen(ask_key));
+    amp_add_responder(proto, "Cmd", stash_request, NULL);
+    req = read_request(proto, ask_key);
 
     amp_put_cstring(resp_args, "field1", "VAL1");
     amp_put_cstring(resp_args, "field2", "VAL2");
@@ -1231,8 +1505,7 @@ START_TEST(test_amp_new_error_from_box_with_malloc_failures)
         else
         {
             fail_unless(result == 0);
-            /* The box has already been free'd if creating the AMP_Error
-             * object was succesful. */
+            /* The AMP_Error lives in the box, and free's it */
             amp_free_error(error);
             break;
         }
@@ -1241,6 +1514,188 @@ START_TEST(test_amp_new_error_from_box_with_malloc_failures)
 END_TEST
 
 
+START_TEST(test_amp_freeze_responders_with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+
+    amp_add_responder(test_proto, "Sum", sum_responder, NULL);
+    amp_add_responder(test_proto, "Multiply", multiply_responder, NULL);
+
+    while (1)
+    {
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_freeze_responders(test_proto);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            fail_unless(test_proto->responder_index == NULL);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            fail_unless(test_proto->responder_index != NULL);
+            break;
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(test_amp_registry_with_malloc_failures)
+{
+    int fail_after = 0;
+    AMP_Registry_T *registry;
+    int result;
+
+    while (1)
+    {
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = 0;
+        if ( (registry = amp_new_registry()) != NULL &&
+             (result = amp_registry_add_responder(registry, "Sum",
+                                                  sum_responder, NULL)) == 0)
+            result = amp_set_registry(test_proto, registry);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(registry == NULL || result == ENOMEM);
+            fail_unless(test_proto->registry == NULL);
+            amp_free_registry(registry);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            fail_unless(test_proto->registry == registry);
+            fail_unless(registry->index != NULL);
+            amp_set_registry(test_proto, NULL);
+            amp_free_registry(registry);
+            break;
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(test_amp_add_responder_with_malloc_failures)
+{
+    int fail_after = 0;
+    _AMP_Responder_p resp;
+
+    while (1)
+    {
+        amp_add_responder(test_proto, "Sum", sum_responder, NULL);
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test - replacing "Sum", and adding "Multiply" */
+        amp_add_responder(test_proto, "Sum", multiply_responder, NULL);
+        amp_add_responder(test_proto, "Multiply", multiply_responder, NULL);
+
+        disable_malloc_failures();
+
+        /* a failed replacement leaves the old responder in place */
+        resp = _amp_get_responder(test_proto->responders,
+                                  (const unsigned char *)"Sum");
+        fail_unless( resp != NULL );
+        resp = _amp_get_responder(test_proto->responders,
+                                  (const unsigned char *)"Multiply");
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless( resp == NULL );
+            amp_remove_responder(test_proto, "Sum");
+        }
+        else
+        {
+            fail_unless( resp != NULL );
+            fail_unless( resp->func == multiply_responder );
+            resp = _amp_get_responder(test_proto->responders,
+                                      (const unsigned char *)"Sum");
+            fail_unless( resp->func == multiply_responder );
+            break;
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(test_dispatch_without_allocation)
+{
+    /* The request, response, error and result objects for an inbound box
+     * are views in to the box itself, so dispatching a box allocates
+     * nothing */
+    AMP_Request_T *request;
+    AMP_Result_T *result;
+
+    amp_add_responder(test_proto, "Sum", stash_request, NULL);
+    _amp_put_callback(test_proto->outstanding_requests, 1, stash_result,
+                      NULL);
+    _amp_put_callback(test_proto->outstanding_requests, 2, stash_result,
+                      NULL);
+
+    /* _command box */
+    amp_put_cstring(test_proto->box, COMMAND, "Sum");
+    amp_put_int(test_proto->box, ASK, 42);
+
+    enable_malloc_failures(0);
+    fail_if( test_proto->dispatch_box(test_proto, test_proto->box) );
+    disable_malloc_failures();
+    fail_if( allocation_failure_occurred );
+
+    request = stashed_request;
+    fail_unless( request->command->size == 3 );
+    fail_unless( strcmp((char *)request->command->value, "Sum") == 0 );
+    fail_unless( request->ask_key->size == 2 );
+    fail_unless( strcmp((char *)request->ask_key->value, "42") == 0 );
+    amp_free_request(request);
+
+    /* _answer box */
+    test_proto->box = amp_new_box();
+    amp_put_int(test_proto->box, ANSWER, 1);
+
+    enable_malloc_failures(0);
+    fail_if( test_proto->dispatch_box(test_proto, test_proto->box) );
+    disable_malloc_failures();
+    fail_if( allocation_failure_occurred );
+
+    result = stashed_result;
+    fail_unless( result->reason == AMP_SUCCESS );
+    fail_unless( result->response->answer_key == 1 );
+    amp_free_result(result);
+
+    /* _error box */
+    test_proto->box = amp_new_box();
+    amp_put_int(test_proto->box, _ERROR, 2);
+    amp_put_cstring(test_proto->box, ERROR_CODE, "SOME_ERROR_CODE");
+
+    enable_malloc_failures(0);
+    fail_if( test_proto->dispatch_box(test_proto, test_proto->box) );
+    disable_malloc_failures();
+    fail_if( allocation_failure_occurred );
+
+    result = stashed_result;
+    fail_unless( result->reason == AMP_ERROR );
+    fail_unless( result->error->answer_key == 2 );
+    fail_unless( strcmp((char *)result->error->error_code->value,
+                        "SOME_ERROR_CODE") == 0 );
+    fail_unless( result->error->error_descr == NULL );
+    amp_free_result(result);
+
+    test_proto->box = amp_new_box();
+}
+END_TEST
+
+
 START_TEST(test_amp_new_responder_with_malloc_failures)
 {
     int fail_after = 0;
@@ -1359,45 +1814,2838 @@ START_TEST(test__amp_call_success)
 END_TEST
 
 
-START_TEST(test__amp_cancel__success)
+/* Pop the most recent write saved by save_writes() and parse it */
+static AMP_Box_T *pop_written_box(AMP_Proto_T *proto)
 {
-    int ask_key;
-    int result;
-    AMP_Box_T *args = amp_new_box();
-    AMP_Proto_T *proto = amp_new_proto();
-    struct saved_result *r;
+    struct saved_write *write;
+    AMP_Box_T *box = amp_new_box();
+    int bytesConsumed;
 
-    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    saved_writes = List_pop(saved_writes, (void**)&write);
+    fail_unless( amp_parse_box(proto, box, &bytesConsumed,
+                               write->chunk->value,
+                               write->chunk->size) );
+    fail_unless(bytesConsumed == write->chunk->size);
 
-    /* set up some call state */
-    amp_call(proto, "SomeCommand", args, save_result_cb, (void*)0x123, &ask_key);
-    amp_free_box(args);
+    free(write->chunk->value);
+    amp_free_chunk(write->chunk);
+    free(write);
+    return box;
+}
 
-    fail_unless( Table_length(proto->outstanding_requests) == 1 );
 
-    /* cancel it */
-    result = amp_cancel(proto, ask_key);
+START_TEST(test__amp_call__args_not_modified)
+{
+    /* amp_call() writes _command and _ask ahead of the arguments, leaving
+     * the args box untouched so that it may be re-used */
+    unsigned int askKey1, askKey2, writtenAskKey;
+    int a, bufSize;
+    unsigned char *buf;
+    AMP_Box_T *box;
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *args = amp_new_box();
 
-    fail_unless( result == 0 );
+    amp_set_write_handler(proto, save_writes, NULL);
+    amp_put_int(args, "a", 1776);
 
-    /* ensure callback was called with correct result */
-    fail_unless( List_length(saved_results) == 1 );
+    fail_if( amp_call(proto, "First", args, junk_callback, NULL, &askKey1) );
+    fail_unless( amp_num_keys(args) == 1 );
+    fail_if( amp_has_key(args, COMMAND) );
+    fail_if( amp_has_key(args, ASK) );
 
-    saved_results = List_pop(saved_results, (void**)&r);
+    fail_if( amp_call(proto, "Second", args, junk_callback, NULL, &askKey2) );
+    fail_if( amp_call_no_answer(proto, "Third", args) );
+    fail_unless( amp_num_keys(args) == 1 );
 
-    fail_unless( r->proto == proto );
+    fail_unless( List_length(saved_writes) == 3 );
 
-    fail_unless( r->result->reason == AMP_CANCEL );
-    fail_unless( r->result->response == NULL );
-    fail_unless( r->result->error == NULL );
+    box = pop_written_box(proto);
+    fail_unless( amp_num_keys(box) == 2 );
+    fail_if( amp_has_key(box, ASK) );
+    fail_if( amp_get_bytes(box, COMMAND, &buf, &bufSize) );
+    fail_unless( bufSize == 5 && memcmp(buf, "Third", 5) == 0 );
+    amp_free_box(box);
 
-    fail_unless( r->callback_arg == (void*)0x123 );
+    box = pop_written_box(proto);
+    fail_unless( amp_num_keys(box) == 3 );
+    fail_if( amp_get_uint(box, ASK, &writtenAskKey) );
+    fail_unless( writtenAskKey == askKey2 );
+    fail_if( amp_get_int(box, "a", &a) );
+    fail_unless( a == 1776 );
+    amp_free_box(box);
 
-    /* and state was forgotten */
-    fail_unless( Table_length(proto->outstanding_requests) == 0 );
+    box = pop_written_box(proto);
+    fail_if( amp_get_uint(box, ASK, &writtenAskKey) );
+    fail_unless( writtenAskKey == askKey1 );
+    amp_free_box(box);
 
-    amp_free_result(r->result);
-    free(r);
+    /* special keys left in the args box are not sent */
+    amp_put_cstring(args, COMMAND, "Stale");
+    amp_put_cstring(args, ASK, "999");
+    fail_if( amp_call(proto, "Fourth", args, junk_callback, NULL, &askKey1) );
+    fail_unless( amp_num_keys(args) == 3 );
+
+    box = pop_written_box(proto);
+    fail_unless( amp_num_keys(box) == 3 );
+    fail_if( amp_get_uint(box, ASK, &writtenAskKey) );
+    fail_unless( writtenAskKey == askKey1 );
+    fail_if( amp_get_int(box, "a", &a) );
+    amp_free_box(box);
+
+    /* a call needn't have any arguments */
+    fail_if( amp_call(proto, "Fifth", NULL, junk_callback, NULL, NULL) );
+    box = pop_written_box(proto);
+    fail_unless( amp_num_keys(box) == 2 );
+    amp_free_box(box);
+
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_cork__coalesces_writes)
+{
+    /* boxes written while corked reach the write handler in one call */
+    int i, bytesConsumed, bufSize;
+    unsigned char *buf;
+    struct saved_write *write;
+    AMP_Request_T *request;
+    AMP_Box_T *box;
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Proto_T *reader = amp_new_proto();
+    AMP_Box_T *args = amp_new_box();
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    amp_put_int(args, "a", 1);
+
+    /* nothing to flush */
+    fail_if( amp_flush(proto) );
+    fail_unless( List_length(saved_writes) == 0 );
+
+    amp_cork(proto);
+
+    fail_if( amp_call(proto, "First", args, junk_callback, NULL, NULL) );
+    fail_if( amp_call_no_answer(proto, "Second", args) );
+
+    /* a response */
+    request = MALLOC(sizeof(*request));
+    request->ask_key = amp_chunk_copy_buffer((unsigned char *)"7", 1);
+    fail_if( amp_respond(proto, request, args) );
+    amp_free_chunk(request->ask_key);
+    free(request);
+
+    fail_unless( List_length(saved_writes) == 0 );
+    fail_unless( amp_flush(proto) == 0 );
+    fail_unless( List_length(saved_writes) == 1 );
+
+    /* flushing leaves the proto corked */
+    fail_if( amp_call(proto, "Third", args, junk_callback, NULL, NULL) );
+    fail_unless( List_length(saved_writes) == 1 );
+    fail_unless( amp_uncork(proto) == 0 );
+    fail_unless( List_length(saved_writes) == 2 );
+
+    /* ...and uncorking writes straight through again */
+    fail_if( amp_call(proto, "Fourth", args, junk_callback, NULL, NULL) );
+    fail_unless( List_length(saved_writes) == 3 );
+    box = pop_written_box(proto);
+    amp_free_box(box);
+    box = pop_written_box(proto);
+    fail_if( amp_get_bytes(box, COMMAND, &buf, &bufSize) );
+    fail_unless( bufSize == 5 && memcmp(buf, "Third", 5) == 0 );
+    amp_free_box(box);
+
+    /* the first write holds the three boxes, in order */
+    saved_writes = List_pop(saved_writes, (void**)&write);
+    buf = write->chunk->value;
+    bufSize = write->chunk->size;
+    for (i = 0; i < 3; i++)
+    {
+        box = amp_new_box();
+        fail_unless( amp_parse_box(reader, box, &bytesConsumed,
+                                   buf, bufSize) );
+        buf += bytesConsumed;
+        bufSize -= bytesConsumed;
+
+        fail_unless( amp_has_key(box, i < 2 ? COMMAND : ANSWER) );
+        amp_free_box(box);
+    }
+    fail_unless( bufSize == 0 );
+
+    free(write->chunk->value);
+    amp_free_chunk(write->chunk);
+    free(write);
+
+    amp_free_box(args);
+    amp_free_proto(reader);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_cork__grow_with_malloc_failures)
+{
+    int fail_after = 0;
+    int result, calls = 0;
+    struct saved_write *write;
+    AMP_Proto_T *proto = amp_new_proto();
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    amp_cork(proto);
+
+    while (1)
+    {
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_call_no_answer(proto, "SomeCommand", NULL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+            fail_unless(result == ENOMEM);
+        else
+        {
+            fail_unless(result == 0);
+
+            /* keep going until the output buffer has had to grow */
+            if (++calls < 3)
+            {
+                fail_after = 0;
+                continue;
+            }
+            break;
+        }
+    }
+
+    fail_unless( List_length(saved_writes) == 0 );
+    fail_if( amp_uncork(proto) );
+    fail_unless( List_length(saved_writes) == 1 );
+    saved_writes = List_pop(saved_writes, (void**)&write);
+    fail_unless( write->chunk->size == 3 * (4 + 8 + 11 + 2) );
+
+    free(write->chunk->value);
+    amp_free_chunk(write->chunk);
+    free(write);
+
+    /* anything still corked is discarded by amp_free_proto() */
+    amp_cork(proto);
+    amp_call_no_answer(proto, "SomeCommand", NULL);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+/* The last scatter/gather write, flattened, and its unreleased
+ * release function */
+static unsigned char writev_data[4096];
+static int writev_size;
+static int writev_iovcnt;
+static const AMP_IOVec_T *writev_iov;
+static amp_write_release_func writev_release;
+static void *writev_release_arg;
+
+static int save_writev(AMP_Proto_T *proto, const AMP_IOVec_T *iov,
+                       int iovcnt, amp_write_release_func release,
+                       void *release_arg, void *write_arg)
+{
+    int i;
+
+    writev_size = 0;
+    for (i = 0; i < iovcnt; i++)
+    {
+        memcpy(writev_data + writev_size, iov[i].base, iov[i].len);
+        writev_size += iov[i].len;
+    }
+    writev_iovcnt = iovcnt;
+    writev_iov = iov;
+    writev_release = release;
+    writev_release_arg = release_arg;
+    return 0;
+}
+
+
+START_TEST(test__amp_writev__references_large_values)
+{
+    unsigned char big[1000];
+    unsigned char *buf;
+    int i, a, bufSize, bytesConsumed, referenced;
+    AMP_Box_T *box;
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *args = amp_new_box();
+
+    amp_set_writev_handler(proto, save_writev, NULL);
+
+    memset(big, 'x', sizeof(big));
+    amp_put_int(args, "a", 1776);
+    amp_put_bytes(args, "big", big, sizeof(big));
+    amp_get_bytes(args, "big", &buf, &bufSize);
+
+    fail_if( amp_call(proto, "SomeCommand", args, junk_callback, NULL,
+                      NULL) );
+
+    /* the large value is referenced in place, everything else copied */
+    fail_unless( writev_iovcnt <= 3 );
+    referenced = 0;
+    for (i = 0; i < writev_iovcnt; i++)
+        if (writev_iov[i].base == buf)
+        {
+            fail_unless( writev_iov[i].len == sizeof(big) );
+            referenced++;
+        }
+    fail_unless( referenced == 1 );
+
+    /* the box may be free'd before the write is released */
+    amp_free_box(args);
+    for (i = 0; i < writev_iovcnt; i++)
+        if (writev_iov[i].base == buf)
+            fail_unless( memcmp(writev_iov[i].base, big, sizeof(big)) == 0 );
+    writev_release(writev_release_arg);
+
+    /* the gathered bytes form the same box that amp_call() would write */
+    box = amp_new_box();
+    fail_unless( amp_parse_box(proto, box, &bytesConsumed,
+                               writev_data, writev_size) );
+    fail_unless( bytesConsumed == writev_size );
+    fail_unless( amp_num_keys(box) == 4 );
+    fail_if( amp_get_int(box, "a", &a) );
+    fail_unless( a == 1776 );
+    fail_if( amp_get_bytes(box, "big", &buf, &bufSize) );
+    fail_unless( bufSize == sizeof(big) && memcmp(buf, big, bufSize) == 0 );
+    fail_unless( amp_has_key(box, COMMAND) && amp_has_key(box, ASK) );
+    amp_free_box(box);
+
+    /* a box of small values is written as a single segment, holding no
+     * reference to the box */
+    args = amp_new_box();
+    amp_put_int(args, "a", 1);
+    fail_if( amp_call_no_answer(proto, "SomeCommand", args) );
+    fail_unless( writev_iovcnt == 1 );
+    amp_free_box(args);
+    writev_release(writev_release_arg);
+
+    /* corked boxes are flushed as a single segment */
+    amp_cork(proto);
+    fail_if( amp_call_no_answer(proto, "SomeCommand", NULL) );
+    fail_if( amp_call_no_answer(proto, "SomeCommand", NULL) );
+    writev_iovcnt = 0;
+    fail_if( amp_uncork(proto) );
+    fail_unless( writev_iovcnt == 1 );
+    fail_unless( writev_size == 2 * (4 + 8 + 11 + 2) );
+    writev_release(writev_release_arg);
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_writev__with_malloc_failures)
+{
+    unsigned char big[100];
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *args = amp_new_box();
+
+    amp_set_writev_handler(proto, save_writev, NULL);
+    memset(big, 'x', sizeof(big));
+    amp_put_bytes(args, "big", big, sizeof(big));
+
+    while (1)
+    {
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_call(proto, "SomeCommand", args, junk_callback, NULL,
+                          NULL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            fail_unless( _amp_callback_map_length(
+                             proto->outstanding_requests) == 0 );
+        }
+        else
+        {
+            fail_unless(result == 0);
+            writev_release(writev_release_arg);
+            break;
+        }
+    }
+
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_call_with_timeout)
+{
+    unsigned int askKeyA, askKeyB, askKeyC;
+    struct saved_result *r;
+    AMP_Proto_T *proto = amp_new_proto();
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    fail_unless( amp_tick(proto, 1000) == 0 ); /* start the clock */
+
+    fail_if( amp_call_with_timeout(proto, "A", NULL, save_result_cb,
+                                   (void *)1, 50, &askKeyA) );
+    fail_if( amp_call_with_timeout(proto, "B", NULL, save_result_cb,
+                                   (void *)2, 200, &askKeyB) );
+    fail_if( amp_call_with_timeout(proto, "C", NULL, save_result_cb,
+                                   (void *)3, 0, &askKeyC) );
+
+    fail_unless( amp_tick(proto, 1049) == 0 );
+    fail_unless( List_length(saved_results) == 0 );
+
+    fail_unless( amp_tick(proto, 1050) == 1 );
+    fail_unless( List_length(saved_results) == 1 );
+    saved_results = List_pop(saved_results, (void**)&r);
+    fail_unless( r->result->reason == AMP_TIMEOUT );
+    fail_unless( r->result->response == NULL && r->result->error == NULL );
+    fail_unless( r->callback_arg == (void *)1 );
+    amp_free_result(r->result);
+    free(r);
+
+    /* a late answer is ignored */
+    amp_put_int(proto->box, ANSWER, askKeyA);
+    fail_if( proto->dispatch_box(proto, proto->box) );
+    fail_unless( List_length(saved_results) == 0 );
+
+    /* an answer in time stops the timer */
+    proto->box = amp_new_box();
+    amp_put_int(proto->box, ANSWER, askKeyB);
+    fail_if( proto->dispatch_box(proto, proto->box) );
+    fail_unless( List_length(saved_results) == 1 );
+    saved_results = List_pop(saved_results, (void**)&r);
+    fail_unless( r->result->reason == AMP_SUCCESS );
+    amp_free_result(r->result);
+    free(r);
+    fail_unless( _amp_timer_wheel_length(proto->timers) == 0 );
+
+    /* a call without a timeout never times out */
+    fail_unless( amp_tick(proto, 100000000) == 0 );
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 1 );
+
+    /* nor does a cancelled call */
+    fail_if( amp_call_with_timeout(proto, "D", NULL, save_result_cb,
+                                   (void *)4, 10, &askKeyA) );
+    fail_if( amp_cancel(proto, askKeyA) );
+    saved_results = List_pop(saved_results, (void**)&r);
+    fail_unless( r->result->reason == AMP_CANCEL );
+    amp_free_result(r->result);
+    free(r);
+    fail_unless( amp_tick(proto, 100000010) == 0 );
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_tick__starts_clock)
+{
+    /* timeouts set before the clock is started are counted from the
+     * first amp_tick() */
+    AMP_Proto_T *proto = amp_new_proto();
+    struct saved_result *r;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    fail_if( amp_call_with_timeout(proto, "A", NULL, save_result_cb, NULL,
+                                   100, NULL) );
+
+    fail_unless( amp_tick(proto, 5000000) == 0 );
+    fail_unless( amp_tick(proto, 5000099) == 0 );
+    fail_unless( amp_tick(proto, 4000000) == 0 ); /* backwards - ignored */
+    fail_unless( amp_tick(proto, 5000100) == 1 );
+
+    saved_results = List_pop(saved_results, (void**)&r);
+    fail_unless( r->result->reason == AMP_TIMEOUT );
+    amp_free_result(r->result);
+    free(r);
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+#define NUM_WHEEL_TIMERS 5000
+static unsigned long long wheel_now;
+static unsigned long long wheel_fired_at[NUM_WHEEL_TIMERS];
+
+static void record_expiry(void *arg, unsigned int ask_key)
+{
+    fail_unless( wheel_fired_at[ask_key] == 0 );
+    wheel_fired_at[ask_key] = wheel_now;
+}
+
+START_TEST(test__timer_wheel__expiry_order)
+{
+    /* Timers spread over more than the span of the wheel each fire on
+     * the first advance that reaches their expiry time */
+    static unsigned long long expires[NUM_WHEEL_TIMERS];
+    static struct _AMP_Timer *timers[NUM_WHEEL_TIMERS];
+    unsigned long long prev, start = 123456;
+    _AMP_Timer_Wheel_p wheel = _amp_new_timer_wheel(start);
+    int i, fired = 0;
+
+    srand(1);
+    memset(wheel_fired_at, 0, sizeof(wheel_fired_at));
+    for (i = 0; i < NUM_WHEEL_TIMERS; i++)
+    {
+        expires[i] = start + 1 + (((unsigned long long)rand() << 8) ^ rand())
+                                 % (1ULL << 25);
+        timers[i] = _amp_add_timer(wheel, expires[i], i);
+    }
+
+    /* some timers are stopped before they expire */
+    for (i = 0; i < NUM_WHEEL_TIMERS; i += 7)
+        _amp_remove_timer(wheel, timers[i]);
+
+    fail_unless( _amp_timer_wheel_length(wheel) ==
+                 NUM_WHEEL_TIMERS - (NUM_WHEEL_TIMERS + 6) / 7 );
+
+    wheel_now = start;
+    while (_amp_timer_wheel_length(wheel) > 0)
+    {
+        wheel_now += 1 + rand() % 5000;
+        fired += _amp_expire_timers(wheel, wheel_now, record_expiry, NULL);
+    }
+    fail_unless( fired == NUM_WHEEL_TIMERS - (NUM_WHEEL_TIMERS + 6) / 7 );
+
+    for (i = 0; i < NUM_WHEEL_TIMERS; i++)
+    {
+        if (i % 7 == 0)
+        {
+            fail_unless( wheel_fired_at[i] == 0 );
+            continue;
+        }
+
+        fail_unless( wheel_fired_at[i] >= expires[i] );
+
+        /* ...and not on a later advance than necessary */
+        prev = wheel_fired_at[i];
+        fail_unless( prev - expires[i] < 5000 );
+    }
+
+    _amp_free_timer_wheel(wheel);
+}
+END_TEST
+
+
+START_TEST(test__amp_call_with_timeout__malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+        amp_set_write_handler(proto, discarding_write_handler, NULL);
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_call_with_timeout(proto, "A", NULL, junk_callback, NULL,
+                                       100, NULL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            fail_unless( _amp_callback_map_length(
+                             proto->outstanding_requests) == 0 );
+            fail_unless( proto->timers == NULL ||
+                         _amp_timer_wheel_length(proto->timers) == 0 );
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            fail_unless( _amp_timer_wheel_length(proto->timers) == 1 );
+            amp_free_proto(proto);
+            break;
+        }
+    }
+}
+END_TEST
+
+
+/* Dispatch an _answer box for `ask_key' */
+static void answer_call(AMP_Proto_T *proto, unsigned int ask_key)
+{
+    if (proto->box != NULL)
+        amp_free_box(proto->box);
+    proto->box = amp_new_box();
+    amp_put_uint(proto->box, ANSWER, ask_key);
+    fail_if( proto->dispatch_box(proto, proto->box) );
+}
+
+START_TEST(test__amp_pipeline)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Pipeline_T *pipeline;
+    AMP_Pipeline_Stats_T stats;
+    AMP_Box_T *args, *box;
+    struct saved_result *r;
+    unsigned int firstKey, askKey;
+    long i;
+    int n;
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    pipeline = amp_new_pipeline(proto, 2);
+    firstKey = proto->last_ask_key + 1;
+
+    for (i = 0; i < 5; i++)
+    {
+        args = amp_new_box();
+        amp_put_int(args, "i", i);
+        fail_if( amp_pipeline_call(pipeline, "Cmd", args, save_result_cb,
+                                   (void *)i) );
+        amp_free_box(args); /* the pipeline keeps queued arguments */
+    }
+
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.in_flight == 2 && stats.queued == 3 );
+    fail_unless( stats.sent == 2 && stats.completed == 0 );
+    fail_unless( List_length(saved_writes) == 2 );
+    amp_free_box(pop_written_box(proto));
+    amp_free_box(pop_written_box(proto));
+
+    /* each answer makes room for the next queued call, in order */
+    for (i = 0; i < 5; i++)
+    {
+        answer_call(proto, firstKey + i);
+
+        fail_unless( List_length(saved_results) == 1 );
+        saved_results = List_pop(saved_results, (void**)&r);
+        fail_unless( r->result->reason == AMP_SUCCESS );
+        fail_unless( r->callback_arg == (void *)i );
+        amp_free_result(r->result);
+        free(r);
+
+        if (i + 2 < 5)
+        {
+            fail_unless( List_length(saved_writes) == 1 );
+            box = pop_written_box(proto);
+            fail_if( amp_get_uint(box, ASK, &askKey) );
+            fail_unless( askKey == firstKey + i + 2 );
+            fail_if( amp_get_int(box, "i", &n) );
+            fail_unless( n == i + 2 );
+            amp_free_box(box);
+        }
+        else
+            fail_unless( List_length(saved_writes) == 0 );
+    }
+
+    amp_pipeline_stats(pipeline, &stats, 1);
+    fail_unless( stats.in_flight == 0 && stats.queued == 0 );
+    fail_unless( stats.sent == 5 && stats.completed == 5 &&
+                 stats.failed == 0 );
+
+    /* the counters were reset */
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.sent == 0 && stats.completed == 0 );
+
+    amp_free_pipeline(pipeline);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_pipeline__set_window)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Pipeline_T *pipeline;
+    AMP_Pipeline_Stats_T stats;
+    int i;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    pipeline = amp_new_pipeline(proto, 1);
+
+    for (i = 0; i < 4; i++)
+        fail_if( amp_pipeline_call(pipeline, "Cmd", NULL, save_result_cb,
+                                   NULL) );
+
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.in_flight == 1 && stats.queued == 3 );
+
+    fail_if( amp_pipeline_set_window(pipeline, 3) );
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.in_flight == 3 && stats.queued == 1 );
+
+    /* shrinking the window doesn't affect calls in flight */
+    fail_if( amp_pipeline_set_window(pipeline, 1) );
+    answer_call(proto, proto->last_ask_key);
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.in_flight == 2 && stats.queued == 1 );
+
+    amp_free_pipeline(pipeline);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_pipeline__write_failure)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Pipeline_T *pipeline;
+    AMP_Pipeline_Stats_T stats;
+    unsigned int askKey;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    pipeline = amp_new_pipeline(proto, 1);
+
+    fail_if( amp_pipeline_call(pipeline, "Cmd", NULL, save_result_cb,
+                               (void *)1) );
+    askKey = proto->last_ask_key;
+    fail_if( amp_pipeline_call(pipeline, "Cmd", NULL, save_result_cb,
+                               (void *)2) );
+
+    /* the queued call can't be made when the first one completes... */
+    amp_set_write_handler(proto, failing_write_handler, NULL);
+    answer_call(proto, askKey);
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.in_flight == 0 && stats.queued == 1 );
+    fail_unless( amp_pipeline_fill(pipeline) != 0 );
+
+    /* ...so it stays queued until it can be */
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    fail_if( amp_pipeline_fill(pipeline) );
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.in_flight == 1 && stats.queued == 0 );
+
+    /* a call that fails to be made straight away isn't queued */
+    amp_set_write_handler(proto, failing_write_handler, NULL);
+    fail_unless( amp_pipeline_set_window(pipeline, 2) == 0 );
+    fail_unless( amp_pipeline_call(pipeline, "Cmd", NULL, save_result_cb,
+                                   (void *)3) != 0 );
+    amp_pipeline_stats(pipeline, &stats, 0);
+    fail_unless( stats.in_flight == 1 && stats.queued == 0 );
+
+    amp_free_pipeline(pipeline);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_free_pipeline)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Pipeline_T *pipeline;
+    AMP_Box_T *args = amp_new_box();
+    struct saved_result *r;
+    int i;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    pipeline = amp_new_pipeline(proto, 2);
+
+    amp_put_int(args, "a", 1);
+    for (i = 0; i < 5; i++)
+        fail_if( amp_pipeline_call(pipeline, "Cmd", args, save_result_cb,
+                                   NULL) );
+    amp_free_box(args);
+
+    /* calls in flight and queued alike are cancelled */
+    amp_free_pipeline(pipeline);
+
+    fail_unless( List_length(saved_results) == 5 );
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 0 );
+    while (saved_results != NULL)
+    {
+        saved_results = List_pop(saved_results, (void**)&r);
+        fail_unless( r->result->reason == AMP_CANCEL );
+        amp_free_result(r->result);
+        free(r);
+    }
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_pipeline__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto;
+    AMP_Pipeline_T *pipeline;
+    AMP_Pipeline_Stats_T stats;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+        amp_set_write_handler(proto, discarding_write_handler, NULL);
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = ENOMEM;
+        if ( (pipeline = amp_new_pipeline(proto, 1)) != NULL &&
+             (result = amp_pipeline_call(pipeline, "A", NULL, junk_callback,
+                                         NULL)) == 0)
+            result = amp_pipeline_call(pipeline, "B", NULL, junk_callback,
+                                       NULL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            if (pipeline != NULL)
+                amp_free_pipeline(pipeline);
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            amp_pipeline_stats(pipeline, &stats, 0);
+            fail_unless( stats.in_flight == 1 && stats.queued == 1 );
+            amp_free_pipeline(pipeline);
+            amp_free_proto(proto);
+            break;
+        }
+    }
+}
+END_TEST
+
+
+/* A box of arguments {"a": a, "b": b}, built in either order */
+static AMP_Box_T *ab_args(int a, int b, int b_first)
+{
+    AMP_Box_T *args = amp_new_box();
+
+    if (b_first)
+        amp_put_int(args, "b", b);
+    amp_put_int(args, "a", a);
+    if (!b_first)
+        amp_put_int(args, "b", b);
+    return args;
+}
+
+static void dispatch_answer(AMP_Proto_T *proto, unsigned int ask_key,
+                            int value)
+{
+    if (proto->box != NULL)
+        amp_free_box(proto->box);
+    proto->box = amp_new_box();
+    amp_put_uint(proto->box, ANSWER, ask_key);
+    amp_put_int(proto->box, "v", value);
+    fail_if( proto->dispatch_box(proto, proto->box) );
+}
+
+START_TEST(test__amp_call_coalesced)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *args;
+    AMP_Result_T *seen[100];
+    struct saved_result *r;
+    unsigned int askKey, otherKey, key;
+    int i, j, value;
+
+    amp_set_write_handler(proto, save_writes, NULL);
+
+    /* identical calls, however their arguments were built, make one call */
+    for (i = 0; i < 100; i++)
+    {
+        args = ab_args(1, 2, i % 2);
+        fail_if( amp_call_coalesced(proto, "Cmd", args, save_result_cb,
+                                    (void *)(long)i, &key) );
+        amp_free_box(args);
+
+        if (i == 0)
+            askKey = key;
+        fail_unless( key == askKey );
+    }
+    fail_unless( List_length(saved_writes) == 1 );
+    amp_free_box(pop_written_box(proto));
+
+    /* different arguments, or a different command, make a new call */
+    args = ab_args(1, 3, 0);
+    fail_if( amp_call_coalesced(proto, "Cmd", args, save_result_cb, NULL,
+                                &otherKey) );
+    fail_if( otherKey == askKey );
+    fail_if( amp_call_coalesced(proto, "Other", args, save_result_cb, NULL,
+                                NULL) );
+    amp_free_box(args);
+    fail_unless( List_length(saved_writes) == 2 );
+    fail_unless( _amp_coalesced_calls_length(proto->coalesced_calls) == 3 );
+
+    /* every waiter gets a result of its own, in the order they called */
+    dispatch_answer(proto, askKey, 42);
+    fail_unless( List_length(saved_results) == 100 );
+    fail_unless( _amp_coalesced_calls_length(proto->coalesced_calls) == 2 );
+
+    for (i = 99; i >= 0; i--)
+    {
+        saved_results = List_pop(saved_results, (void**)&r);
+        fail_unless( r->callback_arg == (void *)(long)i );
+        fail_unless( r->result->reason == AMP_SUCCESS );
+        fail_unless( r->result->response->answer_key == askKey );
+        fail_if( amp_get_int(r->result->response->args, "v", &value) );
+        fail_unless( value == 42 );
+
+        for (j = 99; j > i; j--)
+            fail_if( seen[j] == r->result );
+        seen[i] = r->result;
+
+        /* the response is shared, so it outlives all but the last of
+         * these */
+        amp_free_result(r->result);
+        free(r);
+    }
+
+    /* once answered, the same call is made afresh */
+    args = ab_args(1, 2, 0);
+    fail_if( amp_call_coalesced(proto, "Cmd", args, save_result_cb, NULL,
+                                &key) );
+    amp_free_box(args);
+    fail_if( key == askKey );
+    fail_unless( List_length(saved_writes) == 3 );
+
+    /* cancelling a coalesced call cancels it for every waiter */
+    args = ab_args(1, 3, 1);
+    fail_if( amp_call_coalesced(proto, "Cmd", args, save_result_cb, NULL,
+                                NULL) );
+    amp_free_box(args);
+    fail_if( amp_cancel(proto, otherKey) );
+    fail_unless( List_length(saved_results) == 2 );
+    while (saved_results != NULL)
+    {
+        saved_results = List_pop(saved_results, (void**)&r);
+        fail_unless( r->result->reason == AMP_CANCEL );
+        amp_free_result(r->result);
+        free(r);
+    }
+
+    /* and so does freeing the proto */
+    args = ab_args(1, 2, 1);
+    fail_if( amp_call_coalesced(proto, "Cmd", args, save_result_cb, NULL,
+                                NULL) );
+    amp_free_box(args);
+    amp_free_proto(proto);
+
+    fail_unless( List_length(saved_results) == 3 );
+    while (saved_results != NULL)
+    {
+        saved_results = List_pop(saved_results, (void**)&r);
+        fail_unless( r->result->reason == AMP_CANCEL );
+        free(r);
+    }
+
+    while (saved_writes != NULL)
+    {
+        struct saved_write *write;
+        saved_writes = List_pop(saved_writes, (void**)&write);
+        free(write->chunk->value);
+        amp_free_chunk(write->chunk);
+        free(write);
+    }
+}
+END_TEST
+
+
+START_TEST(test__amp_call_coalesced__error)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    struct saved_result *r;
+    unsigned int askKey;
+    int i;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+
+    for (i = 0; i < 3; i++)
+        fail_if( amp_call_coalesced(proto, "Cmd", NULL, save_result_cb, NULL,
+                                    &askKey) );
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 1 );
+
+    amp_free_box(proto->box);
+    proto->box = amp_new_box();
+    amp_put_uint(proto->box, _ERROR, askKey);
+    amp_put_cstring(proto->box, ERROR_CODE, "BAD");
+    fail_if( proto->dispatch_box(proto, proto->box) );
+
+    fail_unless( List_length(saved_results) == 3 );
+    while (saved_results != NULL)
+    {
+        saved_results = List_pop(saved_results, (void**)&r);
+        fail_unless( r->result->reason == AMP_ERROR );
+        fail_unless( r->result->error->error_code->size == 3 );
+        fail_if( memcmp(r->result->error->error_code->value, "BAD", 3) );
+        amp_free_result(r->result);
+        free(r);
+    }
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+/* Saves results without allocating, for use while mallocs are failing */
+static AMP_Result_T *stored_results[8];
+static int num_stored_results;
+
+static void store_result_cb(AMP_Proto_T *proto, AMP_Result_T *result,
+                            void *callback_arg)
+{
+    (void)proto;
+    (void)callback_arg;
+    stored_results[num_stored_results++] = result;
+}
+
+START_TEST(test__amp_call_coalesced__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result, i;
+    AMP_Proto_T *proto;
+    AMP_Box_T *args = ab_args(1, 2, 0);
+    struct saved_result *r;
+    unsigned int askKey;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+        amp_set_write_handler(proto, discarding_write_handler, NULL);
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        for (i = 0; i < 3; i++)
+            if ( (result = amp_call_coalesced(proto, "Cmd", args,
+                                              save_result_cb, NULL,
+                                              &askKey)) != 0)
+                break;
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+
+            /* the calls made before the failure are still coalesced */
+            amp_free_proto(proto);
+            fail_unless( List_length(saved_results) == i );
+            while (saved_results != NULL)
+            {
+                saved_results = List_pop(saved_results, (void**)&r);
+                free(r);
+            }
+        }
+        else
+        {
+            fail_unless(result == 0);
+            fail_unless( _amp_callback_map_length(
+                             proto->outstanding_requests) == 1 );
+            amp_free_proto(proto);
+            fail_unless( List_length(saved_results) == 3 );
+            while (saved_results != NULL)
+            {
+                saved_results = List_pop(saved_results, (void**)&r);
+                free(r);
+            }
+            break;
+        }
+    }
+
+    /* if the results can't be allocated, the waiters share one */
+    proto = amp_new_proto();
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    for (i = 0; i < 3; i++)
+        fail_if( amp_call_coalesced(proto, "Cmd", args, store_result_cb,
+                                    NULL, &askKey) );
+    num_stored_results = 0;
+
+    amp_free_box(proto->box);
+    proto->box = amp_new_box();
+    amp_put_uint(proto->box, ANSWER, askKey);
+    enable_malloc_failures(0);
+    fail_if( proto->dispatch_box(proto, proto->box) );
+    disable_malloc_failures();
+    fail_unless( allocation_failure_occurred );
+
+    fail_unless( num_stored_results == 3 );
+    for (i = 0; i < 3; i++)
+    {
+        fail_unless( stored_results[i] == stored_results[0] );
+        fail_unless( stored_results[i]->reason == AMP_SUCCESS );
+        amp_free_result(stored_results[i]);
+    }
+
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+static int gather_done_calls;
+static int gather_successes;
+
+static void gather_done(AMP_Gather_T *gather, int successes, void *done_arg)
+{
+    gather_done_calls++;
+    gather_successes = successes;
+    fail_unless( amp_gather_finished(gather) );
+    fail_unless( done_arg == (void *)&gather_done_calls );
+}
+
+START_TEST(test__amp_gather)
+{
+    AMP_Proto_T *proto1 = amp_new_proto();
+    AMP_Proto_T *proto2 = amp_new_proto();
+    AMP_Gather_T *gather;
+    AMP_Result_T *result;
+    unsigned int key1, key2, key3;
+    int i, value;
+
+    amp_set_write_handler(proto1, discarding_write_handler, NULL);
+    amp_set_write_handler(proto2, discarding_write_handler, NULL);
+    gather_done_calls = 0;
+
+    /* fan out over two protos, and finish when all results are in */
+    gather = amp_new_gather(3, 0, 0, gather_done, &gather_done_calls);
+    fail_if( amp_gather_call(gather, proto1, "Cmd", NULL) );
+    key1 = proto1->last_ask_key;
+    fail_if( amp_gather_call(gather, proto2, "Cmd", NULL) );
+    key2 = proto2->last_ask_key;
+    fail_if( amp_gather_call(gather, proto1, "Cmd", NULL) );
+    key3 = proto1->last_ask_key;
+    fail_unless( amp_gather_call(gather, proto1, "Cmd", NULL) ==
+                 AMP_GATHER_FULL );
+
+    dispatch_answer(proto1, key3, 3);
+    dispatch_answer(proto2, key2, 2);
+    fail_unless( amp_gather_result(gather, 0) == NULL );
+    fail_unless( gather_done_calls == 0 );
+    fail_if( amp_gather_finished(gather) );
+
+    dispatch_answer(proto1, key1, 1);
+    fail_unless( gather_done_calls == 1 );
+    fail_unless( gather_successes == 3 );
+
+    /* the results are stored in the order the calls were made */
+    for (i = 0; i < 3; i++)
+    {
+        result = amp_gather_result(gather, i);
+        fail_unless( result->reason == AMP_SUCCESS );
+        fail_if( amp_get_int(result->response->args, "v", &value) );
+        fail_unless( value == i + 1 );
+    }
+    fail_unless( amp_gather_result(gather, 3) == NULL );
+    fail_unless( amp_gather_call(gather, proto1, "Cmd", NULL) ==
+                 AMP_GATHER_FULL );
+    amp_free_gather(gather);
+
+    /* a quorum finishes the gather early, cancelling the other calls */
+    gather = amp_new_gather(3, 2, 0, gather_done, &gather_done_calls);
+    fail_if( amp_gather_call(gather, proto1, "Cmd", NULL) );
+    key1 = proto1->last_ask_key;
+    fail_if( amp_gather_call(gather, proto2, "Cmd", NULL) );
+    key2 = proto2->last_ask_key;
+    fail_if( amp_gather_call(gather, proto2, "Cmd", NULL) );
+
+    dispatch_answer(proto2, key2, 2);
+    dispatch_answer(proto1, key1, 1);
+    fail_unless( gather_done_calls == 2 );
+    fail_unless( gather_successes == 2 );
+    fail_unless( amp_gather_result(gather, 2)->reason == AMP_CANCEL );
+    fail_unless( _amp_callback_map_length(proto2->outstanding_requests) == 0 );
+    amp_free_gather(gather);
+
+    /* freeing an unfinished gather cancels its calls quietly */
+    gather = amp_new_gather(2, 0, 0, gather_done, &gather_done_calls);
+    fail_if( amp_gather_call(gather, proto1, "Cmd", NULL) );
+    dispatch_answer(proto1, proto1->last_ask_key, 1);
+    fail_if( amp_gather_call(gather, proto2, "Cmd", NULL) );
+    amp_free_gather(gather);
+    fail_unless( gather_done_calls == 2 );
+    fail_unless( _amp_callback_map_length(proto2->outstanding_requests) == 0 );
+
+    amp_free_proto(proto1);
+    amp_free_proto(proto2);
+}
+END_TEST
+
+
+START_TEST(test__amp_gather__deadline)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Gather_T *gather;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_tick(proto, 0);
+    gather_done_calls = 0;
+
+    /* calls time out together... */
+    gather = amp_new_gather(2, 0, 100, gather_done, &gather_done_calls);
+    fail_if( amp_gather_call(gather, proto, "Cmd", NULL) );
+    dispatch_answer(proto, proto->last_ask_key, 1);
+    fail_if( amp_gather_call(gather, proto, "Cmd", NULL) );
+
+    amp_tick(proto, 99);
+    fail_unless( gather_done_calls == 0 );
+    amp_tick(proto, 100);
+    fail_unless( gather_done_calls == 1 );
+    fail_unless( gather_successes == 1 );
+    fail_unless( amp_gather_result(gather, 1)->reason == AMP_TIMEOUT );
+    amp_free_gather(gather);
+
+    /* ...a failure that rules out the quorum finishes the gather... */
+    gather = amp_new_gather(3, 3, 100, gather_done, &gather_done_calls);
+    fail_if( amp_gather_call(gather, proto, "Cmd", NULL) );
+    amp_set_write_handler(proto, failing_write_handler, NULL);
+    fail_unless( amp_gather_call(gather, proto, "Cmd", NULL) != 0 );
+    fail_unless( gather_done_calls == 2 );
+    fail_unless( gather_successes == 0 );
+    fail_unless( amp_gather_result(gather, 0)->reason == AMP_CANCEL );
+    fail_unless( amp_gather_result(gather, 1)->reason == AMP_CANCEL );
+    fail_unless( amp_gather_call(gather, proto, "Cmd", NULL) ==
+                 AMP_GATHER_FULL );
+    amp_free_gather(gather);
+
+    /* ...as does the application */
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    gather = amp_new_gather(3, 0, 0, gather_done, &gather_done_calls);
+    fail_if( amp_gather_call(gather, proto, "Cmd", NULL) );
+    amp_gather_finish(gather);
+    fail_unless( gather_done_calls == 3 );
+    amp_gather_finish(gather);
+    fail_unless( gather_done_calls == 3 );
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 0 );
+    amp_free_gather(gather);
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_gather__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto;
+    AMP_Gather_T *gather;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+        amp_set_write_handler(proto, discarding_write_handler, NULL);
+        gather_done_calls = 0;
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = ENOMEM;
+        if ( (gather = amp_new_gather(2, 0, 0, gather_done,
+                                      &gather_done_calls)) != NULL &&
+             (result = amp_gather_call(gather, proto, "Cmd", NULL)) == 0)
+            result = amp_gather_call(gather, proto, "Cmd", NULL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            if (gather != NULL)
+                amp_free_gather(gather);
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            break;
+        }
+    }
+
+    fail_unless( gather_done_calls == 0 );
+    amp_free_gather(gather);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+/* A coroutine that adds up the values answered to a run of calls */
+struct co_session
+{
+    AMP_Proto_T *proto;
+    int calls;           /* how many calls to make */
+    int made;
+    int total;
+    int finished;
+    int error;           /* from amp_co_call(), if it failed */
+    enum amp_result_reason last_reason;
+};
+
+static void co_session(void *arg)
+{
+    struct co_session *session = arg;
+    AMP_Result_T *result;
+    int value;
+
+    for (session->made = 0; session->made < session->calls; session->made++)
+    {
+        if ( (session->error = amp_co_call(session->proto, "Cmd", NULL,
+                                           &result)) != 0)
+            break;
+        session->last_reason = result->reason;
+        if (result->reason != AMP_SUCCESS)
+        {
+            amp_free_result(result);
+            break;
+        }
+
+        fail_if( amp_get_int(result->response->args, "v", &value) );
+        session->total += value;
+        amp_free_result(result);
+    }
+    session->finished = 1;
+}
+
+START_TEST(test__amp_co_call)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Co_Pool_T *pool = amp_new_co_pool(0, 2);
+    struct co_session sessions[3];
+    AMP_Result_T *result;
+    unsigned int firstKey;
+    int i;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    memset(sessions, 0, sizeof(sessions));
+
+    /* not from outside a coroutine */
+    fail_unless( amp_co_call(proto, "Cmd", NULL, &result) ==
+                 AMP_NOT_IN_COROUTINE );
+
+    /* each coroutine runs until its first call */
+    firstKey = proto->last_ask_key + 1;
+    for (i = 0; i < 3; i++)
+    {
+        sessions[i].proto = proto;
+        sessions[i].calls = 2;
+        fail_if( amp_co_spawn(pool, co_session, &sessions[i]) );
+        fail_unless( sessions[i].made == 0 );
+    }
+    fail_unless( proto->last_ask_key == firstKey + 2 );
+
+    /* an answer resumes its coroutine, which makes its next call */
+    dispatch_answer(proto, firstKey + 1, 10);
+    fail_unless( sessions[1].made == 1 );
+    fail_unless( proto->last_ask_key == firstKey + 3 );
+    dispatch_answer(proto, firstKey + 3, 5);
+    fail_unless( sessions[1].finished );
+    fail_unless( sessions[1].total == 15 );
+    fail_if( sessions[0].finished || sessions[2].finished );
+
+    /* returned coroutines are kept for re-use */
+    fail_unless( _amp_co_pool_idle(pool) == 1 );
+    memset(&sessions[1], 0, sizeof(sessions[1]));
+    sessions[1].proto = proto;
+    sessions[1].calls = 1;
+    fail_if( amp_co_spawn(pool, co_session, &sessions[1]) );
+    fail_unless( _amp_co_pool_idle(pool) == 0 );
+
+    /* freeing the proto resumes the rest with cancelled calls */
+    amp_free_proto(proto);
+    for (i = 0; i < 3; i++)
+    {
+        fail_unless( sessions[i].finished );
+        fail_unless( sessions[i].last_reason == AMP_CANCEL );
+    }
+    fail_unless( _amp_co_pool_idle(pool) == 2 ); /* the limit */
+
+    amp_free_co_pool(pool);
+}
+END_TEST
+
+
+/* Answers every call as soon as it is written, with a "v" of 1 */
+static int answering_write_handler(AMP_Proto_T *proto, unsigned char *buf,
+                                   int bufSize, void *write_arg)
+{
+    (void)bufSize;
+    (void)write_arg;
+    free(buf);
+    dispatch_answer(proto, proto->last_ask_key, 1);
+    return 0;
+}
+
+START_TEST(test__amp_co_call__answered_synchronously)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Co_Pool_T *pool = amp_new_co_pool(0, 1);
+    struct co_session session;
+
+    amp_set_write_handler(proto, answering_write_handler, NULL);
+    memset(&session, 0, sizeof(session));
+    session.proto = proto;
+    session.calls = 3;
+
+    /* the coroutine never has to suspend */
+    fail_if( amp_co_spawn(pool, co_session, &session) );
+    fail_unless( session.finished );
+    fail_unless( session.error == 0 );
+    fail_unless( session.total == 3 );
+    fail_unless( _amp_co_pool_idle(pool) == 1 );
+
+    amp_free_co_pool(pool);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_co_call__many)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Co_Pool_T *pool = amp_new_co_pool(16 * 1024, 1000);
+    struct co_session *sessions;
+    unsigned int firstKey, key;
+    int i;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    sessions = calloc(1000, sizeof(*sessions));
+
+    firstKey = proto->last_ask_key + 1;
+    for (i = 0; i < 1000; i++)
+    {
+        sessions[i].proto = proto;
+        sessions[i].calls = 3;
+        fail_if( amp_co_spawn(pool, co_session, &sessions[i]) );
+    }
+
+    /* each answer brings the next call from the same coroutine */
+    for (key = firstKey; key < firstKey + 3000; key++)
+        dispatch_answer(proto, key, 1);
+
+    for (i = 0; i < 1000; i++)
+    {
+        fail_unless( sessions[i].finished );
+        fail_unless( sessions[i].total == 3 );
+    }
+    fail_unless( _amp_co_pool_idle(pool) == 1000 );
+
+    free(sessions);
+    amp_free_co_pool(pool);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_co_spawn__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Co_Pool_T *pool;
+    struct co_session session;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+
+    while (1)
+    {
+        memset(&session, 0, sizeof(session));
+        session.proto = proto;
+        session.calls = 1;
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = ENOMEM;
+        if ( (pool = amp_new_co_pool(0, 1)) != NULL)
+            result = amp_co_spawn(pool, co_session, &session);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            /* the call itself may fail, and end the coroutine */
+            if (result == 0)
+                fail_unless( session.finished && session.error == ENOMEM );
+            else
+                fail_unless( result == ENOMEM );
+            if (pool != NULL)
+                amp_free_co_pool(pool);
+        }
+        else
+        {
+            fail_unless( result == 0 );
+            break;
+        }
+    }
+
+    dispatch_answer(proto, proto->last_ask_key, 7);
+    fail_unless( session.finished && session.total == 7 );
+
+    amp_free_co_pool(pool);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+static int sum_calls;
+
+static void counting_sum_responder(AMP_Proto_T *proto, AMP_Request_T *request,
+                                   void *responder_arg)
+{
+    long long a, b;
+    AMP_Box_T *answer = amp_new_box();
+
+    sum_calls++;
+    fail_if( amp_get_long_long(request->args, "a", &a) );
+    fail_if( amp_get_long_long(request->args, "b", &b) );
+    amp_put_long_long(answer, "total", a + b);
+    fail_if( amp_respond(proto, request, answer) );
+
+    amp_free_box(answer);
+    amp_free_request(request);
+}
+
+/* Feed `proto' a Sum request, putting the arguments in the given order */
+static void send_sum(AMP_Proto_T *proto, const char *ask_key,
+                     long long a, long long b, int b_first)
+{
+    AMP_Box_T *args = amp_new_box();
+    unsigned char *buf;
+    int size;
+
+    if (b_first)
+        amp_put_long_long(args, "b", b);
+    amp_put_long_long(args, "a", a);
+    if (!b_first)
+        amp_put_long_long(args, "b", b);
+
+    fail_if( _amp_serialize_call(args, "Sum", ask_key, NULL, &buf, &size) );
+    fail_if( amp_consume_bytes(proto, buf, size) );
+
+    free(buf);
+    amp_free_box(args);
+}
+
+/* Check the last answer written was `total' for `ask_key' */
+static void check_sum_answer(AMP_Proto_T *proto, unsigned int ask_key,
+                             long long total)
+{
+    AMP_Box_T *box;
+    unsigned int answerKey;
+    long long written;
+
+    fail_unless( List_length(saved_writes) == 1 );
+    box = pop_written_box(proto);
+    fail_unless( amp_num_keys(box) == 2 );
+    fail_if( amp_get_uint(box, ANSWER, &answerKey) );
+    fail_unless( answerKey == ask_key );
+    fail_if( amp_get_long_long(box, "total", &written) );
+    fail_unless( written == total );
+    amp_free_box(box);
+}
+
+START_TEST(test__response_cache)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *box;
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    amp_add_responder(proto, "Sum", counting_sum_responder, NULL);
+    fail_if( amp_set_response_cache(proto, "Sum", 1000, 4096) );
+    sum_calls = 0;
+
+    send_sum(proto, "1", 5, 7, 0);
+    fail_unless( sum_calls == 1 );
+    check_sum_answer(proto, 1, 12);
+
+    /* the same arguments, in a different order, are answered from the
+     * cache - parsing the next request in to the same box */
+    box = proto->box;
+    send_sum(proto, "2", 5, 7, 1);
+    fail_unless( sum_calls == 1 );
+    check_sum_answer(proto, 2, 12);
+    fail_unless( proto->box == box );
+    fail_unless( amp_num_keys(proto->box) == 0 );
+
+    /* different arguments aren't */
+    send_sum(proto, "3", 5, 8, 0);
+    fail_unless( sum_calls == 2 );
+    check_sum_answer(proto, 3, 13);
+    fail_unless( _amp_response_cache_length(proto->response_cache) == 2 );
+
+    /* answers written while corked go straight in to the output buffer */
+    amp_cork(proto);
+    send_sum(proto, "4", 5, 7, 0);
+    send_sum(proto, "5", 5, 8, 0);
+    fail_unless( List_length(saved_writes) == 0 );
+    fail_if( amp_uncork(proto) );
+    fail_unless( sum_calls == 2 );
+    fail_unless( List_length(saved_writes) == 1 );
+    free(((struct saved_write *)saved_writes->first)->chunk->value);
+    free(((struct saved_write *)saved_writes->first)->chunk);
+    free(saved_writes->first);
+    List_free(&saved_writes);
+
+    /* cached answers expire */
+    amp_tick(proto, 0);
+    amp_tick(proto, 999);
+    send_sum(proto, "6", 5, 7, 0);
+    fail_unless( sum_calls == 2 );
+    check_sum_answer(proto, 6, 12);
+
+    amp_tick(proto, 1000);
+    send_sum(proto, "7", 5, 7, 0);
+    fail_unless( sum_calls == 3 );
+    check_sum_answer(proto, 7, 12);
+
+    /* other commands aren't cached */
+    amp_add_responder(proto, "Add", counting_sum_responder, NULL);
+    box = amp_new_box();
+    amp_put_long_long(box, "a", 1);
+    amp_put_long_long(box, "b", 1);
+    fail_if( amp_call(proto, "Add", box, junk_callback, NULL, NULL) );
+    amp_free_box(pop_written_box(proto));
+    amp_free_box(box);
+    fail_unless( _amp_response_cache_length(proto->response_cache) == 2 );
+
+    /* turning caching off drops the cached answers */
+    fail_if( amp_set_response_cache(proto, "Sum", 0, 0) );
+    fail_unless( _amp_response_cache_length(proto->response_cache) == 0 );
+    send_sum(proto, "8", 5, 7, 0);
+    fail_unless( sum_calls == 4 );
+    check_sum_answer(proto, 8, 12);
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__response_cache__budget)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    int i, before;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_add_responder(proto, "Sum", counting_sum_responder, NULL);
+    fail_if( amp_set_response_cache(proto, "Sum", 1000, 1000000) );
+    sum_calls = 0;
+
+    for (i = 0; i < 100; i++)
+        send_sum(proto, "1", i, i, 0);
+    fail_unless( _amp_response_cache_length(proto->response_cache) == 100 );
+
+    /* shrinking the budget evicts the least recently used answers */
+    send_sum(proto, "1", 0, 0, 0);
+    fail_if( amp_set_response_cache(proto, "Sum", 1000, 1000) );
+    fail_unless( _amp_response_cache_length(proto->response_cache) > 0 );
+    fail_unless( _amp_response_cache_length(proto->response_cache) < 100 );
+
+    before = sum_calls;
+    send_sum(proto, "1", 0, 0, 0);
+    fail_unless( sum_calls == before );
+    send_sum(proto, "1", 1, 1, 0);
+    fail_unless( sum_calls == before + 1 );
+
+    /* the cache stays within budget however many answers are made */
+    for (i = 0; i < 1000; i++)
+        send_sum(proto, "1", i, i, 0);
+    fail_unless( _amp_response_cache_length(proto->response_cache) < 100 );
+
+    /* an answer which doesn't fit in the budget at all isn't cached */
+    fail_if( amp_set_response_cache(proto, "Sum", 1000, 10) );
+    fail_unless( _amp_response_cache_length(proto->response_cache) == 0 );
+    send_sum(proto, "1", 0, 0, 0);
+    fail_unless( _amp_response_cache_length(proto->response_cache) == 0 );
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__box_canonical)
+{
+    /* enough keys that some must share a bucket */
+    AMP_Box_T *box1 = amp_new_box();
+    AMP_Box_T *box2 = amp_new_box();
+    unsigned char *buf;
+    int size, i;
+    char key[16];
+
+    for (i = 0; i < 300; i++)
+    {
+        sprintf(key, "k%d", i);
+        amp_put_int(box1, key, i);
+
+        sprintf(key, "k%d", 299 - i);
+        amp_put_int(box2, key, 299 - i);
+    }
+    amp_put_cstring(box1, ASK, "1");
+    amp_put_cstring(box2, ASK, "2"); /* not part of the canonical form */
+
+    fail_unless( _amp_box_digest(box1) == _amp_box_digest(box2) );
+    fail_if( _amp_box_canonical(box1, &buf, &size) );
+    fail_unless( _amp_box_canonical_equal(box2, buf, size) );
+
+    amp_put_int(box2, "k0", 1);
+    fail_if( _amp_box_digest(box1) == _amp_box_digest(box2) );
+    fail_if( _amp_box_canonical_equal(box2, buf, size) );
+    fail_if( _amp_box_canonical_equal(box1, buf, size - 1) );
+
+    free(buf);
+    amp_free_box(box1);
+    amp_free_box(box2);
+}
+END_TEST
+
+
+START_TEST(test__response_cache__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_set_response_cache(proto, "Sum", 1000, 4096);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            fail_unless( proto->response_cache == NULL ||
+                         _amp_get_cache_policy(proto->response_cache,
+                                               &(AMP_Chunk_T){
+                                                   (unsigned char *)"Sum", 3})
+                         == NULL );
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            amp_free_proto(proto);
+            break;
+        }
+    }
+}
+END_TEST
+
+
+static pthread_t main_thread;
+static int ran_on_main;
+static int release_responders;
+
+static void async_sum_responder(AMP_Proto_T *proto, AMP_Request_T *request,
+                                void *responder_arg)
+{
+    long long a, b;
+    AMP_Box_T *answer = amp_new_box();
+
+    (void)responder_arg;
+    if (pthread_equal(pthread_self(), main_thread))
+        ran_on_main = 1;
+
+    /* hold the request until the test lets go */
+    while (!__atomic_load_n(&release_responders, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    fail_if( amp_get_long_long(request->args, "a", &a) );
+    fail_if( amp_get_long_long(request->args, "b", &b) );
+    amp_put_long_long(answer, "total", a + b);
+    fail_if( amp_respond(proto, request, answer) );
+
+    amp_free_box(answer);
+    amp_free_request(request);
+}
+
+static void count_wakeup(void *wakeup_arg)
+{
+    __atomic_add_fetch((int *)wakeup_arg, 1, __ATOMIC_SEQ_CST);
+}
+
+START_TEST(test__amp_add_responder_async)
+{
+    AMP_Worker_Pool_T *pool = amp_new_worker_pool(4);
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Proto_T *reader = amp_new_proto();
+    AMP_Box_T *box;
+    struct saved_write *write;
+    char ask[16];
+    char seen[201];
+    unsigned int answerKey;
+    long long total;
+    int i, offset, consumed, answers = 0, wakeups = 0, waited = 0;
+
+    main_thread = pthread_self();
+    ran_on_main = 0;
+    release_responders = 1;
+    memset(seen, 0, sizeof(seen));
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    fail_if( amp_add_responder_async(proto, pool, "Sum", async_sum_responder,
+                                     NULL) );
+    fail_if( amp_set_wakeup_handler(proto, count_wakeup, &wakeups) );
+
+    /* nothing to write yet */
+    fail_if( amp_drain_completions(proto) );
+    fail_unless( saved_writes == NULL );
+
+    for (i = 1; i <= 200; i++)
+    {
+        sprintf(ask, "%d", i);
+        send_sum(proto, ask, i, i, i % 2);
+    }
+
+    /* the answers are only written when drained, on this thread */
+    while (answers < 200)
+    {
+        fail_unless( waited++ < 10000 );
+        usleep(1000);
+        fail_if( amp_drain_completions(proto) );
+
+        while (saved_writes != NULL)
+        {
+            saved_writes = List_pop(saved_writes, (void**)&write);
+            for (offset = 0; offset < write->chunk->size; offset += consumed)
+            {
+                box = amp_new_box();
+                fail_unless( amp_parse_box(reader, box, &consumed,
+                                           write->chunk->value + offset,
+                                           write->chunk->size - offset) );
+                fail_if( amp_get_uint(box, ANSWER, &answerKey) );
+                fail_unless( answerKey >= 1 && answerKey <= 200 );
+                fail_if( seen[answerKey] );
+                seen[answerKey] = 1;
+                fail_if( amp_get_long_long(box, "total", &total) );
+                fail_unless( total == answerKey * 2 );
+                amp_free_box(box);
+                answers++;
+            }
+            free(write->chunk->value);
+            amp_free_chunk(write->chunk);
+            free(write);
+        }
+    }
+
+    fail_if( ran_on_main );
+    fail_unless( wakeups >= 1 && wakeups <= 200 );
+
+    amp_free_worker_pool(pool);
+    amp_free_proto(proto);
+    amp_free_proto(reader);
+}
+END_TEST
+
+
+START_TEST(test__amp_add_responder_async__proto_freed)
+{
+    /* a proto may go away while its requests are with the pool */
+    AMP_Worker_Pool_T *pool = amp_new_worker_pool(2);
+    AMP_Proto_T *proto = amp_new_proto();
+    int i, wakeups = 0;
+
+    release_responders = 0;
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    fail_if( amp_add_responder_async(proto, pool, "Sum", async_sum_responder,
+                                     NULL) );
+    fail_if( amp_set_wakeup_handler(proto, count_wakeup, &wakeups) );
+
+    for (i = 0; i < 10; i++)
+        send_sum(proto, "1", i, i, 0);
+    amp_free_proto(proto);
+
+    /* the answers are discarded, and the handler isn't called */
+    __atomic_store_n(&release_responders, 1, __ATOMIC_RELEASE);
+    amp_free_worker_pool(pool);
+
+    fail_unless( wakeups == 0 );
+    fail_unless( saved_writes == NULL );
+}
+END_TEST
+
+
+START_TEST(test__amp_add_responder_async__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Worker_Pool_T *pool = amp_new_worker_pool(1);
+    AMP_Proto_T *proto;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_add_responder_async(proto, pool, "Sum",
+                                         async_sum_responder, NULL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            fail_unless( proto->responders == NULL ||
+                         _amp_get_responder(proto->responders,
+                                            (unsigned char *)"Sum") == NULL );
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            amp_free_proto(proto);
+            break;
+        }
+    }
+
+    amp_free_worker_pool(pool);
+}
+END_TEST
+
+
+struct caller
+{
+    AMP_Proto_T *proto;
+    int id;
+};
+
+static int off_main_callbacks;
+static int threadsafe_callbacks;
+
+static void threadsafe_cb(AMP_Proto_T *proto, AMP_Result_T *result,
+                          void *callback_arg)
+{
+    int value;
+
+    (void)proto;
+    if (!pthread_equal(pthread_self(), main_thread))
+        off_main_callbacks++;
+
+    fail_unless( result->reason == AMP_SUCCESS );
+    fail_if( amp_get_int(result->response->args, "v", &value) );
+    fail_unless( value == (long)callback_arg );
+    threadsafe_callbacks++;
+    amp_free_result(result);
+}
+
+static void *make_calls(void *arg)
+{
+    struct caller *caller = arg;
+    AMP_Box_T *args = amp_new_box();
+    long i;
+
+    for (i = 0; i < 500; i++)
+    {
+        amp_put_int(args, "t", caller->id);
+        amp_put_int(args, "i", i);
+        fail_if( amp_call_threadsafe(caller->proto, "Cmd", args,
+                                     threadsafe_cb,
+                                     (void *)(caller->id * 1000 + i)) );
+    }
+    amp_free_box(args);
+    return NULL;
+}
+
+START_TEST(test__amp_call_threadsafe)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Proto_T *reader = amp_new_proto();
+    AMP_Box_T *box;
+    struct saved_write *write;
+    struct saved_result *r;
+    struct caller callers[4];
+    pthread_t threads[4];
+    int next[4];
+    unsigned char *command;
+    int commandSize;
+    unsigned int askKey;
+    int i, t, offset, consumed, calls = 0, wakeups = 0;
+
+    main_thread = pthread_self();
+    off_main_callbacks = 0;
+    threadsafe_callbacks = 0;
+
+    amp_set_write_handler(proto, save_writes, NULL);
+
+    fail_unless( amp_call_threadsafe(proto, "Cmd", NULL, threadsafe_cb,
+                                     NULL) == AMP_NO_WAKEUP_HANDLER );
+
+    fail_if( amp_set_wakeup_handler(proto, count_wakeup, &wakeups) );
+
+    for (t = 0; t < 4; t++)
+    {
+        callers[t].proto = proto;
+        callers[t].id = t;
+        fail_if( pthread_create(&threads[t], NULL, make_calls, &callers[t]) );
+    }
+    for (t = 0; t < 4; t++)
+        pthread_join(threads[t], NULL);
+
+    fail_unless( wakeups >= 1 && wakeups <= 2000 );
+    fail_unless( saved_writes == NULL );
+
+    /* every queued call is written at once, with its own ask key, and
+     * the calls from each thread in the order they were made */
+    fail_if( amp_drain_completions(proto) );
+    fail_unless( List_length(saved_writes) == 1 );
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) ==
+                 2000 );
+
+    memset(next, 0, sizeof(next));
+    saved_writes = List_pop(saved_writes, (void**)&write);
+    for (offset = 0; offset < write->chunk->size; offset += consumed)
+    {
+        box = amp_new_box();
+        fail_unless( amp_parse_box(reader, box, &consumed,
+                                   write->chunk->value + offset,
+                                   write->chunk->size - offset) );
+        fail_if( amp_get_bytes(box, COMMAND, &command, &commandSize) );
+        fail_unless( commandSize == 3 && memcmp(command, "Cmd", 3) == 0 );
+        fail_if( amp_get_int(box, "t", &t) );
+        fail_if( amp_get_int(box, "i", &i) );
+        fail_unless( i == next[t]++ );
+        fail_if( amp_get_uint(box, ASK, &askKey) );
+
+        dispatch_answer(proto, askKey, t * 1000 + i);
+        amp_free_box(box);
+        calls++;
+    }
+    free(write->chunk->value);
+    amp_free_chunk(write->chunk);
+    free(write);
+
+    /* the callbacks ran on this thread */
+    fail_unless( calls == 2000 );
+    fail_unless( threadsafe_callbacks == 2000 );
+    fail_unless( off_main_callbacks == 0 );
+
+    /* calls still queued when the proto is free'd are cancelled */
+    for (i = 0; i < 3; i++)
+        fail_if( amp_call_threadsafe(proto, "Cmd", NULL, save_result_cb,
+                                     NULL) );
+    amp_free_proto(proto);
+    fail_unless( saved_writes == NULL );
+
+    fail_unless( List_length(saved_results) == 3 );
+    while (saved_results != NULL)
+    {
+        saved_results = List_pop(saved_results, (void**)&r);
+        fail_unless( r->result->reason == AMP_CANCEL );
+        free(r);
+    }
+
+    amp_free_proto(reader);
+}
+END_TEST
+
+
+START_TEST(test__amp_call_threadsafe__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto;
+    AMP_Box_T *args = amp_new_box();
+
+    amp_put_int(args, "a", 1);
+
+    while (1)
+    {
+        proto = amp_new_proto();
+        amp_set_write_handler(proto, discarding_write_handler, NULL);
+        fail_if( amp_set_wakeup_handler(proto, NULL, NULL) );
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_call_threadsafe(proto, "Cmd", args, store_result_cb,
+                                     NULL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            break;
+        }
+    }
+
+    /* a queued call that can't be made is cancelled */
+    num_stored_results = 0;
+    enable_malloc_failures(0);
+    result = amp_drain_completions(proto);
+    disable_malloc_failures();
+
+    fail_unless( result == ENOMEM );
+    fail_unless( num_stored_results == 1 );
+    fail_unless( stored_results[0]->reason == AMP_CANCEL );
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 0 );
+
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+/* Feed `proto' a request for `command', with no arguments */
+static void send_command(AMP_Proto_T *proto, const char *command)
+{
+    unsigned char *buf;
+    int size;
+
+    fail_if( _amp_serialize_call(NULL, command, "1", NULL, &buf, &size) );
+    fail_if( amp_consume_bytes(proto, buf, size) );
+    free(buf);
+}
+
+/* The order in which recording_responder() saw requests, by the first
+ * letter of each command */
+static char dispatched[128];
+static int num_dispatched;
+
+static void recording_responder(AMP_Proto_T *proto, AMP_Request_T *request,
+                                void *responder_arg)
+{
+    (void)proto;
+    (void)responder_arg;
+    dispatched[num_dispatched++] = request->command->value[0];
+    dispatched[num_dispatched] = '\0';
+    amp_free_request(request);
+}
+
+START_TEST(test__staged_dispatch)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    int i;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_add_responder(proto, "Ping", recording_responder, NULL);
+    amp_add_responder(proto, "Bulk", recording_responder, NULL);
+    amp_add_responder(proto, "Normal", recording_responder, NULL);
+    fail_if( amp_set_command_priority(proto, "Ping", AMP_PRIORITY_CONTROL) );
+    fail_if( amp_set_command_priority(proto, "Bulk", AMP_PRIORITY_BULK) );
+    num_dispatched = 0;
+
+    /* nothing is staged until staged dispatch is turned on */
+    send_command(proto, "Bulk");
+    fail_unless( num_dispatched == 1 );
+    fail_unless( amp_staged_requests(proto) == 0 );
+    num_dispatched = 0;
+
+    fail_if( amp_set_staged_dispatch(proto, 1) );
+    for (i = 0; i < 3; i++)
+        send_command(proto, "Bulk");
+    send_command(proto, "Normal");
+    send_command(proto, "Ping");
+    fail_unless( num_dispatched == 0 );
+    fail_unless( amp_staged_requests(proto) == 5 );
+
+    /* urgent requests first, then FIFO within each class */
+    fail_unless( amp_dispatch_staged(proto, 2) == 2 );
+    fail_unless( strcmp(dispatched, "PN") == 0 );
+    fail_unless( amp_dispatch_staged(proto, 0) == 3 );
+    fail_unless( strcmp(dispatched, "PNBBB") == 0 );
+    fail_unless( amp_staged_requests(proto) == 0 );
+    fail_unless( amp_dispatch_staged(proto, 0) == 0 );
+
+    /* requests for unknown commands are answered with an error in turn */
+    send_command(proto, "Unknown");
+    fail_unless( amp_staged_requests(proto) == 1 );
+    fail_unless( amp_dispatch_staged(proto, 0) == 1 );
+
+    /* the default class can be set again */
+    fail_if( amp_set_command_priority(proto, "Ping", AMP_PRIORITY_NORMAL) );
+    num_dispatched = 0;
+    send_command(proto, "Bulk");
+    send_command(proto, "Ping");
+    fail_unless( amp_dispatch_staged(proto, 0) == 2 );
+    fail_unless( strcmp(dispatched, "PB") == 0 );
+
+    /* requests left queued are dropped with the proto */
+    send_command(proto, "Bulk");
+    send_command(proto, "Ping");
+    fail_if( amp_set_staged_dispatch(proto, 0) );
+    send_command(proto, "Ping");
+    fail_unless( num_dispatched == 3 );
+    fail_unless( amp_staged_requests(proto) == 2 );
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__staged_dispatch__weights)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    int i, normal;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_add_responder(proto, "Bulk", recording_responder, NULL);
+    amp_add_responder(proto, "Normal", recording_responder, NULL);
+    fail_if( amp_set_command_priority(proto, "Bulk", AMP_PRIORITY_BULK) );
+    fail_if( amp_set_staged_dispatch(proto, 1) );
+    num_dispatched = 0;
+
+    /* only the priority classes there are */
+    fail_unless( amp_set_priority_weight(proto, AMP_PRIORITY_CLASSES, 1) ==
+                 AMP_BAD_PRIORITY );
+    fail_unless( amp_set_priority_weight(proto, -1, 1) == AMP_BAD_PRIORITY );
+    fail_unless( amp_set_command_priority(proto, "Normal",
+                                          AMP_PRIORITY_CLASSES) ==
+                 AMP_BAD_PRIORITY );
+
+    for (i = 0; i < 50; i++)
+    {
+        send_command(proto, "Bulk");
+        send_command(proto, "Normal");
+    }
+
+    /* a busy class doesn't starve a less urgent one */
+    fail_unless( amp_dispatch_staged(proto, 30) == 30 );
+    for (i = 0, normal = 0; i < 30; i++)
+        normal += dispatched[i] == 'N';
+    fail_unless( normal == 20 );
+
+    /* the weights can be changed */
+    fail_if( amp_set_priority_weight(proto, AMP_PRIORITY_NORMAL, 1) );
+    fail_if( amp_set_priority_weight(proto, AMP_PRIORITY_BULK, 3) );
+    num_dispatched = 0;
+    fail_unless( amp_dispatch_staged(proto, 40) == 40 );
+    for (i = 0, normal = 0; i < 40; i++)
+        normal += dispatched[i] == 'N';
+    fail_unless( normal == 10 );
+
+    /* an idle class doesn't hold up the others */
+    num_dispatched = 0;
+    fail_unless( amp_dispatch_staged(proto, 0) == 30 );
+    fail_unless( amp_staged_requests(proto) == 0 );
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__staged_dispatch__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    AMP_Proto_T *proto;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_set_command_priority(proto, "Ping",
+                                          AMP_PRIORITY_CONTROL);
+        if (result == 0)
+            result = amp_set_staged_dispatch(proto, 1);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless(result == 0);
+            break;
+        }
+    }
+
+    fail_unless( proto->staged );
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+/* Feed `proto' a request for `command' which must be answered within
+ * `deadline' milliseconds */
+static void send_with_deadline(AMP_Proto_T *proto, const char *command,
+                               const char *deadline)
+{
+    unsigned char *buf;
+    int size;
+
+    fail_if( _amp_serialize_call(NULL, command, "1", deadline, &buf,
+                                 &size) );
+    fail_if( amp_consume_bytes(proto, buf, size) );
+    free(buf);
+}
+
+START_TEST(test__deadline_propagation)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *box;
+    unsigned int deadline;
+    unsigned long long digest;
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    amp_tick(proto, 1000);
+
+    /* off by default */
+    fail_if( amp_call_with_timeout(proto, "Cmd", NULL, junk_callback, NULL,
+                                   500, NULL) );
+    box = pop_written_box(proto);
+    fail_if( amp_has_key(box, DEADLINE) );
+    amp_free_box(box);
+
+    amp_set_deadline_propagation(proto, 1);
+    fail_if( amp_call_with_timeout(proto, "Cmd", NULL, junk_callback, NULL,
+                                   500, NULL) );
+    box = pop_written_box(proto);
+    fail_if( amp_get_uint(box, DEADLINE, &deadline) );
+    fail_unless( deadline == 500 );
+    amp_free_box(box);
+
+    /* only calls with a timeout carry a deadline */
+    fail_if( amp_call(proto, "Cmd", NULL, junk_callback, NULL, NULL) );
+    box = pop_written_box(proto);
+    fail_if( amp_has_key(box, DEADLINE) );
+    amp_free_box(box);
+
+    fail_if( amp_call_no_answer(proto, "Cmd", NULL) );
+    box = pop_written_box(proto);
+    fail_if( amp_has_key(box, DEADLINE) );
+    amp_free_box(box);
+
+    /* a deadline doesn't change the canonical form of a request */
+    box = amp_new_box();
+    amp_put_int(box, "a", 1);
+    digest = _amp_box_digest(box);
+    amp_put_cstring(box, DEADLINE, "100");
+    fail_unless( _amp_box_digest(box) == digest );
+    amp_free_box(box);
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+static AMP_Proto_T *downstream;
+static unsigned int time_left;
+
+/* Pass the request on to `downstream', with a timeout of `responder_arg'
+ * milliseconds */
+static void forwarding_responder(AMP_Proto_T *proto, AMP_Request_T *request,
+                                 void *responder_arg)
+{
+    time_left = amp_request_time_left(proto, request);
+    fail_if( amp_call_with_timeout(downstream, "Forwarded", NULL,
+                                   junk_callback, NULL,
+                                   (unsigned int)(long)responder_arg,
+                                   NULL) );
+    amp_free_request(request);
+}
+
+START_TEST(test__deadline_inherited)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *box;
+    unsigned int deadline;
+
+    downstream = amp_new_proto();
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_set_write_handler(downstream, save_writes, NULL);
+    amp_set_deadline_propagation(downstream, 1);
+    amp_add_responder(proto, "Cmd", forwarding_responder, NULL);
+    amp_add_responder(proto, "Short", forwarding_responder, (void *)20);
+
+    /* deadlines are ignored until the clock is started */
+    send_with_deadline(proto, "Cmd", "100");
+    fail_unless( time_left == 0 );
+    box = pop_written_box(downstream);
+    fail_if( amp_has_key(box, DEADLINE) );
+    amp_free_box(box);
+
+    amp_tick(proto, 1000);
+    amp_tick(downstream, 0);
+
+    /* the call made by the responder gets the time that is left... */
+    fail_if( amp_set_staged_dispatch(proto, 1) );
+    send_with_deadline(proto, "Cmd", "100");
+    amp_tick(proto, 1040);
+    fail_unless( amp_dispatch_staged(proto, 0) == 1 );
+    fail_unless( time_left == 60 );
+    box = pop_written_box(downstream);
+    fail_if( amp_get_uint(box, DEADLINE, &deadline) );
+    fail_unless( deadline == 60 );
+    amp_free_box(box);
+
+    /* ...unless its own timeout is shorter... */
+    send_with_deadline(proto, "Short", "100");
+    fail_unless( amp_dispatch_staged(proto, 0) == 1 );
+    box = pop_written_box(downstream);
+    fail_if( amp_get_uint(box, DEADLINE, &deadline) );
+    fail_unless( deadline == 20 );
+    amp_free_box(box);
+
+    /* ...and calls made outside the responder inherit nothing */
+    fail_if( amp_call(downstream, "Cmd", NULL, junk_callback, NULL, NULL) );
+    box = pop_written_box(downstream);
+    fail_if( amp_has_key(box, DEADLINE) );
+    amp_free_box(box);
+
+    /* a request whose deadline passes before its turn is dropped */
+    send_with_deadline(proto, "Cmd", "100");
+    send_with_deadline(proto, "Cmd", "101");
+    amp_tick(proto, 1140);
+    time_left = 0;
+    fail_unless( amp_dispatch_staged(proto, 0) == 2 );
+    fail_unless( List_length(saved_writes) == 1 );
+    fail_unless( time_left == 1 );
+    amp_free_box(pop_written_box(downstream));
+    amp_free_proto(proto);
+
+    /* a deadline that is already due when the clock reads 0 is still a
+     * deadline */
+    proto = amp_new_proto();
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_add_responder(proto, "Cmd", forwarding_responder, NULL);
+    amp_tick(proto, 0);
+    time_left = 12345;
+    send_with_deadline(proto, "Cmd", "0");
+    fail_unless( time_left == 12345 );
+    fail_unless( List_length(saved_writes) == 0 );
+
+    amp_free_proto(downstream);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+/* Total bytes passed to counting_write_handler() */
+static size_t bytes_written;
+
+static int counting_write_handler(AMP_Proto_T *proto, unsigned char *buf,
+                                  int bufSize, void *write_arg)
+{
+    bytes_written += bufSize;
+    free(buf);
+    return 0;
+}
+
+static int pauses, resumes;
+
+static void count_pause(AMP_Proto_T *proto, void *flow_arg)
+{
+    pauses++;
+    fail_unless( flow_arg == (void *)&pauses );
+}
+
+static void count_resume(AMP_Proto_T *proto, void *flow_arg)
+{
+    resumes++;
+    fail_unless( flow_arg == (void *)&pauses );
+}
+
+START_TEST(test__write_watermarks)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *args = amp_new_box();
+    int i;
+
+    amp_set_write_handler(proto, counting_write_handler, NULL);
+    amp_set_flow_handlers(proto, count_pause, count_resume, &pauses);
+    amp_put_cstring(args, "data", "0123456789012345678901234567890123456789");
+    bytes_written = 0;
+    pauses = resumes = 0;
+
+    /* pending output is counted whether or not there are watermarks */
+    fail_if( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) );
+    fail_unless( bytes_written > 0 );
+    fail_unless( amp_bytes_pending(proto) == bytes_written );
+    amp_bytes_drained(proto, bytes_written);
+    fail_unless( amp_bytes_pending(proto) == 0 );
+    amp_bytes_drained(proto, 100); /* too much is harmless */
+    fail_unless( amp_bytes_pending(proto) == 0 );
+
+    /* calls are refused from the high watermark... */
+    amp_set_write_watermarks(proto, 100, 300);
+    bytes_written = 0;
+    for (i = 0; bytes_written < 300; i++)
+        fail_if( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) );
+    fail_unless( pauses == 1 );
+    fail_unless( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) ==
+                 AMP_WOULD_BLOCK );
+    fail_unless( amp_call_no_answer(proto, "Cmd", args) == AMP_WOULD_BLOCK );
+    fail_unless( amp_bytes_pending(proto) == bytes_written );
+
+    /* ...though answers still go out */
+    i = bytes_written;
+    send_command(proto, "Unknown");
+    fail_unless( bytes_written > (size_t)i );
+    fail_unless( amp_bytes_pending(proto) == bytes_written );
+
+    /* ...until the output drains to the low watermark */
+    amp_bytes_drained(proto, bytes_written - 101);
+    fail_unless( resumes == 0 );
+    fail_unless( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) ==
+                 AMP_WOULD_BLOCK );
+    amp_bytes_drained(proto, 1);
+    fail_unless( resumes == 1 );
+    fail_if( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) );
+
+    /* corked output counts towards the high watermark */
+    amp_bytes_drained(proto, amp_bytes_pending(proto));
+    bytes_written = 0;
+    amp_cork(proto);
+    for (i = 0; i < 100; i++)
+        if (amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) != 0)
+            break;
+    fail_unless( i < 100 );
+    fail_unless( pauses == 1 );
+    fail_unless( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) ==
+                 AMP_WOULD_BLOCK );
+    fail_if( amp_uncork(proto) );
+    fail_unless( pauses == 2 );
+    fail_unless( amp_bytes_pending(proto) == bytes_written );
+
+    /* turning the watermarks off resumes the proto */
+    amp_set_write_watermarks(proto, 0, 0);
+    fail_unless( resumes == 2 );
+    fail_if( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) );
+
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__write_watermarks__writev)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *args = amp_new_box();
+    unsigned char big[1000];
+
+    memset(big, 'x', sizeof(big));
+    amp_put_bytes(args, "big", big, sizeof(big));
+    amp_set_writev_handler(proto, save_writev, NULL);
+    amp_set_write_watermarks(proto, 0, 1500);
+
+    /* scatter/gather writes are counted in full */
+    fail_if( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) );
+    fail_unless( amp_bytes_pending(proto) == (size_t)writev_size );
+    writev_release(writev_release_arg);
+
+    fail_if( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) );
+    writev_release(writev_release_arg);
+    fail_unless( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) ==
+                 AMP_WOULD_BLOCK );
+
+    amp_bytes_drained(proto, 2 * writev_size);
+    fail_if( amp_call(proto, "Cmd", args, junk_callback, NULL, NULL) );
+    writev_release(writev_release_arg);
+
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+/* Requests kept by holding_responder(), to be answered later */
+static AMP_Request_T *held[8];
+static int num_held;
+
+static void holding_responder(AMP_Proto_T *proto, AMP_Request_T *request,
+                              void *responder_arg)
+{
+    (void)proto;
+    (void)responder_arg;
+    held[num_held++] = request;
+}
+
+static int admits;
+static size_t written_at_admit; /* bytes_written when last admitted */
+
+static void count_admit(AMP_Proto_T *proto, void *admit_arg)
+{
+    (void)proto;
+    (*(int *)admit_arg)++;
+    written_at_admit = bytes_written;
+}
+
+/* Append a request for `command' to `buf' - with no _ask key if
+ * `ask_key' is NULL */
+static int append_call(unsigned char *buf, int len, const char *command,
+                       const char *ask_key)
+{
+    unsigned char *call;
+    int size;
+
+    fail_if( _amp_serialize_call(NULL, command, ask_key, NULL, &call, &size) );
+    memcpy(buf + len, call, size);
+    free(call);
+    return len + size;
+}
+
+START_TEST(test__max_in_progress)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *answer = amp_new_box();
+    unsigned char buf[512];
+    int len = 0, first, consumed;
+
+    amp_set_write_handler(proto, counting_write_handler, NULL);
+    amp_add_responder(proto, "Hold", holding_responder, NULL);
+    amp_set_max_in_progress(proto, 2, count_admit, &admits);
+    num_held = 0;
+    admits = 0;
+    bytes_written = 0;
+
+    len = append_call(buf, len, "Hold", "1");
+    first = len;
+    len = append_call(buf, len, "Hold", NULL);
+    len = append_call(buf, len, "Hold", "2");
+    len = append_call(buf, len, "Hold", "3");
+
+    /* reading stops at the limit, between boxes - requests with no _ask
+     * key don't count towards it */
+    fail_unless( amp_consume_bytes_partial(proto, buf, len, &consumed) ==
+                 AMP_PAUSED );
+    fail_unless( num_held == 3 );
+    fail_unless( amp_in_progress(proto) == 2 );
+    fail_unless( consumed > first && consumed < len );
+    fail_unless( amp_consume_bytes_partial(proto, buf + consumed,
+                                           len - consumed, &first) ==
+                 AMP_PAUSED );
+    fail_unless( first == 0 );
+    amp_free_request(held[1]);
+    fail_unless( admits == 0 );
+
+    /* answering a request makes room for the next - once the answer
+     * has been written */
+    fail_if( amp_respond(proto, held[0], answer) );
+    fail_unless( admits == 1 );
+    fail_unless( bytes_written > 0 && written_at_admit == bytes_written );
+    fail_unless( amp_in_progress(proto) == 1 );
+    amp_free_request(held[0]);
+    fail_unless( amp_in_progress(proto) == 1 );
+
+    fail_if( amp_consume_bytes_partial(proto, buf + consumed, len - consumed,
+                                       &first) );
+    fail_unless( first == len - consumed );
+    fail_unless( num_held == 4 );
+    fail_unless( amp_in_progress(proto) == 2 );
+
+    /* as does freeing one unanswered */
+    amp_free_request(held[2]);
+    fail_unless( admits == 1 ); /* wasn't paused */
+    fail_unless( amp_in_progress(proto) == 1 );
+
+    /* amp_consume_bytes() ignores the limit */
+    len = append_call(buf, 0, "Hold", "4");
+    len = append_call(buf, len, "Hold", "5");
+    fail_if( amp_consume_bytes(proto, buf, len) );
+    fail_unless( num_held == 6 );
+    fail_unless( amp_in_progress(proto) == 3 );
+
+    /* raising the limit admits more at once */
+    fail_unless( amp_consume_bytes_partial(proto, buf, len, &consumed) ==
+                 AMP_PAUSED );
+    amp_set_max_in_progress(proto, 0, count_admit, &admits);
+    fail_unless( admits == 2 );
+
+    amp_free_request(held[3]);
+    amp_free_request(held[4]);
+    amp_free_request(held[5]);
+    fail_unless( amp_in_progress(proto) == 0 );
+
+    amp_free_box(answer);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__max_in_progress__cache_and_staging)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+
+    amp_set_write_handler(proto, save_writes, NULL);
+    amp_add_responder(proto, "Sum", counting_sum_responder, NULL);
+    amp_add_responder(proto, "Hold", holding_responder, NULL);
+    fail_if( amp_set_response_cache(proto, "Sum", 1000, 4096) );
+    amp_set_max_in_progress(proto, 1, NULL, NULL);
+    num_held = 0;
+
+    /* requests answered from the cache never count */
+    send_sum(proto, "1", 5, 7, 0);
+    check_sum_answer(proto, 1, 12);
+    send_sum(proto, "2", 5, 7, 0);
+    check_sum_answer(proto, 2, 12);
+    fail_unless( amp_in_progress(proto) == 0 );
+
+    /* staged requests do, until they are dispatched and answered */
+    fail_if( amp_set_staged_dispatch(proto, 1) );
+    send_command(proto, "Hold");
+    fail_unless( num_held == 0 );
+    fail_unless( amp_in_progress(proto) == 1 );
+    amp_dispatch_staged(proto, 0);
+    fail_unless( num_held == 1 );
+    fail_unless( amp_in_progress(proto) == 1 );
+    amp_free_request(held[0]);
+    fail_unless( amp_in_progress(proto) == 0 );
+
+    /* and those still staged are dropped with the proto */
+    send_command(proto, "Hold");
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__max_in_progress__request_outlives_proto)
+{
+    AMP_Proto_T *proto = amp_new_proto();
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_add_responder(proto, "Hold", holding_responder, NULL);
+    amp_set_max_in_progress(proto, 2, NULL, NULL);
+    num_held = 0;
+
+    send_command(proto, "Hold");
+    send_command(proto, "Hold");
+    fail_unless( amp_in_progress(proto) == 2 );
+
+    /* requests held back to answer later may be free'd after the proto */
+    amp_free_proto(proto);
+    amp_free_request(held[1]);
+    amp_free_request(held[0]);
+
+    /* without a limit, requests aren't tied to their proto at all */
+    proto = amp_new_proto();
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    amp_add_responder(proto, "Hold", holding_responder, NULL);
+    send_command(proto, "Hold");
+    fail_unless( held[2]->admitted_by == NULL );
+    fail_unless( amp_in_progress(proto) == 0 );
+    amp_free_proto(proto);
+    amp_free_request(held[2]);
+}
+END_TEST
+
+
+START_TEST(test__max_in_progress__async_proto_freed)
+{
+    AMP_Worker_Pool_T *pool = amp_new_worker_pool(2);
+    AMP_Proto_T *proto = amp_new_proto();
+    int i;
+
+    release_responders = 0;
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    fail_if( amp_add_responder_async(proto, pool, "Sum", async_sum_responder,
+                                     NULL) );
+    amp_set_max_in_progress(proto, 10, NULL, NULL);
+
+    for (i = 0; i < 5; i++)
+        send_sum(proto, "1", i, i, 0);
+    amp_free_proto(proto);
+
+    /* the workers answer and free the requests after the proto is gone */
+    __atomic_store_n(&release_responders, 1, __ATOMIC_RELEASE);
+    amp_free_worker_pool(pool);
+}
+END_TEST
+
+
+START_TEST(test__max_in_progress__async)
+{
+    AMP_Worker_Pool_T *pool = amp_new_worker_pool(2);
+    AMP_Proto_T *proto = amp_new_proto();
+    AMP_Box_T *args = amp_new_box();
+    unsigned char buf[512];
+    unsigned char *call;
+    int len = 0, size, consumed, waited = 0;
+
+    release_responders = 0;
+    admits = 0;
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    fail_if( amp_add_responder_async(proto, pool, "Sum", async_sum_responder,
+                                     NULL) );
+    amp_set_max_in_progress(proto, 1, count_admit, &admits);
+
+    amp_put_long_long(args, "a", 1);
+    amp_put_long_long(args, "b", 2);
+    fail_if( _amp_serialize_call(args, "Sum", "1", NULL, &call, &size) );
+    memcpy(buf, call, size);
+    memcpy(buf + size, call, size);
+    len = 2 * size;
+    free(call);
+
+    fail_unless( amp_consume_bytes_partial(proto, buf, len, &consumed) ==
+                 AMP_PAUSED );
+    fail_unless( consumed == size );
+    __atomic_store_n(&release_responders, 1, __ATOMIC_RELEASE);
+
+    /* requests answered on a worker are released when the answers are
+     * drained on this thread */
+    while (admits == 0)
+    {
+        fail_unless( waited++ < 10000 );
+        usleep(1000);
+        fail_if( amp_drain_completions(proto) );
+    }
+    fail_unless( amp_in_progress(proto) == 0 );
+    fail_if( amp_consume_bytes_partial(proto, buf + consumed, len - consumed,
+                                       &consumed) );
+
+    amp_free_worker_pool(pool);
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_cancel__success)
+{
+    int ask_key;
+    int result;
+    AMP_Box_T *args = amp_new_box();
+    AMP_Proto_T *proto = amp_new_proto();
+    struct saved_result *r;
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+
+    /* set up some call state */
+    amp_call(proto, "SomeCommand", args, save_result_cb, (void*)0x123, &ask_key);
+    amp_free_box(args);
+
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 1 );
+
+    /* cancel it */
+    result = amp_cancel(proto, ask_key);
+
+    fail_unless( result == 0 );
+
+    /* ensure callback was called with correct result */
+    fail_unless( List_length(saved_results) == 1 );
+
+    saved_results = List_pop(saved_results, (void**)&r);
+
+    fail_unless( r->proto == proto );
+
+    fail_unless( r->result->reason == AMP_CANCEL );
+    fail_unless( r->result->response == NULL );
+    fail_unless( r->result->error == NULL );
+
+    fail_unless( r->callback_arg == (void*)0x123 );
+
+    /* and state was forgotten */
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 0 );
+
+    amp_free_result(r->result);
+    free(r);
     amp_free_proto(proto);
 }
 END_TEST
@@ -1418,6 +4666,278 @@ START_TEST(test__amp_cancel__no_such_key)
 END_TEST
 
 
+#define NUM_CANCEL_ALL_CALLS 50000
+static int cancelled_calls[NUM_CANCEL_ALL_CALLS];
+static AMP_Result_T *cancel_all_result;
+
+static void count_cancel_cb(AMP_Proto_T *proto, AMP_Result_T *result,
+                            void *callback_arg)
+{
+    long i = (long)callback_arg;
+
+    cancelled_calls[i]++;
+    fail_unless( result->response == NULL && result->error == NULL );
+    if (cancel_all_result == NULL)
+        cancel_all_result = result;
+    fail_unless( result == cancel_all_result ); /* the result is shared */
+
+    /* a call made while cancelling isn't cancelled itself */
+    if (i == 0)
+        fail_if( amp_call(proto, "Again", NULL, junk_callback, NULL, NULL) );
+    amp_free_result(result);
+}
+
+START_TEST(test__amp_cancel_all)
+{
+    unsigned int askKey;
+    long i;
+    AMP_Proto_T *proto = amp_new_proto();
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    memset(cancelled_calls, 0, sizeof(cancelled_calls));
+    cancel_all_result = NULL;
+
+    for (i = 0; i < NUM_CANCEL_ALL_CALLS; i++)
+        fail_if( amp_call_with_timeout(proto, "SomeCommand", NULL,
+                                       count_cancel_cb, (void *)i,
+                                       i % 2 ? 1000 : 0, &askKey) );
+    fail_unless( _amp_timer_wheel_length(proto->timers) ==
+                 NUM_CANCEL_ALL_CALLS / 2 );
+
+    fail_if( amp_cancel_all(proto, AMP_CONNECTION_LOST) );
+
+    fail_unless( cancel_all_result->reason == AMP_CONNECTION_LOST );
+    for (i = 0; i < NUM_CANCEL_ALL_CALLS; i++)
+        fail_unless( cancelled_calls[i] == 1 );
+
+    /* only the call made by a callback is left */
+    fail_unless( _amp_callback_map_length(proto->outstanding_requests) == 1 );
+    fail_unless( _amp_timer_wheel_length(proto->timers) == 0 );
+
+    /* a late answer is ignored */
+    amp_put_int(proto->box, ANSWER, askKey);
+    fail_if( proto->dispatch_box(proto, proto->box) );
+    proto->box = amp_new_box();
+
+    /* nothing left to time out */
+    fail_unless( amp_tick(proto, 0) == 0 );
+    fail_unless( amp_tick(proto, 100000) == 0 );
+
+    /* cancelling with nothing outstanding is fine */
+    fail_if( amp_cancel(proto, proto->last_ask_key) );
+    fail_if( amp_cancel_all(proto, AMP_CANCEL) );
+
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__amp_cancel_all__with_malloc_failures)
+{
+    int fail_after = 0;
+    int result;
+    long i;
+    AMP_Proto_T *proto;
+
+    while (1)
+    {
+        proto = amp_new_proto();
+        amp_set_write_handler(proto, discarding_write_handler, NULL);
+        memset(cancelled_calls, 0, sizeof(cancelled_calls));
+        cancel_all_result = NULL;
+
+        /* calls from index 1 up, so that the callbacks make no calls */
+        for (i = 1; i < 10; i++)
+            fail_if( amp_call(proto, "SomeCommand", NULL, count_cancel_cb,
+                              (void *)i, NULL) );
+
+        enable_malloc_failures(fail_after++);
+
+        /* Run code under test */
+        result = amp_cancel_all(proto, AMP_CANCEL);
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            /* nothing was cancelled */
+            fail_unless( result == ENOMEM );
+            fail_unless( cancel_all_result == NULL );
+            fail_unless( _amp_callback_map_length(
+                             proto->outstanding_requests) == 9 );
+            amp_free_proto(proto);
+        }
+        else
+        {
+            fail_unless( result == 0 );
+            fail_unless( cancel_all_result->reason == AMP_CANCEL );
+            fail_unless( _amp_callback_map_length(
+                             proto->outstanding_requests) == 0 );
+            amp_free_proto(proto);
+            break;
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(test__amp_free_proto__cancels_calls)
+{
+    long i;
+    AMP_Proto_T *proto = amp_new_proto();
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+    memset(cancelled_calls, 0, sizeof(cancelled_calls));
+    cancel_all_result = NULL;
+
+    for (i = 1; i < 10; i++)
+        fail_if( amp_call_with_timeout(proto, "SomeCommand", NULL,
+                                       count_cancel_cb, (void *)i, 10, NULL) );
+
+    /* the callbacks are given a chance to release their arguments */
+    amp_free_proto(proto);
+
+    fail_unless( cancel_all_result->reason == AMP_CANCEL );
+    for (i = 1; i < 10; i++)
+        fail_unless( cancelled_calls[i] == 1 );
+}
+END_TEST
+
+
+START_TEST(test__callback_map__many_outstanding)
+{
+    _AMP_Callback_Map_p cb_map = _amp_new_callback_map();
+    struct _AMP_Callback cb;
+    unsigned int i;
+
+    for (i = 1; i <= 100000; i++)
+        fail_unless(_amp_put_callback(cb_map, i, junk_callback,
+                                      (void *)(unsigned long)i) == 0);
+
+    fail_unless(_amp_callback_map_length(cb_map) == 100000);
+
+    for (i = 100000; i >= 1; i--)
+    {
+        fail_unless(_amp_pop_callback(cb_map, i, &cb) == 1);
+        fail_unless(cb.ask_key == i);
+        fail_unless(cb.func == junk_callback);
+        fail_unless(cb.arg == (void *)(unsigned long)i);
+    }
+
+    fail_unless(_amp_callback_map_length(cb_map) == 0);
+
+    /* already popped */
+    fail_unless(_amp_pop_callback(cb_map, 1, NULL) == 0);
+
+    _amp_free_callback_map(cb_map);
+}
+END_TEST
+
+
+START_TEST(test__callback_map__collision)
+{
+    _AMP_Callback_Map_p cb_map = _amp_new_callback_map();
+    unsigned int i, collided = 0;
+
+    fail_unless(_amp_put_callback(cb_map, 1, junk_callback, NULL) == 0);
+
+    /* keys that share a slot with key 1 are refused rather than
+     * overwriting it, and aren't found when looking up */
+    for (i = 2; i < 1000; i++)
+    {
+        fail_unless(_amp_pop_callback(cb_map, i, NULL) == 0);
+
+        if (_amp_put_callback(cb_map, i, junk_callback, NULL) == -1)
+            collided++;
+        else
+            fail_unless(_amp_pop_callback(cb_map, i, NULL) == 1);
+    }
+    fail_unless(collided > 0);
+
+    fail_unless(_amp_callback_map_length(cb_map) == 1);
+    fail_unless(_amp_pop_callback(cb_map, 1, NULL) == 1);
+
+    _amp_free_callback_map(cb_map);
+}
+END_TEST
+
+
+START_TEST(test__amp_call__skips_outstanding_ask_key)
+{
+    /* A call that stays outstanding while many others come and go keeps
+     * its ask key, and no later call is given the same key */
+    unsigned int oldKey, askKey;
+    int i;
+    AMP_Box_T *args = amp_new_box();
+    AMP_Proto_T *proto = amp_new_proto();
+
+    amp_set_write_handler(proto, discarding_write_handler, NULL);
+
+    fail_unless(amp_call(proto, "Cmd", args, junk_callback, NULL,
+                         &oldKey) == 0);
+
+    for (i = 0; i < 1000; i++)
+    {
+        fail_unless(amp_call(proto, "Cmd", args, junk_callback, NULL,
+                             &askKey) == 0);
+        fail_unless(askKey != oldKey);
+        fail_unless(amp_cancel(proto, askKey) == 0);
+    }
+
+    fail_unless(_amp_callback_map_length(proto->outstanding_requests) == 1);
+    fail_unless(amp_cancel(proto, oldKey) == 0);
+
+    amp_free_box(args);
+    amp_free_proto(proto);
+}
+END_TEST
+
+
+START_TEST(test__callback_map__grow_with_malloc_failures)
+{
+    _AMP_Callback_Map_p cb_map = _amp_new_callback_map();
+    unsigned int i, next = 1;
+    int fail_after = 0;
+    int result;
+
+    while (1)
+    {
+        enable_malloc_failures(fail_after++);
+
+        /* fill the map until it has to grow */
+        result = 0;
+        for (i = 0; i < 100 && result == 0; i++)
+            if ( (result = _amp_put_callback(cb_map, next, junk_callback,
+                                             NULL)) == 0)
+                next++;
+
+        disable_malloc_failures();
+
+        if (allocation_failure_occurred)
+        {
+            fail_unless(result == ENOMEM);
+
+            /* everything registered so far is still there */
+            fail_unless(_amp_callback_map_length(cb_map) == (int)next - 1);
+            for (i = 1; i < next; i++)
+            {
+                fail_unless(_amp_pop_callback(cb_map, i, NULL) == 1);
+                fail_unless(_amp_put_callback(cb_map, i, junk_callback,
+                                              NULL) == 0);
+            }
+        }
+        else
+        {
+            fail_unless(result == 0);
+            break;
+        }
+    }
+
+    _amp_free_callback_map(cb_map);
+}
+END_TEST
+
+
 /* Test amp_call_no_answer() */
 START_TEST(test__amp_call_no_answer)
 {
@@ -1612,12 +5132,8 @@ START_TEST(test_amp_respond)
 
     amp_set_write_handler(proto, save_writes, NULL);
 
-    NEW(req);
-    memset(req, 0, sizeof(*req));
-
-    /* The other fields of a `struct AMP_Request' are not accessed
-     * when responding */
-    req->ask_key = amp_chunk_copy_buffer(ask_key, strlen(ask_key));
+    amp_add_responder(proto, "Cmd", stash_request, NULL);
+    req = read_request(proto, ask_key);
 
     amp_put_cstring(resp_args, "field1", "VAL1");
     amp_put_cstring(resp_args, "field2", "VAL2");
@@ -1810,6 +5326,11 @@ Suite *make_core_suite()
     tcase_add_checked_fixture(tc_dispatch, core_setup, core_teardown);
     tcase_add_test(tc_dispatch, dispatch_handled_responses);
     tcase_add_test(tc_dispatch, dispatch_handled_requests);
+    tcase_add_test(tc_dispatch, dispatch_frozen_requests);
+    tcase_add_test(tc_dispatch, dispatch_registry_requests);
+    tcase_add_test(tc_dispatch, test__responder_index__many_commands);
+    tcase_add_test(tc_dispatch, test__responder_index__probing);
+    tcase_add_test(tc_dispatch, test__responder_index__empty);
     tcase_add_test(tc_dispatch, dispatch_unhandled_boxes);
     tcase_add_test(tc_dispatch, unhandled_request_sends_error);
     tcase_add_test(tc_dispatch, test_process_bad_box);
@@ -1834,6 +5355,10 @@ Suite *make_core_suite()
     tcase_add_test(tc_memory, test_amp_respond_with_malloc_failures);
     tcase_add_test(tc_memory, test_amp_new_error_from_box_with_malloc_failures);
     tcase_add_test(tc_memory, test_amp_new_responder_with_malloc_failures);
+    tcase_add_test(tc_memory, test_amp_freeze_responders_with_malloc_failures);
+    tcase_add_test(tc_memory, test_amp_registry_with_malloc_failures);
+    tcase_add_test(tc_memory, test_amp_add_responder_with_malloc_failures);
+    tcase_add_test(tc_memory, test_dispatch_without_allocation);
     suite_add_tcase(s, tc_memory);
 
     /* amp_call() and amp_call_no_answer() test cases */
@@ -1842,12 +5367,119 @@ Suite *make_core_suite()
     tcase_add_test(tc_call, test__amp_call_no_answer);
     tcase_add_test(tc_call, test__amp_call_no_ask_key);
     tcase_add_test(tc_call, test__amp_call__max_ask_key);
+    tcase_add_test(tc_call, test__amp_call__skips_outstanding_ask_key);
+    tcase_add_test(tc_call, test__amp_call__args_not_modified);
     suite_add_tcase(s, tc_call);
 
+    /* amp_cork() and friends */
+    TCase *tc_cork = tcase_create("cork");
+    tcase_add_test(tc_cork, test__amp_cork__coalesces_writes);
+    tcase_add_test(tc_cork, test__amp_cork__grow_with_malloc_failures);
+    suite_add_tcase(s, tc_cork);
+
+    /* scatter/gather writes */
+    TCase *tc_writev = tcase_create("writev");
+    tcase_add_test(tc_writev, test__amp_writev__references_large_values);
+    tcase_add_test(tc_writev, test__amp_writev__with_malloc_failures);
+    suite_add_tcase(s, tc_writev);
+
+    /* amp_call_with_timeout() and amp_tick() */
+    TCase *tc_timeout = tcase_create("timeout");
+    tcase_add_test(tc_timeout, test__amp_call_with_timeout);
+    tcase_add_test(tc_timeout, test__amp_tick__starts_clock);
+    tcase_add_test(tc_timeout, test__timer_wheel__expiry_order);
+    tcase_add_test(tc_timeout, test__amp_call_with_timeout__malloc_failures);
+    suite_add_tcase(s, tc_timeout);
+
+    /* the map of outstanding calls */
+    TCase *tc_callback_map = tcase_create("callback map");
+    tcase_add_test(tc_callback_map, test__callback_map__many_outstanding);
+    tcase_add_test(tc_callback_map, test__callback_map__collision);
+    tcase_add_test(tc_callback_map, test__callback_map__grow_with_malloc_failures);
+    suite_add_tcase(s, tc_callback_map);
+
+    /* AMP_Pipeline_T */
+    TCase *tc_pipeline = tcase_create("pipeline");
+    tcase_add_test(tc_pipeline, test__amp_pipeline);
+    tcase_add_test(tc_pipeline, test__amp_pipeline__set_window);
+    tcase_add_test(tc_pipeline, test__amp_pipeline__write_failure);
+    tcase_add_test(tc_pipeline, test__amp_free_pipeline);
+    tcase_add_test(tc_pipeline, test__amp_pipeline__with_malloc_failures);
+    suite_add_tcase(s, tc_pipeline);
+
+    /* amp_call_coalesced() */
+    TCase *tc_coalesce = tcase_create("coalesce");
+    tcase_add_test(tc_coalesce, test__amp_call_coalesced);
+    tcase_add_test(tc_coalesce, test__amp_call_coalesced__error);
+    tcase_add_test(tc_coalesce, test__amp_call_coalesced__with_malloc_failures);
+    suite_add_tcase(s, tc_coalesce);
+
+    /* amp_new_gather() */
+    TCase *tc_gather = tcase_create("gather");
+    tcase_add_test(tc_gather, test__amp_gather);
+    tcase_add_test(tc_gather, test__amp_gather__deadline);
+    tcase_add_test(tc_gather, test__amp_gather__with_malloc_failures);
+    suite_add_tcase(s, tc_gather);
+
+    /* amp_co_call() */
+    TCase *tc_co = tcase_create("coroutines");
+    tcase_add_test(tc_co, test__amp_co_call);
+    tcase_add_test(tc_co, test__amp_co_call__answered_synchronously);
+    tcase_add_test(tc_co, test__amp_co_call__many);
+    tcase_add_test(tc_co, test__amp_co_spawn__with_malloc_failures);
+    suite_add_tcase(s, tc_co);
+
+    /* amp_set_response_cache() */
+    TCase *tc_cache = tcase_create("response cache");
+    tcase_add_test(tc_cache, test__response_cache);
+    tcase_add_test(tc_cache, test__response_cache__budget);
+    tcase_add_test(tc_cache, test__box_canonical);
+    tcase_add_test(tc_cache, test__response_cache__with_malloc_failures);
+    suite_add_tcase(s, tc_cache);
+
+    /* amp_add_responder_async() and amp_call_threadsafe() */
+    TCase *tc_async = tcase_create("threads");
+    tcase_add_test(tc_async, test__amp_add_responder_async);
+    tcase_add_test(tc_async, test__amp_add_responder_async__proto_freed);
+    tcase_add_test(tc_async, test__amp_add_responder_async__with_malloc_failures);
+    tcase_add_test(tc_async, test__amp_call_threadsafe);
+    tcase_add_test(tc_async, test__amp_call_threadsafe__with_malloc_failures);
+    suite_add_tcase(s, tc_async);
+
+    /* amp_set_staged_dispatch() */
+    TCase *tc_priority = tcase_create("priority");
+    tcase_add_test(tc_priority, test__staged_dispatch);
+    tcase_add_test(tc_priority, test__staged_dispatch__weights);
+    tcase_add_test(tc_priority, test__staged_dispatch__with_malloc_failures);
+    suite_add_tcase(s, tc_priority);
+
+    /* amp_set_deadline_propagation() */
+    TCase *tc_deadline = tcase_create("deadline");
+    tcase_add_test(tc_deadline, test__deadline_propagation);
+    tcase_add_test(tc_deadline, test__deadline_inherited);
+    suite_add_tcase(s, tc_deadline);
+
+    /* amp_set_write_watermarks() */
+    TCase *tc_flow = tcase_create("flow control");
+    tcase_add_test(tc_flow, test__write_watermarks);
+    tcase_add_test(tc_flow, test__write_watermarks__writev);
+    suite_add_tcase(s, tc_flow);
+
+    TCase *tc_admission = tcase_create("admission");
+    tcase_add_test(tc_admission, test__max_in_progress);
+    tcase_add_test(tc_admission, test__max_in_progress__cache_and_staging);
+    tcase_add_test(tc_admission, test__max_in_progress__async);
+    tcase_add_test(tc_admission, test__max_in_progress__request_outlives_proto);
+    tcase_add_test(tc_admission, test__max_in_progress__async_proto_freed);
+    suite_add_tcase(s, tc_admission);
+
     /* amp_cancel() */
     TCase *tc_cancel = tcase_create("cancel");
     tcase_add_test(tc_cancel, test__amp_cancel__success);
     tcase_add_test(tc_cancel, test__amp_cancel__no_such_key);
+    tcase_add_test(tc_cancel, test__amp_cancel_all);
+    tcase_add_test(tc_cancel, test__amp_cancel_all__with_malloc_failures);
+    tcase_add_test(tc_cancel, test__amp_free_proto__cancels_calls);
     suite_add_tcase(s, tc_cancel);
 
     /* response-related test */
@@ -1887,6 +5519,7 @@ int main()
     srunner_add_suite(sr, make_box_suite());
     srunner_add_suite(sr, make_log_suite());
     srunner_add_suite(sr, make_buftoll_suite());
+    srunner_add_suite(sr, make_utf8_suite());
     srunner_add_suite(sr, make_mem_suite());
     srunner_add_suite(sr, make_list_suite());
     srunner_add_suite(sr, make_table_suite());
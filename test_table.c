@@ -11,6 +11,8 @@
  * ever broken it would cause regressions elsewhere in the test
  * suite. */
 
+#include <stdlib.h>
+
 /* Check - C unit testing framework */
 #include <check.h>
 
@@ -99,6 +101,28 @@ START_TEST(test_get)
 }
 END_TEST
 
+START_TEST(test_to_array)
+{
+    /* Table_toArray() returns alternating keys and values, followed by
+     * the `end' marker */
+
+    void **array;
+    Table_T *table = Table_new(0, cmpatom, hashatom);
+
+    Table_put(table, (void*)0x12, (void*)0x34);
+
+    array = Table_toArray(table, (void*)0x99);
+
+    fail_unless( array[0] == (void*)0x12 );
+    fail_unless( array[1] == (void*)0x34 );
+    fail_unless( array[2] == (void*)0x99 );
+
+    free(array);
+    Table_remove(table, (void*)0x12);
+    Table_free(&table);
+}
+END_TEST
+
 Suite *make_table_suite(void)
 {
     Suite *s = suite_create ("Hash-Table");
@@ -108,6 +132,7 @@ Suite *make_table_suite(void)
     tcase_add_test(tc_table, test_put_replace);
     tcase_add_test(tc_table, test_put_in_same_bucket);
     tcase_add_test(tc_table, test_get);
+    tcase_add_test(tc_table, test_to_array);
     suite_add_tcase(s, tc_table);
 
     return s;
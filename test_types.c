@@ -195,6 +195,51 @@ START_TEST(test__amp_get_long_long__no_such_key)
 END_TEST
 
 
+START_TEST(test__amp_get_long_long__cached)
+{
+    long long got;
+    int gotInt;
+    struct amp_key_value *keyval;
+    AMP_Box_T * box = amp_new_box();
+
+    amp_put_cstring(box, "key", "123");
+    fail_unless(_amp_get_keyval(box, "key", &keyval) == 0);
+    fail_unless(keyval->decodedType == DECODED_NONE);
+
+    fail_unless(amp_get_long_long(box, "key", &got) == 0);
+    fail_unless(got == 123);
+    fail_unless(keyval->decodedType == DECODED_LONG_LONG);
+    fail_unless(keyval->decoded.ll == 123);
+
+    /* tamper with the cache to prove the second get doesn't re-parse */
+    keyval->decoded.ll = 456;
+    fail_unless(amp_get_long_long(box, "key", &got) == 0);
+    fail_unless(got == 456);
+
+    /* amp_get_int() shares the cache but still range-checks */
+    keyval->decoded.ll = (long long)INT_MAX + 1;
+    fail_unless(amp_get_int(box, "key", &gotInt) == AMP_OUT_OF_RANGE);
+
+    /* a put invalidates the cache */
+    amp_put_cstring(box, "key", "789");
+    fail_unless(amp_get_long_long(box, "key", &got) == 0);
+    fail_unless(got == 789);
+
+    /* a failed decode isn't cached */
+    amp_put_cstring(box, "key", "abc");
+    fail_unless(amp_get_long_long(box, "key", &got) == AMP_DECODE_ERROR);
+    fail_unless(_amp_get_keyval(box, "key", &keyval) == 0);
+    fail_unless(keyval->decodedType == DECODED_NONE);
+
+    /* a deleted key is really gone */
+    amp_del_key(box, "key");
+    fail_unless(amp_get_long_long(box, "key", &got) == AMP_KEY_NOT_FOUND);
+
+    amp_free_box(box);
+}
+END_TEST
+
+
 /* these two arrays initalized in main() */
 char int_max[100];
 char int_min[100];
@@ -480,6 +525,10 @@ struct put_double_case
     {-1.0,               "-1.0"},
     {3.14159265358979323, "3.141592653589793"},
     {99999.9999999,       "99999.9999"},
+    {1267650600228229401496703205376.0,      /* 2**100 */
+                          "1267650600228229401496703205376.0000"},
+    {-1267650600228229401496703205376.0,
+                         "-1267650600228229401496703205376.0000"},
 #ifdef NAN
     {NAN,                 "nan"},
 #endif
@@ -547,6 +596,9 @@ struct get_double_case {
     {0,  3.14159265358979323846,   "3.14159265358979323846"},
     {0, -3.14159265358979323846,  "-3.14159265358979323846"},
     {0,  99999.99999, "99999.99999"},
+    {0,  0.0,        "-0"},
+    {0,  9007199254740992.0,  "9007199254740993"}, /* 2**53 + 1 rounds */
+    {0, -9007199254740992.0, "-9007199254740993"},
 
     {0,  1.012345678901234567890123456789,  "1.012345678901234567890123456789012345678901234567890123456789"
                                             "012345678901234567890123456789012345678901234567890123456789"},
@@ -704,6 +756,37 @@ START_TEST(test__amp_get_double__no_such_key)
 END_TEST
 
 
+START_TEST(test__amp_get_double__cached)
+{
+    double got;
+    long long gotLL;
+    struct amp_key_value *keyval;
+    AMP_Box_T * box = amp_new_box();
+
+    amp_put_cstring(box, "key", "1.5");
+    fail_unless(amp_get_double(box, "key", &got) == 0);
+    fail_unless(got == 1.5);
+
+    fail_unless(_amp_get_keyval(box, "key", &keyval) == 0);
+    fail_unless(keyval->decodedType == DECODED_DOUBLE);
+
+    keyval->decoded.d = 2.5;
+    fail_unless(amp_get_double(box, "key", &got) == 0);
+    fail_unless(got == 2.5);
+
+    /* a get of a different type ignores the cached double */
+    amp_put_cstring(box, "key", "10");
+    fail_unless(amp_get_double(box, "key", &got) == 0);
+    fail_unless(_amp_get_keyval(box, "key", &keyval) == 0);
+    fail_unless(amp_get_long_long(box, "key", &gotLL) == 0);
+    fail_unless(gotLL == 10);
+    fail_unless(keyval->decodedType == DECODED_LONG_LONG);
+
+    amp_free_box(box);
+}
+END_TEST
+
+
 /* amp_put_bool() test case data */
 struct put_bool_case
 {
@@ -717,6 +800,79 @@ struct put_bool_case
 int num_put_bool_tests = (sizeof(put_bool_cases) /
                           sizeof(struct put_bool_case));
 
+START_TEST(test__amp_put_int_array)
+{
+    int values[12] = {0, 1, -1, 2, INT_MAX, INT_MIN, 6, 7, 8, 9, 10, 11};
+    int got[12];
+    const char *keys[12] = {"v0", "v1", "v2", "v3", "v4", "v5",
+                            "v6", "v7", "v8", "v9", "v10", "v11"};
+    unsigned char *buf;
+    int bufSize;
+    AMP_Box_T *box = amp_new_box();
+
+    fail_unless(amp_put_int_array(box, "v", values, 12) == 0);
+    fail_unless(amp_num_keys(box) == 12);
+
+    fail_unless(amp_get_bytes(box, "v11", &buf, &bufSize) == 0);
+    fail_unless(bufSize == 2 && memcmp(buf, "11", 2) == 0);
+
+    fail_unless(amp_get_int_array(box, keys, 12, got) == 0);
+    fail_unless(memcmp(values, got, sizeof(values)) == 0);
+
+    amp_free_box(box);
+}
+END_TEST
+
+
+START_TEST(test__amp_put_int_array__bad_key_size)
+{
+    char prefix[MAX_KEY_LENGTH + 1];
+    int values[2] = {1, 2};
+    AMP_Box_T *box = amp_new_box();
+
+    /* room for a single-digit index only */
+    memset(prefix, 'x', MAX_KEY_LENGTH - 1);
+    prefix[MAX_KEY_LENGTH - 1] = '\0';
+
+    fail_unless(amp_put_int_array(box, prefix, values, 2) == 0);
+
+    prefix[MAX_KEY_LENGTH - 1] = 'x';
+    prefix[MAX_KEY_LENGTH] = '\0';
+
+    fail_unless(amp_put_int_array(box, prefix, values, 2) ==
+                AMP_BAD_KEY_SIZE);
+
+    amp_free_box(box);
+}
+END_TEST
+
+
+START_TEST(test__amp_get_double_array)
+{
+    double values[4] = {0.0, -1.5, 3.25, INFINITY};
+    double got[4];
+    const char *keys[4] = {"d0", "d1", "d2", "d3"};
+    AMP_Box_T *box = amp_new_box();
+
+    fail_unless(amp_put_double_array(box, "d", values, 4) == 0);
+    fail_unless(amp_get_double_array(box, keys, 4, got) == 0);
+    fail_unless(memcmp(values, got, sizeof(values)) == 0);
+
+    /* stops at, and reports, the first bad element */
+    memset(got, 0, sizeof(got));
+    amp_put_cstring(box, "d2", "junk");
+    fail_unless(amp_get_double_array(box, keys, 4, got) == AMP_DECODE_ERROR);
+    fail_unless(got[1] == -1.5);
+    fail_unless(got[2] == 0.0);
+
+    amp_del_key(box, "d2");
+    fail_unless(amp_get_double_array(box, keys, 4, got) == AMP_KEY_NOT_FOUND);
+
+    amp_free_box(box);
+}
+END_TEST
+
+
 START_TEST(test__amp_put_bool)
 {
     int ret;
@@ -829,6 +985,112 @@ START_TEST(test__amp_get_bool__no_such_key)
 END_TEST
 
 
+/* amp_put_unicode() / amp_get_unicode() test case data */
+struct unicode_case
+{
+    int expectedError;
+    char *testValue;
+    int size;
+} unicode_cases[] = {
+    {0,                "hello",                 5},
+    {0,                "",                      0},
+    {0,                "caf\xC3\xA9",            5},
+    {0,                "\xF0\x9F\x98\x80",      4},
+    {AMP_DECODE_ERROR, "nul\x00" "byte",        8},
+    {AMP_DECODE_ERROR, "\xC0\xAF",              2}, /* overlong '/' */
+    {AMP_DECODE_ERROR, "\xED\xB0\x80",          3}, /* surrogate */
+    {AMP_DECODE_ERROR, "\xFF",                  1}
+};
+int num_unicode_tests = (sizeof(unicode_cases) /
+                         sizeof(struct unicode_case));
+
+START_TEST(test__amp_put_unicode)
+{
+    int ret;
+    unsigned char *buf;
+    int bufSize;
+
+    /* the variable _i is made available by Check's "loop test" machinery */
+    struct unicode_case c = unicode_cases[_i];
+
+    AMP_Box_T * box = amp_new_box();
+
+    ret = amp_put_unicode(box, "key", (unsigned char *)c.testValue, c.size);
+
+    if (c.expectedError)
+    {
+        fail_unless(ret == AMP_ENCODE_ERROR,
+                    "ERR: amp_put_unicode() != %d", AMP_ENCODE_ERROR);
+
+        /* nothing was stored */
+        fail_if(amp_has_key(box, "key"));
+    }
+    else
+    {
+        fail_unless(ret == 0,
+                    "ERR: amp_put_unicode() != 0");
+
+        amp_get_bytes(box, "key", &buf, &bufSize);
+
+        fail_unless(bufSize == c.size);
+        fail_if(memcmp(buf, c.testValue, c.size));
+    }
+
+    amp_free_box(box);
+}
+END_TEST
+
+START_TEST(test__amp_get_unicode)
+{
+    int ret;
+    unsigned char *buf = NULL;
+    int bufSize = -1;
+
+    /* the variable _i is made available by Check's "loop test" machinery */
+    struct unicode_case c = unicode_cases[_i];
+
+    AMP_Box_T * box = amp_new_box();
+
+    amp_put_bytes(box, "key", (unsigned char *)c.testValue, c.size);
+
+    ret = amp_get_unicode(box, "key", &buf, &bufSize);
+
+    fail_unless(ret == c.expectedError,
+                "ERR: amp_get_unicode() != %d", c.expectedError);
+
+    if (!c.expectedError)
+    {
+        fail_unless(bufSize == c.size);
+        fail_if(memcmp(buf, c.testValue, c.size));
+    }
+    else
+    {
+        /* output arguments untouched on error */
+        fail_unless(buf == NULL);
+        fail_unless(bufSize == -1);
+    }
+
+    amp_free_box(box);
+}
+END_TEST
+
+
+START_TEST(test__amp_get_unicode__no_such_key)
+{
+    int ret;
+    unsigned char *buf;
+    int bufSize;
+    AMP_Box_T * box = amp_new_box();
+
+    ret = amp_get_unicode(box, "missing_key", &buf, &bufSize);
+
+    fail_unless(ret == AMP_KEY_NOT_FOUND);
+
+    amp_free_box(box);
+}
+END_TEST
+
+
 /* AMP_DateTime_T test cases */
 struct put_dt_case {
     int expectedError;
@@ -1012,6 +1274,172 @@ START_TEST(test__amp_get_datetime)
 END_TEST
 
 
+/* AMP_Decimal_T test cases */
+#define DEC_FIN AMP_DECIMAL_FINITE
+#define DEC_INF AMP_DECIMAL_INFINITY
+#define DEC_NAN AMP_DECIMAL_NAN
+
+struct put_decimal_case {
+    int expectedError;
+    AMP_Decimal_T testValue;
+    char *expectedResult;
+} put_decimal_cases[] = {
+      /* kind    neg  coeff_high  coeff_low  exponent */
+    {0, {DEC_FIN, 0, 0, 12345, -2},   "123.45"},
+    {0, {DEC_FIN, 1, 0, 12345, -2},   "-123.45"},
+    {0, {DEC_FIN, 0, 0, 0,      0},   "0"},
+    {0, {DEC_FIN, 1, 0, 0,      0},   "-0"},
+    {0, {DEC_FIN, 0, 0, 0,     -2},   "0.00"},
+    {0, {DEC_FIN, 0, 0, 150,   -2},   "1.50"},
+    {0, {DEC_FIN, 0, 0, 5,     -3},   "0.005"},
+    {0, {DEC_FIN, 0, 0, 1,     -6},   "0.000001"},
+    {0, {DEC_FIN, 0, 0, 1,     -7},   "1E-7"},
+    {0, {DEC_FIN, 0, 0, 1,      2},   "1E+2"},
+    {0, {DEC_FIN, 0, 0, 12345,  3},   "1.2345E+7"},
+    {0, {DEC_FIN, 0, 0, 123,  -10},   "1.23E-8"},
+
+    /* 2**64 */
+    {0, {DEC_FIN, 0, 1, 0,      0},   "18446744073709551616"},
+
+    /* largest coefficient */
+    {0, {DEC_FIN, 1, ULLONG_MAX, ULLONG_MAX, -38},
+        "-3.40282366920938463463374607431768211455"},
+
+    /* special values */
+    {0, {DEC_INF, 0, 0, 0, 0},        "Infinity"},
+    {0, {DEC_INF, 1, 0, 0, 0},        "-Infinity"},
+    {0, {DEC_NAN, 0, 0, 0, 0},        "NaN"},
+
+    /* bogus kind */
+    {AMP_ENCODE_ERROR, {42, 0, 0, 0, 0}, NULL}
+};
+int num_put_decimal_tests = (sizeof put_decimal_cases /
+                             sizeof put_decimal_cases[0]);
+
+
+START_TEST(test__amp_put_decimal)
+{
+    int ret;
+    unsigned char *buf;
+    int buf_size;
+
+    /* the variable _i is made available by Check's "loop test" machinery */
+    struct put_decimal_case c = put_decimal_cases[_i];
+
+    AMP_Box_T * box = amp_new_box();
+
+    ret = amp_put_decimal(box, "key", &(c.testValue));
+
+    fail_unless(ret == c.expectedError);
+
+    if (!c.expectedError)
+    {
+        amp_get_bytes(box, "key", &buf, &buf_size);
+
+        fail_unless(buf_size == strlen(c.expectedResult),
+                    "ERR: buf_size != %d", strlen(c.expectedResult));
+
+        if (memcmp(buf, c.expectedResult,
+                        strlen(c.expectedResult)) != 0)
+        {
+            debug_print("%s", "buf contains wrong data\n");
+            debug_print("%s", "bad buf: ");
+            printBuf(buf, buf_size);
+            fail("buf does not compare equal to c->expectedResult");
+        }
+    }
+
+    amp_free_box(box);
+}
+END_TEST
+
+
+struct get_decimal_case {
+    int expectedError;
+    char *testValue;
+    AMP_Decimal_T expectedResult;
+} get_decimal_cases[] = {
+    {0, "123.45",     {DEC_FIN, 0, 0, 12345, -2}},
+    {0, "-123.45",    {DEC_FIN, 1, 0, 12345, -2}},
+    {0, "+7",         {DEC_FIN, 0, 0, 7,      0}},
+    {0, "007",        {DEC_FIN, 0, 0, 7,      0}},
+    {0, "-0",         {DEC_FIN, 1, 0, 0,      0}},
+    {0, "0.00",       {DEC_FIN, 0, 0, 0,     -2}},
+    {0, "1.50",       {DEC_FIN, 0, 0, 150,   -2}},
+    {0, "5.",         {DEC_FIN, 0, 0, 5,      0}},
+    {0, ".5",         {DEC_FIN, 0, 0, 5,     -1}},
+    {0, "1E-7",       {DEC_FIN, 0, 0, 1,     -7}},
+    {0, "1e+2",       {DEC_FIN, 0, 0, 1,      2}},
+    {0, "1.2345E+7",  {DEC_FIN, 0, 0, 12345,  3}},
+
+    /* 19 significant digits - the last on the 64-bit path */
+    {0, "9999999999999999999", {DEC_FIN, 0, 0, 9999999999999999999ULL, 0}},
+
+    /* 2**64 - the first past it */
+    {0, "18446744073709551616",  {DEC_FIN, 0, 1, 0, 0}},
+
+    /* largest coefficient, with leading zeros that don't count */
+    {0, "-0003.40282366920938463463374607431768211455",
+        {DEC_FIN, 1, ULLONG_MAX, ULLONG_MAX, -38}},
+
+    /* special values */
+    {0, "Infinity",   {DEC_INF, 0, 0, 0, 0}},
+    {0, "-Infinity",  {DEC_INF, 1, 0, 0, 0}},
+    {0, "NaN",        {DEC_NAN, 0, 0, 0, 0}},
+
+    {AMP_DECODE_ERROR, "",          {0}},
+    {AMP_DECODE_ERROR, "-",         {0}},
+    {AMP_DECODE_ERROR, ".",         {0}},
+    {AMP_DECODE_ERROR, "1.2.3",     {0}},
+    {AMP_DECODE_ERROR, "1E",        {0}},
+    {AMP_DECODE_ERROR, "1E+",       {0}},
+    {AMP_DECODE_ERROR, "1E5x",      {0}},
+    {AMP_DECODE_ERROR, " 1",        {0}},
+    {AMP_DECODE_ERROR, "1 ",        {0}},
+    {AMP_DECODE_ERROR, "infinity",  {0}},
+    {AMP_DECODE_ERROR, "nan",       {0}},
+
+    /* 2**128 */
+    {AMP_OUT_OF_RANGE, "340282366920938463463374607431768211456", {0}},
+    {AMP_OUT_OF_RANGE, "1E9999999999", {0}},
+    {AMP_OUT_OF_RANGE, "0.1E-2147483648", {0}},
+};
+int num_get_decimal_tests = (sizeof get_decimal_cases /
+                             sizeof get_decimal_cases[0]);
+
+
+START_TEST(test__amp_get_decimal)
+{
+    int ret;
+    AMP_Decimal_T dec;
+
+    memset(&dec, 0, sizeof(dec));
+
+    /* the variable _i is made available by Check's "loop test" machinery */
+    struct get_decimal_case c = get_decimal_cases[_i];
+
+    AMP_Box_T * box = amp_new_box();
+
+    amp_put_cstring(box, "key", c.testValue);
+
+    ret = amp_get_decimal(box, "key", &dec);
+
+    fail_unless(ret == c.expectedError);
+
+    if (!c.expectedError)
+    {
+        fail_unless(dec.kind == c.expectedResult.kind);
+        fail_unless(dec.negative == c.expectedResult.negative);
+        fail_unless(dec.coeff_high == c.expectedResult.coeff_high);
+        fail_unless(dec.coeff_low == c.expectedResult.coeff_low);
+        fail_unless(dec.exponent == c.expectedResult.exponent);
+    }
+
+    amp_free_box(box);
+}
+END_TEST
+
+
 Suite *make_types_suite()
 {
 
@@ -1076,6 +1504,7 @@ Suite *make_types_suite()
     tcase_add_loop_test(tc_long_long, test__amp_get_long_long, 0,
                         num_get_ll_tests);
     tcase_add_test(tc_long_long, test__amp_get_long_long__no_such_key);
+    tcase_add_test(tc_long_long, test__amp_get_long_long__cached);
     suite_add_tcase(s, tc_long_long);
 
     TCase *tc_int = tcase_create("int");
@@ -1103,18 +1532,38 @@ Suite *make_types_suite()
     tcase_add_loop_test(tc_double, test__amp_get_double__special, 0,
                         num_get_double_special_tests);
     tcase_add_test(tc_double, test__amp_get_double__no_such_key);
+    tcase_add_test(tc_double, test__amp_get_double__cached);
     suite_add_tcase(s, tc_double);
 
+    TCase *tc_array = tcase_create("array");
+    tcase_add_test(tc_array, test__amp_put_int_array);
+    tcase_add_test(tc_array, test__amp_put_int_array__bad_key_size);
+    tcase_add_test(tc_array, test__amp_get_double_array);
+    suite_add_tcase(s, tc_array);
+
     TCase *tc_bool = tcase_create("bool");
     tcase_add_loop_test(tc_bool, test__amp_put_bool, 0, num_put_bool_tests);
     tcase_add_loop_test(tc_bool, test__amp_get_bool, 0, num_get_bool_tests);
     tcase_add_test(tc_bool, test__amp_get_bool__no_such_key);
     suite_add_tcase(s, tc_bool);
 
+    TCase *tc_unicode = tcase_create("unicode");
+    tcase_add_loop_test(tc_unicode, test__amp_put_unicode, 0, num_unicode_tests);
+    tcase_add_loop_test(tc_unicode, test__amp_get_unicode, 0, num_unicode_tests);
+    tcase_add_test(tc_unicode, test__amp_get_unicode__no_such_key);
+    suite_add_tcase(s, tc_unicode);
+
     TCase *tc_dt = tcase_create("datetime");
     tcase_add_loop_test(tc_dt, test__amp_put_datetime, 0, num_put_dt_tests);
     tcase_add_loop_test(tc_dt, test__amp_get_datetime, 0, num_get_dt_tests);
     suite_add_tcase(s, tc_dt);
 
+    TCase *tc_decimal = tcase_create("decimal");
+    tcase_add_loop_test(tc_decimal, test__amp_put_decimal, 0,
+                        num_put_decimal_tests);
+    tcase_add_loop_test(tc_decimal, test__amp_get_decimal, 0,
+                        num_get_decimal_tests);
+    suite_add_tcase(s, tc_decimal);
+
     return s;
 }
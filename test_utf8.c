@@ -0,0 +1,104 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+#include <string.h>
+
+#include <check.h>
+
+#include "amp.h"
+#include "utf8.h"
+
+
+struct utf8_case
+{
+    int expectedResult;
+    char *testValue;
+    int size;
+} utf8_cases[] = {
+    {1, "",                      0},
+    {1, "hello",                 5},
+    {1, "\xC2\xA2",              2}, /* U+00A2 */
+    {1, "\xE2\x82\xAC",          3}, /* U+20AC */
+    {1, "\xED\x9F\xBF",          3}, /* U+D7FF, last before surrogates */
+    {1, "\xEE\x80\x80",          3}, /* U+E000, first after surrogates */
+    {1, "\xF0\x90\x8D\x88",      4}, /* U+10348 */
+    {1, "\xF4\x8F\xBF\xBF",      4}, /* U+10FFFF */
+
+    {0, "\x00",                  1}, /* NUL */
+    {0, "ab\x00" "cd",           5}, /* embedded NUL */
+    {0, "\x80",                  1}, /* stray continuation byte */
+    {0, "\xC0\x80",              2}, /* overlong NUL */
+    {0, "\xC1\xBF",              2}, /* overlong 2-byte */
+    {0, "\xE0\x9F\xBF",          3}, /* overlong 3-byte */
+    {0, "\xF0\x8F\xBF\xBF",      4}, /* overlong 4-byte */
+    {0, "\xED\xA0\x80",          3}, /* surrogate U+D800 */
+    {0, "\xF4\x90\x80\x80",      4}, /* U+110000 */
+    {0, "\xF5\x80\x80\x80",      4}, /* invalid lead byte */
+    {0, "\xE2\x82",              2}, /* truncated */
+    {0, "\xE2\x28\xA1",          3}, /* bad continuation byte */
+};
+int num_utf8_tests = (sizeof(utf8_cases) /
+                      sizeof(struct utf8_case));
+
+START_TEST(test_utf8_valid)
+{
+    /* the variable _i is made available by Check's "loop test" machinery */
+    struct utf8_case c = utf8_cases[_i];
+
+    fail_unless(utf8_valid((unsigned char *)c.testValue, c.size) ==
+                c.expectedResult);
+}
+END_TEST
+
+
+START_TEST(test_utf8_valid__long_buffers)
+{
+    /* Exercise the vectorized ASCII fast-path by placing a multi-byte
+     * character, or a bad byte, at every offset of a buffer that spans
+     * several vectors. */
+    unsigned char buf[100];
+    int i;
+
+    memset(buf, 'a', sizeof(buf));
+    fail_unless(utf8_valid(buf, sizeof(buf)) == 1);
+
+    for (i = 0; i < (int)sizeof(buf) - 1; i++)
+    {
+        memset(buf, 'a', sizeof(buf));
+        buf[i]   = 0xC3;
+        buf[i+1] = 0xA9; /* U+00E9 */
+        fail_unless(utf8_valid(buf, sizeof(buf)) == 1);
+
+        buf[i+1] = 'a'; /* truncated sequence */
+        fail_unless(utf8_valid(buf, sizeof(buf)) == 0);
+
+        buf[i] = '\0';
+        fail_unless(utf8_valid(buf, sizeof(buf)) == 0);
+    }
+
+    /* bad byte in the last position */
+    memset(buf, 'a', sizeof(buf));
+    buf[sizeof(buf)-1] = 0xFF;
+    fail_unless(utf8_valid(buf, sizeof(buf)) == 0);
+
+    /* the size is respected - bytes beyond it are not examined */
+    fail_unless(utf8_valid(buf, sizeof(buf)-1) == 1);
+}
+END_TEST
+
+
+Suite *make_utf8_suite(void)
+{
+    Suite *s = suite_create ("utf8");
+
+    TCase *tc_utf8 = tcase_create("utf8");
+
+    tcase_add_loop_test(tc_utf8, test_utf8_valid, 0, num_utf8_tests);
+    tcase_add_test(tc_utf8, test_utf8_valid__long_buffers);
+
+    suite_add_tcase(s, tc_utf8);
+    return s;
+};
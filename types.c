@@ -13,6 +13,7 @@
 #define _ISOC99_SOURCE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
@@ -23,6 +24,7 @@
 #include "amp.h"
 #include "amp_internal.h"
 #include "buftoll.h"
+#include "utf8.h"
 
 
 /* AMP Type: Bytes (known as String in Twisted) */
@@ -49,6 +51,42 @@ int amp_put_cstring(AMP_Box_T *box, const char *key, const char *value)
     return _amp_put_buf(box, key, (unsigned char*)value, strlen(value));
 }
 
+/* AMP Type: Unicode (UTF-8 encoded text) */
+
+/* Validate and store a buffer of UTF-8 encoded text into an AMP_Box.
+ * Returns 0 on success, AMP_ENCODE_ERROR if the buffer is not valid
+ * UTF-8, or another AMP_* error code on failure. */
+int amp_put_unicode(AMP_Box_T *box, const char *key,
+                    const unsigned char *buf, int buf_size)
+{
+    if (!utf8_valid(buf, buf_size))
+        return AMP_ENCODE_ERROR;
+
+    return _amp_put_buf(box, key, buf, buf_size);
+}
+
+/* Retrieve a buffer of UTF-8 encoded text from an AMP_Box, after
+ * checking that it is valid UTF-8.
+ * Returns 0 on success, AMP_DECODE_ERROR if the value is not valid
+ * UTF-8, or another AMP_* error code on failure. */
+int amp_get_unicode(AMP_Box_T *box, const char *key,
+                    unsigned char **buf, int *size)
+{
+    int err;
+    unsigned char *value;
+    int value_size;
+
+    if ( (err = _amp_get_buf(box, key, &value, &value_size)) != 0)
+        return err;
+
+    if (!utf8_valid(value, value_size))
+        return AMP_DECODE_ERROR;
+
+    *buf = value;
+    *size = value_size;
+    return 0;
+}
+
 /* AMP Type: Boolean */
 
 /* Encode and store a boolean value into an AMP_Box.
@@ -86,26 +124,102 @@ int amp_get_bool(AMP_Box_T *box, const char *key, int *value)
     return 0;
 }
 
+/* Decode the integer stored under `key', using the keyval's cached
+ * decoded value if an earlier amp_get_* call has already parsed it.
+ * Only successful conversions are cached, so that a bad value reports
+ * its error on every call.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+static int get_long_long_cached(AMP_Box_T *box, const char *key,
+                                long long *value)
+{
+    int err;
+    long long tmp;
+    struct amp_key_value *keyval;
+
+    if ( (err = _amp_get_keyval(box, key, &keyval)) != 0)
+        return err;
+
+    if (keyval->decodedType == DECODED_LONG_LONG)
+    {
+        *value = keyval->decoded.ll;
+        return 0;
+    }
+
+    tmp = buftoll(keyval->value, keyval->valueSize, &err);
+    if (err != 0)
+        return err;
+
+    keyval->decodedType = DECODED_LONG_LONG;
+    keyval->decoded.ll = tmp;
+    *value = tmp;
+    return 0;
+}
+
+
+/* Number of bytes in the base-10 representation of `magnitude',
+ * including a "-" sign if `neg' is set. */
+static int integer_size(unsigned long long magnitude, int neg)
+{
+    int size = 1;
+
+    while (magnitude >= 10)
+    {
+        magnitude /= 10;
+        size++;
+    }
+    return neg ? size + 1 : size;
+}
+
+
+/* Write the `size' byte base-10 representation of `magnitude', preceded
+ * by a "-" sign if `neg' is set, directly in to `out'. The digits are
+ * written right-to-left in their final position. */
+static void format_integer(unsigned char *out, int size,
+                           unsigned long long magnitude, int neg)
+{
+    if (neg)
+        *out = '-';
+
+    out += size;
+    do
+    {
+        *--out = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+}
+
+
+/* Encode an integer straight in to the box's own storage for `key',
+ * rather than formatting in to a temporary buffer that must be copied.
+ * The storage is sized from the digit count, so it holds no more than
+ * the encoded value.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+static int put_integer(AMP_Box_T *box, const char *key,
+                       unsigned long long magnitude, int neg)
+{
+    int ret;
+    int size = integer_size(magnitude, neg);
+    struct amp_key_value *keyval;
+
+    if ( (ret = _amp_new_keyval(key, size, &keyval)) != 0)
+        return ret;
+
+    format_integer(keyval->value, size, magnitude, neg);
+
+    return _amp_store_keyval(box, keyval);
+}
+
+
 /* Encode and store a `long long' into an AMP_Box.
  * Returns 0 on success, or an AMP_* error code on failure. */
 int amp_put_long_long(AMP_Box_T *box, const char *key,
                       long long value)
 {
-    /* A ludicrous way to determine the maximum number of base-10 digits
-     * required to represent any `long long' on this system.
-     *
-     * add 3 because:
-     *         1) round up because casting to `int' truncates the `double'
-     *         2) need extra byte to hold possible "-" sign char
-     *         3) extra byte to hold NUL-terminator
-     *
-     * Any sane person would have just done char buf[100];
-     */
-    int bufLen = ((int)(log10(pow(2, sizeof(long long)*CHAR_BIT)))) + 3;
-    char buf[bufLen];
-
-    snprintf(buf, bufLen, "%lld", value);
-    return _amp_put_buf(box, key, (unsigned char *)buf, strlen(buf));
+    /* negate as unsigned so that LLONG_MIN doesn't overflow */
+    if (value < 0)
+        return put_integer(box, key, -(unsigned long long)value, 1);
+    else
+        return put_integer(box, key, value, 0);
 }
 
 
@@ -115,18 +229,7 @@ int amp_put_long_long(AMP_Box_T *box, const char *key,
 int amp_get_long_long(AMP_Box_T *box, const char *key,
                       long long *value)
 {
-    int err;
-    unsigned char *buf;
-    int buf_size;
-
-    if ( (err = _amp_get_buf(box, key, &buf, &buf_size)) != 0)
-        return err;
-
-    *value = buftoll(buf, buf_size, &err);
-
-    /* `err' will have been set to 0 if conversion was successful.
-     * Otherwise it will be an AMP_* error code. */
-    return err;
+    return get_long_long_cached(box, key, value);
 }
 
 /* AMP Type: Integer (C type `int') */
@@ -135,20 +238,7 @@ int amp_get_long_long(AMP_Box_T *box, const char *key,
  * Returns 0 on success, or an AMP_* error code on failure. */
 int amp_put_int(AMP_Box_T *box, const char *key, int value)
 {
-    /* A ludicrous way to determine the maximum number of base-10 digits
-     * required to represent any `int' on this system. */
-    /* add 3 because:
-     *         1) round up because casting to `int' truncates the `double'
-     *         2) need extra byte to hold possible "-" sign char
-     *         3) extra byte to hold NUL-terminator
-     *
-     * Any sane person would have just done char buf[100];
-     */
-    int bufLen = ((int)(log10(pow(2, sizeof(int)*CHAR_BIT)))) + 3;
-    char buf[bufLen];
-
-    snprintf(buf, bufLen, "%d", value);
-    return _amp_put_buf(box, key, (unsigned char *)buf, strlen(buf));
+    return amp_put_long_long(box, key, value);
 }
 
 
@@ -158,31 +248,19 @@ int amp_put_int(AMP_Box_T *box, const char *key, int value)
 int amp_get_int(AMP_Box_T *box, const char *key, int *value)
 {
     int err;
-    unsigned char *buf;
-    int buf_size;
     long long tmp = 0;
 
-    if ( (err = _amp_get_buf(box, key, &buf, &buf_size)) != 0)
+    if ( (err = get_long_long_cached(box, key, &tmp)) != 0)
         return err;
 
-    tmp = buftoll(buf, buf_size, &err);
-    if (err == 0)
+    if (tmp >= INT_MIN && tmp <= INT_MAX)
     {
-        if (tmp >= INT_MIN && tmp <= INT_MAX)
-        {
-            *value = (int)tmp;
-            return 0;
-        }
-        else
-        {
-            return AMP_OUT_OF_RANGE;
-        }
+        *value = (int)tmp;
+        return 0;
     }
     else
     {
-        /* `err' will have been set to 0 if conversion was successful.
-         * Otherwise it will be an AMP_* error code. */
-        return err;
+        return AMP_OUT_OF_RANGE;
     }
 }
 
@@ -190,14 +268,7 @@ int amp_get_int(AMP_Box_T *box, const char *key, int *value)
  * Returns 0 on success, or an AMP_* error code on failure. */
 int amp_put_uint(AMP_Box_T *box, const char *key, unsigned int value)
 {
-    /* calculate maximum number of base-10 digits required to represent
-     * any `unsigned int' on this system. same as for amp_put_int(), minus
-     * one character since we won't need a '-' sign. */
-    int bufLen = ((int)(log10(pow(2, sizeof(unsigned int)*8)))) + 2;
-    char buf[bufLen];
-
-    snprintf(buf, bufLen, "%u", value);
-    return _amp_put_buf(box, key, (unsigned char *)buf, strlen(buf));
+    return put_integer(box, key, value, 0);
 }
 
 
@@ -207,95 +278,120 @@ int amp_put_uint(AMP_Box_T *box, const char *key, unsigned int value)
 int amp_get_uint(AMP_Box_T *box, const char *key, unsigned int *value)
 {
     int err;
-    unsigned char *buf;
-    int buf_size;
     long long tmp = 0;
 
-    if ( (err = _amp_get_buf(box, key, &buf, &buf_size)) != 0)
+    if ( (err = get_long_long_cached(box, key, &tmp)) != 0)
         return err;
 
-    tmp = buftoll(buf, buf_size, &err);
-    if (err == 0)
+    if (tmp >= 0 && tmp <= UINT_MAX)
     {
-        if (tmp >= 0 && tmp <= UINT_MAX)
-        {
-            *value = (unsigned int)tmp;
-            return 0;
-        }
-        else
-        {
-            return AMP_OUT_OF_RANGE;
-        }
+        *value = (unsigned int)tmp;
+        return 0;
     }
     else
     {
-        /* `err' will have been set to 0 if conversion was successful.
-         * Otherwise it will be an AMP_* error code. */
-        return err;
+        return AMP_OUT_OF_RANGE;
     }
 }
 
 /* AMP Type: Float (C `double') */
 
+/* Room on the stack for a formatted `double'. "%.17f" of any value
+ * below 1e13 in magnitude fits; larger ones are formatted a second time,
+ * once their exact size is known. */
+#define AMP_DOUBLE_FORMAT_SIZE 32
+
 /* Encode and store a `double' in to an AMP_Box.
  * Returns 0 on success, or an AMP_* error code on failure. */
 int amp_put_double(AMP_Box_T *box, const char *key, double value)
 {
-    unsigned char buf[100];
+    int ret;
     int buf_size;
+    char buf[AMP_DOUBLE_FORMAT_SIZE + 1];
+    struct amp_key_value *keyval;
 
     if (isnan(value))
     {
-        buf_size = 3;
-        strncpy((char *)buf, "nan", buf_size);
+        return _amp_put_buf(box, key, (unsigned char *)"nan", 3);
     }
     else if (isinf(value))
     {
         if (signbit(value) == 0)
-        {
-            /* positive */
-            buf_size = 3;
-            strncpy((char *)buf, "inf", buf_size);
-        }
+            return _amp_put_buf(box, key, (unsigned char *)"inf", 3);
         else
-        {
-            /* negative */
-            buf_size = 4;
-            strncpy((char *)buf, "-inf", buf_size);
-        }
+            return _amp_put_buf(box, key, (unsigned char *)"-inf", 4);
     }
+
+    /* not Infinity or NaN so assume a normal float. It is formatted on
+     * the stack first, so that the box's storage for it can be allocated
+     * at its exact size. The spare byte after the value absorbs the
+     * NUL-terminator that snprintf() insists on writing. */
+    buf_size = snprintf(buf, sizeof(buf), "%.17f", value);
+
+    if ( (ret = _amp_new_keyval(key, buf_size, &keyval)) != 0)
+        return ret;
+
+    if (buf_size > AMP_DOUBLE_FORMAT_SIZE)
+        /* Very large magnitude - now that we know the exact size */
+        snprintf((char *)keyval->value, buf_size + 1, "%.17f", value);
     else
-    {
-        /* not Infinity or NaN so assume a normal float */
-        buf_size = snprintf((char *)buf, 100, "%.17f", value);
-    }
+        memcpy(keyval->value, buf, buf_size);
 
-    return _amp_put_buf(box, key, buf, buf_size);
+    return _amp_store_keyval(box, keyval);
 }
 
-/* Retrieve and decode a `double' from an AMP_Box.
- * Stores the decoded floating-point number in to the `double'
- * pointed to by `value'.
+/* fractionFactor[i] is the factor applied to the (i+1)th digit after the
+ * decimal point: 0.1 divided by 10, `i' times, in double precision. The
+ * values are spelled out in hex so that they reproduce that sequence of
+ * divisions bit-for-bit, rather than being the (differently rounded)
+ * nearest doubles to the exact powers of ten. Digits beyond the table
+ * fall back to dividing. */
+static const double fractionFactors[] = {
+    0x1.999999999999ap-4, /* 0.10000000000000001 */
+    0x1.47ae147ae147bp-7, /* 0.01 */
+    0x1.0624dd2f1a9fcp-10, /* 0.001 */
+    0x1.a36e2eb1c432dp-14, /* 0.0001 */
+    0x1.4f8b588e368f1p-17, /* 1.0000000000000001e-05 */
+    0x1.0c6f7a0b5ed8ep-20, /* 1.0000000000000002e-06 */
+    0x1.ad7f29abcaf4ap-24, /* 1.0000000000000002e-07 */
+    0x1.5798ee2308c3bp-27, /* 1.0000000000000002e-08 */
+    0x1.12e0be826d696p-30, /* 1.0000000000000003e-09 */
+    0x1.b7cdfd9d7bdbdp-34, /* 1.0000000000000003e-10 */
+    0x1.5fd7fe1796497p-37, /* 1.0000000000000003e-11 */
+    0x1.19799812dea12p-40, /* 1.0000000000000002e-12 */
+    0x1.c25c268497683p-44, /* 1.0000000000000002e-13 */
+    0x1.6849b86a12b9cp-47, /* 1.0000000000000002e-14 */
+    0x1.203af9ee75616p-50, /* 1.0000000000000001e-15 */
+    0x1.cd2b297d889bdp-54, /* 1.0000000000000001e-16 */
+    0x1.70ef54646d497p-57, /* 1.0000000000000001e-17 */
+    0x1.2725dd1d243acp-60, /* 1.0000000000000001e-18 */
+    0x1.d83c94fb6d2adp-64, /* 1.0000000000000001e-19 */
+    0x1.79ca10c924224p-67, /* 1.0000000000000001e-20 */
+    0x1.2e3b40a0e9b5p-70, /* 1.0000000000000001e-21 */
+    0x1.e392010175ee6p-74, /* 1e-22 */
+    0x1.82db34012b252p-77, /* 1.0000000000000001e-23 */
+    0x1.357c299a88ea8p-80, /* 1.0000000000000001e-24 */
+};
+#define NUM_FRACTION_FACTORS \
+        ((int)(sizeof(fractionFactors) / sizeof(fractionFactors[0])))
+
+
+/* Parse the AMP Float representation held in `buf'.
  * Returns 0 on success, or an AMP_* error code on failure. */
-int amp_get_double(AMP_Box_T *box, const char *key, double *value)
+static int buftod(unsigned char *buf, int buf_size, double *value)
 {
-    unsigned char *buf;
-    int buf_size;
-    int ret;
     int base = 10;    /* we only parse base-10 numbers */
     int any = 0;      /* have we parsed any digits at all? */
     int neg = 0;      /* have parsed a negative sign? */
-    int gotDot = 0;   /* have we parsed a dot ('.'), yet? */
     double acc = 0.0; /* accumulator */
     double fractionFactor = 0.1;
+    int fractionDigits = 0; /* number of digits parsed after the dot */
+    unsigned long long mag = 0; /* integer accumulator for the fast path */
 
-    int size;         /* copy of buf_size that we decrement in the loop below */
-    int c;            /* the character being parsed */
+    int size;         /* copy of buf_size that we decrement in the loops below */
+    int c;            /* the first character */
     unsigned char *s; /* pointer in to input buffer */
 
-    if ( (ret = _amp_get_buf(box, key, &buf, &buf_size)) != 0)
-        return ret;
-
     s = buf;
     size = buf_size;
 
@@ -331,7 +427,12 @@ int amp_get_double(AMP_Box_T *box, const char *key, double *value)
     /* Not a recognized special value */
 
     /* Try to parse it as decimal digits with an optional leading sign
-     * character (+ or -). */
+     * character (+ or -), then an optional decimal point followed by
+     * more digits.
+     *
+     * The magnitude is accumulated and the sign applied at the end,
+     * which gives the same result as accumulating a negative value
+     * since IEEE rounding is symmetric about zero. */
 
     c = *s; /* grab first char - guaranteed to have at least one char in buf at this point */
 
@@ -349,75 +450,97 @@ int amp_get_double(AMP_Box_T *box, const char *key, double *value)
         neg = 1;
     }
 
-    while (size-- > 0)
+    /* Fast path for the leading integer digits: while the running total
+     * stays below 2**53 the floating-point arithmetic in the loop below
+     * is exact, so accumulating in an integer gives an identical result
+     * without a floating-point multiply per digit. */
+    while (size > 0 && *s >= '0' && *s <= '9' &&
+           mag <= ((1ULL << 53) - 9) / 10)
     {
-        c = *s++;
+        mag = mag * 10 + (*s++ - '0');
+        size--;
+        any = 1;
+    }
+    acc = (double)mag;
 
-        if (isdigit(c))
-        {
-            c -= '0';
-        }
-        else
-        {
-            if (c == '.' && !gotDot && any)
-            {
-                /* 1) found a decimal point
-                 * 2) haven't found one before
-                 * 3) have parsed at least one digit before now */
+    /* parsing the rest of the integer portion, if any */
+    while (size > 0 && *s >= '0' && *s <= '9')
+    {
+        acc = acc * base + (*s++ - '0');
+        size--;
+    }
 
-                gotDot = 1;
-                continue;
-            }
-            else
-            {
-                return AMP_DECODE_ERROR;
-            }
-        }
+    if (size > 0 && *s == '.')
+    {
+        /* a decimal point must follow at least one digit */
+        if (!any)
+            return AMP_DECODE_ERROR;
 
-        any = 1; /* have seen at least one digit now */
+        s++;
+        size--;
 
-        if (!gotDot)
+        /* parsing fractional portion */
+        while (size > 0 && *s >= '0' && *s <= '9')
         {
-            /* parsing integer portion */
-
-            if (neg)
-            {
-                /* building a negative value... */
-                acc *= base;
-                acc -= c;
-            }
+            if (fractionDigits < NUM_FRACTION_FACTORS)
+                fractionFactor = fractionFactors[fractionDigits];
             else
-            {
-                /* building a positive value... */
-                acc *= base;
-                acc += c;
-            }
-        }
-        else
-        {
-            /* parsing fractional portion */
+                fractionFactor /= 10;
+            fractionDigits++;
 
-            if (neg)
-            {
-                /* building a negative value... */
-                acc -= c * fractionFactor;
-            }
-            else
-            {
-                /* building a positive value... */
-                acc += c * fractionFactor;
-            }
-            fractionFactor /= 10;
+            acc += (*s++ - '0') * fractionFactor;
+            size--;
         }
     }
 
+    if (size != 0) /* trailing garbage, such as a second decimal point */
+        return AMP_DECODE_ERROR;
+
     if (!any) /* never parsed a digit */
         return AMP_DECODE_ERROR;
 
-    *value = acc;
+    /* subtract from 0.0 rather than negating, so "-0" gives +0.0 */
+    *value = neg ? 0.0 - acc : acc;
     return 0;
 }
 
+/* Decode the `double' held by `keyval', via its decoded-value cache.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+static int get_double_keyval(struct amp_key_value *keyval, double *value)
+{
+    int ret;
+    double tmp;
+
+    if (keyval->decodedType == DECODED_DOUBLE)
+    {
+        *value = keyval->decoded.d;
+        return 0;
+    }
+
+    if ( (ret = buftod(keyval->value, keyval->valueSize, &tmp)) != 0)
+        return ret;
+
+    keyval->decodedType = DECODED_DOUBLE;
+    keyval->decoded.d = tmp;
+    *value = tmp;
+    return 0;
+}
+
+/* Retrieve and decode a `double' from an AMP_Box.
+ * Stores the decoded floating-point number in to the `double'
+ * pointed to by `value'.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int amp_get_double(AMP_Box_T *box, const char *key, double *value)
+{
+    int ret;
+    struct amp_key_value *keyval;
+
+    if ( (ret = _amp_get_keyval(box, key, &keyval)) != 0)
+        return ret;
+
+    return get_double_keyval(keyval, value);
+}
+
 
 /* AMP Type: DateTime (C type `AMP_DateTime_T *') */
 
@@ -552,3 +675,390 @@ int amp_get_datetime(AMP_Box_T *box, const char *key, AMP_DateTime_T *value)
     return 0;
 }
 
+
+/* AMP Type: Decimal (C type `AMP_Decimal_T *') */
+
+
+/* Enough room for the longest encoding we produce: a sign, the 39 digits
+ * of a 128-bit coefficient, and either a decimal point with up to 6
+ * leading zeros, or an exponent suffix such as "E-2147483686". */
+#define AMP_DECIMAL_MAX_SIZE 64
+
+
+/* Split a 128-bit coefficient in to 32-bit limbs, least-significant first,
+ * so that the slow paths below can do long multiplication and division
+ * using only 64-bit arithmetic. */
+static void decimal_to_limbs(unsigned long long hi, unsigned long long lo,
+                             uint32_t limb[4])
+{
+    limb[0] = (uint32_t)(lo & 0xffffffffULL);
+    limb[1] = (uint32_t)((lo >> 32) & 0xffffffffULL);
+    limb[2] = (uint32_t)(hi & 0xffffffffULL);
+    limb[3] = (uint32_t)((hi >> 32) & 0xffffffffULL);
+}
+
+static void decimal_from_limbs(uint32_t limb[4], unsigned long long *hi,
+                               unsigned long long *lo)
+{
+    *lo = ((unsigned long long)limb[1] << 32) | limb[0];
+    *hi = ((unsigned long long)limb[3] << 32) | limb[2];
+}
+
+/* Multiply the coefficient by 10 and add `digit'.
+ * Returns 0 on success, or AMP_OUT_OF_RANGE if it no longer fits. */
+static int decimal_mul10_add(unsigned long long *hi, unsigned long long *lo,
+                             int digit)
+{
+    uint32_t limb[4];
+    uint64_t t;
+    uint64_t carry = digit;
+    int i;
+
+    decimal_to_limbs(*hi, *lo, limb);
+
+    for (i = 0; i < 4; i++)
+    {
+        t = (uint64_t)limb[i] * 10 + carry;
+        limb[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+
+    if (carry)
+        return AMP_OUT_OF_RANGE;
+
+    decimal_from_limbs(limb, hi, lo);
+    return 0;
+}
+
+/* Divide the coefficient by 10 in place and return the remainder. */
+static int decimal_divmod10(unsigned long long *hi, unsigned long long *lo)
+{
+    uint32_t limb[4];
+    uint64_t t;
+    uint64_t rem = 0;
+    int i;
+
+    decimal_to_limbs(*hi, *lo, limb);
+
+    for (i = 3; i >= 0; i--)
+    {
+        t = (rem << 32) | limb[i];
+        limb[i] = (uint32_t)(t / 10);
+        rem = t % 10;
+    }
+
+    decimal_from_limbs(limb, hi, lo);
+    return (int)rem;
+}
+
+
+/* Encode and store an `AMP_Decimal' in to an AMP_Box.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int amp_put_decimal(AMP_Box_T *box, const char *key, AMP_Decimal_T *value)
+{
+    char buf[AMP_DECIMAL_MAX_SIZE];
+    char digits[40]; /* coefficient digits, least-significant first */
+    int ndigits = 0;
+    int len = 0;
+    int i;
+    long long adjusted;
+    unsigned long long hi = value->coeff_high;
+    unsigned long long lo = value->coeff_low;
+
+    switch (value->kind)
+    {
+        case AMP_DECIMAL_FINITE:
+            break;
+        case AMP_DECIMAL_INFINITY:
+            return amp_put_cstring(box, key,
+                                   value->negative ? "-Infinity" : "Infinity");
+        case AMP_DECIMAL_NAN:
+            return amp_put_cstring(box, key, value->negative ? "-NaN" : "NaN");
+        default:
+            return AMP_ENCODE_ERROR;
+    }
+
+    /* Only coefficients wider than 64 bits need the long division; the
+     * rest of the digits come from native 64-bit division. */
+    while (hi != 0)
+        digits[ndigits++] = '0' + decimal_divmod10(&hi, &lo);
+
+    do
+    {
+        digits[ndigits++] = '0' + (lo % 10);
+        lo /= 10;
+    } while (lo != 0);
+
+    if (value->negative)
+        buf[len++] = '-';
+
+    /* Same rules as Python's Decimal.__str__() (the "to-scientific-string"
+     * operation of the General Decimal Arithmetic specification): use plain
+     * notation unless the exponent is positive or the value is very small */
+    adjusted = (long long)value->exponent + ndigits - 1;
+
+    if (value->exponent <= 0 && adjusted >= -6)
+    {
+        int int_digits = ndigits + value->exponent;
+
+        if (int_digits > 0)
+        {
+            for (i = ndigits - 1; i >= ndigits - int_digits; i--)
+                buf[len++] = digits[i];
+        }
+        else
+        {
+            buf[len++] = '0';
+        }
+
+        if (value->exponent < 0)
+        {
+            buf[len++] = '.';
+            for (i = int_digits; i < 0; i++)
+                buf[len++] = '0';
+            for (i = (int_digits > 0 ? ndigits - int_digits : ndigits) - 1;
+                 i >= 0; i--)
+                buf[len++] = digits[i];
+        }
+    }
+    else
+    {
+        buf[len++] = digits[ndigits - 1];
+        if (ndigits > 1)
+        {
+            buf[len++] = '.';
+            for (i = ndigits - 2; i >= 0; i--)
+                buf[len++] = digits[i];
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "E%+lld", adjusted);
+    }
+
+    return _amp_put_buf(box, key, (unsigned char *)buf, len);
+}
+
+
+/* Retrieve and decode an `AMP_Decimal' from an AMP_Box.
+ * Stores the decoded data in to the `AMP_Decimal' pointed to by `value'.
+ * Returns 0 on success, or an AMP_* error code on failure. */
+int amp_get_decimal(AMP_Box_T *box, const char *key, AMP_Decimal_T *value)
+{
+    int err;
+    unsigned char *buf;
+    int buf_size;
+
+    unsigned char *s, *end;
+    int c;
+    int neg = 0;        /* have parsed a negative sign? */
+    int any = 0;        /* have we parsed any digits at all? */
+    int gotDot = 0;     /* have we parsed a dot ('.'), yet? */
+    int sigDigits = 0;  /* significant digits accumulated so far */
+    int fracDigits = 0; /* digits parsed after the dot */
+    unsigned long long hi = 0, lo = 0;
+    long long exponent = 0;
+
+    if ( (err = _amp_get_buf(box, key, &buf, &buf_size)) != 0)
+        return err;
+
+    s = buf;
+    end = buf + buf_size;
+
+    if (s < end && (*s == '-' || *s == '+'))
+    {
+        neg = (*s == '-');
+        s++;
+    }
+
+    /* check for special values */
+    if (end - s == 8 && memcmp(s, "Infinity", 8) == 0)
+    {
+        value->kind = AMP_DECIMAL_INFINITY;
+        value->negative = neg;
+        value->coeff_high = value->coeff_low = 0;
+        value->exponent = 0;
+        return 0;
+    }
+    else if (end - s == 3 && memcmp(s, "NaN", 3) == 0)
+    {
+        value->kind = AMP_DECIMAL_NAN;
+        value->negative = neg;
+        value->coeff_high = value->coeff_low = 0;
+        value->exponent = 0;
+        return 0;
+    }
+
+    /* Parse the coefficient. Up to 19 significant digits always fit in
+     * 64 bits, so those accumulate with plain integer arithmetic. Only
+     * longer coefficients take the 128-bit path. */
+    for (; s < end; s++)
+    {
+        c = *s;
+
+        if (c >= '0' && c <= '9')
+        {
+            any = 1;
+            if (gotDot)
+                fracDigits++;
+
+            if (sigDigits < 19)
+            {
+                lo = lo * 10 + (c - '0');
+                if (lo != 0)
+                    sigDigits++;
+            }
+            else if ( (err = decimal_mul10_add(&hi, &lo, c - '0')) != 0)
+                return err;
+        }
+        else if (c == '.' && !gotDot)
+        {
+            gotDot = 1;
+        }
+        else
+            break;
+    }
+
+    if (!any) /* never parsed a digit */
+        return AMP_DECODE_ERROR;
+
+    /* optional exponent */
+    if (s < end)
+    {
+        if (*s != 'E' && *s != 'e')
+            return AMP_DECODE_ERROR;
+        s++;
+
+        exponent = buftoll_range(s, end - s, INT_MIN, INT_MAX, &err);
+        if (err)
+            return err;
+    }
+
+    exponent -= fracDigits;
+    if (exponent < INT_MIN)
+        return AMP_OUT_OF_RANGE;
+
+    value->kind = AMP_DECIMAL_FINITE;
+    value->negative = neg;
+    value->coeff_high = hi;
+    value->coeff_low = lo;
+    value->exponent = (int)exponent;
+    return 0;
+}
+
+
+/* Arrays of numbers, stored one element per key.
+ *
+ * The encoders store element `i' under the key formed by appending the
+ * decimal index to a prefix - e.g. "v0", "v1", "v2" ... for the prefix
+ * "v". The decoders take an explicit array of keys, so that a caller
+ * decoding the same layout repeatedly can build the key list once. */
+
+
+/* Build the key for element `index' of an array in to `keybuf', which
+ * must have room for MAX_KEY_LENGTH + 1 bytes.
+ * Returns 0 on success, or AMP_BAD_KEY_SIZE if the key would be too long. */
+static int array_key(char *keybuf, const char *prefix, int prefixLen,
+                     int index)
+{
+    int numDigits = integer_size(index, 0);
+
+    if (prefixLen + numDigits > MAX_KEY_LENGTH)
+        return AMP_BAD_KEY_SIZE;
+
+    memcpy(keybuf, prefix, prefixLen);
+    format_integer((unsigned char *)keybuf + prefixLen, numDigits, index, 0);
+    keybuf[prefixLen + numDigits] = '\0';
+    return 0;
+}
+
+
+/* Encode and store `n' `int's in to an AMP_Box under the keys
+ * "<prefix>0" to "<prefix>n-1".
+ * Returns 0 on success, or an AMP_* error code on failure. On error,
+ * the elements before the one that failed will have been stored. */
+int amp_put_int_array(AMP_Box_T *box, const char *prefix,
+                      const int *values, int n)
+{
+    char keybuf[MAX_KEY_LENGTH + 1];
+    int prefixLen = strlen(prefix);
+    int ret;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if ( (ret = array_key(keybuf, prefix, prefixLen, i)) != 0)
+            return ret;
+
+        if ( (ret = amp_put_long_long(box, keybuf, values[i])) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+
+/* Retrieve and decode `n' `int's from an AMP_Box, one per key.
+ * Returns 0 on success, or an AMP_* error code on failure. On error,
+ * the elements before the one that failed will have been filled in. */
+int amp_get_int_array(AMP_Box_T *box, const char **keys, int n,
+                      int *values)
+{
+    int ret;
+    int i;
+    long long tmp;
+
+    for (i = 0; i < n; i++)
+    {
+        if ( (ret = get_long_long_cached(box, keys[i], &tmp)) != 0)
+            return ret;
+
+        if (tmp < INT_MIN || tmp > INT_MAX)
+            return AMP_OUT_OF_RANGE;
+
+        values[i] = (int)tmp;
+    }
+    return 0;
+}
+
+
+/* Encode and store `n' `double's in to an AMP_Box under the keys
+ * "<prefix>0" to "<prefix>n-1".
+ * Returns 0 on success, or an AMP_* error code on failure. On error,
+ * the elements before the one that failed will have been stored. */
+int amp_put_double_array(AMP_Box_T *box, const char *prefix,
+                         const double *values, int n)
+{
+    char keybuf[MAX_KEY_LENGTH + 1];
+    int prefixLen = strlen(prefix);
+    int ret;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if ( (ret = array_key(keybuf, prefix, prefixLen, i)) != 0)
+            return ret;
+
+        if ( (ret = amp_put_double(box, keybuf, values[i])) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+
+/* Retrieve and decode `n' `double's from an AMP_Box, one per key.
+ * Returns 0 on success, or an AMP_* error code on failure. On error,
+ * the elements before the one that failed will have been filled in. */
+int amp_get_double_array(AMP_Box_T *box, const char **keys, int n,
+                         double *values)
+{
+    struct amp_key_value *keyval;
+    int ret;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if ( (ret = _amp_get_keyval(box, keys[i], &keyval)) != 0)
+            return ret;
+
+        if ( (ret = get_double_keyval(keyval, &values[i])) != 0)
+            return ret;
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/*
+ * UTF-8 validation for the AMP Unicode type.
+ *
+ * Text on the wire is overwhelmingly ASCII, so runs of plain ASCII are
+ * skipped a whole vector at a time (32 bytes with AVX2, 16 with SSE2)
+ * and only the bytes that start a multi-byte sequence - or a NUL - are
+ * examined individually. Builds without SSE2 use the scalar loop alone.
+ *
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "utf8.h"
+
+
+/* Check the multi-byte sequence starting at `s', whose lead byte is
+ * known to be >= 0x80. Returns the length of the sequence, or 0 if it
+ * is not well-formed.
+ *
+ * The ranges allowed for the second byte are those of Table 3-7
+ * ("Well-Formed UTF-8 Byte Sequences") in the Unicode Standard, which
+ * excludes overlong forms (C0, C1, E0 80..9F, F0 80..8F), surrogates
+ * (ED A0..BF) and code points above U+10FFFF (F4 90..BF, F5..FF). */
+static int utf8_sequence_length(const unsigned char *s, int remaining)
+{
+    unsigned char lead = s[0];
+    unsigned char lo = 0x80; /* allowed range of the second byte */
+    unsigned char hi = 0xBF;
+    int len, i;
+
+    if (lead < 0xC2)
+        return 0; /* stray continuation byte, or overlong 2-byte form */
+    else if (lead < 0xE0)
+        len = 2;
+    else if (lead < 0xF0)
+    {
+        len = 3;
+        if (lead == 0xE0)
+            lo = 0xA0;
+        else if (lead == 0xED)
+            hi = 0x9F;
+    }
+    else if (lead < 0xF5)
+    {
+        len = 4;
+        if (lead == 0xF0)
+            lo = 0x90;
+        else if (lead == 0xF4)
+            hi = 0x8F;
+    }
+    else
+        return 0;
+
+    if (remaining < len)
+        return 0; /* truncated */
+
+    if (s[1] < lo || s[1] > hi)
+        return 0;
+
+    for (i = 2; i < len; i++)
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+
+    return len;
+}
+
+
+int utf8_valid(const unsigned char *buf, int size)
+{
+    const unsigned char *s = buf;
+    const unsigned char *end = buf + (size > 0 ? size : 0);
+    int len;
+
+    while (s < end)
+    {
+        /* Skip ahead over plain ASCII. A vector is "plain" if no byte has
+         * the high bit set and no byte is NUL. Otherwise we stop at the
+         * first offending byte and let the scalar code below judge it. */
+#if defined(__AVX2__)
+        const __m256i zero32 = _mm256_setzero_si256();
+        while (end - s >= 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)s);
+            unsigned int mask = (unsigned int)_mm256_movemask_epi8(v) |
+                (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero32));
+            if (mask != 0)
+            {
+                s += __builtin_ctz(mask);
+                goto scalar;
+            }
+            s += 32;
+        }
+#endif
+#if defined(__SSE2__)
+        {
+            const __m128i zero16 = _mm_setzero_si128();
+            while (end - s >= 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i *)s);
+                unsigned int mask = (unsigned int)_mm_movemask_epi8(v) |
+                    (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero16));
+                if (mask != 0)
+                {
+                    s += __builtin_ctz(mask);
+                    goto scalar;
+                }
+                s += 16;
+            }
+        }
+#endif
+        if (s >= end)
+            break;
+
+#if defined(__SSE2__)
+scalar:
+#endif
+        if (*s == '\0')
+            return 0;
+
+        if (*s < 0x80)
+        {
+            s++;
+            continue;
+        }
+
+        if ( (len = utf8_sequence_length(s, end - s)) == 0)
+            return 0;
+        s += len;
+    }
+    return 1;
+}
@@ -0,0 +1,24 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/*
+ * Validate a buffer of UTF-8 encoded text, as carried by the AMP
+ * Unicode type.
+ *
+ * Returns 1 if the `size' bytes at `buf' are well-formed UTF-8, or 0 if
+ * not. In addition to the usual rules (no stray continuation bytes, no
+ * truncated sequences, no surrogates, nothing above U+10FFFF), overlong
+ * encodings and embedded NUL bytes are rejected, so that a valid buffer
+ * can never be shortened or disguised when treated as a C-string.
+ *
+ */
+
+#ifndef _UTF8_H
+#define _UTF8_H
+
+int utf8_valid(const unsigned char *buf, int size);
+
+#endif
@@ -0,0 +1,503 @@
+/* Copyright (c) 2011 - Eric P. Mangold
+ * Copyright (c) 2011 - Peter Le Bek
+ *
+ * See LICENSE.txt for details.
+ */
+
+/*
+ * Worker pools, for responders added with amp_add_responder_async(),
+ * and calls made from other threads with amp_call_threadsafe().
+ *
+ * A request for an asynchronous responder is queued on the responder's
+ * AMP_Worker_Pool by the thread parsing it, and run by the next idle
+ * worker thread. amp_respond() called from a worker serializes the
+ * answer there, and pushes it on to the completion queue of the
+ * AMP_Proto the request came from. amp_call_threadsafe() likewise
+ * serializes the arguments of a call on the calling thread, and pushes
+ * the call on to the same queue. The proto's own thread writes the
+ * queued answers, and makes the queued calls, when it calls
+ * amp_drain_completions().
+ *
+ * The completion queue is an intrusive, lock-free, multiple-producer
+ * single-consumer queue (after Dmitry Vyukov's): producers exchange
+ * themselves in to `head', and the one consumer follows the links from
+ * `tail'. It outlives its proto for as long as workers still hold
+ * requests from it.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "amp.h"
+#include "amp_internal.h"
+#include "dispatch.h"
+
+
+/* Passed to the callbacks of queued calls that are dropped when the
+ * proto is free'd. amp_free_result() leaves it alone. */
+static AMP_Result_T cancel_result = {AMP_CANCEL, NULL, NULL};
+
+struct _AMP_Completion
+{
+    struct _AMP_Completion *next;
+    unsigned char *buf;
+    int size;
+
+    /* set for a call queued by amp_call_threadsafe(), in which case
+     * `buf' holds its serialized arguments - otherwise `buf' holds a
+     * serialized answer */
+    char *command; /* allocated along with the node */
+    amp_callback_func callback;
+    void *callback_arg;
+};
+
+struct _AMP_Completions
+{
+    struct _AMP_Completion *head; /* most recently pushed */
+    struct _AMP_Completion *tail; /* next to pop - only the consumer's */
+    struct _AMP_Completion stub;
+
+    /* one for the proto, and one per request held by a worker */
+    int refs;
+
+    /* set once the proto has been free'd */
+    int closed;
+
+    /* requests that asynchronous responders have finished with, yet to
+     * be taken off the proto's count of requests in progress */
+    int released;
+
+    /* set by a producer that calls the wakeup handler, and cleared by
+     * the consumer before it drains the queue - so that a burst of
+     * answers calls the handler once, rather than once each */
+    int signalled;
+
+    amp_wakeup_func wakeup;
+    void *wakeup_arg;
+};
+
+struct AMP_Worker_Pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  /* signalled when a job is queued, or stopping */
+
+    /* requests waiting for a worker, oldest first */
+    struct amp_job *head;
+    struct amp_job *tail;
+
+    int stopping;
+
+    int num_threads;
+    pthread_t *threads;
+};
+
+
+/* The proto whose request a worker is running a responder for, if any,
+ * and the queue its answer goes on */
+static __thread AMP_Proto_T *current_proto = NULL;
+static __thread _AMP_Completions_p current_completions = NULL;
+
+
+/* Completion queue */
+
+_AMP_Completions_p _amp_new_completions(void)
+{
+    _AMP_Completions_p completions;
+
+    if ( (completions = MALLOC(sizeof(*completions))) == NULL)
+        return NULL;
+
+    completions->stub.next = NULL;
+    completions->head = &completions->stub;
+    completions->tail = &completions->stub;
+    completions->refs = 1;
+    completions->closed = 0;
+    completions->released = 0;
+    completions->signalled = 0;
+    completions->wakeup = NULL;
+    completions->wakeup_arg = NULL;
+
+    debug_print("New _AMP_Completions at %p\n", completions);
+    return completions;
+}
+
+static void push_completion(_AMP_Completions_p completions,
+                            struct _AMP_Completion *node)
+{
+    struct _AMP_Completion *prev;
+
+    node->next = NULL;
+    prev = __atomic_exchange_n(&completions->head, node, __ATOMIC_ACQ_REL);
+    /* until this store the consumer can't see past `prev' */
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/* Returns the oldest completion, or NULL if the queue is empty - or
+ * momentarily appears so, because a producer is half-way through a
+ * push. That producer wakes the consumer again once it's done. */
+static struct _AMP_Completion *pop_completion(_AMP_Completions_p completions)
+{
+    struct _AMP_Completion *tail = completions->tail;
+    struct _AMP_Completion *next = __atomic_load_n(&tail->next,
+                                                   __ATOMIC_ACQUIRE);
+
+    if (tail == &completions->stub)
+    {
+        if (next == NULL)
+            return NULL;
+        completions->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL)
+    {
+        completions->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&completions->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    /* `tail' is the last node - put the stub back behind it, so that
+     * it can be taken */
+    push_completion(completions, &completions->stub);
+
+    if ( (next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)) != NULL)
+    {
+        completions->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* Push `node', and call the wakeup handler unless it's already been
+ * called since the queue was last drained */
+static void push_and_wake(_AMP_Completions_p completions,
+                          struct _AMP_Completion *node)
+{
+    push_completion(completions, node);
+
+    if (!__atomic_load_n(&completions->closed, __ATOMIC_ACQUIRE) &&
+        completions->wakeup != NULL &&
+        !__atomic_exchange_n(&completions->signalled, 1, __ATOMIC_ACQ_REL))
+        (completions->wakeup)(completions->wakeup_arg);
+}
+
+/* Drop a reference to the queue. The last reference frees it, and
+ * anything still in it. */
+static void release_completions(_AMP_Completions_p completions)
+{
+    struct _AMP_Completion *node;
+
+    if (__atomic_sub_fetch(&completions->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    while ( (node = pop_completion(completions)) != NULL)
+    {
+        free(node->buf);
+        free(node);
+    }
+
+    debug_print("Free _AMP_Completions at %p\n", completions);
+    free(completions);
+}
+
+void _amp_close_completions(AMP_Proto_T *proto)
+{
+    _AMP_Completions_p completions = proto->completions;
+    struct _AMP_Completion *node;
+
+    __atomic_store_n(&completions->closed, 1, __ATOMIC_RELEASE);
+
+    /* calls that were never made are cancelled, and answers dropped */
+    while ( (node = pop_completion(completions)) != NULL)
+    {
+        if (node->command != NULL)
+            (node->callback)(proto, &cancel_result, node->callback_arg);
+        free(node->buf);
+        free(node);
+    }
+
+    release_completions(completions);
+}
+
+_AMP_Completions_p _amp_worker_completions(AMP_Proto_T *proto)
+{
+    if (current_completions == NULL || current_proto != proto)
+        return NULL;
+    return current_completions;
+}
+
+void _amp_release_async(_AMP_Completions_p completions)
+{
+    __atomic_add_fetch(&completions->released, 1, __ATOMIC_RELEASE);
+}
+
+int _amp_take_released(_AMP_Completions_p completions)
+{
+    return __atomic_exchange_n(&completions->released, 0, __ATOMIC_ACQUIRE);
+}
+
+int _amp_respond_async(_AMP_Completions_p completions, AMP_Request_T *request,
+                       AMP_Box_T *args)
+{
+    struct _AMP_Completion *node;
+    int ret;
+
+    if ( (node = MALLOC(sizeof(*node))) == NULL)
+        return ENOMEM;
+    node->command = NULL;
+
+    if ( (ret = amp_put_bytes(args, ANSWER, request->ask_key->value,
+                              request->ask_key->size)) != 0 ||
+         (ret = amp_serialize_box(args, &node->buf, &node->size)) != 0)
+    {
+        free(node);
+        return ret;
+    }
+
+    push_and_wake(completions, node);
+    return 0;
+}
+
+int amp_call_threadsafe(AMP_Proto_T *proto, const char *command,
+                        AMP_Box_T *args, amp_callback_func callback,
+                        void *callback_arg)
+{
+    _AMP_Completions_p completions = proto->completions;
+    struct _AMP_Completion *node;
+    int ret, size;
+
+    if (completions == NULL)
+        return AMP_NO_WAKEUP_HANDLER;
+
+    size = strlen(command);
+    if ( (node = MALLOC(sizeof(*node) + size + 1)) == NULL)
+        return ENOMEM;
+
+    node->command = (char *)(node + 1);
+    memcpy(node->command, command, size + 1);
+    node->callback = callback;
+    node->callback_arg = callback_arg;
+
+    if (args != NULL)
+    {
+        if ( (ret = amp_serialize_box(args, &node->buf, &node->size)) != 0)
+        {
+            free(node);
+            return ret;
+        }
+    }
+    else
+    {
+        /* no arguments - just the end of the box */
+        if ( (node->buf = MALLOC(2)) == NULL)
+        {
+            free(node);
+            return ENOMEM;
+        }
+        node->buf[0] = node->buf[1] = 0;
+        node->size = 2;
+    }
+
+    push_and_wake(completions, node);
+    return 0;
+}
+
+int amp_set_wakeup_handler(AMP_Proto_T *proto, amp_wakeup_func func,
+                           void *wakeup_arg)
+{
+    if (proto->completions == NULL &&
+        (proto->completions = _amp_new_completions()) == NULL)
+        return ENOMEM;
+
+    proto->completions->wakeup = func;
+    proto->completions->wakeup_arg = wakeup_arg;
+    return 0;
+}
+
+int amp_drain_completions(AMP_Proto_T *proto)
+{
+    _AMP_Completions_p completions = proto->completions;
+    struct _AMP_Completion *node;
+    int ret, err = 0;
+    int corked = proto->corked;
+
+    if (completions == NULL)
+        return 0;
+
+    /* answers pushed from here on call the wakeup handler again */
+    __atomic_store_n(&completions->signalled, 0, __ATOMIC_SEQ_CST);
+
+    /* write everything that's waiting in one go */
+    amp_cork(proto);
+
+    while ( (node = pop_completion(completions)) != NULL)
+    {
+        if (node->command != NULL)
+        {
+            ret = _amp_make_prepared_call(proto, node->command, node->buf,
+                                          node->size, node->callback,
+                                          node->callback_arg);
+            free(node->buf);
+        }
+        else
+            ret = _amp_do_write(proto, node->buf, node->size);
+
+        free(node);
+        if (ret != 0 && err == 0)
+            err = ret;
+    }
+
+    if (!corked && (ret = amp_uncork(proto)) != 0 && err == 0)
+        err = ret;
+
+    /* the answers drained may have made room for more requests */
+    _amp_update_admission(proto);
+    return err;
+}
+
+
+/* Worker pool */
+
+static void run_job(struct amp_job *job)
+{
+    AMP_Box_T *box = AMP_BOX_OF(job, job);
+    _AMP_Completions_p completions = job->completions;
+
+    current_proto = job->proto;
+    current_completions = completions;
+    (job->func)(job->proto, &box->views.as.request, job->arg);
+    current_proto = NULL;
+    current_completions = NULL;
+
+    /* the responder has free'd the request, and `job' along with it */
+    release_completions(completions);
+}
+
+static void *worker_main(void *arg)
+{
+    AMP_Worker_Pool_T *pool = arg;
+    struct amp_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->head == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        /* when stopping, finish whatever is queued first */
+        if ( (job = pool->head) == NULL)
+            break;
+
+        if ( (pool->head = job->next) == NULL)
+            pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->lock);
+        run_job(job);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+void _amp_submit_request(AMP_Worker_Pool_T *pool, AMP_Proto_T *proto,
+                         _AMP_Responder_p responder, AMP_Request_T *request)
+{
+    struct amp_job *job = &AMP_BOX_OF(request, as.request)->views.job;
+
+    job->next = NULL;
+    job->proto = proto;
+    job->completions = proto->completions;
+    job->func = responder->func;
+    job->arg = responder->arg;
+
+    __atomic_add_fetch(&proto->completions->refs, 1, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Stop the first `num_threads' workers, once they've run every queued
+ * request */
+static void stop_workers(AMP_Worker_Pool_T *pool, int num_threads)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+}
+
+AMP_Worker_Pool_T *amp_new_worker_pool(int num_threads)
+{
+    AMP_Worker_Pool_T *pool;
+    int i;
+
+    if (num_threads < 1)
+        num_threads = 1;
+
+    if ( (pool = MALLOC(sizeof(*pool))) == NULL)
+        return NULL;
+
+    if ( (pool->threads = MALLOC(num_threads * sizeof(*pool->threads)))
+         == NULL)
+        goto error;
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0)
+        goto error;
+
+    if (pthread_cond_init(&pool->cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&pool->lock);
+        goto error;
+    }
+
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->stopping = 0;
+    pool->num_threads = num_threads;
+
+    for (i = 0; i < num_threads; i++)
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+        {
+            stop_workers(pool, i);
+            pthread_cond_destroy(&pool->cond);
+            pthread_mutex_destroy(&pool->lock);
+            goto error;
+        }
+
+    debug_print("New AMP_Worker_Pool at %p\n", pool);
+    return pool;
+
+error:
+    free(pool->threads);
+    free(pool);
+    return NULL;
+}
+
+void amp_free_worker_pool(AMP_Worker_Pool_T *pool)
+{
+    stop_workers(pool, pool->num_threads);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    debug_print("Free AMP_Worker_Pool at %p\n", pool);
+    free(pool->threads);
+    free(pool);
+}